@@ -0,0 +1,210 @@
+import collections
+import sqlite3
+import threading
+import time
+import numpy as np
+import consts
+
+SCHEMA = """
+CREATE TABLE IF NOT EXISTS sessions (
+    id INTEGER PRIMARY KEY,  -- capture start, ms since epoch
+    ssid TEXT, bssid TEXT, channel INTEGER,
+    ended INTEGER
+);
+CREATE TABLE IF NOT EXISTS scanners (
+    id INTEGER PRIMARY KEY,
+    name TEXT NOT NULL UNIQUE
+);
+-- one row per scanner, AP and ARCHIVE_BLOCK_MS of samples; timestamps are uint16 offsets from t0,
+-- signal int8 and variance float32, all little endian
+CREATE TABLE IF NOT EXISTS blocks (
+    t0 INTEGER NOT NULL,
+    t1 INTEGER NOT NULL,
+    scanner INTEGER NOT NULL REFERENCES scanners(id),
+    bssid TEXT NOT NULL,
+    session INTEGER NOT NULL REFERENCES sessions(id),
+    count INTEGER NOT NULL,
+    ts BLOB NOT NULL,
+    signal BLOB NOT NULL,
+    variance BLOB NOT NULL
+);
+CREATE INDEX IF NOT EXISTS blocks_time ON blocks(t0);
+CREATE INDEX IF NOT EXISTS blocks_scanner_time ON blocks(scanner, t0);
+CREATE INDEX IF NOT EXISTS blocks_ap_time ON blocks(bssid, t0);
+"""
+
+OFFSET_DTYPE = np.dtype("<u2")
+SIGNAL_DTYPE = np.dtype("i1")
+VARIANCE_DTYPE = np.dtype("<f4")
+
+
+class Archive:
+    """Every capture's samples in one SQLite file, indexed by time, scanner and AP.
+
+    Samples are stored in blocks of at most ARCHIVE_BLOCK_MS per scanner and AP, so a time range query
+    reads a few rows per scanner per minute instead of one per sample. add() only queues arrays; a
+    thread of its own turns everything queued into blocks every ARCHIVE_FLUSH_SEC and inserts them in
+    one transaction. Queries go through a read connection per calling thread and don't wait for it."""
+
+    def __init__(self, path: str):
+        self.path = path
+        self.pending = collections.deque()  # appended by the event loop, drained by the writer
+        self.wakeup = threading.Event()
+        self.closing = False
+        self.last_session = 0
+        self.blocks = 0  # written so far
+        self.samples = 0
+        self.readers = threading.local()
+
+        db = sqlite3.connect(path)
+        db.execute("PRAGMA journal_mode=WAL")  # readers don't block the writer and the other way
+        db.executescript(SCHEMA)
+        db.close()
+        self.thread = threading.Thread(target=self._run, name="archive", daemon=True)
+        self.thread.start()
+
+    def begin_session(self, ap: dict | None) -> int:
+        """New capture on the given AP, returns its id for add()"""
+        session = max(int(time.time() * 1000), self.last_session + 1)
+        self.last_session = session
+        ap = ap or {}
+        bssid = ap["bssid"].lower() if ap.get("bssid") else None
+        self.pending.append(("session", session, ap.get("ssid"), bssid, ap.get("channel")))
+        return session
+
+    def end_session(self, session: int):
+        self.pending.append(("end", session, int(time.time() * 1000)))
+
+    def add(self, scanner: str, session: int, bssid: str,
+            ts: np.ndarray, signals: np.ndarray, variances: np.ndarray):
+        """Keeps the arrays as they are until written, they must not be changed afterwards"""
+        self.pending.append(("samples", scanner, session, bssid.lower(), ts, signals, variances))
+
+    def sync(self):
+        """Blocks until everything added so far is committed, for callers not on the event loop"""
+        done = threading.Event()
+        self.pending.append(("sync", done))
+        self.wakeup.set()
+        done.wait()
+
+    def close(self):
+        """Writes what's left and stops the writer, blocks until then"""
+        self.closing = True
+        self.wakeup.set()
+        self.thread.join()
+
+    def query(self, start: int, end: int, scanners: list[str] = None, bssid: str = None
+              ) -> dict[str, tuple[np.ndarray, np.ndarray, np.ndarray]]:
+        """Samples between start and end (ms since epoch, both included) as
+        {scanner: (timestamps int64, signals int8, variances float32)}, sorted by time. Only the given
+        scanners and AP if those are set."""
+        # a block starts at most ARCHIVE_BLOCK_MS before its last sample, so the t0 index bounds it
+        sql = ("SELECT s.name, b.t0, b.count, b.ts, b.signal, b.variance FROM blocks b"
+               " JOIN scanners s ON s.id = b.scanner WHERE b.t0 BETWEEN ? AND ?")
+        args = [start - consts.ARCHIVE_BLOCK_MS + 1, end]
+        if scanners:
+            sql += f" AND b.scanner IN (SELECT id FROM scanners WHERE name IN ({','.join('?' * len(scanners))}))"
+            args += scanners
+        if bssid:
+            sql += " AND b.bssid = ?"
+            args.append(bssid.lower())
+        sql += " ORDER BY b.t0"
+
+        rows: dict[str, list] = dict()
+        for name, t0, count, ts, sig, var in self._reader().execute(sql, args):
+            rows.setdefault(name, []).append((t0, count, ts, sig, var))
+
+        result = dict()
+        for name, blocks in rows.items():
+            t0s, counts, ts, sig, var = zip(*blocks)
+            ts = np.repeat(np.array(t0s, dtype=np.int64), counts) + \
+                np.frombuffer(b"".join(ts), dtype=OFFSET_DTYPE)
+            sig = np.frombuffer(b"".join(sig), dtype=SIGNAL_DTYPE)
+            var = np.frombuffer(b"".join(var), dtype=VARIANCE_DTYPE)
+            keep = (ts >= start) & (ts <= end)
+            ts, sig, var = ts[keep], sig[keep], var[keep]
+            if len(ts) > 1 and np.any(ts[1:] < ts[:-1]):
+                # late samples of an earlier block written in a later one
+                order = np.argsort(ts, kind="stable")
+                ts, sig, var = ts[order], sig[order], var[order]
+            result[name] = (ts, sig, var)
+        return result
+
+    def _reader(self) -> sqlite3.Connection:
+        db = getattr(self.readers, "db", None)
+        if db is None:
+            db = sqlite3.connect(f"file:{self.path}?mode=ro", uri=True)
+            self.readers.db = db
+        return db
+
+    def _run(self):
+        db = sqlite3.connect(self.path)
+        db.execute("PRAGMA synchronous=NORMAL")  # WAL stays consistent, only the last commits can be lost
+        scanner_ids = dict(db.execute("SELECT name, id FROM scanners"))
+        while True:
+            self.wakeup.wait(consts.ARCHIVE_FLUSH_SEC)
+            self.wakeup.clear()
+            closing = self.closing  # anything added after this still gets another round
+
+            items = []
+            while self.pending:
+                items.append(self.pending.popleft())
+            if items:
+                try:
+                    self._write(db, scanner_ids, items)
+                except sqlite3.Error as e:
+                    print(f"Archiving to {self.path} failed: {e}")
+                    db.rollback()
+                    scanner_ids = dict(db.execute("SELECT name, id FROM scanners"))
+                for item in items:
+                    if item[0] == "sync":
+                        item[1].set()
+            if closing:
+                break
+        db.close()
+
+    def _write(self, db: sqlite3.Connection, scanner_ids: dict, items: list):
+        sessions, ends = [], []
+        samples: dict[tuple, list] = dict()
+        for item in items:
+            match item[0]:
+                case "session":
+                    sessions.append(item[1:])
+                case "end":
+                    ends.append((item[2], item[1]))
+                case "samples":
+                    samples.setdefault(item[1:4], []).append(item[4:])
+
+        with db:
+            db.executemany("INSERT OR IGNORE INTO sessions (id, ssid, bssid, channel) VALUES (?, ?, ?, ?)",
+                           sessions)
+            blocks = []
+            for (scanner, session, bssid), chunks in samples.items():
+                if scanner not in scanner_ids:
+                    db.execute("INSERT OR IGNORE INTO scanners (name) VALUES (?)", (scanner,))
+                    scanner_ids[scanner] = db.execute(
+                        "SELECT id FROM scanners WHERE name = ?", (scanner,)).fetchone()[0]
+                ts, sig, var = (np.concatenate(c) for c in zip(*chunks))
+                for t0, t1, count, offs, s, v in self._blocks(ts, sig, var):
+                    blocks.append((t0, t1, scanner_ids[scanner], bssid, session, count, offs, s, v))
+            db.executemany("INSERT INTO blocks VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?)", blocks)
+            db.executemany("UPDATE sessions SET ended = ? WHERE id = ?", ends)
+        self.blocks += len(blocks)
+        self.samples += sum(b[5] for b in blocks)
+
+    @staticmethod
+    def _blocks(ts: np.ndarray, sig: np.ndarray, var: np.ndarray):
+        """Splits samples on ARCHIVE_BLOCK_MS boundaries, yields (t0, t1, count, ts offsets, signals,
+        variances) with the arrays as bytes"""
+        ts = np.asarray(ts, dtype=np.int64)
+        if len(ts) > 1 and np.any(ts[1:] < ts[:-1]):
+            order = np.argsort(ts, kind="stable")
+            ts, sig, var = ts[order], sig[order], var[order]
+        sig = np.asarray(sig, dtype=SIGNAL_DTYPE)
+        var = np.asarray(var, dtype=VARIANCE_DTYPE)
+        bucket = ts // consts.ARCHIVE_BLOCK_MS
+        edges = np.flatnonzero(np.diff(bucket)) + 1
+        for lo, hi in zip(np.append(0, edges), np.append(edges, len(ts))):
+            t0, t1 = int(ts[lo]), int(ts[hi - 1])
+            yield (t0, t1, int(hi - lo), (ts[lo:hi] - t0).astype(OFFSET_DTYPE).tobytes(),
+                   sig[lo:hi].tobytes(), var[lo:hi].tobytes())
@@ -1,8 +1,18 @@
-MAX_CLIENTS = 8
+MAX_CLIENTS = 8  # per process doing the statistics, see INGEST_SHARDS
 PKT_STATS_BUF_SIZE = 30
+SELECT_MAX_APS = 8  # one scanner rotates over at most this many, CAP_MAX_APS there
+DISPLAY_BUF_SIZE = 256_000  # raw samples per scanner kept for the graph
+ROLLUP_SECONDS_KEEP = 6 * 3600  # per second buckets, older is only in per minute ones
+ROLLUP_MINUTES_KEEP = 14 * 24 * 60
 
 OUTPUT_DIR = "./scan_results"
-RES_FILE_EXT = ".csv"
+RES_FILE_EXT = ".csv"  # ".arrow" records Arrow IPC instead, needs pyarrow
+RECORD_BUF_SIZE = 1 << 20
+RECORD_FLUSH_SEC = 1  # queued samples handed to the file this often
+RECORD_FSYNC_SEC = 10
+ARCHIVE_FILE = f"{OUTPUT_DIR}/archive.sqlite3"  # every capture also goes here, "" turns it off
+ARCHIVE_FLUSH_SEC = 5
+ARCHIVE_BLOCK_MS = 60_000  # time one stored block covers at most, must fit uint16 offsets
 
 MQTT_CONF = "./manager_mqtt.conf"
 #direct copy of topics.h
@@ -11,6 +21,9 @@ MQTT_CONF = "./manager_mqtt.conf"
 TOPIC_CMD_BASE = "cmd"
 TOPIC_CMD_ALL = f"{TOPIC_CMD_BASE}/all"
 TOPIC_DATA_BASE = "data"
+TOPIC_STATS_BASE = "stats"
+TOPIC_STATIONS_BASE = "stations"
+TOPIC_INGEST_BASE = "ingest"
 
 CMD_READY = "ready"
 CMD_SCAN = "scan"
@@ -20,6 +33,9 @@ CMD_SELECT_AP = "select_ap"
 CMD_REGISTER = "register"
 CMD_END = "end"
 
+SCANNER_PING_REQ = "ping"
+SCANNER_PING_RESP = "pong"
+
 CMD_ALL_STOP = f"{TOPIC_CMD_ALL}/{CMD_STOP}"
 CMD_ALL_SELECT = f"{TOPIC_CMD_ALL}/select"
 
@@ -32,15 +48,22 @@ SCANNER_PUB_CMD_READY= f"{TOPIC_CMD_BASE}/{CMD_READY}"         # + id
 SCANNER_PUB_CMD_REGISTER = f"{TOPIC_CMD_BASE}/{CMD_REGISTER}"  # + id
 SCANNER_PUB_CMD_STOP = f"{TOPIC_CMD_BASE}/{CMD_STOP}"          # + id
 SCANNER_PUB_CMD_CRASH = f"{TOPIC_CMD_BASE}/{CMD_CRASH}"        # + id
+SCANNER_PUB_CMD_PING = f"{TOPIC_CMD_BASE}/{SCANNER_PING_REQ}"   # + id
 
 SCANNER_PUB_DATA = TOPIC_DATA_BASE  # + id
+SCANNER_PUB_STATS = TOPIC_STATS_BASE  # + id
+SCANNER_PUB_STATIONS = TOPIC_STATIONS_BASE  # + id
+SCANNER_PUB_INGEST = TOPIC_INGEST_BASE  # + shard + id, PKT_LISTs once reg_ack named a shard
 
 MANAGER_SUB_DATA = f"{TOPIC_DATA_BASE}/+"
+MANAGER_SUB_STATS = f"{TOPIC_STATS_BASE}/+"
+MANAGER_SUB_STATIONS = f"{TOPIC_STATIONS_BASE}/+"
 
 MANAGER_SUB_CMD_REGISTER = f"{SCANNER_PUB_CMD_REGISTER}/+"
 MANAGER_SUB_CMD_STOP = f"{SCANNER_PUB_CMD_STOP}/+"  # use the same register to unregister
 MANAGER_SUB_CMD_CRASH = f"{SCANNER_PUB_CMD_CRASH}/+"
 MANAGER_SUB_CMD_READY = f"{SCANNER_PUB_CMD_READY}/+"
+MANAGER_SUB_CMD_PING = f"{SCANNER_PUB_CMD_PING}/+"
 
 MANAGER_PUB_CMD_SCAN = f"{TOPIC_CMD_ALL}/{CMD_SCAN}"
 MANAGER_PUB_CMD_STOP = f"{TOPIC_CMD_ALL}/{CMD_STOP}"
@@ -52,9 +75,18 @@ SCANNER_REG_ACK = "reg_ack"
 # Scanner
 SCAN_CRASH_WAIT = 15
 
+# Ingest
+INGEST_BATCH_MAX = 256  # messages handled per wakeup, UI and timers get a turn in between
+INGEST_SHARDS = 0  # ingest_worker.py processes doing the statistics, 0 - all of it in the manager
+INGEST_AGG_MS = 500  # workers publish what they have this often, plots redraw once a second anyway
+TOPIC_AGG_BASE = "agg"  # + id, worker results for the manager
+MANAGER_SUB_AGG = f"{TOPIC_AGG_BASE}/+"
+
 # Graph
 
 X_AXIS_SPAN = 100
+PLOT_TAIL_MAX = 1000  # full resolution points at the end of a trace, older ones get decimated
+PLOT_WIDTH_PX = 1600  # decimation budget until the browser reports the plot's width
 Y_VAR_MAX = 100
 #Other
 
@@ -1,7 +1,9 @@
 from dataclasses import dataclass, field
-from collections import deque
 from threading import Timer
 import enum
+from stats import StreamingStats
+from ring import Ring, signal_ring, variance_ring, time_ring
+import consts
 
 
 class ManagerState(enum.Enum):
@@ -10,9 +12,19 @@ class ManagerState(enum.Enum):
     IDLE = 2
 
 
+@dataclass
+class IngestStats:
+    depth: int = 0  # messages still queued after the last batch was taken
+    max_depth: int = 0
+    lag_ms: float = 0  # how long the oldest message of the last batch waited
+    messages: int = 0
+    batches: int = 0
+
+
 class PayloadType(enum.Enum):
     AP_LIST = 0
     PKT_LIST = 1
+    STA_LIST = 2
 
 
 class ManagerEvent(enum.Enum):
@@ -34,6 +46,40 @@ class WifiAp:
     ssid: str
     bssid: str
     channel: int
+    beacon_int: int = field(default=100, compare=False)  # TU, sizes scanner dwell slots
+
+
+@dataclass
+class ChannelSurvey:
+    channel: int
+    dwell_ms: int
+    frames_s: dict[str, float]  # by frame type, plus "beacon"
+    airtime: float  # estimated from captured frames, lower bound
+    noise: float = None  # radiotap average, dBm
+    busy: float = None  # driver busy/active time, if it reports it
+
+    @property
+    def load(self) -> float:
+        # the driver sees everything, prefer it
+        return self.busy if self.busy is not None else self.airtime
+
+
+@dataclass
+class Station:
+    mac: str
+    frames: int  # total as counted by the scanner
+    seen: int  # STA_SEEN_* bits
+    random: bool  # locally administered, likely a randomized MAC
+    last_seen: int  # ms
+    rssi: float = None  # average over the last delta it was in
+
+
+@dataclass
+class ScannerClock:
+    synced: bool = False
+    offset_ms: float = 0  # added by scanner to its timestamps
+    err_ms: float = None
+    drift_ppm: float = 0
 
 
 @dataclass
@@ -52,21 +98,26 @@ class ScannerStats:
     minimum: int = 0
     maximum: int = 0
 
-    signal_buf: deque[int] = field(default_factory=deque)
-    variance_calc_buf: deque[int] = field(default_factory=deque)
-    variance_disp_buf: deque[int] = field(default_factory=deque)
-    ts_buf: deque[int] = field(default_factory=deque)
+    signal_buf: Ring = field(default_factory=lambda: signal_ring(consts.PKT_STATS_BUF_SIZE))
+    variance_disp_buf: Ring = field(default_factory=lambda: variance_ring(consts.PKT_STATS_BUF_SIZE))
+    ts_buf: Ring = field(default_factory=lambda: time_ring(consts.PKT_STATS_BUF_SIZE))  # ms since epoch
     done: int = 0
+    engine: StreamingStats = field(default_factory=StreamingStats)  # window state behind the above
 
 
 @dataclass
 class ScannerClient:
     id: str
     ap_list: list[WifiAp] = field(default_factory=list)
+    survey: dict[int, ChannelSurvey] = field(default_factory=dict)  # from last AP search
+    stations: dict[str, Station] = field(default_factory=dict)  # by MAC, kept up to date by deltas
+    clock: ScannerClock = field(default_factory=ScannerClock)  # sample timestamps are already corrected
     finished_scan: bool = False
     ready: bool = False
     scanning: bool = False
-    stats: ScannerStats = field(default_factory=ScannerStats)
+    stats: ScannerStats = field(default_factory=ScannerStats)  # first selected AP, the one graphed
+    ap_stats: dict[str, ScannerStats] = field(default_factory=dict)  # other selected APs by BSSID
     crash_timer: Timer = None
     state: ScannerState = ScannerState.SCANNER_IDLE
     outfile: str = None
+    boot: int = None  # changes when the scanner process restarts
@@ -37,7 +37,8 @@ class GraphTab:
                     bssid_label = ui.label().classes("text-xl")
 
                     ssid_label.bind_text_from(self.manager, "selected_ap_obj", lambda ap: (
-                        f"AP: {ap["ssid"]}" if ap else ""))
+                        f"AP: {ap["ssid"]}" + (f" (+{len(ap["aps"]) - 1} rotating)" if ap.get("aps") else "")
+                        if ap else ""))
 
                     bssid_label.bind_text_from(self.manager, "selected_ap_obj", lambda ap: (
                         f"({ap["bssid"]})" if ap else ""))
@@ -0,0 +1,130 @@
+import json
+import zlib
+import numpy as np
+from data import ScannerStats
+
+# aggregate payload: JSON header, a zero byte, then timestamps int64, signals int8, variances float32
+AGG_SEP = b"\0"
+
+
+def shard_of(id: str, shards: int) -> int:
+    """Ingest shard a scanner's samples go to, the same in every process"""
+    return zlib.crc32(id.encode()) % shards
+
+
+def selection_bssids(selection: dict) -> frozenset[str]:
+    """Lowercase BSSIDs of a select_ap payload, either a single AP or one with {"aps": [...]}"""
+    if not selection:
+        return frozenset()
+    aps = selection.get("aps") or [selection]
+    return frozenset(ap["bssid"].lower() for ap in aps if ap.get("bssid"))
+
+
+def split_by_ap(data: list) -> dict[str, list]:
+    """PKT_LIST items by lowercase BSSID, a scanner rotating over several APs mixes them in a batch"""
+    by_ap: dict[str, list] = dict()
+    for item in data:
+        by_ap.setdefault(item["ap"]["bssid"].lower(), []).append(item)
+    return by_ap
+
+
+def update_stats(stats: ScannerStats, items: list) -> tuple[np.ndarray, np.ndarray, np.ndarray]:
+    """Runs PKT_LIST items of one link (scanner, AP) through its statistics, returns the samples added
+    as (signals, variances, timestamps), a batch can be longer than the window. The arrays are new,
+    not views into the buffers. See split_by_ap(), links must not be mixed in one window."""
+    if not items:
+        empty = np.empty(0)
+        return empty, empty, empty
+
+    signals = [item["radio"]["antenna_signal"] for item in items]
+    timestamps = [item["ap"]["timestamp"] for item in items]
+
+    # outliers (massive one time spikes, not caused by attenuation) come back replaced by the average
+    vals, disp = stats.engine.update(stats, signals)
+    vals = np.array(vals, dtype=stats.signal_buf.buf.dtype)
+    disp = np.array(disp, dtype=stats.variance_disp_buf.buf.dtype)
+    ts = np.array(timestamps, dtype=np.int64)
+    stats.signal_buf.extend(vals)
+    stats.variance_disp_buf.extend(disp)
+    stats.ts_buf.extend(ts)
+    return vals, disp, ts
+
+
+def encode_aggregate(stats: ScannerStats, samples: tuple, bssid: str, clock: dict = None) -> bytes:
+    vals, disp, ts = samples
+    header = {
+        "n": len(ts),
+        "bssid": bssid,
+        "average": stats.average, "variance": stats.variance,
+        "minimum": stats.minimum, "maximum": stats.maximum,
+    }
+    if clock:
+        header["clock"] = clock
+    return b"".join((json.dumps(header).encode(), AGG_SEP,
+                     ts.astype("<i8").tobytes(), vals.astype("i1").tobytes(), disp.astype("<f4").tobytes()))
+
+
+def decode_aggregate(payload: bytes) -> tuple[dict, tuple[np.ndarray, np.ndarray, np.ndarray]]:
+    """(header, (signals, variances, timestamps)) back from encode_aggregate()"""
+    sep = payload.index(AGG_SEP)
+    header = json.loads(payload[:sep])
+    n = header["n"]
+    body = memoryview(payload)[sep + 1:]
+    ts = np.frombuffer(body, dtype="<i8", count=n)
+    vals = np.frombuffer(body, dtype="i1", count=n, offset=8 * n)
+    disp = np.frombuffer(body, dtype="<f4", count=n, offset=9 * n)
+    return header, (vals, disp, ts)
+
+
+class ShardWorker:
+    """Statistics for the scanners of one ingest shard, what an ingest worker process runs. Samples
+    pile up per link (scanner, BSSID) between take_aggregates() calls, which hands them on in one
+    payload each."""
+
+    def __init__(self):
+        self.stats: dict[tuple[str, str], ScannerStats] = dict()
+        self.selected: frozenset[str] = frozenset()
+        self.pending: dict[tuple[str, str], list[tuple]] = dict()
+        self.clocks: dict[str, dict] = dict()
+        self.messages = 0
+        self.samples = 0
+
+    def select(self, selection: dict):
+        """Other APs selected, a new capture starts from empty windows. The manager sends the same
+        selection again to scanners that reconnect, that changes nothing."""
+        bssids = selection_bssids(selection)
+        if bssids != self.selected:
+            self.selected = bssids
+            self.reset()
+
+    def reset(self):
+        self.stats.clear()
+        self.pending.clear()
+        self.clocks.clear()
+
+    def handle_pkt_lists(self, id: str, msgs: list[dict]):
+        """Applies consecutive PKT_LISTs of one scanner as one"""
+        for json_data in reversed(msgs):
+            if "clock" in json_data:
+                self.clocks[id] = json_data["clock"]
+                break
+        data = msgs[0]["data"] if len(msgs) == 1 else [item for m in msgs for item in m["data"]]
+        self.messages += len(msgs)
+        for bssid, items in split_by_ap(data).items():
+            link = (id, bssid)
+            stats = self.stats.get(link)
+            if stats is None:
+                stats = self.stats[link] = ScannerStats()
+            samples = update_stats(stats, items)
+            self.pending.setdefault(link, []).append(samples)
+            self.samples += len(samples[0])
+
+    def take_aggregates(self) -> list[tuple[str, bytes]]:
+        """(scanner id, payload) for every link that added samples since the last call, the payload
+        names the BSSID"""
+        out = []
+        for (id, bssid), chunks in self.pending.items():
+            samples = tuple(np.concatenate(c) for c in zip(*chunks))
+            out.append((id, encode_aggregate(self.stats[(id, bssid)], samples, bssid, self.clocks.pop(id, None))))
+        self.pending.clear()
+        return out
@@ -0,0 +1,112 @@
+#!/usr/bin/env python3
+# Ingest worker: statistics for one shard of the scanners, off the UI process. Scanners told a
+# shard in their reg_ack publish PKT_LISTs to ingest/<shard>/<id>. Statistics are windows per
+# (scanner, BSSID) and can't be split, so run exactly one worker per shard: it owns the shard's
+# topic through a plain subscription, a second one would publish its own agg/<id> for the same
+# scanners. A restart replaces the old worker and starts from empty windows. Results go to
+# agg/<id> every INGEST_AGG_MS.
+import argparse
+import collections
+import json
+import threading
+import time
+import paho.mqtt.client as mqtt
+from paho.mqtt.client import topic_matches_sub
+import consts
+from ingest import ShardWorker
+from data import PayloadType
+
+
+class IngestWorker:
+    def __init__(self, shard: int):
+        self.shard = shard
+        self.worker = ShardWorker()
+        self.items: collections.deque[tuple[str, bytes]] = collections.deque()
+        self.stop = threading.Event()
+        self.client = mqtt.Client(mqtt.CallbackAPIVersion.VERSION2, protocol=mqtt.MQTTv5)
+        self.client.on_connect = self._on_connect
+        self.client.on_message = self._on_message
+
+    def _on_connect(self, client: mqtt.Client, userdata, flags: any, rc: int, properties: any = None):
+        print(f"Shard {self.shard} connected: {rc}")
+        client.subscribe([
+            (f"{consts.TOPIC_INGEST_BASE}/{self.shard}/+", 1),
+            (consts.SCANNER_SUB_CMD_ALL, 1),  # AP selection and stop, same as the scanners get
+        ])
+
+    def _on_message(self, client: mqtt.Client, userdata, msg: mqtt.MQTTMessage):
+        # paho thread, handled in batches by run()
+        self.items.append((msg.topic, msg.payload))
+
+    def run(self, host: str, port: int, username: str, password: str):
+        if username:
+            self.client.username_pw_set(username, password)
+        self.client.connect(host, port, 10)
+        self.client.loop_start()
+        next_flush = time.monotonic()
+        while not self.stop.is_set():
+            next_flush += consts.INGEST_AGG_MS / 1000
+            self.stop.wait(max(0, next_flush - time.monotonic()))
+            self.process()
+        self.client.disconnect()
+        self.client.loop_stop()
+
+    def process(self):
+        pending: dict[str, list[dict]] = dict()
+        while self.items:
+            topic, payload = self.items.popleft()
+            if topic_matches_sub(consts.SCANNER_SUB_CMD_ALL, topic):
+                # commands apply after what arrived before them
+                self._flush(pending)
+                self._handle_cmd(topic.split("/")[-1], payload)
+                continue
+            try:
+                json_data = json.loads(payload)
+            except ValueError:
+                continue
+            if json_data.get("type") == PayloadType.PKT_LIST.value:
+                pending.setdefault(topic.split("/")[-1], []).append(json_data)
+        self._flush(pending)
+        for id, payload in self.worker.take_aggregates():
+            self.client.publish(f"{consts.TOPIC_AGG_BASE}/{id}", payload, 1)
+
+    def _flush(self, pending: dict[str, list[dict]]):
+        for id, msgs in pending.items():
+            self.worker.handle_pkt_lists(id, msgs)
+        pending.clear()
+
+    def _handle_cmd(self, cmd: str, payload: bytes):
+        match cmd:
+            case consts.CMD_SELECT_AP:
+                try:
+                    self.worker.select(json.loads(payload))
+                except (ValueError, AttributeError):
+                    print("Invalid AP selection")
+            case consts.CMD_STOP | consts.CMD_END:
+                self.worker.reset()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="wfan ingest worker")
+    parser.add_argument("shard", type=int)
+    parser.add_argument("--shards", type=int, default=consts.INGEST_SHARDS,
+                        help="how many the manager splits scanners over, INGEST_SHARDS by default")
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=1883)
+    parser.add_argument("--user", default="")
+    parser.add_argument("--password", default="")
+    args = parser.parse_args()
+    if not 0 <= args.shard < args.shards:
+        parser.error(f"shard must be 0 .. {args.shards - 1}, check INGEST_SHARDS")
+
+    worker = IngestWorker(args.shard)
+    try:
+        worker.run(args.host, args.port, args.user, args.password)
+    except KeyboardInterrupt:
+        pass
+    except OSError as e:
+        print(f"Failed to connect to MQTT broker: {e}")
+
+
+if __name__ == "__main__":
+    main()
@@ -66,6 +66,9 @@ async def create_ui(manager: Manager, mqtt_client: MqttClient):
                 "max-sm:hidden").on_click(settings)
 
             ui.space()
+            ui.label().classes("max-sm:hidden text-sm").bind_text_from(
+                manager, "ingest",
+                lambda s: f"Ingest: {s.depth} queued, {s.lag_ms:.0f} ms behind")
             ui.button(icon="power_settings_new").classes(
                 "bg-red").on_click(shutdown)
             # ui.switch("Dark mode").props('keep-color').bind_value(dark)
@@ -125,9 +128,10 @@ async def start():
         def disconnect():
            Updates.UNREGISTER_ID_CALLBACK(ui.context.client.id, manager)
 
-        def shutdown():
+        async def shutdown():
             mqtt_client.disconnect()
             task.cancel()
+            await manager.close()
             
         app.on_shutdown(shutdown)
         app.on_disconnect(disconnect)
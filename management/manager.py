@@ -2,29 +2,37 @@ import consts
 from data import *
 import json
 import os
-import math
 import asyncio
 import datetime
-import copy
-from mqtt_client import MqttClient
+import time
+import sqlite3
+from mqtt_client import MqttClient, IngestQueue
+import numpy as np
+from rollup import SeriesStore
+from recorder import Recorder
+from archive import Archive
+from ingest import shard_of, split_by_ap, update_stats, decode_aggregate
 from paho.mqtt.client import topic_matches_sub
 
 
 class Manager:
     def __init__(self, client: MqttClient):
         self.client: MqttClient = client
-        self.queue: asyncio.Queue = self.client.queue
+        self.queue: IngestQueue = self.client.queue
+        self.ingest = IngestStats()
         self.scanners: dict[str, ScannerClient] = dict()
         self.ap_counters: dict[WifiAp, int] = dict()
         self.common_aps: list[WifiAp] = list()
         self.selected_ap_obj: dict = None
         self.state = ManagerState.IDLE
         self.listeners: dict[str, dict[ManagerEvent, list[callable]]] = dict()
+        self.recorders: dict[str, Recorder] = dict()
+        self.archive: Archive = None
+        self.archive_session: int = None
+        self.archive_off = not consts.ARCHIVE_FILE
 
         # these fetched by UI for display
-        self.rssi_bufs: dict[str, deque] = dict()
-        self.var_bufs: dict[str, deque] = dict()
-        self.ts_bufs: dict[str, deque] = dict()
+        self.series: dict[str, SeriesStore] = dict()
         self.can_scan = False  # BINDS FROM UI
 
         # os.makedirs(consts.OUTPUT_DIR, exist_ok=True)
@@ -34,7 +42,8 @@ class Manager:
             self.scanners[id].outfile = ""
         else:
             time = datetime.datetime.now()
-            self.scanners[id].outfile = f"{path}/{id}_{time.strftime("%Y-%m-%d-%H_%M_%S")}.csv"
+            self.scanners[id].outfile = f"{path}/{id}_{time.strftime("%Y-%m-%d-%H_%M_%S")}{consts.RES_FILE_EXT}"
+        self._close_recorder(id)
         print(f"Updated path for {id}: {self.scanners[id].outfile}")
 
     def update_results_path(self, path: str):
@@ -42,140 +51,130 @@ class Manager:
             self.update_scanner_result_path(id, path)
 
     def update_scanner_display_stats(
-        self, id: str, reset: bool = False, add: bool = True, count=-1
+        self, id: str, reset: bool = False, add: bool = True, samples: tuple = None
     ):
+        """samples is (signals, variances, timestamps) just added, the whole stats window if not given"""
         if reset:
-            self.rssi_bufs[id] = deque(maxlen=256_000)
-            self.var_bufs[id] = deque(maxlen=256_000)
-            self.ts_bufs[id] = deque(maxlen=256_000)
+            self.series[id] = SeriesStore()
 
         if add:
-            self.rssi_bufs[id].extend(
-                self.scanners[id].stats.signal_buf
-                if count == -1
-                else list(self.scanners[id].stats.signal_buf)[-count:]
-            )
-            self.var_bufs[id].extend(
-                self.scanners[id].stats.variance_disp_buf
-                if count == -1
-                else list(self.scanners[id].stats.variance_disp_buf)[-count:]
-            )
-            self.ts_bufs[id].extend(
-                self.scanners[id].stats.ts_buf
-                if count == -1
-                else list(self.scanners[id].stats.ts_buf)[-count:]
-            )
-
-    def fetch_scanner_display_stats(self, id: str):
-        return (
-            list(self.rssi_bufs[id]),
-            list(self.var_bufs[id]),
-            list(self.ts_bufs[id]),
-        )
-
-    def _is_outlier(self, scanner: ScannerClient, entry: int) -> bool:
-        # variance can be 0 if RSSI is very stable (or the window is atleast, so Z score calc fails, assume
-        # there's always some variance in such case
-        var = max(scanner.stats.variance, 1)
-        z = (entry - scanner.stats.average) / math.sqrt(var)
-
-        # hopefully filters out much higher values, found some random one time spikes of 2x weaker RSSi
-        return abs(z) > 5
-
-    def _update_scanner_stats(self, id: str, data):
-        client = self.scanners[id]
-        for item in data:
-            radio_obj = item["radio"]
-            radio = RadioInfo(
-                radio_obj["channel_freq"],
-                radio_obj["antenna_signal"],
-                radio_obj["noise"],
-            )
-            ap_obj = item["ap"]
-
-            val = radio.signal
-
-            # so I saw massive spikes sometimes, better remove it as it's not caused by atennuation methinks
-            if client.stats.done and self._is_outlier(client, radio.signal):
-                val = int(client.stats.average)
-
-            if client.stats.maximum < val or client.stats.maximum == 0:
-                client.stats.maximum = val
-            if client.stats.minimum > val:
-                client.stats.minimum = val
-
-            client.stats.signal_buf.append(val)
-            client.stats.ts_buf.append(
-                datetime.datetime.fromtimestamp(
-                    int(ap_obj["timestamp"]) / 1000)
-            )
+            stats = self.scanners[id].stats
+            vals, disp, ts = samples if samples else (
+                stats.signal_buf.view(), stats.variance_disp_buf.view(), stats.ts_buf.view())
+            self.series[id].extend(vals, disp, ts)
 
-            avg = sum(client.stats.signal_buf) / len(client.stats.signal_buf)
-            client.stats.average = avg
+    def display_count(self, id: str) -> int:
+        """Samples ever added to the display buffers, tells what's new since a previous look"""
+        return self.series[id].total if id in self.series else 0
 
-            # single point variance
-            var = (val - avg) ** 2
-
-            # "smooth" out using prev variance values
-            client.stats.variance_calc_buf.append(var)
-            client.stats.variance = sum(client.stats.variance_calc_buf) / len(
-                client.stats.variance_calc_buf
-            )
-
-            # take last 5 variance values to "smooth" change over time
-            var_sum = sum(list(client.stats.variance_calc_buf)[-5:])
-
-            # just clamp value if its too extreme, don't really care about the value itself
-            if var_sum > consts.Y_VAR_MAX:
-                var_sum = consts.Y_VAR_MAX
-            client.stats.variance_disp_buf.append(var_sum)
-
-            if len(client.stats.signal_buf) == consts.PKT_STATS_BUF_SIZE:
-                client.stats.done = True
-        return len(data)
-
-    async def _write_pkt_data(self, scanner: ScannerClient):
-        f = None
-        if not scanner.outfile:
+    def fetch_scanner_display_stats(self, id: str):
+        """Views into the raw buffers, only valid until the next sample is added"""
+        series = self.series[id]
+        return series.signal.view(), series.variance.view(), series.ts.view()
+
+    def query_scanner_display(self, id: str, start: int, end: int, max_points: int):
+        """(signals, variances, timestamps) between start and end in ms, raw or rolled up per second or
+        minute depending on how far back and how many points that is"""
+        ts, sig, var, _ = self.series[id].query(start, end, max_points)
+        return sig, var, ts
+
+    def fetch_scanner_display_since(self, id: str, seq: int):
+        """Samples added after the first seq, as (seq now, signals, variances, timestamps), views like
+        above. What fell out of the buffers is gone."""
+        now = self.display_count(id)
+        if now - seq <= 0:
+            empty = np.empty(0)
+            return now, empty, empty, empty
+        count = now - seq
+        series = self.series[id]
+        return now, series.signal.last(count), series.variance.last(count), series.ts.last(count)
+
+    def _is_primary(self, bssid: str) -> bool:
+        """Graph and recording follow the first selected AP, the others of a rotating scanner are
+        only kept in their own stats and the archive"""
+        return not self.selected_ap_obj or bssid == self.selected_ap_obj["bssid"].lower()
+
+    def _link_stats(self, id: str, bssid: str) -> ScannerStats:
+        scanner = self.scanners[id]
+        if self._is_primary(bssid):
+            return scanner.stats
+        stats = scanner.ap_stats.get(bssid)
+        if stats is None:
+            stats = scanner.ap_stats[bssid] = ScannerStats()
+        return stats
+
+    def _update_scanner_stats(self, id: str, data) -> dict[str, tuple[np.ndarray, np.ndarray, np.ndarray]]:
+        """Returns the samples added per BSSID as (signals, variances, timestamps), see
+        ingest.update_stats()"""
+        return {
+            bssid: update_stats(self._link_stats(id, bssid), items)
+            for bssid, items in split_by_ap(data).items()
+        }
+
+    def _record_pkt_data(self, id: str, samples: tuple[np.ndarray, np.ndarray, np.ndarray]):
+        scanner = self.scanners[id]
+        vals, disp, ts = samples
+        if not scanner.outfile or len(vals) == 0:
             return
 
-        exists = os.path.exists(scanner.outfile)
-        f = open(scanner.outfile, "a")
-        if not exists:
-            print(f"{id} does not have a results file, create")
-            f.write(
-                f"{self.selected_ap_obj["ssid"]};{self.selected_ap_obj["bssid"]};{self.selected_ap_obj["channel"]}\n"
-            )
-        signals = list(scanner.stats.signal_buf)
-        variances = list(scanner.stats.variance_disp_buf)
-        timestamps = list(scanner.stats.ts_buf)
+        recorder = self.recorders.get(id)
+        if recorder is None:
+            print(f"Recording {id} to {scanner.outfile}")
+            recorder = Recorder(scanner.outfile, dict(self.selected_ap_obj))
+            self.recorders[id] = recorder
+        # only what this batch added, the window itself was written before
+        recorder.add(ts, disp, vals)
 
-        for i in range(len(signals)):
-            f.write(f"{timestamps[i]};{variances[i]:2};{signals[i]}\n")
-        f.close()
+    def _archive_pkt_data(self, id: str, bssid: str, samples: tuple[np.ndarray, np.ndarray, np.ndarray]):
+        if self.archive_off:
+            return
+        if self.archive is None:
+            try:
+                os.makedirs(os.path.dirname(consts.ARCHIVE_FILE) or ".", exist_ok=True)
+                self.archive = Archive(consts.ARCHIVE_FILE)
+            except (OSError, sqlite3.Error) as e:
+                print(f"Can't open archive {consts.ARCHIVE_FILE}: {e}")
+                self.archive_off = True
+                return
+        if self.archive_session is None:
+            self.archive_session = self.archive.begin_session(self.selected_ap_obj)
+        vals, disp, ts = samples
+        self.archive.add(id, self.archive_session, bssid, ts, vals, disp)
+
+    def _end_archive_session(self):
+        if self.archive_session is not None:
+            self.archive.end_session(self.archive_session)
+            self.archive_session = None
+
+    def _close_recorder(self, id: str):
+        recorder = self.recorders.pop(id, None)
+        if recorder:
+            # finishes on its own, flushes whatever is still queued
+            asyncio.get_running_loop().create_task(recorder.close())
+
+    async def close_recorders(self):
+        recorders = list(self.recorders.values())
+        self.recorders.clear()
+        await asyncio.gather(*(r.close() for r in recorders))
+
+    async def close(self):
+        """Writes out everything still queued for recordings and the archive"""
+        await self.close_recorders()
+        if self.archive:
+            self._end_archive_session()
+            await asyncio.to_thread(self.archive.close)
+            self.archive = None
 
     def _init_scanner_stats(self, id: str):
         self.scanners[id].stats = ScannerStats()
-        self.scanners[id].stats.signal_buf = deque(
-            maxlen=consts.PKT_STATS_BUF_SIZE
-        )
-        self.scanners[id].stats.variance_calc_buf = deque(
-            maxlen=consts.PKT_STATS_BUF_SIZE
-        )
-        self.scanners[id].stats.variance_disp_buf = deque(
-            maxlen=consts.PKT_STATS_BUF_SIZE
-        )  # adjust for "smoothness"
-        self.scanners[id].stats.ts_buf = deque(
-            maxlen=consts.PKT_STATS_BUF_SIZE)
         self.scanners[id].stats.done = False
+        self.scanners[id].ap_stats = dict()
 
-    async def _handle_data(self, id: str, payload: str):
+    async def _handle_data(self, id: str, json_data: dict):
         if id not in self.scanners.keys():
             print(f"Received data from {id} but it's not registered, ignore.")
             return
 
-        json_data = json.loads(payload)
-
         data = json_data["data"]
 
         match PayloadType(json_data["type"]):
@@ -185,12 +184,14 @@ class Manager:
                         item["ssid"] if item["ssid"] != "" else "<HIDDEN>",
                         item["bssid"],
                         item["channel"],
+                        item.get("beacon_int") or 100,
                     )
                     self.scanners[id].ap_list.append(ap)
                     if ap not in self.ap_counters:
                         self.ap_counters[ap] = 1
                     else:
                         self.ap_counters[ap] += 1
+                self.scanners[id].survey = self._parse_survey(json_data.get("survey", []))
                 self.scanners[id].finished_scan = True
                 self.scanners[id].stats.done = False
                 if all(c.finished_scan for c in self.scanners.values()):
@@ -203,34 +204,143 @@ class Manager:
                     self.state = ManagerState.SELECTING
 
             case PayloadType.PKT_LIST:
-                self.state = ManagerState.SCANNING
-                self.scanners[id].state = ScannerState.SCANNER_SCANNING
-                count = self._update_scanner_stats(id, data)
-                self.update_scanner_display_stats(id, count=count)
+                self._handle_pkt_lists(id, [json_data])
+
+    def _handle_pkt_lists(self, id: str, msgs: list[dict]):
+        """Applies consecutive PKT_LISTs of one scanner as one"""
+        if id not in self.scanners.keys():
+            print(f"Received data from {id} but it's not registered, ignore.")
+            return
+
+        scanner = self.scanners[id]
+        for json_data in reversed(msgs):
+            if "clock" in json_data:
+                scanner.clock = ScannerClock(**json_data["clock"])
+                break
+        self.state = ManagerState.SCANNING
+        scanner.state = ScannerState.SCANNER_SCANNING
+        data = msgs[0]["data"] if len(msgs) == 1 else [item for m in msgs for item in m["data"]]
+        for bssid, samples in self._update_scanner_stats(id, data).items():
+            self._apply_samples(id, bssid, samples)
+
+    def _handle_aggregate(self, id: str, payload: bytes):
+        """Samples an ingest worker already ran through the statistics"""
+        if id not in self.scanners.keys():
+            return
+        try:
+            header, samples = decode_aggregate(payload)
+        except (ValueError, KeyError):
+            print(f"Invalid aggregate for {id}")
+            return
+
+        scanner = self.scanners[id]
+        if "clock" in header:
+            scanner.clock = ScannerClock(**header["clock"])
+        # workers from before per AP aggregates don't name one, theirs is the selected AP
+        bssid = header.get("bssid") or (self.selected_ap_obj["bssid"].lower() if self.selected_ap_obj else "")
+        stats = self._link_stats(id, bssid)
+        stats.average, stats.variance = header["average"], header["variance"]
+        stats.minimum, stats.maximum = header["minimum"], header["maximum"]
+        vals, disp, ts = samples
+        stats.signal_buf.extend(vals)
+        stats.variance_disp_buf.extend(disp)
+        stats.ts_buf.extend(ts)
+        self.state = ManagerState.SCANNING
+        scanner.state = ScannerState.SCANNER_SCANNING
+        self._apply_samples(id, bssid, samples)
+
+    def _apply_samples(self, id: str, bssid: str, samples: tuple[np.ndarray, np.ndarray, np.ndarray]):
+        if len(samples[0]):
+            if self._is_primary(bssid):
+                self.update_scanner_display_stats(id, samples=samples)
+                self._record_pkt_data(id, samples)
+            self._archive_pkt_data(id, bssid, samples)
+
+    def _handle_stations(self, id: str, payload: str):
+        if id not in self.scanners.keys():
+            return
+
+        json_data = json.loads(payload)
+        stations = self.scanners[id].stations
+        for item in json_data["data"]:
+            rssi = item.get("rssi")
+            stations[item["mac"]] = Station(
+                item["mac"],
+                item["total"],
+                item["seen"],
+                item["random"],
+                item["last_seen"],
+                rssi["avg"] if rssi else None,
+            )
+        # expired on the scanner, LRU evictions are only counted
+        for mac in json_data["gone"]:
+            stations.pop(mac, None)
+
+    def _parse_survey(self, items: list) -> dict[int, ChannelSurvey]:
+        survey = dict()
+        for item in items:
+            driver = item.get("driver", {})
+            survey[item["channel"]] = ChannelSurvey(
+                item["channel"],
+                item["dwell_ms"],
+                item["frames_s"],
+                item["airtime"],
+                item.get("noise", {}).get("avg"),
+                driver.get("busy"),
+            )
+        return survey
 
-                await self._write_pkt_data(copy.deepcopy(self.scanners[id]))
+    def channel_load(self, channel: int) -> float:
+        # worst scanner decides, RSSI is disturbed wherever the channel is busy
+        loads = [
+            scanner.survey[channel].load
+            for scanner in self.scanners.values()
+            if channel in scanner.survey
+        ]
+        return max(loads) if loads else None
 
     def _handle_client_crash(self, id: str):
         self.scanners.pop(id)
 
-    def _handle_cmd(self, cmd: str, id: str):
+    def _parse_cmd_payload(self, payload: bytes) -> dict:
+        if not payload:
+            return {}
+        try:
+            return json.loads(payload)
+        except ValueError:
+            return {}
+
+    def _handle_cmd(self, cmd: str, id: str, payload: bytes = None):
         if len(id) == 0:
             print("Invalid id")
             return
 
+        info = self._parse_cmd_payload(payload)
+
         topic_regack = f"{consts.TOPIC_CMD_BASE}/{id}/{consts.SCANNER_REG_ACK}"
+        # with ingest workers running, the ack tells the scanner which shard its samples go to
+        regack = json.dumps({"shard": shard_of(id, consts.INGEST_SHARDS)}) if consts.INGEST_SHARDS else None
 
         match cmd:
             case consts.CMD_REGISTER:
                 print(f"Registering {id}")
+                boot = info.get("boot")
                 if id in self.scanners:
                     scanner = self.scanners[id]
-                    if scanner.crash_timer is not None:
-                        scanner.crash_timer.cancel()
+                    # scanner retries register until acked, a repeat from the same process isn't an unregister
+                    if boot is not None and boot == scanner.boot and scanner.crash_timer is None:
+                        self.client.mqtt_client.publish(topic_regack, regack, 1)
+                        return
+                    # restarted faster than the broker noticed the crash: new boot id, resume right away
+                    restarted = boot is not None and boot != scanner.boot
+                    if scanner.crash_timer is not None or restarted:
+                        if scanner.crash_timer is not None:
+                            scanner.crash_timer.cancel()
                         scanner.crash_timer = None
+                        scanner.boot = boot
                         scanner.state = ScannerState.SCANNER_IDLE
                         self.can_scan = True
-                        self.client.mqtt_client.publish(topic_regack, None, 1)
+                        self.client.mqtt_client.publish(topic_regack, regack, 1)
                         if self.state == ManagerState.SCANNING:
                             self.client.mqtt_client.publish(
                                 consts.MANAGER_PUB_CMD_SELECT_AP,
@@ -245,9 +355,9 @@ class Manager:
                             self.can_scan = False
                     return
 
-                self.scanners[id] = ScannerClient(id)
+                self.scanners[id] = ScannerClient(id, boot=boot)
                 self._init_scanner_stats(id)
-                self.client.mqtt_client.publish(topic_regack, None, 1)
+                self.client.mqtt_client.publish(topic_regack, regack, 1)
                 self.update_scanner_display_stats(id, reset=True, add=False)
 
             case consts.CMD_CRASH:
@@ -267,6 +377,12 @@ class Manager:
                     self.can_scan = False
             case consts.CMD_READY:
                 print(f"{id} READY")
+                if "startup" in info:
+                    startup = info["startup"]
+                    print(
+                        f"{id} startup: setup {startup.get("setup_ms")} ms, connect {startup.get("connect_ms")} ms, "
+                        f"ready {startup.get("ready_ms")} ms"
+                    )
                 self.can_scan = True
                 if self.state == ManagerState.SCANNING:
                     self.client.mqtt_client.publish(
@@ -285,16 +401,43 @@ class Manager:
     async def _message_handler(self, topic: str, payload: str):
         topic_parts = topic.split("/")
         if topic_matches_sub(consts.MANAGER_SUB_DATA, topic):
-            await self._handle_data(topic_parts[1], payload)
+            await self._handle_data(topic_parts[1], json.loads(payload))
+        elif topic_matches_sub(consts.MANAGER_SUB_AGG, topic):
+            self._handle_aggregate(topic_parts[1], payload)
+        elif topic_matches_sub(consts.MANAGER_SUB_STATIONS, topic):
+            self._handle_stations(topic_parts[1], payload)
         elif topic_matches_sub(consts.MANAGER_SUB_CMD_ID, topic):
-            self._handle_cmd(topic_parts[1], topic_parts[2])
+            self._handle_cmd(topic_parts[1], topic_parts[2], payload)
 
     async def receive_next(self):
-        try:
-            topic, payload = await self.queue.get()
+        """Handles everything queued since the last call, waits if there's nothing"""
+        batch = await self.queue.get_batch(consts.INGEST_BATCH_MAX)
+        self.ingest.depth = len(self.queue)
+        self.ingest.max_depth = max(self.ingest.max_depth, self.ingest.depth + len(batch))
+        self.ingest.lag_ms = (time.monotonic() - batch[0][2]) * 1000
+        self.ingest.messages += len(batch)
+        self.ingest.batches += 1
+
+        # PKT_LISTs pile up per scanner, anything else applies them first so ordering against
+        # commands (stop, select_ap...) stays as it arrived
+        pending: dict[str, list[dict]] = dict()
+        for topic, payload, _ in batch:
+            if topic_matches_sub(consts.MANAGER_SUB_DATA, topic):
+                json_data = json.loads(payload)
+                if json_data["type"] == PayloadType.PKT_LIST.value:
+                    pending.setdefault(topic.split("/")[1], []).append(json_data)
+                    continue
+                self._flush_pkt_lists(pending)
+                await self._handle_data(topic.split("/")[1], json_data)
+                continue
+            self._flush_pkt_lists(pending)
             await self._message_handler(topic, payload)
-        except asyncio.QueueEmpty:
-            return
+        self._flush_pkt_lists(pending)
+
+    def _flush_pkt_lists(self, pending: dict[str, list[dict]]):
+        for id, msgs in pending.items():
+            self._handle_pkt_lists(id, msgs)
+        pending.clear()
 
     async def _common_aps_done(self):
         while True:
@@ -323,6 +466,9 @@ class Manager:
             scanner.finished_scan = False
             scanner.scanning = False
             scanner.stats = ScannerStats()
+            scanner.ap_stats = dict()
+            self._close_recorder(id)
+        self._end_archive_session()
         self.state = ManagerState.IDLE
 
     async def mqtt_send(self, topic: str, payload: str = None, qos: int = 1):
@@ -1,13 +1,50 @@
 import paho.mqtt.client as mqtt
+from paho.mqtt.client import topic_matches_sub
 import asyncio
+import json
+import time
+from collections import deque
 import consts
 
 
+class IngestQueue:
+    """Messages from paho's thread to the event loop. Appending to a deque needs no lock and the loop
+    is only woken when it's waiting on an empty queue, not once per message."""
+
+    def __init__(self, loop: asyncio.AbstractEventLoop):
+        self.items: deque[tuple[str, bytes, float]] = deque()
+        self._loop = loop
+        self._event = asyncio.Event()
+        self._waiting = False
+
+    def __len__(self):
+        return len(self.items)
+
+    def put(self, topic: str, payload: bytes):
+        # paho thread
+        self.items.append((topic, payload, time.monotonic()))
+        if self._waiting:
+            self._waiting = False
+            self._loop.call_soon_threadsafe(self._event.set)
+
+    async def get_batch(self, max_items: int) -> list[tuple[str, bytes, float]]:
+        """Waits for at least one message, returns up to max_items as (topic, payload, received at)"""
+        while not self.items:
+            # flag first, then look again, a put in between either gets seen here or wakes us
+            self._waiting = True
+            if self.items:
+                self._waiting = False
+                break
+            await self._event.wait()
+            self._event.clear()
+        return [self.items.popleft() for _ in range(min(len(self.items), max_items))]
+
+
 class MqttClient:
     def __init__(self):
-        self.queue = asyncio.Queue()
-        self.mqtt_client = self._setup_mqtt_client()
         self._event_loop = asyncio.get_event_loop()
+        self.queue = IngestQueue(self._event_loop)
+        self.mqtt_client = self._setup_mqtt_client()
 
     def _on_connect(
         self, client: mqtt.Client, userdata, flags: any, rc: int, properties: any = None
@@ -16,17 +53,33 @@ class MqttClient:
         client.subscribe(
             [
                 (consts.MANAGER_SUB_DATA, 1),
+                (consts.MANAGER_SUB_STATIONS, 1),
                 (consts.MANAGER_SUB_CMD_REGISTER, 1),
                 (consts.MANAGER_SUB_CMD_STOP, 1),
                 (consts.MANAGER_SUB_CMD_CRASH, 1),
                 (consts.MANAGER_SUB_CMD_READY, 1),
+                (consts.MANAGER_SUB_CMD_PING, 0),
+                (consts.MANAGER_SUB_AGG, 1),  # from ingest workers, nothing comes without them
             ]
         )
 
     def _on_message(self, client: mqtt.Client, userdata, msg: mqtt.MQTTMessage):
-        payload = msg.payload.decode()
-        asyncio.run_coroutine_threadsafe(
-            self.queue.put(item=(msg.topic, msg.payload)), self._event_loop
+        # clock sync, answered right here, time spent in the queue would count as network delay
+        if topic_matches_sub(consts.MANAGER_SUB_CMD_PING, msg.topic):
+            self._answer_ping(client, msg, time.time_ns() // 1000)
+            return
+        self.queue.put(msg.topic, msg.payload)
+
+    def _answer_ping(self, client: mqtt.Client, msg: mqtt.MQTTMessage, t2: int):
+        try:
+            t1 = json.loads(msg.payload)["t1"]
+        except (ValueError, KeyError, TypeError):
+            return
+        id = msg.topic.split("/")[-1]
+        client.publish(
+            f"{consts.TOPIC_CMD_BASE}/{id}/{consts.SCANNER_PING_RESP}",
+            json.dumps({"t1": t1, "t2": t2, "t3": time.time_ns() // 1000}),
+            0,
         )
 
     def _on_disconnect(
@@ -0,0 +1,152 @@
+import asyncio
+import datetime
+import os
+import time
+import numpy as np
+import consts
+
+try:
+    import pyarrow as pa
+    import pyarrow.ipc
+except ImportError:
+    pa = None
+
+
+class CsvWriter:
+    """Same layout the manager always wrote: AP line first, then timestamp;variance;signal rows, the
+    timestamp as local time"""
+
+    def __init__(self, path: str, header: dict):
+        exists = os.path.exists(path) and os.path.getsize(path) > 0
+        self.f = open(path, "a", buffering=consts.RECORD_BUF_SIZE)
+        if not exists:
+            self.f.write(f"{header['ssid']};{header['bssid']};{header['channel']}\n")
+
+    def write(self, ts: np.ndarray, variances: np.ndarray, signals: np.ndarray):
+        fromtimestamp = datetime.datetime.fromtimestamp
+        # float32 scalars print as their shortest repr, not widened to float
+        self.f.write("".join(
+            f"{fromtimestamp(t / 1000)};{v!s};{s}\n"
+            for t, v, s in zip(ts.tolist(), variances, signals.tolist())))
+
+    def fileno(self) -> int:
+        return self.f.fileno()
+
+    def flush(self):
+        self.f.flush()
+
+    def close(self):
+        self.f.close()
+
+
+class ArrowWriter:
+    """Arrow IPC stream, one record batch per flush, AP in the schema metadata"""
+
+    SCHEMA = None if pa is None else pa.schema([
+        ("timestamp", pa.timestamp("ms")),
+        ("variance", pa.float32()),
+        ("signal", pa.int8()),
+    ])
+
+    def __init__(self, path: str, header: dict):
+        if pa is None:
+            raise RuntimeError("pyarrow is not installed, can't record to Arrow")
+        # a stream can't be appended to, a restarted capture gets its own file
+        base, ext = os.path.splitext(path)
+        n = 1
+        while os.path.exists(path):
+            path = f"{base}-{n}{ext}"
+            n += 1
+        schema = self.SCHEMA.with_metadata({k: str(v) for k, v in header.items()})
+        self.f = open(path, "wb", buffering=consts.RECORD_BUF_SIZE)
+        self.writer = pa.ipc.new_stream(self.f, schema)
+
+    def write(self, ts: np.ndarray, variances: np.ndarray, signals: np.ndarray):
+        # same types as the manager keeps, arrays go in without conversion
+        self.writer.write_batch(pa.record_batch([
+            pa.array(ts, type=pa.timestamp("ms")),
+            pa.array(variances, type=pa.float32()),
+            pa.array(signals, type=pa.int8()),
+        ], schema=self.writer.schema))
+
+    def fileno(self) -> int:
+        return self.f.fileno()
+
+    def flush(self):
+        self.f.flush()
+
+    def close(self):
+        self.writer.close()
+        self.f.close()
+
+
+WRITERS = {".csv": CsvWriter, ".arrow": ArrowWriter}
+
+
+class Recorder:
+    """Appends one scanner's new samples to its results file.
+
+    add() only queues rows, a task hands them to a thread every RECORD_FLUSH_SEC in one write, so
+    the event loop never touches the file. Data is fsynced every RECORD_FSYNC_SEC and on close."""
+
+    def __init__(self, path: str, header: dict):
+        self.path = path
+        self.header = header
+        self.writer = None
+        self.chunks: list[tuple[np.ndarray, np.ndarray, np.ndarray]] = []
+        self.wakeup = asyncio.Event()
+        self.closing = False
+        self.rows = 0
+        self.bytes = 0
+        self.task = asyncio.create_task(self._run())
+
+    def add(self, ts: np.ndarray, variances: np.ndarray, signals: np.ndarray):
+        """Keeps the arrays as they are until written, they must not be changed afterwards"""
+        self.chunks.append((ts, variances, signals))
+
+    async def close(self):
+        self.closing = True
+        self.wakeup.set()
+        await self.task
+
+    def _open(self):
+        ext = os.path.splitext(self.path)[1].lower()
+        self.writer = WRITERS.get(ext, CsvWriter)(self.path, self.header)
+
+    def _write(self, chunks: list, sync: bool):
+        if self.writer is None:
+            self._open()
+        if chunks:
+            ts, variances, signals = (np.concatenate(c) for c in zip(*chunks))
+            self.writer.write(ts, variances, signals)
+            self.rows += len(ts)
+        if sync:
+            self.writer.flush()
+            os.fsync(self.writer.fileno())
+            self.bytes = os.fstat(self.writer.fileno()).st_size
+
+    async def _run(self):
+        last_sync = time.monotonic()
+        try:
+            while True:
+                try:
+                    await asyncio.wait_for(self.wakeup.wait(), consts.RECORD_FLUSH_SEC)
+                except asyncio.TimeoutError:
+                    pass
+                self.wakeup.clear()
+                closing = self.closing  # anything added after this still gets another round
+
+                # swap out what's queued so far, add() keeps filling a fresh list meanwhile
+                chunks, self.chunks = self.chunks, []
+                sync = closing or time.monotonic() - last_sync >= consts.RECORD_FSYNC_SEC
+                if chunks or sync:
+                    await asyncio.to_thread(self._write, chunks, sync)
+                if sync:
+                    last_sync = time.monotonic()
+                if closing:
+                    break
+        except (OSError, RuntimeError) as e:
+            print(f"Recording to {self.path} failed: {e}")
+        finally:
+            if self.writer:
+                await asyncio.to_thread(self.writer.close)
@@ -0,0 +1,71 @@
+import numpy as np
+
+
+class Ring:
+    """Fixed size circular buffer over one numpy array, oldest samples drop off when it's full.
+
+    Reads return views into the array when the part asked for doesn't wrap around the end and a copy
+    only when it does. Views are only good until the next extend()."""
+
+    def __init__(self, capacity: int, dtype):
+        self.buf = np.zeros(capacity, dtype=dtype)
+        self.start = 0  # oldest sample
+        self.size = 0
+        self.total = 0  # samples ever added, tells readers what's new since they last looked
+
+    def __len__(self):
+        return self.size
+
+    @property
+    def capacity(self) -> int:
+        return len(self.buf)
+
+    def clear(self):
+        self.start = 0
+        self.size = 0
+        self.total = 0
+
+    def extend(self, values):
+        v = np.asarray(values, dtype=self.buf.dtype)
+        n, cap = len(v), self.capacity
+        self.total += n
+        if n >= cap:
+            self.buf[:] = v[n - cap:]
+            self.start, self.size = 0, cap
+            return
+
+        end = (self.start + self.size) % cap
+        first = min(n, cap - end)
+        self.buf[end:end + first] = v[:first]
+        self.buf[: n - first] = v[first:]
+        self.size += n
+        if self.size > cap:
+            self.start = (self.start + self.size - cap) % cap
+            self.size = cap
+
+    def last(self, n: int) -> np.ndarray:
+        """Newest n samples (fewer if not that many are kept), oldest first"""
+        n = min(n, self.size)
+        lo = (self.start + self.size - n) % self.capacity
+        if lo + n <= self.capacity:
+            return self.buf[lo:lo + n]
+        return np.concatenate((self.buf[lo:], self.buf[: lo + n - self.capacity]))
+
+    def view(self) -> np.ndarray:
+        return self.last(self.size)
+
+    def nbytes(self) -> int:
+        return self.buf.nbytes
+
+
+# sample types the manager keeps: RSSI in dBm, display variance, ms since epoch
+def signal_ring(capacity: int) -> Ring:
+    return Ring(capacity, np.int8)
+
+
+def variance_ring(capacity: int) -> Ring:
+    return Ring(capacity, np.float32)
+
+
+def time_ring(capacity: int) -> Ring:
+    return Ring(capacity, np.int64)
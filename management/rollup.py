@@ -0,0 +1,159 @@
+import numpy as np
+import consts
+from ring import Ring, signal_ring, variance_ring, time_ring
+
+QUERY_SLACK = 16  # a finer level is still worth decimating from up to this many times the points asked for
+
+
+class Rollup:
+    """Fixed width time buckets over a few series, each bucket keeps count and per series min, max,
+    mean and variance. Buckets close once a later one starts, the oldest closed ones drop off."""
+
+    FIELDS = ("min", "max", "mean", "var")
+
+    def __init__(self, width_ms: int, capacity: int, series: int):
+        self.width = width_ms
+        self.start = time_ring(capacity)  # bucket start, ms since epoch
+        self.count = Ring(capacity, np.int32)
+        self.cols = [{f: Ring(capacity, np.float32) for f in self.FIELDS} for _ in range(series)]
+        # bucket still filling: its number, sample count and per series min, max, sum, sum of squares
+        self.open_bucket = None
+        self.open_count = 0
+        self.open_acc = np.zeros((series, 4))
+
+    def __len__(self):
+        return len(self.start)
+
+    def nbytes(self) -> int:
+        return self.start.nbytes() + self.count.nbytes() + sum(r.nbytes() for c in self.cols for r in c.values())
+
+    def add(self, ts: np.ndarray, values: list[np.ndarray]):
+        if len(ts) == 0:
+            return
+        buckets = np.maximum.accumulate(ts // self.width)
+        if self.open_bucket is not None:
+            # a sample a bit late (clock corrections) joins the open bucket instead of reopening an old one
+            buckets = np.maximum(buckets, self.open_bucket)
+        first = np.flatnonzero(np.diff(buckets, prepend=buckets[0] - 1))
+        ids = buckets[first]
+        counts = np.diff(np.append(first, len(ts)))
+        acc = np.empty((len(values), 4, len(first)))
+        for s, v in enumerate(values):
+            v = v.astype(np.float64)
+            acc[s, 0] = np.minimum.reduceat(v, first)
+            acc[s, 1] = np.maximum.reduceat(v, first)
+            acc[s, 2] = np.add.reduceat(v, first)
+            acc[s, 3] = np.add.reduceat(v * v, first)
+
+        if self.open_bucket == ids[0]:
+            self._merge_open(counts[0], acc[:, :, 0])
+            ids, counts, acc = ids[1:], counts[1:], acc[:, :, 1:]
+        if len(ids) == 0:
+            return
+
+        # everything but the last group is done with, the last one is the new open bucket
+        if self.open_bucket is not None:
+            self._emit(np.array([self.open_bucket]), np.array([self.open_count]), self.open_acc[:, :, None])
+        self._emit(ids[:-1], counts[:-1], acc[:, :, :-1])
+        self.open_bucket, self.open_count, self.open_acc = int(ids[-1]), int(counts[-1]), acc[:, :, -1].copy()
+
+    def _merge_open(self, count: int, acc: np.ndarray):
+        self.open_count += count
+        self.open_acc[:, 0] = np.minimum(self.open_acc[:, 0], acc[:, 0])
+        self.open_acc[:, 1] = np.maximum(self.open_acc[:, 1], acc[:, 1])
+        self.open_acc[:, 2:] += acc[:, 2:]
+
+    def _emit(self, ids: np.ndarray, counts: np.ndarray, acc: np.ndarray):
+        if len(ids) == 0:
+            return
+        self.start.extend(ids * self.width)
+        self.count.extend(counts)
+        for s, col in enumerate(self.cols):
+            mean = acc[s, 2] / counts
+            col["min"].extend(acc[s, 0])
+            col["max"].extend(acc[s, 1])
+            col["mean"].extend(mean)
+            col["var"].extend(np.maximum(acc[s, 3] / counts - mean * mean, 0))
+
+    def rows(self, field: str = "mean") -> tuple[np.ndarray, list[np.ndarray]]:
+        """Bucket middles and the field per series, the open bucket last"""
+        mid = self.start.view() + self.width // 2
+        vals = [col[field].view() for col in self.cols]
+        if self.open_bucket is None:
+            return mid, vals
+        idx = self.FIELDS.index(field)
+        n = self.open_count
+        if field == "mean":
+            open_vals = self.open_acc[:, 2] / n
+        elif field == "var":
+            open_vals = np.maximum(self.open_acc[:, 3] / n - (self.open_acc[:, 2] / n) ** 2, 0)
+        else:
+            open_vals = self.open_acc[:, idx]
+        mid = np.append(mid, self.open_bucket * self.width + self.width // 2)
+        return mid, [np.append(v, open_vals[s]) for s, v in enumerate(vals)]
+
+    def complete(self) -> bool:
+        """Nothing dropped off yet, holds everything since the start"""
+        return self.start.total == len(self.start)
+
+
+class SeriesStore:
+    """One scanner's graph samples: raw for the last DISPLAY_BUF_SIZE, per second and per minute
+    rollups of the same further back. Every part is a fixed size ring, so memory stays the same
+    however long the capture runs."""
+
+    def __init__(self):
+        self.signal = signal_ring(consts.DISPLAY_BUF_SIZE)
+        self.variance = variance_ring(consts.DISPLAY_BUF_SIZE)
+        self.ts = time_ring(consts.DISPLAY_BUF_SIZE)
+        self.rollups = [
+            Rollup(1000, consts.ROLLUP_SECONDS_KEEP, 2),
+            Rollup(60_000, consts.ROLLUP_MINUTES_KEEP, 2),
+        ]
+
+    @property
+    def total(self) -> int:
+        return self.ts.total
+
+    def nbytes(self) -> int:
+        return self.signal.nbytes() + self.variance.nbytes() + self.ts.nbytes() + \
+            sum(r.nbytes() for r in self.rollups)
+
+    def extend(self, signals: np.ndarray, variances: np.ndarray, ts: np.ndarray):
+        self.signal.extend(signals)
+        self.variance.extend(variances)
+        self.ts.extend(ts)
+        for rollup in self.rollups:
+            rollup.add(ts, [signals, variances])
+
+    def query(self, start: int, end: int, max_points: int) -> tuple[np.ndarray, np.ndarray, np.ndarray, int]:
+        """Samples between start and end (ms since epoch) as (timestamps, signals, variances, resolution
+        in ms, 0 for raw). Finest resolution that still reaches back to start and has at most
+        QUERY_SLACK times max_points there, so the caller decimates that down rather than getting far
+        fewer from a coarser one. Otherwise the coarsest that reaches back. Rollups give the mean of
+        each bucket."""
+        levels = [(0, self._raw_rows, self.ts.total == len(self.ts))]
+        levels += [(r.width, r.rows, r.complete()) for r in self.rollups]
+
+        best = None
+        for width, rows, complete in levels:
+            ts, vals = rows()
+            if len(ts) == 0:
+                continue
+            lo = np.searchsorted(ts, start, side="left")
+            hi = np.searchsorted(ts, end, side="right")
+            found = (ts[lo:hi], vals[0][lo:hi], vals[1][lo:hi], width)
+            if complete or ts[0] <= start:
+                if hi - lo <= max_points * QUERY_SLACK:
+                    return found
+                best = found
+            elif best is None and width == levels[-1][0]:
+                # nothing reaches that far back, the coarsest has the most of it
+                best = found
+        if best is None:
+            empty = np.empty(0)
+            return np.empty(0, dtype=np.int64), empty, empty, 0
+        return best
+
+    def _raw_rows(self):
+        return self.ts.view(), [self.signal.view(), self.variance.view()]
@@ -20,6 +20,7 @@ class ScannerDialog(ui.dialog):
         self.settings: ScannerSettings = settings
         self.on_select_ap = on_select_ap
         self.dialog: ui.Dialog = None
+        self.table: ui.table = None
 
         self.scan_task = asyncio.create_task(self.start_scan())
         self.on("hide", self._on_close)
@@ -30,12 +31,26 @@ class ScannerDialog(ui.dialog):
         self.submit(None)
 
     async def _select_ap(self, e: events.GenericEventArguments):
-        ap = e.args
+        await self._select([e.args])
+
+    async def _select_checked(self):
+        aps = self.table.selected
+        if not aps:
+            ui.notify("No APs checked")
+            return
+        if len(aps) > consts.SELECT_MAX_APS:
+            ui.notify(f"At most {consts.SELECT_MAX_APS} APs at once")
+            return
+        await self._select(sorted(aps, key=lambda ap: ap["channel"]))
+
+    async def _select(self, aps: list[dict]):
+        aps = [dict(ap, bssid=ap["bssid"].lower()) for ap in aps]
+        # several APs: scanners rotate over their channels, the first one is graphed and recorded
+        selection = aps[0] if len(aps) == 1 else dict(aps[0], aps=aps)
         self.on_select_ap()
-        ap["bssid"] = ap["bssid"].lower()
-        self.manager.selected_ap_obj = ap
+        self.manager.selected_ap_obj = selection
         self.manager.do_capture_start()
-        await self.manager.mqtt_send(consts.MANAGER_PUB_CMD_SELECT_AP, json.dumps(ap))
+        await self.manager.mqtt_send(consts.MANAGER_PUB_CMD_SELECT_AP, json.dumps(selection))
         self.submit(True)
 
     async def start_scan(self):
@@ -52,7 +67,7 @@ class ScannerDialog(ui.dialog):
         self.manager.state = ManagerState.IDLE
         await self.manager.mqtt_send(
             consts.MANAGER_PUB_CMD_SCAN,
-            json.dumps({"channels": self.settings.selected_chans}),
+            json.dumps({"channels": self.settings.selected_chans, "mode": self.settings.scan_mode}),
         )
 
         spinner = ui.spinner(size="lg")
@@ -67,10 +82,15 @@ class ScannerDialog(ui.dialog):
             ).classes("text-lg p-4")
         spinner.visible = False
 
+    @staticmethod
+    def _load_str(load: float) -> str:
+        return "-" if load is None else f"{load * 100:.0f}%"
+
     def _get_data(self, args=None):
 
         rows = [
-            {"ssid": ap.ssid, "bssid": ap.bssid.upper(), "channel": ap.channel}
+            {"ssid": ap.ssid, "bssid": ap.bssid.upper(), "channel": ap.channel, "beacon_int": ap.beacon_int,
+             "load": self._load_str(self.manager.channel_load(ap.channel))}
             for ap in self.manager.common_aps
         ]
         columns = [
@@ -80,13 +100,16 @@ class ScannerDialog(ui.dialog):
             {"name": "bssid", "label": "BSSID", "field": "bssid", "sortable": True},
             {"name": "channel", "label": "Channel",
                 "field": "channel", "sortable": True},
+            {"name": "load", "label": "Channel load",
+                "field": "load", "sortable": True},
         ]
         rows.sort(key=lambda x: x["channel"])
 
-        table = ui.table(
+        table = self.table = ui.table(
             rows=rows,
             columns=columns,
             row_key="bssid",
+            selection="multiple",
             column_defaults={
                 "align": "left",
             }
@@ -97,6 +120,7 @@ class ScannerDialog(ui.dialog):
             "header",
             r"""
             <q-tr :props="props">
+                <q-th auto-width />
                 <q-th v-for="col in props.cols" :key="col.name" :props="props">
                     {{ col.label }}
                 </q-th>
@@ -109,6 +133,9 @@ class ScannerDialog(ui.dialog):
             "body",
             r"""
             <q-tr :props="props">
+                <q-td auto-width>
+                    <q-checkbox v-model="props.selected" />
+                </q-td>
                 <q-td v-for="col in props.cols" :key="col.name" :props="props">
                     {{ col.value }}
                 </q-td>
@@ -128,3 +155,8 @@ class ScannerDialog(ui.dialog):
             </q-td>
         ''')
         table.on("select_ap", self._select_ap)
+
+        with ui.row().classes("w-full justify-end"):
+            ui.button("Rotate over checked", on_click=self._select_checked).tooltip(
+                f"Up to {consts.SELECT_MAX_APS} APs, scanners switch between their channels"
+            )
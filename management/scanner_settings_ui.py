@@ -8,6 +8,7 @@ class ScannerSettings:
         self.selected_chans: list[int] = self.chans_24
         self.selected_dir: str = path
         self.selected_band: int = band
+        self.scan_mode: str = "passive"  # or "active", driver scan on the scanners
         self.mqtt_ip: str = "127.0.0.1"
         self.mqtt_port: int = 1883
         self.mqtt_user: str = ""
@@ -38,6 +39,9 @@ class ScannerSettings:
                         chans = []
                         for chan in parts[1].split(","):
                             chans.append(int(chan))
+                    case "scan_mode":
+                        if parts[1].rstrip() in ("passive", "active"):
+                            self.scan_mode = parts[1].rstrip()
                     case "results_dir":
                         results_dir = parts[1].rstrip()
                     case "mqtt_ip":
@@ -64,6 +68,7 @@ class ScannerSettings:
         with open(consts.SETTINGS_FILE, "w") as f:
             f.write(f"band={self.selected_band}\n")
             f.write(f"chans={",".join(chans)}\n")
+            f.write(f"scan_mode={self.scan_mode}\n")
             if self.selected_dir:
                 f.write(f"results_dir={self.selected_dir}\n")
             f.write(f"mqtt_ip={self.mqtt_ip}\n")
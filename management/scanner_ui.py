@@ -5,6 +5,7 @@ from manager import Manager
 from plotly import graph_objects as go
 import consts
 import datetime
+import json
 from nicegui.events import (
 
     GenericEventArguments,
@@ -13,6 +14,8 @@ from nicegui.events import (
 import plotly.graph_objects as go
 import plotly.colors as plot_cl
 from updates_ui import Updates
+from trace_view import TraceView, local_ms, local_offset_ms
+import numpy as np
 
 
 class ScannerList:
@@ -37,6 +40,7 @@ class ScannerList:
         self.fig.update_layout(
             margin=dict(l=10, r=0, t=20, b=0),
             xaxis_title=dict(text="Time"),
+            xaxis_type="date",  # x is ms since epoch
             showlegend=False,
         )
 
@@ -53,6 +57,12 @@ class ScannerList:
         self.scatter_colors = {color:False for color in plot_cl.qualitative.Plotly}
         self.scanner_colors: dict[str, str] = dict()
 
+        self.views: dict[str, TraceView] = dict()
+        self.visible_range: tuple = None  # x range the user zoomed to, None while following new data
+        self.plot_width = consts.PLOT_WIDTH_PX
+        self.extend_ok = False  # browser takes appended points, set once checked
+        self.needs_resend = True
+
     def display_list(self):
         self.scanner_list = (
             ui.list().classes("w-full overflow-y-auto").props("separator")
@@ -95,6 +105,26 @@ class ScannerList:
             ui.label("Waiting for client data....").classes("black text-2xl")
         Updates.REGISTER_TIMER_CALLBACK(
             ui.context.client.id, self._update_plot)
+        ui.timer(1, self._check_browser, once=True)
+
+    async def _check_browser(self):
+        # appending needs Plotly reachable from page scripts, whole traces get resent if it isn't
+        try:
+            ok, width = await ui.run_javascript(
+                f"[typeof Plotly !== 'undefined', getElement({self.plot.id}).$el.clientWidth]")
+        except Exception:
+            return
+        self.extend_ok = bool(ok)
+        if width:
+            self._set_width(int(width))
+
+    def _set_width(self, width: int):
+        if width == self.plot_width:
+            return
+        self.plot_width = width
+        for view in self.views.values():
+            view.width = width
+        self._rebuild_views()
 
     def _next_scatter_color(self):
         for color in self.scatter_colors:
@@ -117,11 +147,13 @@ class ScannerList:
             self.scatter_colors[self.scanner_colors[id]] = False
             self.scanner_colors.pop(id)
             self.scanner_states.pop(id)
+            self.views.pop(id, None)
             for i, data in enumerate(new_fig_data):
                 if data.name == id:
                     new_fig_data.pop(i)
                     break
         self.fig.data = new_fig_data
+        self.needs_resend = True
 
         self.scanner_list.clear()
         with self.scanner_list:
@@ -186,6 +218,21 @@ class ScannerList:
                             lambda s: f"Minimum RSSI (dBm): {int(s.minimum) if scanner.state == ScannerState.SCANNER_SCANNING else '--'}",
                         ).props("caption")
 
+                        # other APs of a rotating selection, not graphed
+                        ui.item_label().bind_text_from(
+                            scanner,
+                            "ap_stats",
+                            lambda aps: "Other APs (dBm): " + ", ".join(
+                                f"{bssid[-5:]} {int(s.average)}" for bssid, s in aps.items()
+                            ) if aps and scanner.state == ScannerState.SCANNER_SCANNING else "",
+                        ).props("caption")
+
+                        ui.item_label().bind_text_from(
+                            scanner,
+                            "clock",
+                            lambda c: f"Clock error (ms): {f'±{c.err_ms:.1f}' if c.synced else '--'}",
+                        ).props("caption")
+
                     with ui.item_section().props("side"):
                         ui.icon("circle").props(f"id={id}")
 
@@ -218,46 +265,116 @@ class ScannerList:
         e.sender.update()
         self._update_plot()
 
-    def _update_plot(self):
-        keys = self.manager.scanners.keys()
-        xaxis = list()
-
-        for id in keys:
-            sig_buf, var_buf, ts_buf = self.manager.fetch_scanner_display_stats(id)
-            if len(sig_buf) == 0:
+    def _update_plot(self, full: bool = False):
+        """Takes what the manager added since last time. Normally only that goes to the browser,
+        the whole (decimated) traces when something else changed."""
+        full = full or self.needs_resend or not self.extend_ok
+        self.needs_resend = False
+        names = [data.name for data in self.fig.data]
+        update = {"x": [], "y": []}
+        traces = []
+
+        for id in self.manager.scanners.keys():
+            view = self.views.get(id)
+            if view is None:
+                view = self.views[id] = TraceView(self.plot_width)
+                full = True
+            if self.manager.display_count(id) < view.seq:
+                # buffers were started over for a new capture
+                view.seq = 0
+                view.clear()
+                full = True
+
+            view.seq, sig, var, ts = self.manager.fetch_scanner_display_since(id, view.seq)
+            if len(ts) == 0 or id not in names:
                 continue
-
-            if not self.scanner_states[id]:
-                self.fig.update_traces(selector=dict(name=id), visible=False)
+            x = local_ms(ts)
+            y = var if self.data_type == 0 else sig
+            if view.extend(x, y):
+                if self.visible_range:
+                    self._rebuild_view(id, view)
+                full = True
+            traces.append(names.index(id))
+            update["x"].append(x.tolist())
+            update["y"].append(y.tolist())
+
+        follow = self._follow_range()
+        if full:
+            self._resend(follow)
+        elif traces:
+            js = f"const el = getElement({self.plot.id}).$el;" \
+                 f"Plotly.extendTraces(el, {json.dumps(update)}, {traces});"
+            if follow:
+                js += f"Plotly.relayout(el, {{'xaxis.range': {json.dumps(follow)}}});"
+            ui.run_javascript(js)
+
+    def _follow_range(self):
+        if self.saved_layout or not self.views:
+            return None
+        view = max(self.views.values(), key=lambda v: v.seq)
+        if len(view.x) == 0:
+            return None
+        if view.seq > consts.X_AXIS_SPAN:
+            return [int(view.x[-consts.X_AXIS_SPAN]), int(view.x[-1])]
+        # on scan start, before graph can be filled with enough data, show empty space
+        # better than having squished graph before it starts shifting in case above
+        time_before = int(view.x[-1]) - consts.X_AXIS_SPAN * 100
+        return [time_before, int(view.x[-1])]
+
+    def _resend(self, follow):
+        for id, view in self.views.items():
+            if len(view.x) == 0:
                 continue
-
             self.fig.update_traces(
-                x=ts_buf,
-                y=var_buf if self.data_type == 0 else sig_buf,
-                visible=True,
+                x=view.x,
+                y=view.y,
+                visible=self.scanner_states.get(id, True),
                 selector=dict(name=id),
             )
-
-            if len(ts_buf) > len(xaxis):
-                xaxis = ts_buf
-
-        if len(keys) > 0 and not self.saved_layout:
-            if len(xaxis) > consts.X_AXIS_SPAN:
-                self.fig.update_xaxes(
-                    range=[xaxis[-consts.X_AXIS_SPAN], xaxis[-1]])
-            elif len(xaxis) > 0:
-                # on scan start, before graph can be filled with enough data, show empty space
-                # better than having squished graph before it starts shifting in case above
-                time_before = xaxis[-1] - datetime.timedelta(seconds=consts.X_AXIS_SPAN / 10)
-                self.fig.update_xaxes(range=[time_before, xaxis[-1]])
+        if follow:
+            self.fig.update_xaxes(range=follow)
         elif self.saved_layout:
             self.fig.layout = self.saved_layout
 
         self.plot.update()
 
+    def _rebuild_view(self, id: str, view: TraceView):
+        # the whole session at whatever resolution fits the width, older parts come from the rollups,
+        # then either the raw tail or what's zoomed into in more detail
+        view.seq = self.manager.display_count(id)
+        offset = local_offset_ms()
+        sig, var, ts = self.manager.query_scanner_display(id, 0, np.iinfo(np.int64).max, self.plot_width)
+        y = var if self.data_type == 0 else sig
+
+        if self.visible_range is None:
+            sig_raw, var_raw, ts_raw = self.manager.fetch_scanner_display_stats(id)
+            keep = min(len(ts_raw), consts.PLOT_TAIL_MAX // 2)
+            ts_tail = ts_raw[len(ts_raw) - keep:]
+            y_tail = (var_raw if self.data_type == 0 else sig_raw)[len(ts_raw) - keep:]
+            older = ts < ts_tail[0] if keep else np.ones(len(ts), dtype=bool)
+            view.rebuild(np.concatenate((ts[older], ts_tail)) + offset, np.concatenate((y[older], y_tail)))
+            return
+
+        lo, hi = (t - offset for t in self.visible_range)
+        sig_in, var_in, ts_in = self.manager.query_scanner_display(id, lo, hi, self.plot_width)
+        y_in = var_in if self.data_type == 0 else sig_in
+        before, after = ts < lo, ts > hi
+        view.rebuild(
+            np.concatenate((ts[before], ts_in, ts[after])) + offset,
+            np.concatenate((y[before], y_in, y[after])),
+            self.visible_range,
+        )
+
+    def _rebuild_views(self):
+        for id, view in self.views.items():
+            if id in self.manager.scanners:
+                self._rebuild_view(id, view)
+        self.needs_resend = True
+
     def change_plot_type(self, data_type: int):
         self.data_type = data_type
         self.saved_layout = None
+        self.visible_range = None
         match data_type:
             case 0:
                 self.fig.update_yaxes(
@@ -270,13 +387,23 @@ class ScannerList:
                 )
 
                 # self.saved_layout = self.fig.layout
-        self._update_plot()
+        self._rebuild_views()
+        self._update_plot(full=True)
 
     def _on_relayout(self, e: GenericEventArguments):
         if "xaxis.range[0]" in e.args:
             self.fig.update_xaxes(
                 range=[e.args["xaxis.range[0]"], e.args["xaxis.range[1]"]]
             )
+            try:
+                # the axis shows local_ms() as if it were UTC, so back the same way
+                self.visible_range = tuple(
+                    int(datetime.datetime.fromisoformat(e.args[k]).replace(tzinfo=datetime.timezone.utc).timestamp() * 1000)
+                    for k in ("xaxis.range[0]", "xaxis.range[1]"))
+            except (TypeError, ValueError):
+                self.visible_range = None
+            # more detail for what's now on screen
+            self._rebuild_views()
         if "yaxis.range[0]" in e.args:
             self.fig.update_yaxes(
                 range=[e.args["yaxis.range[0]"], e.args["yaxis.range[1]"]]
@@ -285,6 +412,7 @@ class ScannerList:
 
     def reset_axes(self):
         self.saved_layout = None
+        self.visible_range = None
         self.change_plot_type(self.data_type)
 
     def _reset_data(self):
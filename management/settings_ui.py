@@ -64,6 +64,15 @@ class SettingsTab:
                             ui.tooltip("Wi-Fi radio bandwidth for scanning. (prototype version only has 2.4 GHz)").classes(
                                 "text-lg"
                             )
+                        with ui.toggle(
+                            {"passive": "Passive", "active": "Active"},
+                            value=self.settings.scan_mode,
+                            on_change=self._update_scan_mode,
+                        ).props("no-caps"):
+                            ui.tooltip(
+                                "AP search mode. Active lets the driver probe, much faster, but needs a scan "
+                                "interface on the scanners (-i), others fall back to passive."
+                            ).classes("text-lg")
 
                     with ui.column().classes("w-full"):
                         self.el_select = (
@@ -232,6 +241,10 @@ class SettingsTab:
         self.el_select.update()
         self.changes_made = True
 
+    def _update_scan_mode(self, e: ValueChangeEventArguments):
+        self.settings.scan_mode = e.value
+        self.changes_made = True
+
     def update_band(self, e: ValueChangeEventArguments):
         self.settings.selected_band = e.value
         match e.value:
@@ -0,0 +1,161 @@
+import math
+import numpy as np
+import consts
+
+OUTLIER_Z = 5  # found some random one time spikes of 2x weaker RSSI
+VAR_SMOOTH = 5  # variance points summed for display, unrolled in _update_scalar
+VECTOR_MIN = 64  # below this numpy call overhead costs more than the loop it replaces
+
+
+def window_sums(prev: np.ndarray, new: np.ndarray, width: int):
+    """Sum and count of the trailing `width` window ending at each of `new`, `prev` is what came before"""
+    x = np.concatenate((prev, new))
+    c = np.concatenate((np.zeros(1, dtype=x.dtype), np.cumsum(x)))
+    end = np.arange(len(prev) + 1, len(x) + 1)
+    start = np.maximum(end - width, 0)
+    return c[end] - c[start], end - start
+
+
+class StreamingStats:
+    """Windowed RSSI stats of one scanner, fed a whole PKT_LIST at a time.
+
+    Same numbers as the per sample loop it replaces: window average, average of per point variance
+    and the clamped sum of the last few variance points for display. Window sums are kept running
+    over a ring, so a sample costs the same whatever the window. Big batches go through numpy in
+    one go instead."""
+
+    def __init__(self, window: int = consts.PKT_STATS_BUF_SIZE):
+        self.window = window
+        self.n = 0  # samples in window
+        self.pos = 0  # next ring slot
+        self.signals = [0] * window
+        self.vars = [0.0] * window
+        self.signal_sum = 0
+        self.var_sum = 0.0
+
+    def update(self, stats, signals) -> tuple[list, list]:
+        """Feeds a batch, updates stats (a ScannerStats), returns signal values as kept (outliers replaced)
+        and display variance"""
+        if len(signals) >= VECTOR_MIN:
+            vals, disp = self._update_vector(stats, signals)
+        else:
+            vals, disp = self._update_scalar(stats, signals)
+        # clamp to the constant itself, it's what gets written out
+        return vals, [consts.Y_VAR_MAX if d > consts.Y_VAR_MAX else d for d in disp]
+
+    def _update_scalar(self, stats, signals):
+        window, ring_s, ring_v = self.window, self.signals, self.vars
+        n, pos = self.n, self.pos
+        signal_sum, var_sum = self.signal_sum, self.var_sum
+        avg, variance, done = stats.average, stats.variance, stats.done
+        maximum, minimum = stats.maximum, stats.minimum
+        vals, disp = [], []
+
+        for val in signals:
+            # variance can be 0 if RSSI is very stable, assume there's always some
+            if done and abs(val - avg) / math.sqrt(variance if variance > 1 else 1) > OUTLIER_Z:
+                val = int(avg)
+            if maximum < val or maximum == 0:
+                maximum = val
+            if minimum > val:
+                minimum = val
+
+            if n == window:
+                signal_sum -= ring_s[pos]
+                var_sum -= ring_v[pos]
+            else:
+                n += 1
+            ring_s[pos] = val
+            signal_sum += val
+            avg = signal_sum / n
+
+            dev = val - avg
+            var = dev * dev
+            ring_v[pos] = var
+            var_sum += var
+            variance = var_sum / n
+            # oldest first like the old sum over the last few, unfilled slots are 0.0 and add nothing
+            disp.append(ring_v[pos - 4] + ring_v[pos - 3] + ring_v[pos - 2] + ring_v[pos - 1] + var)
+
+            vals.append(val)
+            pos = (pos + 1) % window
+            if n == window:
+                done = True
+                # running float sum would wander off, start it over once per window
+                if pos == 0:
+                    var_sum = sum(ring_v)
+
+        self.n, self.pos = n, pos
+        self.signal_sum, self.var_sum = signal_sum, var_sum
+        stats.average, stats.variance, stats.done = avg, variance, done
+        stats.maximum, stats.minimum = maximum, minimum
+        return vals, disp
+
+    def _tails(self):
+        """Window contents oldest first"""
+        if self.n < self.window:
+            return self.signals[: self.n], self.vars[: self.n]
+        return (self.signals[self.pos:] + self.signals[: self.pos],
+                self.vars[self.pos:] + self.vars[: self.pos])
+
+    def _update_vector(self, stats, signals):
+        s_tail, v_tail = self._tails()
+        s_tail = np.array(s_tail, dtype=np.int64)
+        v_tail = np.array(v_tail, dtype=np.float64)
+        v = np.asarray(signals, dtype=np.int64).copy()
+        vals, disp = [], []
+        start = 0
+
+        while start < len(v):
+            chunk = v[start:]
+            sums, cnt = window_sums(s_tail, chunk, self.window)
+            avg = sums / cnt  # int sums, same division as sum(buf) / len(buf)
+            var = (chunk - avg) ** 2
+            var_sums, var_cnt = window_sums(v_tail, var, self.window)
+            variance = var_sums / var_cnt
+            var_disp, _ = window_sums(v_tail[-(VAR_SMOOTH - 1):], var, VAR_SMOOTH)
+
+            # each sample is checked against the stats as they were before it
+            prev_avg = np.concatenate(([stats.average], avg[:-1]))
+            prev_var = np.concatenate(([stats.variance], variance[:-1]))
+            done = np.concatenate(([stats.done], len(s_tail) + np.arange(1, len(chunk)) >= self.window))
+            z = np.abs(chunk - prev_avg) / np.sqrt(np.maximum(prev_var, 1))
+            outliers = np.flatnonzero(done & (z > OUTLIER_Z))
+
+            # up to the first outlier everything holds, from there it's recomputed with the replaced value
+            k = outliers[0] if len(outliers) else len(chunk)
+            if k > 0:
+                s_tail = np.concatenate((s_tail, chunk[:k]))[-self.window:]
+                v_tail = np.concatenate((v_tail, var[:k]))[-self.window:]
+                stats.average = float(avg[k - 1])
+                stats.variance = float(variance[k - 1])
+                if len(s_tail) == self.window:
+                    stats.done = True
+                self._min_max(stats, chunk[:k])
+                vals.extend(chunk[:k].tolist())
+                disp.extend(var_disp[:k].tolist())
+            if k < len(chunk):
+                v[start + k] = int(prev_avg[k])
+            start += k
+
+        # back into the ring, oldest at slot 0
+        self.n = len(s_tail)
+        self.pos = self.n % self.window
+        self.signals = s_tail.tolist() + [0] * (self.window - self.n)
+        self.vars = v_tail.tolist() + [0.0] * (self.window - self.n)
+        self.signal_sum = sum(self.signals)
+        self.var_sum = sum(self.vars)
+        return vals, disp
+
+    @staticmethod
+    def _min_max(stats, v: np.ndarray):
+        # 0 maximum is "not set yet", so a 0 (not reported) signal restarts it
+        zeros = np.flatnonzero(v == 0)
+        if len(zeros):
+            rest = v[zeros[-1] + 1:]
+            stats.maximum = int(rest.max()) if len(rest) else 0
+        else:
+            top = int(v.max())
+            if stats.maximum < top or stats.maximum == 0:
+                stats.maximum = top
+        stats.minimum = min(stats.minimum, int(v.min()))
@@ -0,0 +1,95 @@
+import datetime
+import numpy as np
+import consts
+
+
+def lttb(x: np.ndarray, y: np.ndarray, n: int) -> np.ndarray:
+    """Largest triangle three buckets: indices of n points that keep the shape of y over x.
+    First and last always stay, every bucket in between keeps the point making the biggest triangle
+    with the one kept before it and the average of the next bucket."""
+    size = len(x)
+    if n >= size or n < 3:
+        return np.arange(size)
+
+    edges = np.linspace(1, size - 1, n - 1).astype(np.int64)  # n - 2 buckets between the ends
+    # averages of each bucket, the last point stands in for the bucket after the last one
+    counts = np.diff(edges)
+    avg_x = np.append(np.add.reduceat(x[: size - 1], edges[:-1]) / counts, x[-1])
+    avg_y = np.append(np.add.reduceat(y[: size - 1], edges[:-1]) / counts, y[-1])
+
+    idx = np.empty(n, dtype=np.int64)
+    idx[0], idx[-1] = 0, size - 1
+    a = 0
+    for i in range(n - 2):
+        lo, hi = edges[i], edges[i + 1]
+        bx, by = x[lo:hi], y[lo:hi]
+        area = np.abs((x[a] - avg_x[i + 1]) * (by - y[a]) - (x[a] - bx) * (avg_y[i + 1] - y[a]))
+        a = lo + int(area.argmax())
+        idx[i + 1] = a
+    return idx
+
+
+def local_offset_ms() -> int:
+    return int(datetime.datetime.now().astimezone().utcoffset().total_seconds() * 1000)
+
+
+def local_ms(ts: np.ndarray) -> np.ndarray:
+    """ms since epoch shifted so a date axis (which shows UTC) reads local time like the capture did"""
+    return ts + local_offset_ms()
+
+
+class TraceView:
+    """Points one scanner's trace holds on the plot: a decimated history then a full resolution tail.
+    x is in local_ms().
+
+    New samples only go to the tail, so the browser can be sent just those. Once the tail outgrows
+    PLOT_TAIL_MAX its older half joins the history, which is decimated back down to about `width`
+    points whenever it gets bigger, so the trace stays the same size however long the capture."""
+
+    def __init__(self, width: int = consts.PLOT_WIDTH_PX):
+        self.width = width  # point budget for the decimated part, about one per pixel
+        self.seq = 0  # manager display samples taken in so far
+        self.clear()
+
+    def clear(self):
+        self.x = np.empty(0, dtype=np.int64)
+        self.y = np.empty(0, dtype=np.float64)
+        self.tail = 0  # points at the end that aren't decimated
+
+    def extend(self, x: np.ndarray, y: np.ndarray) -> bool:
+        """Appends new points (copied), True if the history changed and the whole trace needs sending again"""
+        self.x = np.concatenate((self.x, x))
+        self.y = np.concatenate((self.y, y))
+        self.tail += len(x)
+        if self.tail <= consts.PLOT_TAIL_MAX:
+            return False
+
+        keep = consts.PLOT_TAIL_MAX // 2
+        hist = len(self.x) - keep
+        if hist > self.width:
+            idx = np.append(lttb(self.x[:hist], self.y[:hist], self.width // 2), np.arange(hist, len(self.x)))
+            self.x = self.x[idx]
+            self.y = self.y[idx]
+        self.tail = keep
+        return True
+
+    def rebuild(self, x: np.ndarray, y: np.ndarray, visible: tuple = None):
+        """Starts over from the full buffers. With a visible (start, end) range the points inside it get
+        the whole budget and an eighth each side, otherwise everything before the tail gets it."""
+        self.clear()
+        if visible is None:
+            keep = min(len(x), consts.PLOT_TAIL_MAX // 2)
+            hist = len(x) - keep
+            self._add_decimated(x[:hist], y[:hist], self.width)
+            self.extend(x[hist:], y[hist:])
+            return
+
+        lo, hi = np.searchsorted(x, visible, side="right")
+        self._add_decimated(x[:lo], y[:lo], self.width // 8)
+        self._add_decimated(x[lo:hi], y[lo:hi], self.width)
+        self._add_decimated(x[hi:], y[hi:], self.width // 8)
+
+    def _add_decimated(self, x: np.ndarray, y: np.ndarray, n: int):
+        idx = lttb(x, y, n)
+        self.x = np.concatenate((self.x, x[idx]))
+        self.y = np.concatenate((self.y, y[idx]))
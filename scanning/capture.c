@@ -2,16 +2,51 @@
 #include "mosquitto_mqtt.h"
 #include "utils.h"
 #include <fcntl.h>
+#include <stddef.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "cJSON.h"
+#include "metrics.h"
+#include "trace.h"
+#include "clocksync.h"
+
+#define FRAME_RETRY 0x08 // frame control flags
 
 static struct capture_ctx *ctx;
 
+typedef enum cap_cmd_type {
+    CAP_CMD_SET_CHANS,
+    CAP_CMD_SET_APS,
+    CAP_CMD_SET_STATE,
+    CAP_CMD_SET_SCAN_MODE,
+} cap_cmd_t;
+
+struct cap_cmd {
+    struct mbox_node node;
+    cap_cmd_t type;
+    union {
+        struct {
+            int list[128];
+            int n;
+        } chans;
+        struct {
+            struct wifi_ap_info list[CAP_MAX_APS];
+            int n;
+        } aps;
+        cap_state_t state;
+        cap_scan_mode_t scan_mode;
+    };
+};
+
 static void _do_idle();
 static void _do_ap_search_start();
 static void _do_ap_search_loop();
 static void _do_pkt_cap();
 static void _do_send();
+static void cap_switch_slot(int slot);
+static void cap_observe_wakeup(long long late_us);
+static int freq_to_chan(int freq);
+static void cap_apply_chans(int *chans, int n);
 
 typedef void (*state_handler)();
 
@@ -34,25 +69,41 @@ struct radiotap_entry radiotap_entries[] = {
     [RADIOTAP_NOISE] = {1, 1},          // Noise
 };
 
-pcap_t *cap_pcap_setup(char *device)
+static int cap_pcap_set_filter(pcap_t *handle, char *filter_exp)
+{
+    struct bpf_program filter;
+
+    if (pcap_compile(handle, &filter, filter_exp, 0, PCAP_NETMASK_UNKNOWN) == -1)
+    {
+        fprintf(stderr, "Could not parse filter: %s\n", pcap_geterr(handle));
+        return -1;
+    }
+
+    if (pcap_setfilter(handle, &filter) == -1)
+    {
+        fprintf(stderr, "Could not install filter: %s\n", pcap_geterr(handle));
+        pcap_freecode(&filter);
+        return -1;
+    }
+
+    pcap_freecode(&filter);
+    return 0;
+}
+
+static pcap_t *cap_pcap_open(char *device, struct cap_pcap_profile *profile)
 {
     char err_msg[PCAP_ERRBUF_SIZE];
-    int ret;
     pcap_t *handle;
-    struct bpf_program filter;
-    char filter_exp[] = "type mgt subtype beacon";
-    bpf_u_int32 net;
 
-    // handle = pcap_open_live(device, CAP_BUF_SIZE, 0, 50, err_msg);
     handle = pcap_create(device, err_msg);          
-    pcap_set_snaplen(handle, CAP_BUF_SIZE);
-
     if (handle == NULL)
     {
         fprintf(stderr, "Failed to create handle: %s\n", err_msg);
         return NULL;
     }
-    pcap_set_buffer_size(handle, 1024 * 1024);
+    pcap_set_snaplen(handle, profile->snaplen);
+    pcap_set_buffer_size(handle, profile->buffer_size);
+    pcap_set_immediate_mode(handle, profile->immediate);
     pcap_set_timeout(handle, 50);
 
     if (pcap_activate(handle)) {
@@ -65,36 +116,191 @@ pcap_t *cap_pcap_setup(char *device)
         goto err;
     }
 
-    if (pcap_compile(handle, &filter, filter_exp, 0, net) == -1)
-    {
-        fprintf(stderr, "Could not parse filter: %s\n", pcap_geterr(handle));
-        goto err;
-    }
-
-    if (pcap_setfilter(handle, &filter) == -1)
-    {
-        fprintf(stderr, "Could not install filter: %s\n", pcap_geterr(handle));
-        goto err;
-    }
-
     return handle;
 err:
     pcap_close(handle);
     return NULL;
 }
 
-void cap_close()
+static pcap_t *cap_pcap_open_replay(char *path)
+{
+    char err_msg[PCAP_ERRBUF_SIZE];
+    pcap_t *handle;
+
+    if (!(handle = pcap_open_offline(path, err_msg))) {
+        fprintf(stderr, "Failed to open replay file: %s\n", err_msg);
+        return NULL;
+    }
+
+    // reopened at EOF, keep whatever filter the current profile has
+    if (ctx->filter[0] && cap_pcap_set_filter(handle, ctx->filter)) {
+        pcap_close(handle);
+        return NULL;
+    }
+    return handle;
+}
+
+static void cap_profile_filter(cap_profile_t id, char *filter)
+{
+    char bssid[32];
+    u_int8_t mac[6];
+    int len;
+
+    // search also surveys the channel, every frame counts there
+    if (id == PROFILE_SEARCH) {
+        filter[0] = '\0';
+        return;
+    }
+
+    len = snprintf(filter, CAP_FILTER_LEN, "(type mgt subtype beacon");
+    if (ctx->selected_n) {
+        // only the selected APs' beacons get copied to us at all
+        len += snprintf(filter + len, CAP_FILTER_LEN - len, " and (");
+        for (int i = 0; i < ctx->selected_n; i++) {
+            sprintf(bssid, MAC_FMT, MAC_BYTES(ctx->selected_aps[i].bssid));
+            len += snprintf(filter + len, CAP_FILTER_LEN - len, "%swlan addr3 %s", i ? " or " : "", bssid);
+        }
+        len += snprintf(filter + len, CAP_FILTER_LEN - len, ")");
+    }
+    len += snprintf(filter + len, CAP_FILTER_LEN - len, ")");
+
+    // answers to our injected frames, addressed to the source address each AP got them from
+    if (ctx->probe.started && ctx->selected_n) {
+        len += snprintf(filter + len, CAP_FILTER_LEN - len,
+                        " or ((type mgt subtype probe-resp or type ctl subtype ack) and (");
+        for (int i = 0; i < ctx->selected_n; i++) {
+            probe_src_mac(&ctx->probe, i, mac);
+            sprintf(bssid, MAC_FMT, MAC_BYTES(mac));
+            len += snprintf(filter + len, CAP_FILTER_LEN - len, "%swlan addr1 %s", i ? " or " : "", bssid);
+        }
+        len += snprintf(filter + len, CAP_FILTER_LEN - len, "))");
+    }
+
+    // what stations send on their own, see cap_track_station()
+    if (ctx->stations)
+        snprintf(filter + len, CAP_FILTER_LEN - len,
+                 " or type mgt subtype probe-req or type mgt subtype assoc-req"
+                 " or type mgt subtype reassoc-req or (type data and dir tods)");
+}
+
+// force reopens even if profile is already active, used after buffer size changed
+static int cap_apply_profile(cap_profile_t id, int force)
+{
+    char filter[CAP_FILTER_LEN];
+    struct cap_pcap_profile *profile = &ctx->profiles[id];
+    pcap_t *handle;
+
+    if (id == PROFILE_NONE)
+        return 0;
+    if (id == ctx->profile && !force &&
+        (id != PROFILE_RSSI || ctx->filter_gen == ctx->selected_gen))
+        return 0;
+
+    if ((id != ctx->profile || force) && !ctx->replay_path) {
+        if (!(handle = cap_pcap_open(ctx->dev, profile)))
+            return -1; // keep capturing on the old one
+        if (ctx->handle) {
+            pcap_close(ctx->handle);
+            ctx->pcap_base.ps_recv += ctx->pcap_last.ps_recv;
+            ctx->pcap_base.ps_drop += ctx->pcap_last.ps_drop;
+            ctx->pcap_base.ps_ifdrop += ctx->pcap_last.ps_ifdrop;
+            memset(&ctx->pcap_last, 0, sizeof(ctx->pcap_last));
+        }
+        ctx->handle = handle;
+        metrics_set(M_PCAP_BUFFER, profile->buffer_size);
+        printf("Capture profile %d: snaplen %d, buffer %d KiB, immediate %d\n",
+               id, profile->snaplen, profile->buffer_size / 1024, profile->immediate);
+    }
+
+    cap_profile_filter(id, filter);
+    if (cap_pcap_set_filter(ctx->handle, filter))
+        return -1;
+
+    strcpy(ctx->filter, filter);
+    ctx->filter_gen = ctx->selected_gen;
+    ctx->profile = id;
+    return 0;
+}
+
+static cap_profile_t cap_state_profile(cap_state_t state)
+{
+    switch (state) {
+    case STATE_AP_SEARCH_START:
+    case STATE_AP_SEARCH_LOOP:
+        return PROFILE_SEARCH;
+    case STATE_PKT_CAP:
+        return PROFILE_RSSI;
+    default:
+        return ctx->profile; // idle and send keep whatever is open
+    }
+}
+
+// hold packets back to the configured rate, absolute deadlines so sleep overshoot doesn't add up
+static void cap_replay_pace()
 {
-    if (!ctx || !ctx->handle)
+    struct timespec now;
+    long long behind_ns;
+
+    if (!ctx->replay_rate)
         return;
 
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    behind_ns = (now.tv_sec - ctx->replay_next.tv_sec) * 1000000000LL + now.tv_nsec - ctx->replay_next.tv_nsec;
+    if (behind_ns > 1000000000LL || !ctx->replay_next.tv_sec)
+        ctx->replay_next = now; // too far behind (or first packet), don't burst to catch up
+    else if (!clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ctx->replay_next, NULL)) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        cap_observe_wakeup(((now.tv_sec - ctx->replay_next.tv_sec) * 1000000000LL +
+                            now.tv_nsec - ctx->replay_next.tv_nsec) / 1000);
+    }
+
+    ctx->replay_next.tv_nsec += 1000000000LL / ctx->replay_rate;
+    while (ctx->replay_next.tv_nsec >= 1000000000LL) {
+        ctx->replay_next.tv_nsec -= 1000000000LL;
+        ctx->replay_next.tv_sec++;
+    }
+}
+
+static int cap_next_packet(struct pcap_pkthdr **hdr, const u_int8_t **pkt)
+{
+    int ret;
+
+    if (!ctx->replay_path)
+        return pcap_next_ex(ctx->handle, hdr, pkt);
+
+    cap_replay_pace();
+    ret = pcap_next_ex(ctx->handle, hdr, pkt);
+    if (ret != PCAP_ERROR_BREAK)
+        return ret;
+
+    // end of file, loop over it
     pcap_close(ctx->handle);
+    if (!(ctx->handle = cap_pcap_open_replay(ctx->replay_path)))
+        return PCAP_ERROR;
+    return pcap_next_ex(ctx->handle, hdr, pkt);
+}
+
+void cap_close()
+{
+    if (!ctx)
+        return;
+
+    probe_deinit(&ctx->probe);
+    if (ctx->nl_scan_ok)
+        netlink_scan_deinit(&ctx->nl_scan);
+    sta_destroy(ctx->stations);
+    ctx->stations = NULL;
+    if (ctx->handle)
+        pcap_close(ctx->handle);
 }
 
 static int cap_add_ap(struct wifi_ap_info *ap)
 {
     for (int i = 0; i < ctx->ap_count; i++) {
         if (bssid_equal(ap->bssid, ctx->ap_list[i].bssid)) {
+            // hidden one, named by a probe response since
+            if (!ctx->ap_list[i].ssid[0] && ap->ssid[0])
+                memcpy(ctx->ap_list[i].ssid, ap->ssid, sizeof(ap->ssid));
             return -1;
         }
     }
@@ -104,15 +310,35 @@ static int cap_add_ap(struct wifi_ap_info *ap)
 
     // printf("Add AP %s ("MAC_FMT")\n", ap->ssid, MAC_BYTES(ap->bssid));
     memcpy(&(ctx->ap_list[ctx->ap_count++]), ap, sizeof(struct wifi_ap_info));
+    metrics_inc(M_FRAMES_KEPT);
 
     return 0;
 }
 
-static int cap_add_pkt(struct cap_pkt_info *pkt)
+static struct cap_batch *cap_fill_batch()
+{
+    return &ctx->batches[ctx->fill];
+}
+
+static int cap_add_sample(struct cap_pkt_info *pkt, int ap_idx, u_int8_t fc)
 {
-    if (ctx->pkt_count >= PKT_MAX)
+    struct cap_batch *batch = cap_fill_batch();
+    size_t i = batch->count;
+
+    if (i >= PKT_MAX)
         return -1;
-    memcpy(&(ctx->pkt_list[ctx->pkt_count++]), pkt, sizeof(struct cap_pkt_info));
+    if (!i)
+        batch->base_ms = pkt->ap.timestamp;
+    // wall clock can step back, don't let the delta wrap
+    batch->ts_delta_ms[i] = pkt->ap.timestamp > batch->base_ms ? pkt->ap.timestamp - batch->base_ms : 0;
+    batch->freq[i] = pkt->radio.channel_freq;
+    batch->rssi[i] = pkt->radio.antenna_signal;
+    batch->noise[i] = pkt->radio.noise;
+    batch->ap[i] = ap_idx;
+    batch->slot[i] = ctx->sched.slot;
+    batch->fc[i] = fc;
+    batch->count++;
+    metrics_inc(M_FRAMES_KEPT);
 
     return 0;
 }
@@ -145,7 +371,7 @@ static int cap_parse_radiotap(struct cap_pkt_info *cap_info, u_int8_t *packet)
     
 
     // skip over extended bitmask
-    while (*present_flags & (1 << RADIOTAP_EXT))
+    while (*present_flags & (1U << RADIOTAP_EXT))
     {
         data += sizeof(u_int32_t);
         offset += sizeof(u_int32_t);
@@ -166,6 +392,9 @@ static int cap_parse_radiotap(struct cap_pkt_info *cap_info, u_int8_t *packet)
         case RADIOTAP_ANTENNA_SIGNAL:
             cap_info->radio.antenna_signal = *(int8_t *)data;
             break;
+        case RADIOTAP_RATE:
+            cap_info->radio.rate = *data;
+            break;
         case RADIOTAP_CHANNEL:
             cap_info->radio.channel_freq = *(u_int16_t *)data;
             break;
@@ -184,31 +413,34 @@ static int cap_parse_radiotap(struct cap_pkt_info *cap_info, u_int8_t *packet)
     return radiotap->length;
 }
 
+// data_len is what was captured past the beacon header, FCS already taken off
 static void cap_parse_beacon_tags(struct cap_pkt_info *cap_info, u_int8_t *frame_data, size_t data_len)
 {
     struct wifi_tag_param *tag;
-    u_int8_t *ptr;
     struct wifi_beacon_fixed_params *fixed_params;
+    u_int8_t *ptr;
     size_t tag_param_len;
+    size_t offset = 0;
+
+    if (ctx->cap_scan_done || data_len < sizeof(struct wifi_beacon_fixed_params))
+        return;
 
     fixed_params = (struct wifi_beacon_fixed_params *)frame_data;
+    cap_info->ap.beacon_int = fixed_params->interval;
     ptr = frame_data + sizeof(struct wifi_beacon_fixed_params);
-    tag_param_len = data_len - sizeof(struct wifi_beacon_fixed_params) - 4; //4 is FCS at the end, assume its always there
-    
-    int offset = 0;
+    tag_param_len = data_len - sizeof(struct wifi_beacon_fixed_params);
 
-    if (ctx->cap_scan_done)
-        return;
-
-    while (offset < tag_param_len)
+    while (offset + sizeof(struct wifi_tag_param) <= tag_param_len)
     {
         tag = (struct wifi_tag_param *)ptr;
+        // IEs past snaplen are cut off
+        if (offset + sizeof(struct wifi_tag_param) + tag->length > tag_param_len)
+            break;
         ptr += sizeof(struct wifi_tag_param);
         switch (tag->id)
         {
         case TAG_SSID:
-           
-            memcpy(cap_info->ap.ssid, ptr, tag->length);
+            memcpy(cap_info->ap.ssid, ptr, MIN(tag->length, sizeof(cap_info->ap.ssid) - 1));
             break;
         case TAG_DS:
             cap_info->ap.channel = *(u_int8_t *)ptr;
@@ -226,6 +458,10 @@ static void cap_parse_mgmt_frame(struct cap_pkt_info *cap_info, u_int8_t *frame,
     struct wifi_beacon_header *beacon;
     u_int8_t *data;
     struct wifi_frame_control *ctrl;
+    int ap;
+
+    if (len < sizeof(struct wifi_beacon_header))
+        return;
 
     ctrl = (struct wifi_frame_control *)frame;
     switch (ctrl->subtype) {
@@ -234,10 +470,34 @@ static void cap_parse_mgmt_frame(struct cap_pkt_info *cap_info, u_int8_t *frame,
         data = (u_int8_t *)beacon + sizeof(struct wifi_beacon_header);
         // printf("AP BSSID:"MAC_FMT"\n", MAC_BYTES(beacon->addr3));
         memcpy(&(cap_info->ap.bssid[0]), &(beacon->addr3[0]), 6);
+        // RSSI capture already knows the AP, IEs aren't even captured there
+        if (ctx->state == STATE_PKT_CAP)
+            break;
         cap_parse_beacon_tags(cap_info, data, len - sizeof(struct wifi_beacon_header));
+        cap_info->ap.signal = cap_info->radio.antenna_signal;
         if (ctx->state == STATE_AP_SEARCH_LOOP)
             cap_add_ap(&cap_info->ap);
         break;
+    case FRAME_SUBTYPE_PROBE_RESP:
+        // same body as a beacon, and the only place a hidden AP says its SSID
+        if (ctx->state == STATE_AP_SEARCH_LOOP) {
+            beacon = (struct wifi_beacon_header *)frame;
+            memcpy(&(cap_info->ap.bssid[0]), &(beacon->addr3[0]), 6);
+            cap_parse_beacon_tags(cap_info, (u_int8_t *)(beacon + 1), len - sizeof(struct wifi_beacon_header));
+            cap_info->ap.signal = cap_info->radio.antenna_signal;
+            cap_add_ap(&cap_info->ap);
+            break;
+        }
+        // only answers to our own probes, nobody acks them for us so the AP retries: all of them
+        // are samples, only the first one counts as a response
+        beacon = (struct wifi_beacon_header *)frame;
+        if (ctx->state != STATE_PKT_CAP || (ap = probe_match(&ctx->probe, beacon->addr1)) < 0 ||
+            ap >= ctx->selected_n || !bssid_equal(beacon->addr3, ctx->selected_aps[ap].bssid))
+            break;
+        memcpy(&(cap_info->ap.bssid[0]), &(beacon->addr3[0]), 6);
+        if (!(ctrl->flags & FRAME_RETRY))
+            probe_count_response(&ctx->probe, ap);
+        break;
     // ignore others for now
     default:
         break;
@@ -259,6 +519,20 @@ static void cap_parse_ctrl_frame(struct cap_pkt_info *cap_info, u_int8_t *frame,
     }
 }
 
+// ACKs carry no transmitter, the address they go to says which AP our null frame went to
+static int cap_parse_probe_ack(struct cap_pkt_info *cap_info, u_int8_t *frame, size_t len)
+{
+    int ap;
+
+    if (ctx->state != STATE_PKT_CAP || len < offsetof(struct wifi_control_has_ta, addr2) ||
+        (ap = probe_match(&ctx->probe, frame + offsetof(struct wifi_control_has_ta, addr1))) < 0 ||
+        ap >= ctx->selected_n)
+        return -1;
+    memcpy(cap_info->ap.bssid, ctx->selected_aps[ap].bssid, 6);
+    probe_count_response(&ctx->probe, ap);
+    return 0;
+}
+
 static int cap_parse_frame(struct cap_pkt_info *cap_info, u_int8_t *frame, size_t len)
 {
     int ret;
@@ -274,7 +548,9 @@ static int cap_parse_frame(struct cap_pkt_info *cap_info, u_int8_t *frame, size_
         break;
     case FRAME_TYPE_CTRL:
         // cap_parse_ctrl_frame(cap_info, frame, len);
-        // break;
+        if (ctrl->subtype == FRAME_SUBTYPE_ACK && !cap_parse_probe_ack(cap_info, frame, len))
+            return 0;
+        break;
     case FRAME_TYPE_DATA:
     default:
         break;
@@ -282,16 +558,165 @@ static int cap_parse_frame(struct cap_pkt_info *cap_info, u_int8_t *frame, size_
     return -1;
 }
 
+static int cap_chan_freq(int chan)
+{
+    if (chan == 14)
+        return 2484;
+    if (chan < 14)
+        return 2407 + chan * 5;
+    return 5000 + chan * 5;
+}
+
+// rough on-air time of a frame: preamble plus payload symbols at the reported legacy rate
+static u_int32_t cap_airtime_us(u_int8_t rate, u_int32_t len)
+{
+    u_int32_t kbps, bits_per_sym;
+
+    switch (rate) {
+    case 2: case 4: case 11: case 22:
+        // DSSS/CCK, long preamble
+        kbps = rate * 500;
+        return 192 + (len * 8 * 1000 + kbps - 1) / kbps;
+    case 0:
+        rate = 12; // not reported, assume the lowest OFDM rate
+        // fallthrough
+    default:
+        // OFDM, 20 us preamble and SIGNAL, 4 us symbols carrying 16 service and 6 tail bits too
+        bits_per_sym = rate * 2;
+        return 20 + 4 * ((16 + 8 * len + 6 + bits_per_sym - 1) / bits_per_sym);
+    }
+}
+
+static struct cap_survey *cap_survey_current()
+{
+    if (!ctx->survey_n)
+        return NULL;
+    return &ctx->survey[ctx->survey_n - 1];
+}
+
+static void cap_survey_begin(int chan)
+{
+    struct cap_survey *s;
+
+    if (ctx->survey_n >= CAP_SURVEY_MAX)
+        return;
+    s = &ctx->survey[ctx->survey_n++];
+    memset(s, 0, sizeof(*s));
+    s->channel = chan;
+    s->freq = cap_chan_freq(chan);
+    s->noise_min = INT8_MAX;
+    s->noise_max = INT8_MIN;
+    netlink_get_survey(&ctx->nl, s->freq, &s->nl_start);
+    s->start_us = time_mono_us();
+}
+
+static void cap_survey_end()
+{
+    struct cap_survey *s = cap_survey_current();
+    struct netlink_survey *start, *end;
+
+    if (!s || s->dwell_us)
+        return;
+    s->dwell_us = time_mono_us() - s->start_us;
+
+    start = &s->nl_start;
+    end = &s->nl;
+    if (netlink_get_survey(&ctx->nl, s->freq, end))
+        return;
+    // some drivers restart the counters on channel change, then the end values are the dwell
+    if (!(start->flags & NL_SURVEY_TIME) || end->active_ms < start->active_ms)
+        return;
+    end->active_ms -= start->active_ms;
+    end->busy_ms = end->busy_ms >= start->busy_ms ? end->busy_ms - start->busy_ms : end->busy_ms;
+    end->rx_ms = end->rx_ms >= start->rx_ms ? end->rx_ms - start->rx_ms : end->rx_ms;
+    end->tx_ms = end->tx_ms >= start->tx_ms ? end->tx_ms - start->tx_ms : end->tx_ms;
+}
+
+// len is the frame as it was on air, not what got captured
+static void cap_survey_frame(struct cap_pkt_info *cap_info, struct wifi_frame_control *ctrl, u_int32_t len)
+{
+    struct cap_survey *s = cap_survey_current();
+
+    // still queued from the previous channel
+    if (!s || s->dwell_us || (cap_info->radio.channel_freq && cap_info->radio.channel_freq != s->freq))
+        return;
+
+    s->frames[ctrl->type]++;
+    if (ctrl->type == FRAME_TYPE_MGMT && ctrl->subtype == FRAME_SUBTYPE_BEACON)
+        s->beacons++;
+    if (!cap_info->radio.rate)
+        s->rate_unknown++;
+    s->airtime_us += cap_airtime_us(cap_info->radio.rate, len);
+
+    if (cap_info->radio.noise) {
+        s->noise_n++;
+        s->noise_sum += cap_info->radio.noise;
+        s->noise_min = MIN(s->noise_min, cap_info->radio.noise);
+        s->noise_max = MAX(s->noise_max, cap_info->radio.noise);
+    }
+}
+
+// frames only a client sends, addr2 is the station in all of them
+static void cap_track_station(struct cap_pkt_info *cap_info, u_int8_t *frame, size_t len)
+{
+    struct wifi_frame_control *ctrl = (struct wifi_frame_control *)frame;
+    struct wifi_data_header *hdr = (struct wifi_data_header *)frame;
+    int seen;
+
+    if (len < offsetof(struct wifi_data_header, addr3))
+        return;
+    // our own injected frames, as seen going out
+    if (probe_match(&ctx->probe, hdr->addr2) >= 0)
+        return;
+
+    switch (ctrl->type) {
+    case FRAME_TYPE_MGMT:
+        if (ctrl->subtype == FRAME_SUBTYPE_PROBE_REQ)
+            seen = STA_SEEN_PROBE;
+        else if (ctrl->subtype == FRAME_SUBTYPE_ASSOC_REQ || ctrl->subtype == FRAME_SUBTYPE_REASSOC_REQ)
+            seen = STA_SEEN_ASSOC;
+        else
+            return;
+        break;
+    case FRAME_TYPE_DATA:
+        // to AP only (ToDS set, FromDS clear), otherwise addr2 could be the AP or a WDS link
+        if ((ctrl->flags & 0x03) != 0x01)
+            return;
+        seen = STA_SEEN_DATA;
+        break;
+    default:
+        return;
+    }
+    sta_update(ctx->stations, hdr->addr2, cap_info->radio.antenna_signal, seen, cap_info->ap.timestamp);
+}
+
 static void cap_packet_handler(unsigned char *args, const struct pcap_pkthdr *header, const unsigned char *packet)
 {
     struct cap_pkt_info cap_info = {0};
     u_int8_t *frame;
     int radiotap_len;
+    size_t frame_len;
+    struct cap_batch *batch;
+    int ap_idx;
+    long long handler_us = 0, kernel_us = 0;
+
+    if (TRACE_ON()) {
+        handler_us = time_mono_us();
+        // replayed packets carry file timestamps
+        if (!ctx->replay_path) {
+            kernel_us = trace_since_kernel_us(&header->ts);
+            trace_observe(TR_KERNEL_TO_HANDLER, kernel_us);
+        }
+    }
+
     cap_info.ap.timestamp = time_millis();
-    if (ctx->state == STATE_PKT_CAP && !is_valid_mac(ctx->selected_ap.bssid))
+    metrics_inc(M_FRAMES_SEEN);
+    if (ctx->state == STATE_PKT_CAP && !ctx->selected_n)
         return;
 
-    if (header->len < sizeof(struct radiotap_header))
+    // only caplen bytes are there, snaplen is cut to what the state needs
+    if (header->caplen < sizeof(struct radiotap_header) ||
+        ((struct radiotap_header *)packet)->length + sizeof(struct wifi_frame_control) > header->caplen)
         return;
 
     radiotap_len = cap_parse_radiotap(&cap_info, packet);
@@ -299,16 +724,35 @@ static void cap_packet_handler(unsigned char *args, const struct pcap_pkthdr *he
         return;
     
     frame = packet + radiotap_len;
-    if (cap_parse_frame(&cap_info, frame, header->len - radiotap_len))
+    frame_len = header->caplen - radiotap_len;
+    // FCS is at the very end, assume its always there, gone if the frame got truncated
+    if (header->caplen == header->len && frame_len >= FCS_LEN)
+        frame_len -= FCS_LEN;
+    if (ctx->stations)
+        cap_track_station(&cap_info, frame, frame_len);
+    if (ctx->state == STATE_AP_SEARCH_LOOP)
+        cap_survey_frame(&cap_info, (struct wifi_frame_control *)frame, header->len - radiotap_len);
+    if (cap_parse_frame(&cap_info, frame, frame_len))
         return;
+    metrics_inc(M_FRAMES_PARSED);
 
     if (ctx->state != STATE_PKT_CAP)
         return;
 
-    if (!bssid_equal(ctx->selected_ap.bssid, cap_info.ap.bssid))
+    for (ap_idx = 0; ap_idx < ctx->selected_n; ap_idx++)
+        if (bssid_equal(ctx->selected_aps[ap_idx].bssid, cap_info.ap.bssid))
+            break;
+    if (ap_idx == ctx->selected_n)
+        return;
+    if (cap_add_sample(&cap_info, ap_idx, *frame))
         return;
-    cap_add_pkt(&cap_info);
-    // printf("added pkt (%d), rssi %d\n", ctx->pkt_count, cap_info.radio.antenna_signal);
+    atomic_fetch_add_explicit(&ctx->sched.samples[ap_idx], 1, memory_order_relaxed);
+
+    if (TRACE_ON()) {
+        batch = cap_fill_batch();
+        ctx->batch_trace[ctx->fill].handler_us[batch->count - 1] = handler_us;
+        ctx->batch_trace[ctx->fill].kernel_us[batch->count - 1] = kernel_us;
+    }
 }
 
 static char *cap_state_to_str(enum cap_capture_state state)
@@ -332,59 +776,216 @@ static char *cap_state_to_str(enum cap_capture_state state)
     return NULL;
 }
 
-// bandaid fix to stop work if end received externally
 static void cap_next_state(cap_state_t state)
 {
     if (!ctx)
         return;
 
-    if (!ctx->override_state) 
-        ctx->state = state;
+    ctx->state = state;
+}
 
-    ctx->override_state = 0;
+static void cap_post_cmd(struct cap_cmd *cmd)
+{
+    mbox_post(&ctx->cmds, &cmd->node);
+}
+
+static struct cap_cmd *cap_new_cmd(cap_cmd_t type)
+{
+    struct cap_cmd *cmd = malloc(sizeof(struct cap_cmd));
+
+    if (!cmd) {
+        fprintf(stderr, "Failed to allocate capture command\n");
+        return NULL;
+    }
+    cmd->type = type;
+    return cmd;
 }
 
 void cap_override_state(cap_state_t state)
 {
-    if (!ctx)
+    struct cap_cmd *cmd;
+
+    if (!ctx || !(cmd = cap_new_cmd(CAP_CMD_SET_STATE)))
         return;
 
-    ctx->override_state = 1;
-    ctx->state = state;
+    cmd->state = state;
+    cap_post_cmd(cmd);
+}
+
+// every capture thread sleep doubles as a scheduling latency probe
+static void cap_observe_wakeup(long long late_us)
+{
+    if (late_us < 0)
+        late_us = 0;
+    metrics_observe(H_SCHED_LATENCY_US, late_us);
+    TRACE_OBSERVE(TR_SCHED_WAKEUP, late_us);
+}
+
+static void cap_sleep_ms(int ms)
+{
+    long long start = time_mono_us();
+
+    msleep(ms);
+    cap_observe_wakeup(time_mono_us() - start - ms * 1000LL);
 }
 
 static void _do_idle()
 {   
-    sleep(1);
+    cap_sleep_ms(50); // short, so commands are picked up quickly
     cap_next_state(STATE_IDLE);
 }
 
 static void cap_next_channel()
 {
+    cap_survey_end();
     if (ctx->cap_channel_idx < 0 || ctx->cap_channel_idx >= ctx->cap_channel_list_n - 1) {
         ctx->cap_scan_done = 1;
         return;
     }
 
-    netlink_switch_chan(&ctx->nl, ctx->cap_channel_list[++ ctx->cap_channel_idx]);
+    // radio stayed where it was, no dwell to survey on this one
+    if (netlink_switch_chan(&ctx->nl, ctx->cap_channel_list[++ ctx->cap_channel_idx]))
+        return;
+    cap_survey_begin(ctx->cap_channel_list[ctx->cap_channel_idx]);
+}
+
+static void cap_passive_scan_start()
+{
+    ctx->cap_channel_idx = 0;
+    if (!netlink_switch_chan(&ctx->nl, ctx->cap_channel_list[0]))
+        cap_survey_begin(ctx->cap_channel_list[0]);
+    ctx->time = time_millis();
+}
+
+// the driver hops and probes by itself, the monitor interface follows the radio meanwhile and
+// still picks up beacons, those end up in the same table
+static int cap_active_scan_start()
+{
+    int freqs[ARR_SIZE(ctx->cap_channel_list)];
+
+    if (!ctx->nl_scan_ok) {
+        ctx->scan_fallback = "unavailable";
+        return -1;
+    }
+    for (int i = 0; i < ctx->cap_channel_list_n; i++)
+        freqs[i] = cap_chan_freq(ctx->cap_channel_list[i]);
+    if (netlink_scan_trigger(&ctx->nl_scan, freqs, ctx->cap_channel_list_n)) {
+        ctx->scan_fallback = "refused";
+        return -1;
+    }
+    ctx->scan_running = 1;
+    return 0;
+}
+
+static int cap_chan_listed(int chan)
+{
+    for (int i = 0; i < ctx->cap_channel_list_n; i++)
+        if (ctx->cap_channel_list[i] == chan)
+            return 1;
+    return 0;
+}
+
+// the BSS table also has entries from earlier scans, only what this one saw counts
+static void cap_add_bss(struct netlink_bss *bss, void *arg)
+{
+    struct wifi_ap_info ap = {0};
+    long long scan_ms = (time_mono_us() - ctx->scan_start_us) / 1000;
+    int chan = freq_to_chan(bss->freq);
+
+    if (bss->age_ms > scan_ms || !cap_chan_listed(chan))
+        return;
+    memcpy(ap.bssid, bss->bssid, 6);
+    memcpy(ap.ssid, bss->ssid, bss->ssid_len);
+    ap.channel = chan;
+    ap.beacon_int = bss->beacon_int;
+    ap.signal = bss->signal;
+    cap_add_ap(&ap);
+}
+
+// a wildcard probe doesn't get hidden APs to say their SSID, listen on their channels for
+// somebody else's directed probe instead
+static void cap_hidden_fallback()
+{
+    int chans[ARR_SIZE(ctx->cap_channel_list)];
+    int n = 0, j;
+
+    for (int i = 0; i < ctx->ap_count; i++) {
+        // no DS IE, nowhere to listen
+        if (ctx->ap_list[i].ssid[0] || !cap_chan_listed(ctx->ap_list[i].channel))
+            continue;
+        for (j = 0; j < n && chans[j] != ctx->ap_list[i].channel; j++)
+            ;
+        if (j == n)
+            chans[n++] = ctx->ap_list[i].channel;
+    }
+    if (!n) {
+        ctx->cap_scan_done = 1;
+        return;
+    }
+
+    printf("Hidden SSIDs on %d channel(s), listening there\n", n);
+    ctx->scan_fallback = "hidden";
+    metrics_inc(M_SCAN_FALLBACKS);
+    cap_apply_chans(chans, n);
+    cap_passive_scan_start();
+}
+
+static void cap_active_scan_poll()
+{
+    int status = netlink_scan_poll(&ctx->nl_scan);
+
+    if (status == NL_SCAN_RUNNING &&
+        time_mono_us() - ctx->scan_start_us < ACTIVE_SCAN_TIMEOUT_MS * 1000LL)
+        return;
+
+    ctx->scan_running = 0;
+    if (status != NL_SCAN_DONE) {
+        if (status == NL_SCAN_RUNNING)
+            netlink_scan_abort(&ctx->nl_scan);
+        fprintf(stderr, "Driver scan %s, passive search\n", status == NL_SCAN_RUNNING ? "timed out" : "aborted");
+        ctx->scan_fallback = status == NL_SCAN_RUNNING ? "timeout" : "aborted";
+        metrics_inc(M_SCAN_FALLBACKS);
+        cap_passive_scan_start();
+        return;
+    }
+
+    if (netlink_scan_results(&ctx->nl_scan, cap_add_bss, NULL))
+        fprintf(stderr, "Failed to read driver scan results\n");
+    printf("Driver scan done in %lld ms, %zu APs\n", (time_mono_us() - ctx->scan_start_us) / 1000, ctx->ap_count);
+    cap_hidden_fallback();
 }
 
 static void _do_ap_search_start()
 {
     memset(ctx->ap_list, 0, sizeof(struct wifi_ap_info) * AP_MAX);
-    memset(&(ctx->selected_ap), 0, sizeof(struct wifi_ap_info));
+    pthread_mutex_lock(&ctx->sched.lock);
+    ctx->selected_n = 0;
+    ctx->sched.n_slots = 0;
+    ctx->selected_gen++;
+    pthread_mutex_unlock(&ctx->sched.lock);
     ctx->ap_count = 0;
-    memset(&ctx->pkt_list, 0, sizeof(ctx->pkt_list));
-    ctx->pkt_count = 0;
+    ctx->batches[0].count = ctx->batches[1].count = 0;
     
     ctx->cap_band = BAND_24G;
-    ctx->cap_channel_idx = 0;
     ctx->cap_scan_done = 0;
-    netlink_switch_chan(&ctx->nl, ctx->cap_channel_list[0]);
+    ctx->survey_n = 0;
+    ctx->scan_start_us = time_mono_us();
+    ctx->scan_fallback = NULL;
+    // a search restarted before the last one finished
+    if (ctx->scan_running) {
+        netlink_scan_abort(&ctx->nl_scan);
+        ctx->scan_running = 0;
+    }
 
-    cap_next_state(STATE_AP_SEARCH_LOOP);
+    if (ctx->scan_mode != SCAN_ACTIVE || cap_active_scan_start()) {
+        if (ctx->scan_mode == SCAN_ACTIVE) {
+            fprintf(stderr, "No driver scan (%s), passive search\n", ctx->scan_fallback);
+            metrics_inc(M_SCAN_FALLBACKS);
+        }
+        cap_passive_scan_start();
+    }
 
-    ctx->time = time_millis();
+    cap_next_state(STATE_AP_SEARCH_LOOP);
 }
 
 static void _do_ap_search_loop()
@@ -393,6 +994,9 @@ static void _do_ap_search_loop()
     const u_int8_t *pkt;
     int ret;
 
+    if (ctx->scan_running)
+        cap_active_scan_poll();
+
     if (ctx->cap_scan_done) {
         if (ctx->ap_count > 0) {
             ctx->payload = AP_LIST;
@@ -403,17 +1007,17 @@ static void _do_ap_search_loop()
 
     u_int64_t elapsed = time_elapsed_ms(ctx->time);
     // printf("%llu ms\n", elapsed);
-    if (time_elapsed_ms(ctx->time) >= CHAN_PASSIVE_SCAN_MS) {
+    if (!ctx->scan_running && time_elapsed_ms(ctx->time) >= CHAN_PASSIVE_SCAN_MS) {
         cap_next_channel();
         ctx->time = time_millis();
     }
 
-    ret = pcap_next_ex(ctx->handle,&hdr, &pkt);
+    ret = cap_next_packet(&hdr, &pkt);
     if (ret > 0)
         cap_packet_handler(NULL, hdr, pkt);
     else if (ret < 0)
         fprintf(stderr, "Packet receive error\n");
-    else msleep(10);
+    else cap_sleep_ms(10);
 
     cap_next_state(STATE_AP_SEARCH_LOOP);
 }
@@ -424,18 +1028,24 @@ static void _do_pkt_cap()
     const u_int8_t *pkt;
     int ret;
 
-    if (ctx->pkt_count == PKT_MAX) {
+    struct cap_batch *batch = cap_fill_batch();
+
+    if (batch->count == PKT_MAX || (batch->count && time_elapsed_ms(ctx->time) >= BATCH_MAX_AGE_MS)) {
         ctx->payload = PKT_LIST;
         cap_next_state(STATE_SEND);
         return;
     }
 
-    ret = pcap_next_ex(ctx->handle,&hdr, &pkt);
+    // a single slot only needs switching again if getting there failed
+    if ((ctx->sched.n_slots > 1 || ctx->sched.slot < 0) && time_mono_us() >= ctx->sched.slot_end_us)
+        cap_switch_slot((ctx->sched.slot + 1) % ctx->sched.n_slots);
+
+    ret = cap_next_packet(&hdr, &pkt);
     if (ret > 0)
         cap_packet_handler(NULL, hdr, pkt);
     else if (ret < 0)
         fprintf(stderr, "Packet receive error\n");
-     else msleep(10);
+    else cap_sleep_ms(10);
     // pcap_dispatch(ctx->handle, 10, cap_packet_handler, NULL);
 
     cap_next_state(STATE_PKT_CAP);
@@ -455,66 +1065,191 @@ void ap_list_to_json(cJSON *json, struct wifi_ap_info *ap_list, size_t count)
         cJSON_AddStringToObject(ap, "ssid", (char *)ap_list[i].ssid);
         cJSON_AddStringToObject(ap, "bssid", bssid);
         cJSON_AddNumberToObject(ap, "channel", ap_list[i].channel);
+        cJSON_AddNumberToObject(ap, "beacon_int", ap_list[i].beacon_int);
+        if (ap_list[i].signal)
+            cJSON_AddNumberToObject(ap, "signal", ap_list[i].signal);
         cJSON_AddItemToArray(list, ap);
         // printf("%s\n", cJSON_Print(ap));
     }
     cJSON_AddItemToObject(json, "data", list);
 }
 
-void pkt_list_to_json(cJSON *json, struct cap_pkt_info *pkt_list, size_t count)
+static void survey_to_json(cJSON *json)
 {
-    char bssid[32] = {0};
+    struct cap_survey *s;
+    double dwell_s;
+    cJSON *list = cJSON_AddArrayToObject(json, "survey");
+
+    for (int i = 0; i < ctx->survey_n; i++) {
+        s = &ctx->survey[i];
+        if (!s->dwell_us)
+            continue;
+        dwell_s = s->dwell_us / 1e6;
+
+        cJSON *item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "channel", s->channel);
+        cJSON_AddNumberToObject(item, "dwell_ms", s->dwell_us / 1000);
+        cJSON *fps = cJSON_AddObjectToObject(item, "frames_s");
+        cJSON_AddNumberToObject(fps, "mgmt", s->frames[FRAME_TYPE_MGMT] / dwell_s);
+        cJSON_AddNumberToObject(fps, "ctrl", s->frames[FRAME_TYPE_CTRL] / dwell_s);
+        cJSON_AddNumberToObject(fps, "data", s->frames[FRAME_TYPE_DATA] / dwell_s);
+        cJSON_AddNumberToObject(fps, "beacon", s->beacons / dwell_s);
+        // share of the dwell the captured frames were on air, lower bound, missed frames aren't in it
+        cJSON_AddNumberToObject(item, "airtime", (double)s->airtime_us / s->dwell_us);
+        cJSON_AddNumberToObject(item, "rate_unknown", s->rate_unknown);
+
+        if (s->noise_n) {
+            cJSON *noise = cJSON_AddObjectToObject(item, "noise");
+            cJSON_AddNumberToObject(noise, "min", s->noise_min);
+            cJSON_AddNumberToObject(noise, "avg", (double)s->noise_sum / s->noise_n);
+            cJSON_AddNumberToObject(noise, "max", s->noise_max);
+        }
+
+        if (s->nl.flags) {
+            cJSON *drv = cJSON_AddObjectToObject(item, "driver");
+            if (s->nl.flags & NL_SURVEY_NOISE)
+                cJSON_AddNumberToObject(drv, "noise", s->nl.noise);
+            if (s->nl.flags & NL_SURVEY_TIME) {
+                cJSON_AddNumberToObject(drv, "active_ms", s->nl.active_ms);
+                cJSON_AddNumberToObject(drv, "busy_ms", s->nl.busy_ms);
+                cJSON_AddNumberToObject(drv, "rx_ms", s->nl.rx_ms);
+                cJSON_AddNumberToObject(drv, "tx_ms", s->nl.tx_ms);
+                if (s->nl.active_ms)
+                    cJSON_AddNumberToObject(drv, "busy", (double)s->nl.busy_ms / s->nl.active_ms);
+            }
+        }
+        cJSON_AddItemToArray(list, item);
+    }
+}
+
+// how the list was found and how long it took
+static void scan_to_json(cJSON *json)
+{
+    long long duration_ms = (time_mono_us() - ctx->scan_start_us) / 1000;
+    cJSON *scan = cJSON_AddObjectToObject(json, "scan");
+
+    metrics_set(M_AP_SEARCH_MS, duration_ms);
+    cJSON_AddStringToObject(scan, "mode", ctx->scan_mode == SCAN_ACTIVE ? "active" : "passive");
+    cJSON_AddNumberToObject(scan, "duration_ms", duration_ms);
+    if (ctx->scan_fallback)
+        cJSON_AddStringToObject(scan, "fallback", ctx->scan_fallback);
+}
+
+// wire format is unchanged, AP fields are filled in from the selection the samples refer to
+static void batch_to_json(cJSON *json, struct cap_batch *batch)
+{
+    char bssids[CAP_MAX_APS][32];
+    struct wifi_ap_info *sel;
+    long long offset_ms;
     if (!json)
         return;
 
+    // to manager time, drift over one batch is way below a ms so one offset does
+    offset_ms = clk_offset_us(batch->base_ms * 1000) / 1000;
+    cJSON_AddItemToObject(json, "clock", clk_to_json());
+
+    for (int i = 0; i < ctx->selected_n; i++)
+        sprintf(bssids[i], MAC_FMT, MAC_BYTES(ctx->selected_aps[i].bssid));
+
     cJSON *list = cJSON_CreateArray();
-    for (size_t i = 0; i < count; i++) {
-        sprintf(bssid, MAC_FMT, MAC_BYTES(pkt_list[i].ap.bssid));
+    for (size_t i = 0; i < batch->count; i++) {
+        sel = &ctx->selected_aps[batch->ap[i]];
         cJSON *pkt = cJSON_CreateObject();
         cJSON *radio = cJSON_AddObjectToObject(pkt, "radio");
         cJSON *ap = cJSON_AddObjectToObject(pkt, "ap");
 
-        cJSON_AddNumberToObject(radio, "channel_freq", pkt_list[i].radio.channel_freq);
-        cJSON_AddNumberToObject(radio, "antenna_signal", pkt_list[i].radio.antenna_signal);
-        cJSON_AddNumberToObject(radio, "noise", pkt_list[i].radio.noise);
+        cJSON_AddNumberToObject(radio, "channel_freq", batch->freq[i]);
+        cJSON_AddNumberToObject(radio, "antenna_signal", batch->rssi[i]);
+        cJSON_AddNumberToObject(radio, "noise", batch->noise[i]);
         
-        cJSON_AddNumberToObject(ap, "channel_freq", pkt_list[i].ap.channel);
-        cJSON_AddStringToObject(ap, "ssid", (char *)pkt_list[i].ap.ssid);
-        cJSON_AddStringToObject(ap, "bssid", bssid);
-        cJSON_AddNumberToObject(ap, "timestamp", pkt_list[i].ap.timestamp);
+        cJSON_AddNumberToObject(ap, "channel_freq", sel->channel);
+        cJSON_AddStringToObject(ap, "ssid", (char *)sel->ssid);
+        cJSON_AddStringToObject(ap, "bssid", bssids[batch->ap[i]]);
+        cJSON_AddNumberToObject(ap, "timestamp", batch->base_ms + batch->ts_delta_ms[i] + offset_ms);
+        cJSON_AddNumberToObject(pkt, "slot", batch->slot[i]);
 
         cJSON_AddItemToArray(list, pkt);
     }
     cJSON_AddItemToObject(json, "data", list);
 }
+
+// kernel counters, pcap handle isn't thread safe so this is polled from capture loop.
+// Drops mean the ring filled up between reads, give the kernel more room
+static void cap_update_pcap_stats()
+{
+    struct pcap_stat stats;
+    struct cap_pcap_profile *profile;
+    u_int32_t dropped;
+
+    if (pcap_stats(ctx->handle, &stats))
+        return;
+    dropped = stats.ps_drop - ctx->pcap_last.ps_drop;
+    ctx->pcap_last = stats;
+    // counters, totals over every handle this process opened
+    metrics_set(M_PCAP_RECV, ctx->pcap_base.ps_recv + stats.ps_recv);
+    metrics_set(M_PCAP_DROP, ctx->pcap_base.ps_drop + stats.ps_drop);
+    metrics_set(M_PCAP_IFDROP, ctx->pcap_base.ps_ifdrop + stats.ps_ifdrop);
+
+    if (!dropped || ctx->replay_path || ctx->profile == PROFILE_NONE)
+        return;
+    profile = &ctx->profiles[ctx->profile];
+    if (profile->buffer_size >= CAP_BUFFER_MAX)
+        return;
+
+    profile->buffer_size *= 2;
+    if (profile->buffer_size > CAP_BUFFER_MAX)
+        profile->buffer_size = CAP_BUFFER_MAX;
+    printf("Kernel dropped %u packets, growing capture buffer to %d KiB\n",
+           dropped, profile->buffer_size / 1024);
+    cap_apply_profile(ctx->profile, 1);
+}
+
+static void cap_trace_batch(struct cap_batch *batch, long long flush_us, long long serialized_us, long long published_us)
+{
+    struct cap_batch_trace *tr = &ctx->batch_trace[batch - ctx->batches];
+
+    trace_observe(TR_SERIALIZE, serialized_us - flush_us);
+    trace_observe(TR_PUBLISH, published_us - serialized_us);
+    for (size_t i = 0; i < batch->count; i++) {
+        trace_observe(TR_HANDLER_TO_FLUSH, flush_us - tr->handler_us[i]);
+        trace_observe(TR_CAPTURE_TO_PUBLISH, tr->kernel_us[i] + published_us - tr->handler_us[i]);
+    }
+}
+
 static void _do_send()
 {
     cJSON *json; 
     cap_state_t next_state;
-    cap_msg_t *msg = malloc(sizeof(cap_msg_t));
-    msg->type = ctx->payload;
+    char *json_str;
+    struct cap_batch *flush = NULL;
+    long long send_start = time_mono_us();
+    long long serialized = 0, published = 0;
 
     json = cJSON_CreateObject();
-    cJSON_AddNumberToObject(json, "type", msg->type);
+    cJSON_AddNumberToObject(json, "type", ctx->payload);
 
 
     switch (ctx->payload) {
         case AP_LIST:
-            memcpy(msg->ap_list, ctx->ap_list, sizeof(msg->ap_list));
-            msg->count = ctx->ap_count;
-            cJSON_AddNumberToObject(json, "count", msg->count);
+            cJSON_AddNumberToObject(json, "count", ctx->ap_count);
             ap_list_to_json(json, ctx->ap_list, ctx->ap_count);
+            survey_to_json(json);
+            scan_to_json(json);
             ctx->ap_count = 0;
             next_state = STATE_IDLE;
             break;
         case PKT_LIST:
             printf("Send data (packet scan time: %lld)\n", time_elapsed_ms(ctx->time));
+            metrics_observe(H_BATCH_FILL_MS, time_elapsed_ms(ctx->time));
+            metrics_inc(M_BATCHES_SENT);
             ctx->time = time_millis();
-            memcpy(msg->pkt_list, ctx->pkt_list, sizeof(msg->pkt_list));
-            msg->count = ctx->pkt_count;
-            cJSON_AddNumberToObject(json, "count", msg->count);
-            pkt_list_to_json(json, ctx->pkt_list, ctx->pkt_count);
-            ctx->pkt_count = 0;
+            // swap, capture carries on in the other batch
+            flush = cap_fill_batch();
+            ctx->fill ^= 1;
+            cap_fill_batch()->count = 0;
+            metrics_add(M_SAMPLES_SENT, flush->count);
+            cJSON_AddNumberToObject(json, "count", flush->count);
+            batch_to_json(json, flush);
             next_state = STATE_PKT_CAP;
             break;
         default:
@@ -522,11 +1257,24 @@ static void _do_send()
     }
 
     if (ctx->send_cb) {
-        ctx->send_cb(cJSON_Print(json));
-        free(msg);
+        json_str = cJSON_Print(json);
+        serialized = time_mono_us();
+        ctx->send_cb(ctx->payload, json_str);
+        published = time_mono_us();
+        free(json_str);
+    }
+
+    if (flush && flush->count && !ctx->first_sample_us) {
+        ctx->first_sample_us = published;
+        metrics_set(M_STARTUP_FIRST_SAMPLE_MS, (published - ctx->start_us) / 1000);
+        printf("First samples sent %lld ms after start\n", (published - ctx->start_us) / 1000);
     }
 
+    if (TRACE_ON() && flush)
+        cap_trace_batch(flush, send_start, serialized, published);
+
     cJSON_Delete(json);
+    metrics_observe(H_BATCH_SEND_US, time_mono_us() - send_start);
     cap_next_state(next_state);
 }
 
@@ -536,80 +1284,368 @@ static int freq_to_chan(int freq)
         return -1;
     return (freq - 2407) / 5;
 }
-void cap_set_chans(int *chans, int n)
+static void cap_apply_chans(int *chans, int n)
 {
-    if (!ctx)
-        return;
-
     if (n == 0) {
         for (int i = 1 ; i <= 13; i ++)
-            ctx->cap_channel_list[i] = i;
+            ctx->cap_channel_list[i - 1] = i;
         ctx->cap_channel_list_n = 13;
     } else {
-        for (int i = 0 ; i <= n; i ++)
+        for (int i = 0 ; i < n; i ++)
             ctx->cap_channel_list[i] = chans[i];
         ctx->cap_channel_list_n = n;
     }
 }
 
-void cap_set_ap(struct wifi_ap_info *ap)
+// one slot per distinct channel, dwell sized for the slowest beaconing AP in it
+static void cap_build_schedule()
+{
+    struct cap_schedule *sched = &ctx->sched;
+    struct wifi_ap_info *ap;
+    int slot, dwell_us;
+
+    sched->n_slots = 0;
+    for (int i = 0; i < ctx->selected_n; i++) {
+        ap = &ctx->selected_aps[i];
+        for (slot = 0; slot < sched->n_slots; slot++)
+            if (sched->slots[slot].channel == ap->channel)
+                break;
+        if (slot == sched->n_slots) {
+            sched->slots[slot].channel = ap->channel;
+            sched->slots[slot].dwell_us = 0;
+            sched->n_slots++;
+        }
+        dwell_us = CAP_SLOT_BEACONS * (ap->beacon_int ? ap->beacon_int : CAP_DEFAULT_BEACON_INT) * TU_US;
+        if (dwell_us > sched->slots[slot].dwell_us)
+            sched->slots[slot].dwell_us = dwell_us;
+        sched->ap_slot[i] = slot;
+    }
+
+    sched->slot = -1; // until the first switch succeeds
+    sched->start_us = time_mono_us();
+    probe_reset_stats(&ctx->probe);
+    atomic_store(&sched->switch_us, 0);
+    atomic_store(&sched->switches, 0);
+    atomic_store(&sched->switch_errors, 0);
+    for (int i = 0; i < CAP_MAX_APS; i++)
+        atomic_store(&sched->samples[i], 0);
+}
+
+// injection follows the radio, only the APs of the slot it's tuned to are probed
+static void cap_probe_slot(int slot)
+{
+    int idx[CAP_MAX_APS], n = 0;
+
+    for (int i = 0; i < ctx->selected_n; i++)
+        if (ctx->sched.ap_slot[i] == slot)
+            idx[n++] = i;
+    probe_set_targets(&ctx->probe, ctx->selected_aps, idx, n);
+}
+
+static void cap_switch_slot(int slot)
+{
+    struct cap_schedule *sched = &ctx->sched;
+    long long start = time_mono_us(), end;
+    int ret;
+
+    probe_set_targets(&ctx->probe, NULL, NULL, 0); // nothing goes out while the channel changes
+    ret = netlink_switch_chan(&ctx->nl, sched->slots[slot].channel);
+    end = time_mono_us();
+    atomic_fetch_add_explicit(&sched->switch_us, end - start, memory_order_relaxed);
+    atomic_fetch_add_explicit(&sched->switches, 1, memory_order_relaxed);
+    // radio is still on the previous slot's channel, samples keep its tag, the slot is retried
+    // after another dwell
+    if (ret)
+        atomic_fetch_add_explicit(&sched->switch_errors, 1, memory_order_relaxed);
+    else
+        sched->slot = slot;
+    sched->slot_end_us = end + sched->slots[slot].dwell_us;
+    cap_probe_slot(sched->slot);
+}
+
+static void cap_apply_aps(struct wifi_ap_info *aps, int n)
+{
+    pthread_mutex_lock(&ctx->sched.lock);
+    memcpy(ctx->selected_aps, aps, n * sizeof(struct wifi_ap_info));
+    ctx->selected_n = n;
+    ctx->selected_gen++;
+    cap_build_schedule();
+    cap_fill_batch()->count = 0; // indices refer to the old selection
+    pthread_mutex_unlock(&ctx->sched.lock);
+
+    if (!n) {
+        cap_next_state(STATE_IDLE);
+        return;
+    }
+    if (ctx->sched.n_slots > 1)
+        printf("Rotating over %d channels for %d APs\n", ctx->sched.n_slots, n);
+    cap_switch_slot(0);
+    ctx->time = time_millis();
+    cap_next_state(STATE_PKT_CAP);
+}
+
+// runs on capture thread between state handlers, so nothing else touches ctx while applying
+static void cap_drain_cmds()
+{
+    struct mbox_node *node;
+    struct cap_cmd *cmd;
+
+    while ((node = mbox_take(&ctx->cmds))) {
+        cmd = mbox_entry(node, struct cap_cmd, node);
+        switch (cmd->type) {
+        case CAP_CMD_SET_CHANS:
+            cap_apply_chans(cmd->chans.list, cmd->chans.n);
+            break;
+        case CAP_CMD_SET_APS:
+            cap_apply_aps(cmd->aps.list, cmd->aps.n);
+            break;
+        case CAP_CMD_SET_STATE:
+            cap_next_state(cmd->state);
+            break;
+        case CAP_CMD_SET_SCAN_MODE:
+            ctx->scan_mode = cmd->scan_mode;
+            break;
+        default:
+            break;
+        }
+        free(cmd);
+    }
+
+    if (atomic_exchange(&ctx->stop, 0))
+        cap_next_state(STATE_END);
+}
+
+void cap_set_chans(int *chans, int n)
+{
+    struct cap_cmd *cmd;
+
+    if (!ctx || !(cmd = cap_new_cmd(CAP_CMD_SET_CHANS)))
+        return;
+
+    if (n > (int)ARR_SIZE(cmd->chans.list))
+        n = ARR_SIZE(cmd->chans.list);
+    memcpy(cmd->chans.list, chans, n * sizeof(int));
+    cmd->chans.n = n;
+    cap_post_cmd(cmd);
+}
+
+// applies to the next AP search
+void cap_set_scan_mode(cap_scan_mode_t mode)
+{
+    struct cap_cmd *cmd;
+
+    if (!ctx || !(cmd = cap_new_cmd(CAP_CMD_SET_SCAN_MODE)))
+        return;
+    cmd->scan_mode = mode;
+    cap_post_cmd(cmd);
+}
+
+// channel switch happens on capture thread when command is drained, an empty selection clears
+// the previous one and leaves capture idle
+void cap_set_aps(struct wifi_ap_info *aps, int n)
 {  
-    if (!ctx || !ap)
+    struct cap_cmd *cmd;
+
+    if (!ctx || (n > 0 && !aps) || n < 0 || !(cmd = cap_new_cmd(CAP_CMD_SET_APS)))
         return;
 
-    // printf("recv ap: %s\n", ap->ssid);
-    
-    memcpy(&ctx->selected_ap, ap, sizeof(struct wifi_ap_info));
+    if (n > CAP_MAX_APS)
+        n = CAP_MAX_APS;
+    memcpy(cmd->aps.list, aps, n * sizeof(struct wifi_ap_info));
+    cmd->aps.n = n;
+    cap_post_cmd(cmd);
+}
 
-    netlink_switch_chan(&ctx->nl, ctx->selected_ap.channel);
-    ctx->time = time_millis();
-    cap_override_state(STATE_PKT_CAP);
+// runs on stats timer thread
+cJSON *cap_schedule_to_json()
+{
+    struct cap_schedule *sched;
+    cJSON *json, *aps, *ap;
+    char bssid[32];
+    long long elapsed_us, switch_us, dwell_us = 0;
+    u_int64_t samples;
+
+    if (!ctx)
+        return NULL;
+
+    sched = &ctx->sched;
+    json = cJSON_CreateObject();
+    pthread_mutex_lock(&sched->lock);
+    elapsed_us = time_mono_us() - sched->start_us;
+    switch_us = atomic_load(&sched->switch_us);
+    for (int i = 0; i < sched->n_slots; i++)
+        dwell_us += sched->slots[i].dwell_us;
+
+    cJSON_AddNumberToObject(json, "slots", sched->n_slots);
+    cJSON_AddNumberToObject(json, "switches", atomic_load(&sched->switches));
+    cJSON_AddNumberToObject(json, "switch_errors", atomic_load(&sched->switch_errors));
+    // dwell plus average switch per slot
+    cJSON_AddNumberToObject(json, "cycle_ms", sched->n_slots > 1 ?
+                            (dwell_us + switch_us / MAX(atomic_load(&sched->switches), 1) * sched->n_slots) / 1000.0 : 0);
+    cJSON_AddNumberToObject(json, "switch_overhead", elapsed_us > 0 ? (double)switch_us / elapsed_us : 0);
+    if (ctx->probe.started)
+        cJSON_AddItemToObject(json, "probe", probe_to_json(&ctx->probe));
+
+    aps = cJSON_AddArrayToObject(json, "aps");
+    for (int i = 0; i < ctx->selected_n; i++) {
+        samples = atomic_load(&sched->samples[i]);
+        sprintf(bssid, MAC_FMT, MAC_BYTES(ctx->selected_aps[i].bssid));
+        ap = cJSON_CreateObject();
+        cJSON_AddStringToObject(ap, "bssid", bssid);
+        cJSON_AddNumberToObject(ap, "channel", ctx->selected_aps[i].channel);
+        cJSON_AddNumberToObject(ap, "slot", sched->ap_slot[i]);
+        cJSON_AddNumberToObject(ap, "samples", samples);
+        cJSON_AddNumberToObject(ap, "rate_hz", elapsed_us > 0 ? samples * 1e6 / elapsed_us : 0);
+        if (ctx->probe.started)
+            probe_ap_to_json(&ctx->probe, i, ap);
+        cJSON_AddItemToArray(aps, ap);
+    }
+    pthread_mutex_unlock(&sched->lock);
+    return json;
 }
 
+// async-signal-safe, called from SIGINT handler
 void cap_stop()
 {
     if (!ctx)
         return;
 
-    cap_override_state(STATE_END);
+    atomic_store(&ctx->stop, 1);
+}
+
+struct cap_nl_setup {
+    struct nl80211_data *nl;
+    char *dev;
+    int ret;
+};
+
+static void *cap_nl_setup_func(void *arg)
+{
+    struct cap_nl_setup *setup = arg;
+
+    setup->ret = netlink_init(setup->nl, setup->dev);
+    return NULL;
 }
 
 int cap_setup(struct capture_ctx *cap_ctx, char *dev, cap_send_cb cb)
 {
+    struct cap_nl_setup nl_setup;
+    pthread_t nl_thread;
+    long long start;
+
     if (!cap_ctx) 
         return -1;
 
+    // mailbox has to be usable before ctx is, MQTT thread may already be posting commands
+    mbox_init(&cap_ctx->cmds);
+    pthread_mutex_init(&cap_ctx->sched.lock, NULL);
+    atomic_init(&cap_ctx->stop, 0);
+    cap_ctx->send_cb = cb;
     ctx = cap_ctx;
 
-    ctx->handle = cap_pcap_setup(dev);
-    ctx->send_cb = cb;
+    ctx->dev = dev;
+    ctx->profile = PROFILE_NONE;
+    ctx->profiles[PROFILE_SEARCH] = (struct cap_pcap_profile){CAP_SNAPLEN_SEARCH, CAP_BUFFER_SEARCH, 0};
+    ctx->profiles[PROFILE_RSSI] = (struct cap_pcap_profile){CAP_SNAPLEN_RSSI, CAP_BUFFER_RSSI, 1};
+
+    if (ctx->sta_flush_ms > 0 && !(ctx->stations = sta_create())) {
+        fprintf(stderr, "Failed to allocate station table\n");
+        return -1;
+    }
+
+    start = time_mono_us();
+    if (ctx->replay_path) {
+        if (!(ctx->handle = cap_pcap_open_replay(ctx->replay_path)) ||
+            cap_apply_profile(PROFILE_SEARCH, 0))
+            return PCAP_ERROR;
+        printf("Replaying %s at %d packets/s\n", ctx->replay_path, ctx->replay_rate);
+        ctx->setup_us = time_mono_us() - start;
+        return 0; // no radio to tune
+    }
+
+    // nl80211 resolve doesn't depend on pcap, overlap it with activation
+    nl_setup.nl = &ctx->nl;
+    nl_setup.dev = dev;
+    nl_setup.ret = 0;
+    if (pthread_create(&nl_thread, NULL, cap_nl_setup_func, &nl_setup)) {
+        fprintf(stderr, "Failed to start netlink setup thread\n");
+        return -1;
+    }
+
+    cap_apply_profile(PROFILE_SEARCH, 0);
+    pthread_join(nl_thread, NULL);
+    ctx->setup_us = time_mono_us() - start;
+
     if (!ctx->handle) {
         fprintf(stderr, "Failed to setup pcap on device\n");
+        if (!nl_setup.ret)
+            netlink_deinit(&ctx->nl);
         return PCAP_ERROR;
     }
     
-    if (netlink_init(&ctx->nl, dev)) {
+    if (nl_setup.ret) {
         fprintf(stderr, "Failed to setup netlink\n");
         return NLE_FAILURE;
     }
+
+    // beacons still come in without it
+    if (probe_init(&ctx->probe, dev))
+        fprintf(stderr, "Can't inject on %s, active sensing off\n", dev);
+    // whether it can actually scan only shows on the first trigger
+    if (netlink_scan_init(&ctx->nl_scan, ctx->scan_dev ? ctx->scan_dev : dev))
+        fprintf(stderr, "No driver scans on %s, AP search is passive only\n", ctx->scan_dev ? ctx->scan_dev : dev);
+    else
+        ctx->nl_scan_ok = 1;
     return 0;
 }
 
+static void cap_flush_stations()
+{
+    cJSON *json;
+    char *msg;
+
+    json = sta_flush_json(ctx->stations, time_millis());
+    cJSON_AddNumberToObject(json, "type", STA_LIST);
+    msg = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+    if (!msg)
+        return;
+    if (ctx->send_cb)
+        ctx->send_cb(STA_LIST, msg);
+    free(msg);
+}
+
 int cap_run()
 {
     if (!ctx)
         return -1;
     ctx->ap_count = 0;
-    ctx->pkt_count = 0;
+    ctx->batches[0].count = ctx->batches[1].count = 0;
+    ctx->fill = 0;
     ctx->state = STATE_IDLE;
-    if (is_valid_mac(ctx->selected_ap.bssid))
+    if (ctx->selected_n)
        ctx->state = STATE_PKT_CAP;
 
+    long long stats_time = 0;
     while (ctx->state != STATE_END) {
+        cap_drain_cmds();
+        cap_apply_profile(cap_state_profile(ctx->state), 0);
+        metrics_set(M_CAP_STATE, ctx->state);
+        trace_dump_if_requested(stdout);
+        if (time_elapsed_ms(stats_time) >= 1000) {
+            cap_update_pcap_stats();
+            stats_time = time_millis();
+        }
+        if (ctx->stations && time_elapsed_ms(ctx->sta_flush_time) >= ctx->sta_flush_ms) {
+            cap_flush_stations();
+            ctx->sta_flush_time = time_millis();
+        }
+        if (ctx->probe.started)
+            atomic_store(&ctx->probe.active, ctx->selected_n &&
+                         (ctx->state == STATE_PKT_CAP || ctx->state == STATE_SEND));
         if (!handlers[ctx->state])
             continue;
         handlers[ctx->state]();
-        ctx->override_state = 0;
     }
 
     return 0;
@@ -0,0 +1,189 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "clocksync.h"
+#include "metrics.h"
+#include "utils.h"
+
+static struct clk_sync clk;
+
+void clk_init()
+{
+    memset(&clk, 0, sizeof(clk));
+    pthread_mutex_init(&clk.lock, NULL);
+}
+
+// wall clock, the one sample timestamps come from
+long long clk_now_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+char *clk_ping_json(long long now_us)
+{
+    cJSON *json;
+    char *msg;
+    long long interval;
+
+    pthread_mutex_lock(&clk.lock);
+    interval = clk.n < CLK_FILTER ? CLK_BURST_INTERVAL_MS : CLK_PING_INTERVAL_MS;
+    if (now_us - clk.last_ping_us < interval * 1000) {
+        pthread_mutex_unlock(&clk.lock);
+        return NULL;
+    }
+    clk.last_ping_us = now_us;
+    pthread_mutex_unlock(&clk.lock);
+
+    json = cJSON_CreateObject();
+    cJSON_AddNumberToObject(json, "t1", now_us);
+    msg = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+    return msg;
+}
+
+// delay the fit cuts at: at least the faster half of the history, queueing only ever adds delay
+static long long clk_fit_threshold()
+{
+    long long d[CLK_HISTORY], v;
+    int i, j;
+
+    for (i = 0; i < clk.n; i++) {
+        v = clk.hist[i].delay_us;
+        for (j = i; j > 0 && d[j - 1] > v; j--)
+            d[j] = d[j - 1];
+        d[j] = v;
+    }
+    return MAX(d[0] + CLK_DELAY_SLACK_US, d[(clk.n - 1) / 2]);
+}
+
+// caller holds clk.lock
+static void clk_estimate()
+{
+    struct clk_sample *s, *best = NULL;
+    double sx = 0, sy = 0, sxx = 0, sxy = 0, x, y, resid = 0, drift = 0, offset;
+    long long t0, threshold, t_first = 0, t_last = 0;
+    int i, idx, m = 0;
+
+    // least delayed recent sample, used as is until there is enough for a fit
+    for (i = 0; i < clk.n && i < CLK_FILTER; i++) {
+        idx = (clk.next - 1 - i + CLK_HISTORY) % CLK_HISTORY;
+        s = &clk.hist[idx];
+        if (!best || s->delay_us < best->delay_us)
+            best = s;
+    }
+    t0 = best->local_us;
+    offset = best->offset_us;
+
+    // least squares over the fast samples of the whole history
+    threshold = clk_fit_threshold();
+    for (i = 0; i < clk.n; i++) {
+        s = &clk.hist[i];
+        if (s->delay_us > threshold)
+            continue;
+        x = s->local_us - t0;
+        y = s->offset_us - best->offset_us;
+        sx += x; sy += y; sxx += x * x; sxy += x * y;
+        if (!m || s->local_us < t_first)
+            t_first = s->local_us;
+        if (!m || s->local_us > t_last)
+            t_last = s->local_us;
+        m++;
+    }
+    if (m >= 4 && t_last - t_first >= CLK_DRIFT_MIN_SPAN_US && m * sxx - sx * sx > 0) {
+        drift = (m * sxy - sx * sy) / (m * sxx - sx * sx);
+        if (fabs(drift) > CLK_DRIFT_MAX)
+            drift = 0;
+        else
+            offset = best->offset_us + (sy - drift * sx) / m;
+    }
+
+    // spread of the fit samples around the estimate, on top of what the best sample's delay allows
+    for (i = 0; i < clk.n; i++) {
+        s = &clk.hist[i];
+        if (s->delay_us > threshold)
+            continue;
+        y = s->offset_us - (offset + drift * (s->local_us - t0));
+        resid += y * y;
+    }
+    resid = m ? sqrt(resid / m) : 0;
+
+    clk.ref_us = t0;
+    clk.offset_us = offset;
+    clk.drift = drift;
+    clk.err_us = best->delay_us / 2 + (long long)resid;
+    clk.synced = 1;
+}
+
+int clk_on_pong(const char *data, unsigned int len, long long t4_us)
+{
+    cJSON *json = cJSON_ParseWithLength(data, len);
+    cJSON *t1j, *t2j, *t3j;
+    long long t1, t2, t3;
+    struct clk_sample *s;
+
+    t1j = cJSON_GetObjectItem(json, "t1");
+    t2j = cJSON_GetObjectItem(json, "t2");
+    t3j = cJSON_GetObjectItem(json, "t3");
+    if (!cJSON_IsNumber(t1j) || !cJSON_IsNumber(t2j) || !cJSON_IsNumber(t3j)) {
+        cJSON_Delete(json);
+        return -1;
+    }
+    t1 = (long long)t1j->valuedouble;
+    t2 = (long long)t2j->valuedouble;
+    t3 = (long long)t3j->valuedouble;
+    cJSON_Delete(json);
+
+    pthread_mutex_lock(&clk.lock);
+    // answer to an older ping, its t4 isn't ours
+    if (t1 != clk.last_ping_us || t4_us < t1) {
+        pthread_mutex_unlock(&clk.lock);
+        return -1;
+    }
+    clk.last_ping_us = t1 - 1; // one answer per ping
+
+    s = &clk.hist[clk.next];
+    s->local_us = t4_us;
+    s->offset_us = ((t2 - t1) + (t3 - t4_us)) / 2;
+    s->delay_us = (t4_us - t1) - (t3 - t2);
+    if (s->delay_us < 0)
+        s->delay_us = 0;
+    clk.next = (clk.next + 1) % CLK_HISTORY;
+    if (clk.n < CLK_HISTORY)
+        clk.n++;
+
+    clk_estimate();
+    metrics_set(M_CLOCK_OFFSET_US, (long long)clk.offset_us);
+    metrics_set(M_CLOCK_ERR_US, clk.err_us);
+    pthread_mutex_unlock(&clk.lock);
+    return 0;
+}
+
+long long clk_offset_us(long long local_us)
+{
+    long long off = 0;
+
+    pthread_mutex_lock(&clk.lock);
+    if (clk.synced)
+        off = (long long)(clk.offset_us + clk.drift * (local_us - clk.ref_us));
+    pthread_mutex_unlock(&clk.lock);
+    return off;
+}
+
+cJSON *clk_to_json()
+{
+    cJSON *json = cJSON_CreateObject();
+
+    pthread_mutex_lock(&clk.lock);
+    cJSON_AddBoolToObject(json, "synced", clk.synced);
+    if (clk.synced) {
+        cJSON_AddNumberToObject(json, "offset_ms", clk.offset_us / 1000.0);
+        cJSON_AddNumberToObject(json, "err_ms", clk.err_us / 1000.0);
+        cJSON_AddNumberToObject(json, "drift_ppm", clk.drift * 1e6);
+    }
+    pthread_mutex_unlock(&clk.lock);
+    return json;
+}
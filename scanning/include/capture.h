@@ -4,11 +4,23 @@
 #include <sys/types.h>
 #include <pcap/pcap.h>
 #include <time.h>
+#include <pthread.h>
 #include "capture_types.h"
 #include "netlink.h"
 #include "cJSON.h"
+#include "mailbox.h"
+#include "stations.h"
+#include "probe.h"
 
-#define CAP_BUF_SIZE 32000
+// per state capture profiles, RSSI capture only needs radiotap + 802.11 header,
+// AP search needs beacon IEs for SSID and DS channel
+#define CAP_SNAPLEN_SEARCH 2048
+#define CAP_SNAPLEN_RSSI 256 // radiotap with extended bitmaps + 24 byte header, with room to spare
+#define CAP_BUFFER_SEARCH (1024 * 1024)
+#define CAP_BUFFER_RSSI (256 * 1024)
+#define CAP_BUFFER_MAX (16 * 1024 * 1024) // kernel buffer doubles on drops up to this
+#define CAP_FILTER_LEN 1024 // fits all selected APs as wlan addr3 alternatives, and our probe addresses
+#define FCS_LEN 4
 
 #define BAND_24G 0
 #define BAND_5G 1
@@ -49,7 +61,7 @@ struct radiotap_header {
     u_int32_t present_flags;
 }__attribute__((packed));
 
-#define RADIOTAP_HAS_FLAG(hdr, flag) (hdr->present_flags & (1 << flag))
+#define RADIOTAP_HAS_FLAG(hdr, flag) (hdr->present_flags & (1U << flag))
 
 //has to be this way due to endianess?
 struct wifi_frame_control {
@@ -128,22 +140,112 @@ enum tagged_params {
     //expand if needed
 };
 
-typedef void (*cap_send_cb)(char *msg);
+typedef enum cap_scan_mode {
+    SCAN_PASSIVE, // hop over the channels, CHAN_PASSIVE_SCAN_MS each, and collect beacons
+    SCAN_ACTIVE,  // driver scan on scan_dev, passive only on channels with hidden SSIDs or if it fails
+} cap_scan_mode_t;
+
+typedef enum cap_profile_id {
+    PROFILE_NONE,
+    PROFILE_SEARCH,
+    PROFILE_RSSI,
+    PROFILE_MAX,
+} cap_profile_t;
+
+// snaplen, buffer and immediate mode only apply at activation, changing them reopens the handle
+struct cap_pcap_profile {
+    int snaplen;
+    int buffer_size;
+    int immediate;
+};
+
+// time division RSSI capture: selected APs are grouped by channel into slots, the radio
+// rotates over slots, dwelling long enough to catch a few beacons of every AP in the slot
+#define CAP_MAX_APS 8
+#define CAP_SLOT_BEACONS 3
+#define CAP_DEFAULT_BEACON_INT 100 // TU, when AP list didn't carry it
+#define TU_US 1024
+
+struct cap_slot {
+    int channel;
+    int dwell_us;
+};
+
+struct cap_schedule {
+    struct cap_slot slots[CAP_MAX_APS];
+    int n_slots;
+    int slot;                 // current, -1 - radio isn't on any slot's channel yet
+    int ap_slot[CAP_MAX_APS]; // slot of each selected AP
+    long long slot_end_us;
+
+    // report, counters are bumped by capture thread and read from stats timer
+    pthread_mutex_t lock; // guards selection while it's being reported
+    long long start_us;
+    atomic_llong switch_us;
+    atomic_ullong switches;
+    atomic_ullong switch_errors; // radio stayed on the previous slot
+    atomic_ullong samples[CAP_MAX_APS];
+};
+
+#define CAP_SURVEY_MAX 128 // as many as fit in cap_channel_list
+#define FRAME_TYPE_N 4
+
+// one channel's dwell during AP search
+struct cap_survey {
+    int channel;
+    int freq;
+    long long start_us;
+    long long dwell_us;
+
+    u_int32_t frames[FRAME_TYPE_N]; // by frame type
+    u_int32_t beacons;
+    u_int32_t rate_unknown; // airtime guessed at the lowest OFDM rate
+    u_int64_t airtime_us;   // sum of estimated on-air time of captured frames
+
+    // noise floor as reported in radiotap
+    int noise_n;
+    int noise_min;
+    int noise_max;
+    long noise_sum;
+
+    // driver counters, deltas over the dwell
+    struct netlink_survey nl_start;
+    struct netlink_survey nl;
+};
+
+typedef void (*cap_send_cb)(cap_payload_t type, char *msg);
 
 struct capture_ctx {
     struct wifi_ap_info ap_list[AP_MAX];
     size_t ap_count;
-    struct cap_pkt_info pkt_list[PKT_MAX];
-    size_t pkt_count;
+    struct cap_batch batches[2];
+    int fill; // batch being filled, the other one was last flushed
+    struct cap_batch_trace batch_trace[2]; // same index as batches, apart so they stay compact
     cap_payload_t payload;
     cap_state_t state;
 
-    struct wifi_ap_info selected_ap;
+    struct wifi_ap_info selected_aps[CAP_MAX_APS];
+    int selected_n;
+    u_int32_t selected_gen; // bumped on every selection, filter follows it
+    struct cap_schedule sched;
     pcap_t *handle;
 
     u_int64_t time;
     cap_send_cb send_cb;
-    int override_state;
+
+    // pcap file replay instead of live capture, for benchmarks without a radio
+    char *replay_path;
+    int replay_rate; // packets/s, 0 - as fast as possible
+    struct timespec replay_next;
+
+    // startup timing, monotonic us
+    long long start_us;        // process start, set by caller
+    long long setup_us;        // cap_setup duration
+    long long first_sample_us; // first sample batch handed to send_cb
+
+    // commands from other threads, applied by capture thread between state handlers
+    struct mailbox cmds;
+    atomic_int stop; // set from signal handler, can't go through mailbox
 
     timer_t timerid;
     int cap_band;
@@ -151,7 +253,33 @@ struct capture_ctx {
     int cap_channel_list_n;
     int cap_channel_idx;
     int cap_scan_done;
+    struct cap_survey survey[CAP_SURVEY_MAX]; // same index as cap_channel_list
+    int survey_n;
     struct nl80211_data nl;
+
+    char *dev;
+    cap_profile_t profile; // active on handle
+    struct cap_pcap_profile profiles[PROFILE_MAX];
+    char filter[CAP_FILTER_LEN];
+    u_int32_t filter_gen;
+
+    // optional client station tracking, fed from the same frames
+    struct sta_table *stations;
+    int sta_flush_ms; // set by caller, 0 - off
+    long long sta_flush_time;
+    struct pcap_stat pcap_last; // counters of current handle
+    struct pcap_stat pcap_base; // accumulated from closed handles
+
+    struct probe_ctx probe; // active sensing, rate_hz and type set by caller
+
+    // AP search mode comes with every scan command, driver scans need scan_dev up
+    char *scan_dev; // set by caller, interface on the same radio that can scan, NULL - dev
+    struct nl80211_scan nl_scan;
+    int nl_scan_ok;
+    cap_scan_mode_t scan_mode;
+    int scan_running;          // driver scan triggered, results not in yet
+    long long scan_start_us;
+    const char *scan_fallback; // why the search went passive, NULL - it didn't
 };
 
 #define FRAME_ID(type, subtype) (type | subtype << 4)
@@ -161,13 +289,17 @@ struct capture_ctx {
 #define RADIOTAP_BAND_5(hdr) (hdr->data.channel_flags & (1 << 8)) 
 
 #define CHAN_PASSIVE_SCAN_MS 150
+#define BATCH_MAX_AGE_MS 1000 // flush a batch that isn't full by then, slow APs don't wait for PKT_MAX
+#define ACTIVE_SCAN_TIMEOUT_MS 10000 // drivers take a few seconds at most for the whole 2.4 GHz band
 #define IDLE_TIME 60
 
 int cap_setup(struct capture_ctx *cap_ctx, char *dev, cap_send_cb cb);
 int cap_run();
 void cap_override_state(cap_state_t state);
-void cap_set_ap(struct wifi_ap_info *ap);
+void cap_set_aps(struct wifi_ap_info *aps, int n);
+cJSON *cap_schedule_to_json();
 void cap_stop();
 void cap_close();
 void cap_set_chans(int *chans, int n);
+void cap_set_scan_mode(cap_scan_mode_t mode);
 #endif
\ No newline at end of file
@@ -6,36 +6,50 @@ struct radio_info {
     u_int16_t channel_freq;
     int8_t antenna_signal; 
     int8_t noise;
+    u_int8_t rate; // 500 kbps units, 0 if not reported (HT/VHT)
 };
 struct wifi_ap_info {
     u_int8_t ssid[32];
     u_int8_t bssid[6];
     u_int64_t timestamp;
     u_int16_t channel; // got from DS params
+    u_int16_t beacon_int; // TU (1024 us), from beacon fixed params
+    int8_t signal; // dBm when found, 0 - unknown
 };
 
+// parse scratch for a single frame, only what survives into cap_batch is kept
 struct cap_pkt_info {
     struct radio_info radio; 
     struct wifi_ap_info ap;
 };
 
 #define AP_MAX 50
-#define PKT_MAX 10
+#define PKT_MAX 64 // 11 bytes a sample, takes about what 10 full cap_pkt_infos used to
 
 typedef enum cap_send_payload_type {
     AP_LIST,
     PKT_LIST,
+    STA_LIST, // station table delta, own topic
 } cap_payload_t;
 
-struct cap_msg {
-    cap_payload_t type;
+// Compact samples, structure of arrays: AP details are kept once in the capture context and
+// samples refer to them by index, 11 bytes per sample instead of a full cap_pkt_info.
+// Two of these are swapped on flush, so nothing is copied
+struct cap_batch {
     size_t count;
-    // size_t bytes_len;
-    union {
-        struct wifi_ap_info ap_list[AP_MAX];
-        struct cap_pkt_info pkt_list[PKT_MAX];
-    };
-} __attribute__((packed));
+    u_int64_t base_ms;              // wall clock of first sample
+    u_int32_t ts_delta_ms[PKT_MAX]; // from base_ms
+    u_int16_t freq[PKT_MAX];        // MHz as measured in radiotap, 0 if not reported
+    int8_t rssi[PKT_MAX];
+    int8_t noise[PKT_MAX];
+    u_int8_t ap[PKT_MAX];           // index into selected APs
+    int8_t slot[PKT_MAX];           // schedule slot the radio was on when it was captured, -1 none
+    u_int8_t fc[PKT_MAX];           // first frame control byte, version/type/subtype bits
+};
 
-typedef struct cap_msg cap_msg_t;
+// per sample trace points of a batch, only touched when tracing is on
+struct cap_batch_trace {
+    long long handler_us[PKT_MAX];
+    long long kernel_us[PKT_MAX];
+};
 #endif
\ No newline at end of file
@@ -0,0 +1,47 @@
+#ifndef CLOCKSYNC_H
+#define CLOCKSYNC_H
+
+#include <pthread.h>
+#include "cJSON.h"
+
+// NTP style offset estimate against the manager's wall clock, exchanged over MQTT:
+// scanner sends t1, manager stamps receive t2 and send t3, scanner receives at t4
+#define CLK_HISTORY 32          // samples kept for the drift fit
+#define CLK_FILTER 8            // recent samples the offset is picked from, lowest delay wins
+#define CLK_BURST_INTERVAL_MS 1000 // until CLK_FILTER samples are in
+#define CLK_PING_INTERVAL_MS 8000
+#define CLK_DRIFT_MIN_SPAN_US (60 * 1000000LL) // shorter than this and drift is mostly noise
+#define CLK_DRIFT_MAX 500e-6    // anything above is a clock step, not drift
+#define CLK_DELAY_SLACK_US 2000 // samples this much slower than the fastest are left out of the fit
+
+struct clk_sample {
+    long long local_us; // t4
+    long long offset_us;
+    long long delay_us;
+};
+
+struct clk_sync {
+    pthread_mutex_t lock;
+    struct clk_sample hist[CLK_HISTORY];
+    int n;
+    int next;
+    long long last_ping_us; // t1 of outstanding ping, stale pongs are dropped
+
+    // estimate, offset(t) = offset_us + drift * (t - ref_us)
+    int synced;
+    long long ref_us;
+    double offset_us;
+    double drift;
+    long long err_us;
+};
+
+void clk_init();
+long long clk_now_us();
+// ping payload if one is due, caller frees
+char *clk_ping_json(long long now_us);
+int clk_on_pong(const char *data, unsigned int len, long long t4_us);
+// what to add to a local wall clock time to get manager time, 0 until synced
+long long clk_offset_us(long long local_us);
+cJSON *clk_to_json();
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+// Intrusive lock-free MPSC queue (Vyukov). Any thread can post, only one thread takes.
+// Embed struct mbox_node in the message and get it back with mbox_entry().
+struct mbox_node {
+    _Atomic(struct mbox_node *) next;
+};
+
+struct mailbox {
+    _Atomic(struct mbox_node *) head; // last posted node, producers swap themselves in here
+    struct mbox_node *tail;           // next node to take, consumer only
+    struct mbox_node stub;
+};
+
+#define mbox_entry(node, type, member) ((type *)((char *)(node) - offsetof(type, member)))
+
+void mbox_init(struct mailbox *mb);
+void mbox_post(struct mailbox *mb, struct mbox_node *node);
+struct mbox_node *mbox_take(struct mailbox *mb);
+
+#endif
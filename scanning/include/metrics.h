@@ -0,0 +1,72 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdatomic.h>
+#include <sys/types.h>
+#include "cJSON.h"
+
+#define METRICS_PREFIX "wfan_"
+#define METRICS_HIST_BUCKETS 32 // bucket i holds values < 2^i, last one is everything above
+#define METRICS_DEFAULT_INTERVAL 10
+
+typedef enum metric_type {
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+} metric_type_t;
+
+typedef enum metric_id {
+    M_FRAMES_SEEN,
+    M_FRAMES_PARSED,
+    M_FRAMES_KEPT,
+    M_PCAP_RECV,
+    M_PCAP_DROP,
+    M_PCAP_IFDROP,
+    M_PCAP_BUFFER,
+    M_CHAN_SWITCHES,
+    M_CHAN_SWITCH_ERRORS,
+    M_BATCHES_SENT,
+    M_SAMPLES_SENT,
+    M_MQTT_PUBLISHED,
+    M_MQTT_ACKED,
+    M_MQTT_DROPPED,
+    M_MQTT_RESENT,
+    M_MQTT_INFLIGHT,
+    M_CAP_STATE,
+    M_STARTUP_READY_MS,
+    M_STARTUP_FIRST_SAMPLE_MS,
+    M_CLOCK_OFFSET_US,
+    M_CLOCK_ERR_US,
+    M_PROBES_SENT,
+    M_PROBE_RESPONSES,
+    M_PROBE_ERRORS,
+    M_PROBE_MISSED,
+    M_AP_SEARCH_MS,
+    M_SCAN_FALLBACKS,
+    M_MAX,
+} metric_t;
+
+typedef enum metric_hist_id {
+    H_CHAN_SWITCH_US,
+    H_BATCH_FILL_MS,
+    H_BATCH_SEND_US,
+    H_MQTT_ACK_US,
+    H_SCHED_LATENCY_US,
+    H_MAX,
+} metric_hist_t;
+
+struct metrics_hist {
+    atomic_ullong buckets[METRICS_HIST_BUCKETS];
+    atomic_ullong count;
+    atomic_ullong sum;
+};
+
+void metrics_inc(metric_t id);
+void metrics_add(metric_t id, long long val);
+void metrics_set(metric_t id, long long val);
+long long metrics_get(metric_t id);
+void metrics_observe(metric_hist_t id, long long val);
+
+cJSON *metrics_to_json();
+int metrics_write_prom(const char *path, const char *client_id);
+
+#endif
@@ -2,14 +2,25 @@
 #define MOSQUITTO_MQTT_H
 
 #include <linux/limits.h>
+#include <sys/types.h>
+#include <pthread.h>
 
 #define MQTT_CONFIG_FILE "client_mqtt.conf"
 #define MAX_TOPIC_LEN 256
 
 #define MQTT_MAX_TOPICS 16
+
+// publish flags, only have effect on MQTT v5 connections (except MQTT_PUB_WINDOW)
+// send topic alias instead of full topic after first publish. QoS 0 only: libmosquitto resends unacked
+// QoS >= 1 messages unchanged after a reconnect, and the new connection has no such alias
+#define MQTT_PUB_ALIAS (1 << 0)
+#define MQTT_PUB_EXPIRE (1 << 1) // attach message expiry interval from config
+#define MQTT_PUB_WINDOW (1 << 2) // count against in-flight window, dropped when window is full
+
 typedef struct mqtt_topic {
     char name[MAX_TOPIC_LEN];
     int qos;
+    int flags;
 } topic_t;
 
 typedef struct mqtt_payload {
@@ -18,27 +29,83 @@ typedef struct mqtt_payload {
 } payload_t;
 
 #define CONN_RETRY_CNT 5
+
+#define MQTT_PROTO_V311 4
+#define MQTT_PROTO_V5 5
+
+#define MQTT_DEFAULT_MAX_INFLIGHT 16
+#define MQTT_INFLIGHT_LIMIT 256 // size of the in-flight tracking table, window is capped to half of it
+#define MQTT_DEFAULT_MSG_EXPIRY 10 // seconds
+#define MQTT_MAX_ALIASES 8
+#define MQTT_STATS_PRINT_SEC 10
+
+// mqtt_publish_topic() returns the message id, or one of these
+#define MQTT_ERR_WINDOW_FULL -1 // MQTT_PUB_WINDOW message doesn't fit in the window
+#define MQTT_ERR_PUBLISH -2     // mosquitto refused it, not connected etc.
+
 struct mosquitto_conf {
     char *host;
     int port;
     char *username;
     char *password;
+    int protocol;     // preferred protocol, falls back to 3.1.1 if broker doesn't speak v5
+    int max_inflight; // max unacked MQTT_PUB_WINDOW messages
+    int msg_expiry;   // seconds, 0 - never expire
+    int quiet;        // no per connection messages, for processes running many clients
+};
+
+// publish/ack accounting, filled by mqtt_get_pub_stats()
+struct mqtt_pub_stats {
+    int protocol;
+    int inflight;
+    int max_inflight;
+    u_int64_t published;
+    u_int64_t acked;
+    u_int64_t nacked;  // broker acked with error reason code
+    u_int64_t dropped; // window full
+    u_int64_t resent;  // in-flight over a reconnect, libmosquitto sends them again
+    u_int64_t lost;    // never acked, counted by whoever frees a client with messages in flight
+    long long ack_last_us;
+    long long ack_min_us;
+    long long ack_max_us;
+    long long ack_sum_us;
 };
 
 struct threads_shared {
     pthread_mutex_t lock;
+    pthread_cond_t cond; // signaled on connect, reg ack and stop
     int stop;
+    int connected;
+    long long connected_us; // first successful connect, monotonic
 };
 
+// one broker connection; the scanner has one behind the mqtt_*() calls below, the fleet simulator
+// one per virtual scanner
+struct mqtt_client;
+
+typedef void (*mqtt_client_cb)(void *userdata, const char *topic, void *data, u_int32_t len);
+int mqtt_read_config(const char *path, struct mosquitto_conf *conf);
+struct mqtt_client *mqtt_client_new(const struct mosquitto_conf *conf, const char *id,
+                                    mqtt_client_cb on_msg_cb, void *userdata, struct threads_shared *shared);
+void mqtt_client_free(struct mqtt_client *c); // no disconnect, the broker sends the will as after a crash
+int mqtt_client_subscribe(struct mqtt_client *c, topic_t topic);
+int mqtt_client_publish(struct mqtt_client *c, topic_t topic, payload_t payload);
+void mqtt_client_set_sub_topics(struct mqtt_client *c, topic_t *topics);
+int mqtt_client_set_will(struct mqtt_client *c, topic_t will);
+int mqtt_client_get_pub_stats(struct mqtt_client *c, struct mqtt_pub_stats *stats);
+int mqtt_client_run(struct mqtt_client *c);   // connects and loops on the calling thread until shared->stop
+int mqtt_client_start(struct mqtt_client *c); // connects and loops on a thread of the library's
+int mqtt_client_stop(struct mqtt_client *c, int with_will);
+
 typedef void (*mqtt_cb)(const char *topic, void* data, u_int32_t len);
-int mqtt_register_cb(mqtt_cb *func);
 int mqtt_subscribe_topic(topic_t topic);
 int mqtt_publish_topic(topic_t topic, payload_t payload);
-int mqtt_setup(char *mqtt_conf_path, mqtt_cb on_msg_cb);
+int mqtt_setup(char *mqtt_conf_path, mqtt_cb on_msg_cb, struct threads_shared *shared);
 int mqtt_is_sub_match(char* sub, char *topic);
 int mqtt_set_sub_topics(topic_t *topics);
 int mqtt_set_will(topic_t will);
 const char *mqtt_get_user();
+int mqtt_get_pub_stats(struct mqtt_pub_stats *stats);
 void mqtt_cleanup();
 int mqtt_run();
 
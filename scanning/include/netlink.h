@@ -15,7 +15,53 @@ struct nl80211_data
     int ifindex;
 };
 
+// driver channel survey, times are cumulative counters in ms
+#define NL_SURVEY_NOISE (1 << 0)
+#define NL_SURVEY_TIME  (1 << 1)
+struct netlink_survey
+{
+    int freq;
+    int flags; // which of the fields below the driver reported
+    int8_t noise;
+    u_int64_t active_ms;
+    u_int64_t busy_ms;
+    u_int64_t rx_ms;
+    u_int64_t tx_ms;
+};
+
+// driver offloaded AP search, needs an interface that can scan: monitor ones can't, a managed one
+// on the same radio can
+#define NL_SCAN_RUNNING 0
+#define NL_SCAN_DONE 1
+#define NL_SCAN_ABORTED -1
+struct nl80211_scan
+{
+    struct nl80211_data nl; // commands and result dump
+    struct nl_sock *events; // "scan" multicast group, non-blocking
+    int status;
+};
+
+// one entry of the driver's BSS table
+struct netlink_bss
+{
+    u_int8_t bssid[6];
+    u_int8_t ssid[32];
+    int ssid_len; // 0 - hidden
+    int freq;
+    int signal;   // dBm, 0 if the driver didn't report it
+    int beacon_int;
+    u_int32_t age_ms; // since the BSS was last seen, the table keeps entries of earlier scans
+};
+typedef void (*netlink_bss_cb)(struct netlink_bss *bss, void *arg);
+
 int netlink_init(struct nl80211_data *nl, char *iface);
 int netlink_deinit(struct nl80211_data *nl);
 int netlink_switch_chan(struct nl80211_data *nl, int chan);
+int netlink_get_survey(struct nl80211_data *nl, int freq, struct netlink_survey *survey);
+int netlink_scan_init(struct nl80211_scan *scan, char *iface);
+void netlink_scan_deinit(struct nl80211_scan *scan);
+int netlink_scan_trigger(struct nl80211_scan *scan, int *freqs, int n);
+int netlink_scan_poll(struct nl80211_scan *scan);
+void netlink_scan_abort(struct nl80211_scan *scan);
+int netlink_scan_results(struct nl80211_scan *scan, netlink_bss_cb cb, void *arg);
 #endif
\ No newline at end of file
@@ -0,0 +1,69 @@
+#ifndef PROBE_H
+#define PROBE_H
+
+#include <stdatomic.h>
+#include <pthread.h>
+#include <pcap/pcap.h>
+#include <sys/types.h>
+#include "capture_types.h"
+#include "cJSON.h"
+
+// Active sensing: frames injected at the selected APs at a fixed rate, their responses are
+// samples like beacons are, so the sample rate isn't stuck at the beacon interval.
+// Every selected AP gets its own locally administered source address, the response is
+// addressed to it and that alone says which AP answered, ACKs carry no transmitter.
+#define PROBE_MAX_TARGETS 8 // CAP_MAX_APS, index goes into 3 bits of the source address
+#define PROBE_MAX_HZ 1000
+#define PROBE_FRAME_MAX 128
+#define PROBE_TX_RATE 12 // 500 kbps units, 6 Mbps OFDM: short on air and still robust
+
+typedef enum probe_type {
+    PROBE_REQ,  // directed probe request, answered with a probe response
+    PROBE_NULL, // null data frame, answered with an ACK only (needs control frames in monitor mode)
+} probe_type_t;
+
+struct probe_target {
+    int ap; // index into the capture's selected APs
+    u_int16_t seq;
+    int len;
+    u_int8_t frame[PROBE_FRAME_MAX]; // radiotap + 802.11, only the sequence number changes
+};
+
+struct probe_ctx {
+    // set by caller before probe_init()
+    int rate_hz; // per AP, 0 - off
+    probe_type_t type;
+
+    pcap_t *handle; // own handle, the capture one is reopened on profile changes
+    pthread_t thread;
+    int started;
+    u_int8_t base_mac[6];
+    atomic_int active; // capture thread says when there is something to sample
+    atomic_int stop;
+
+    pthread_mutex_t lock; // targets
+    struct probe_target targets[PROBE_MAX_TARGETS];
+    int n_targets;
+
+    // report, bumped by injector and capture thread, reset on new selection
+    long long start_us;
+    atomic_ullong missed; // timer expirations the injector woke up too late for
+    atomic_ullong errors;
+    atomic_ullong sent[PROBE_MAX_TARGETS];
+    atomic_ullong responses[PROBE_MAX_TARGETS];
+};
+
+int probe_init(struct probe_ctx *p, char *dev);
+void probe_deinit(struct probe_ctx *p);
+// aps[idx[i]] are on the channel the radio is on now, n = 0 pauses injection
+void probe_set_targets(struct probe_ctx *p, struct wifi_ap_info *aps, int *idx, int n);
+void probe_reset_stats(struct probe_ctx *p);
+// selected AP index a frame to this address answers, -1 - not ours
+int probe_match(struct probe_ctx *p, const u_int8_t *addr);
+void probe_src_mac(struct probe_ctx *p, int ap, u_int8_t *mac);
+void probe_count_response(struct probe_ctx *p, int ap);
+cJSON *probe_to_json(struct probe_ctx *p);
+void probe_ap_to_json(struct probe_ctx *p, int ap, cJSON *json);
+const char *probe_type_str(probe_type_t type);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef RT_H
+#define RT_H
+
+// cpu_set_t and affinity calls need _GNU_SOURCE, set for all sources in Makefile
+#include <pthread.h>
+#include <sched.h>
+#include <sys/types.h>
+
+#define RT_PREFAULT_STACK (256 * 1024) // capture thread stack touched up front when memory is locked
+
+struct rt_opts {
+    int capture_cpu;    // -1 - don't pin
+    int fifo_prio;      // 0 - keep SCHED_OTHER
+    int lock_mem;
+    cpu_set_t aux_cpus; // MQTT and timer threads
+    int aux_set;
+};
+
+int rt_parse_cpus(const char *str, cpu_set_t *set);
+void rt_default_aux_cpus(struct rt_opts *opts);
+int rt_pin_thread(pthread_t thread, cpu_set_t *set);
+int rt_setup_capture_thread(struct rt_opts *opts);
+int rt_lock_memory();
+void rt_prefault(void *buf, size_t len);
+void rt_prefault_stack();
+
+#endif
@@ -8,10 +8,18 @@
 #include "mosquitto_mqtt.h"
 #include <libgen.h> //for basename()
 #include "topics.h"
+#include "metrics.h"
+#include "trace.h"
+#include "rt.h"
+#include "clocksync.h"
 #include <unistd.h>
 #include <signal.h>
 #include <stdlib.h>
 
+// reg ack wait, doubled after every unanswered register up to max
+#define REG_BACKOFF_MIN_MS 200
+#define REG_BACKOFF_MAX_MS 5000
+
 struct scanner_client_ctx
 {
     char *dev;
@@ -21,7 +29,26 @@ struct scanner_client_ctx
     char *client_id;
     topic_t sub_topics[MQTT_MAX_TOPICS];
     int registered;
-    struct wifi_ap_info selected_ap;
+    int shard; // ingest worker shard from reg_ack, -1 - samples go to the plain data topic
+    struct wifi_ap_info selected_aps[CAP_MAX_APS];
+    int n_selected;
+
+    char *replay_path; // pcap file to replay instead of capturing on dev
+    int replay_rate;
+    int sta_flush_sec; // 0 - station tracking off
+    int probe_rate;    // injected frames per second per AP, 0 - passive
+    probe_type_t probe_type;
+    char *scan_dev;    // driver scans go through this one, NULL - dev
+
+    int stats_interval; // seconds, 0 - don't publish stats
+    char *prom_path;    // node_exporter textfile, optional
+    timer_t stats_timer;
+    timer_t ping_timer; // clock sync, ticks at the burst rate, clocksync decides when to ping
+
+    struct rt_opts rt;
+
+    long long start_us;  // monotonic, for startup timings
+    u_int32_t boot_id;   // lets manager tell a register retry from a restarted scanner
 };
 
 #endif
@@ -0,0 +1,65 @@
+#ifndef STATIONS_H
+#define STATIONS_H
+
+#include <sys/types.h>
+#include "cJSON.h"
+
+// Client station table, fixed pool so memory is bounded (~135 KiB), least recently seen
+// station is dropped when it's full
+#define STA_MAX 2048
+#define STA_HASH_BITS 12 // twice the pool, keeps chains short
+#define STA_BUCKETS (1 << STA_HASH_BITS)
+#define STA_EXPIRE_MS (5 * 60 * 1000) // not seen for this long - gone
+#define STA_GONE_MAX 64               // reported per flush, rest go out with the next one
+#define STA_NONE -1
+
+// what the station was seen sending
+#define STA_SEEN_PROBE (1 << 0)
+#define STA_SEEN_ASSOC (1 << 1)
+#define STA_SEEN_DATA (1 << 2)
+
+struct sta_entry {
+    u_int8_t mac[6];
+    u_int8_t seen;
+    u_int8_t reported; // went out in a flush, manager has to hear it's gone
+    u_int32_t gen; // flush interval it was last touched in
+    int16_t hnext;
+    int16_t prev; // LRU, head is most recently seen
+    int16_t next;
+
+    u_int64_t first_seen_ms;
+    u_int64_t last_seen_ms;
+    u_int32_t total_frames;
+
+    // since last flush
+    u_int32_t frames;
+    u_int32_t rssi_n;
+    int32_t rssi_sum;
+    int8_t rssi_min;
+    int8_t rssi_max;
+};
+
+struct sta_table {
+    struct sta_entry pool[STA_MAX];
+    int16_t buckets[STA_BUCKETS];
+    int16_t head;
+    int16_t tail;
+    int16_t free;
+    int count;
+    u_int32_t gen;
+    u_int32_t evicted; // since last flush
+
+    // reported stations dropped to make room, go out as gone before expired ones. Oldest is
+    // overwritten if evictions outrun the flushes for a whole pool's worth
+    u_int8_t evicted_macs[STA_MAX][6];
+    int16_t evicted_head;
+    int16_t evicted_n;
+};
+
+struct sta_table *sta_create();
+void sta_destroy(struct sta_table *t);
+void sta_update(struct sta_table *t, const u_int8_t *mac, int8_t rssi, int seen, u_int64_t now_ms);
+// delta since the previous flush: touched stations and expired ones, starts a new interval
+cJSON *sta_flush_json(struct sta_table *t, u_int64_t now_ms);
+
+#endif
@@ -4,6 +4,9 @@
 #define TOPIC_CMD_BASE "cmd"
 #define TOPIC_CMD_ALL TOPIC_CMD_BASE "/all"
 #define TOPIC_DATA_BASE "data"
+#define TOPIC_STATS_BASE "stats"
+#define TOPIC_STATIONS_BASE "stations"
+#define TOPIC_INGEST_BASE "ingest"
 
 #define CMD_SCAN "scan"
 #define CMD_STOP "stop"
@@ -23,14 +26,21 @@
 #define SCANNER_PUB_CMD_REGISTER TOPIC_CMD_BASE "/" CMD_REGISTER // + id
 #define SCANNER_PUB_CMD_STOP TOPIC_CMD_BASE "/" CMD_STOP         // + id
 #define SCANNER_PUB_CMD_CRASH TOPIC_CMD_BASE "/" CMD_CRASH       // + id
+#define SCANNER_PUB_CMD_PING TOPIC_CMD_BASE "/" SCANNER_PING_REQ // + id, answered with SCANNER_PING_RESP
 
 #define SCANNER_PUB_DATA TOPIC_DATA_BASE // + id
+#define SCANNER_PUB_STATS TOPIC_STATS_BASE // + id
+#define SCANNER_PUB_STATIONS TOPIC_STATIONS_BASE // + id
+#define SCANNER_PUB_INGEST TOPIC_INGEST_BASE // + shard + id, PKT_LISTs once reg_ack named a shard
 
 #define MANAGER_SUB_DATA TOPIC_DATA_BASE "/+"
+#define MANAGER_SUB_STATS TOPIC_STATS_BASE "/+"
+#define MANAGER_SUB_STATIONS TOPIC_STATIONS_BASE "/+"
 
 #define MANAGER_SUB_CMD_REGISTER SCANNER_PUB_CMD_REGISTER "/+"
 #define MANAGER_SUB_CMD_STOP SCANNER_PUB_CMD_STOP "/+" // use the same register to unregister
 #define MANAGER_SUB_CMD_CRASH SCANNER_PUB_CMD_CRASH "/+"
+#define MANAGER_SUB_CMD_PING SCANNER_PUB_CMD_PING "/+"
 #define MANAGER_PUB_CMD_SCAN TOPIC_CMD_ALL "/" CMD_SCAN
 #define MANAGER_PUB_CMD_STOP TOPIC_CMD_ALL "/" CMD_STOP
 #define MANAGER_PUB_CMD_SELECT_AP TOPIC_CMD_ALL "/" CMD_SELECT_AP
@@ -0,0 +1,56 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include "cJSON.h"
+
+// HDR style histogram: linear sub-buckets inside each power of 2, ~3% worst case error
+#define TRACE_SUB_BITS 5
+#define TRACE_SUB_COUNT (1 << TRACE_SUB_BITS)
+#define TRACE_MAX_BITS 32 // values in us, anything above ~71 min lands in the last bucket
+#define TRACE_BUCKETS ((TRACE_MAX_BITS - TRACE_SUB_BITS + 1) * TRACE_SUB_COUNT)
+
+typedef enum trace_stage {
+    TR_KERNEL_TO_HANDLER, // pcap kernel timestamp -> cap_packet_handler
+    TR_HANDLER_TO_FLUSH,  // sample stored -> batch flush
+    TR_SERIALIZE,         // batch flush -> JSON ready
+    TR_PUBLISH,           // JSON ready -> mosquitto_publish returned
+    TR_ACK,               // mosquitto_publish -> broker ack
+    TR_CAPTURE_TO_PUBLISH, // kernel timestamp -> mosquitto_publish returned, per sample
+    TR_SCHED_WAKEUP,      // capture thread sleep overshoot
+    TR_MAX,
+} trace_stage_t;
+
+struct trace_hist {
+    atomic_ullong buckets[TRACE_BUCKETS];
+    atomic_ullong count;
+    atomic_ullong max;
+};
+
+extern int trace_enabled;
+
+// Trace points cost a single predictable branch when tracing is off,
+// build with -DWFAN_NO_TRACE to drop them entirely.
+#ifdef WFAN_NO_TRACE
+#define TRACE_ON() 0
+#else
+#define TRACE_ON() __builtin_expect(trace_enabled, 0)
+#endif
+
+#define TRACE_OBSERVE(stage, us)              \
+    do {                                      \
+        if (TRACE_ON())                       \
+            trace_observe(stage, us);         \
+    } while (0)
+
+long long trace_since_kernel_us(const struct timeval *ts);
+void trace_observe(trace_stage_t stage, long long us);
+long long trace_percentile(trace_stage_t stage, double q);
+void trace_request_dump();
+void trace_dump_if_requested(FILE *fp);
+void trace_dump(FILE *fp);
+cJSON *trace_to_json();
+
+#endif
@@ -39,6 +39,7 @@ enum mgmt_frame_subtypes {
 enum ctrl_frame_subtypes {
     FRAME_SUBTYPE_BLOCK_ACK = 9,
     FRAME_SUBTYPE_RTS =11,
+    FRAME_SUBTYPE_ACK = 13,
 };
 
 enum frame_types {
@@ -59,15 +60,19 @@ char *wfs_mgmt_frame_to_str(enum mgmt_frame_subtypes subtype);
 char *wfs_frame_type_to_str(enum frame_types type);
 
 void wfs_print_mac(u_int8_t *mac);
+char *set_dev_mac(char *iface, unsigned char *buf);
 char *get_client_id(char *iface);
 int is_valid_mac(unsigned char* mac);
 void print_ap_list(struct wifi_ap_info *list, size_t n);
 
 #define ARR_SIZE(arr) (sizeof(arr) / sizeof(arr[0]))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 
 timer_t set_timer(int sec, long nsec, void (*cb)(union sigval), void* cb_data, int one_shot);
 long long time_millis();
 long long time_elapsed_ms(long long start);
+long long time_mono_us();
 int msleep(long msec);
 int bssid_equal(unsigned char *a, unsigned char *b);
 int bssid_str_to_val(char *str, unsigned char *bssid);
@@ -0,0 +1,50 @@
+#include "mailbox.h"
+
+void mbox_init(struct mailbox *mb)
+{
+    atomic_store_explicit(&mb->stub.next, NULL, memory_order_relaxed);
+    atomic_store_explicit(&mb->head, &mb->stub, memory_order_relaxed);
+    mb->tail = &mb->stub;
+}
+
+void mbox_post(struct mailbox *mb, struct mbox_node *node)
+{
+    struct mbox_node *prev;
+
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    prev = atomic_exchange_explicit(&mb->head, node, memory_order_acq_rel);
+    // consumer can't see node until this store, it will just find the queue empty for a moment
+    atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+// returns NULL if empty (or a producer is halfway through posting, it'll show up on next call)
+struct mbox_node *mbox_take(struct mailbox *mb)
+{
+    struct mbox_node *tail = mb->tail;
+    struct mbox_node *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if (tail == &mb->stub) {
+        if (!next)
+            return NULL;
+        mb->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    }
+
+    if (next) {
+        mb->tail = next;
+        return tail;
+    }
+
+    if (tail != atomic_load_explicit(&mb->head, memory_order_acquire))
+        return NULL;
+
+    // tail is the last node, put stub behind it so tail can be handed out
+    mbox_post(mb, &mb->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next) {
+        mb->tail = next;
+        return tail;
+    }
+    return NULL;
+}
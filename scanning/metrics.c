@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <limits.h>
+#include <string.h>
+#include "metrics.h"
+#include "utils.h"
+
+static const struct metric_desc {
+    const char *name;
+    const char *help;
+    metric_type_t type;
+} metric_descs[M_MAX] = {
+    [M_FRAMES_SEEN] = {"frames_seen", "Frames read from capture handle", METRIC_COUNTER},
+    [M_FRAMES_PARSED] = {"frames_parsed", "Frames with a decoded 802.11 header", METRIC_COUNTER},
+    [M_FRAMES_KEPT] = {"frames_kept", "Frames stored as RSSI sample or AP", METRIC_COUNTER},
+    [M_PCAP_RECV] = {"pcap_recv", "Packets received by the capture socket (pcap_stats)", METRIC_COUNTER},
+    [M_PCAP_DROP] = {"pcap_drop", "Packets dropped by the kernel, buffer full (pcap_stats)", METRIC_COUNTER},
+    [M_PCAP_IFDROP] = {"pcap_ifdrop", "Packets dropped by the interface (pcap_stats)", METRIC_COUNTER},
+    [M_PCAP_BUFFER] = {"pcap_buffer_bytes", "Kernel capture buffer size of active profile", METRIC_GAUGE},
+    [M_CHAN_SWITCHES] = {"chan_switches", "nl80211 channel switches", METRIC_COUNTER},
+    [M_CHAN_SWITCH_ERRORS] = {"chan_switch_errors", "Failed nl80211 channel switches", METRIC_COUNTER},
+    [M_BATCHES_SENT] = {"batches_sent", "Data messages handed to MQTT", METRIC_COUNTER},
+    [M_SAMPLES_SENT] = {"samples_sent", "RSSI samples handed to MQTT", METRIC_COUNTER},
+    [M_MQTT_PUBLISHED] = {"mqtt_published", "Messages accepted by mosquitto_publish", METRIC_COUNTER},
+    [M_MQTT_ACKED] = {"mqtt_acked", "Messages acked by broker", METRIC_COUNTER},
+    [M_MQTT_DROPPED] = {"mqtt_dropped", "Messages dropped, in-flight window full", METRIC_COUNTER},
+    [M_MQTT_RESENT] = {"mqtt_resent", "Messages in flight over a reconnect, resent", METRIC_COUNTER},
+    [M_MQTT_INFLIGHT] = {"mqtt_inflight", "Messages waiting for broker ack", METRIC_GAUGE},
+    [M_CAP_STATE] = {"capture_state", "Capture state machine state", METRIC_GAUGE},
+    [M_STARTUP_READY_MS] = {"startup_ready_ms", "Process start to registered with manager", METRIC_GAUGE},
+    [M_STARTUP_FIRST_SAMPLE_MS] = {"startup_first_sample_ms", "Process start to first sample batch sent", METRIC_GAUGE},
+    [M_CLOCK_OFFSET_US] = {"clock_offset_us", "Estimated offset of manager clock to ours", METRIC_GAUGE},
+    [M_CLOCK_ERR_US] = {"clock_err_us", "Error bound of the clock offset estimate", METRIC_GAUGE},
+    [M_PROBES_SENT] = {"probes_sent", "Frames injected for active sensing", METRIC_COUNTER},
+    [M_PROBE_RESPONSES] = {"probe_responses", "Probe responses and ACKs to injected frames", METRIC_COUNTER},
+    [M_PROBE_ERRORS] = {"probe_errors", "Failed injections", METRIC_COUNTER},
+    [M_PROBE_MISSED] = {"probe_missed", "Injection ticks skipped, injector woke up too late", METRIC_COUNTER},
+    [M_AP_SEARCH_MS] = {"ap_search_ms", "Duration of the last AP search, scan command to AP list", METRIC_GAUGE},
+    [M_SCAN_FALLBACKS] = {"scan_fallbacks", "Active AP searches that went passive, wholly or on hidden SSID channels", METRIC_COUNTER},
+};
+
+static const char *hist_names[H_MAX] = {
+    [H_CHAN_SWITCH_US] = "chan_switch_us",
+    [H_BATCH_FILL_MS] = "batch_fill_ms",
+    [H_BATCH_SEND_US] = "batch_send_us",
+    [H_MQTT_ACK_US] = "mqtt_ack_us",
+    [H_SCHED_LATENCY_US] = "sched_latency_us",
+};
+
+static const char *hist_helps[H_MAX] = {
+    [H_CHAN_SWITCH_US] = "nl80211 channel switch time, including settle wait",
+    [H_BATCH_FILL_MS] = "Time to fill a sample batch",
+    [H_BATCH_SEND_US] = "Time to serialize and publish a batch",
+    [H_MQTT_ACK_US] = "Publish to broker ack latency",
+    [H_SCHED_LATENCY_US] = "Capture thread wakeup past requested sleep",
+};
+
+static atomic_llong values[M_MAX];
+static struct metrics_hist hists[H_MAX];
+
+void metrics_inc(metric_t id)
+{
+    atomic_fetch_add_explicit(&values[id], 1, memory_order_relaxed);
+}
+
+void metrics_add(metric_t id, long long val)
+{
+    atomic_fetch_add_explicit(&values[id], val, memory_order_relaxed);
+}
+
+void metrics_set(metric_t id, long long val)
+{
+    atomic_store_explicit(&values[id], val, memory_order_relaxed);
+}
+
+long long metrics_get(metric_t id)
+{
+    return atomic_load_explicit(&values[id], memory_order_relaxed);
+}
+
+static int hist_bucket(long long val)
+{
+    int b = 0;
+
+    if (val <= 0)
+        return 0;
+    b = 64 - __builtin_clzll((unsigned long long)val); // val < 2^b
+    return b < METRICS_HIST_BUCKETS ? b : METRICS_HIST_BUCKETS - 1;
+}
+
+void metrics_observe(metric_hist_t id, long long val)
+{
+    struct metrics_hist *h = &hists[id];
+
+    atomic_fetch_add_explicit(&h->buckets[hist_bucket(val)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, val > 0 ? val : 0, memory_order_relaxed);
+}
+
+static void hist_to_json(cJSON *json, metric_hist_t id)
+{
+    struct metrics_hist *h = &hists[id];
+    cJSON *obj = cJSON_AddObjectToObject(json, hist_names[id]);
+    cJSON *buckets = cJSON_AddArrayToObject(obj, "buckets");
+    unsigned long long n;
+
+    cJSON_AddNumberToObject(obj, "count", atomic_load(&h->count));
+    cJSON_AddNumberToObject(obj, "sum", atomic_load(&h->sum));
+
+    // only non-empty buckets as [exclusive upper bound, count], last bound is -1 (overflow)
+    for (int i = 0; i < METRICS_HIST_BUCKETS; i++) {
+        if (!(n = atomic_load(&h->buckets[i])))
+            continue;
+        cJSON *pair = cJSON_CreateArray();
+        cJSON_AddItemToArray(pair, cJSON_CreateNumber(i < METRICS_HIST_BUCKETS - 1 ? (double)(1ULL << i) : -1));
+        cJSON_AddItemToArray(pair, cJSON_CreateNumber(n));
+        cJSON_AddItemToArray(buckets, pair);
+    }
+}
+
+cJSON *metrics_to_json()
+{
+    cJSON *json = cJSON_CreateObject();
+    cJSON *counters = cJSON_AddObjectToObject(json, "counters");
+    cJSON *gauges = cJSON_AddObjectToObject(json, "gauges");
+    cJSON *hist = cJSON_AddObjectToObject(json, "hist");
+
+    cJSON_AddNumberToObject(json, "timestamp", time_millis());
+    for (int i = 0; i < M_MAX; i++)
+        cJSON_AddNumberToObject(metric_descs[i].type == METRIC_COUNTER ? counters : gauges,
+                                metric_descs[i].name, metrics_get(i));
+
+    for (int i = 0; i < H_MAX; i++)
+        hist_to_json(hist, i);
+
+    return json;
+}
+
+// node_exporter textfile collector format, written to a temp file and renamed so it's never read half done
+int metrics_write_prom(const char *path, const char *client_id)
+{
+    char tmp_path[PATH_MAX];
+    unsigned long long cumulative;
+    struct metrics_hist *h;
+    FILE *fp;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    if (!(fp = fopen(tmp_path, "w"))) {
+        fprintf(stderr, "Can't open metrics file %s\n", tmp_path);
+        return -1;
+    }
+
+    for (int i = 0; i < M_MAX; i++) {
+        const struct metric_desc *d = &metric_descs[i];
+        const char *suffix = d->type == METRIC_COUNTER ? "_total" : "";
+
+        fprintf(fp, "# HELP " METRICS_PREFIX "%s%s %s\n", d->name, suffix, d->help);
+        fprintf(fp, "# TYPE " METRICS_PREFIX "%s%s %s\n", d->name, suffix,
+                d->type == METRIC_COUNTER ? "counter" : "gauge");
+        fprintf(fp, METRICS_PREFIX "%s%s{client=\"%s\"} %lld\n", d->name, suffix, client_id, metrics_get(i));
+    }
+
+    for (int i = 0; i < H_MAX; i++) {
+        h = &hists[i];
+        cumulative = 0;
+        fprintf(fp, "# HELP " METRICS_PREFIX "%s %s\n", hist_names[i], hist_helps[i]);
+        fprintf(fp, "# TYPE " METRICS_PREFIX "%s histogram\n", hist_names[i]);
+        for (int b = 0; b < METRICS_HIST_BUCKETS - 1; b++) {
+            cumulative += atomic_load(&h->buckets[b]);
+            fprintf(fp, METRICS_PREFIX "%s_bucket{client=\"%s\",le=\"%llu\"} %llu\n",
+                    hist_names[i], client_id, (1ULL << b) - 1, cumulative);
+        }
+        fprintf(fp, METRICS_PREFIX "%s_bucket{client=\"%s\",le=\"+Inf\"} %llu\n",
+                hist_names[i], client_id, atomic_load(&h->count));
+        fprintf(fp, METRICS_PREFIX "%s_sum{client=\"%s\"} %llu\n", hist_names[i], client_id, atomic_load(&h->sum));
+        fprintf(fp, METRICS_PREFIX "%s_count{client=\"%s\"} %llu\n", hist_names[i], client_id, atomic_load(&h->count));
+    }
+
+    fclose(fp);
+    if (rename(tmp_path, path)) {
+        fprintf(stderr, "Can't move metrics file to %s\n", path);
+        return -1;
+    }
+    return 0;
+}
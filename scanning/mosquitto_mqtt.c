@@ -4,21 +4,46 @@
 #include <stdio.h>
 #include "mosquitto_mqtt.h"
 #include "utils.h"
+#include "metrics.h"
+#include "trace.h"
 #include <stdlib.h>
 #include <unistd.h>
 #include <pthread.h>
 
-static struct mqtt_ctx
+struct mqtt_inflight {
+    int mid;
+    long long sent_us;
+};
+
+struct mqtt_alias {
+    char name[MAX_TOPIC_LEN];
+    int sent; // broker knows the mapping on this connection
+};
+
+struct mqtt_client
 {
     struct mosquitto *mosquitto;
     struct mosquitto_conf config;
     topic_t *sub_topics;
-    mqtt_cb on_message;
-    int cb_count;
+    mqtt_client_cb on_message;
+    void *userdata;
+    struct threads_shared *shared; // connect state and stop flag of whoever runs this client
     pthread_mutex_t lock;
-} *ctx;
 
-extern struct threads_shared shared;
+    // publish window, recursive since QoS 0 publish callback can fire inside mosquitto_publish
+    pthread_mutex_t pub_lock;
+    int protocol;
+    int alias_max; // from CONNACK, 0 - broker doesn't accept aliases
+    struct mqtt_alias aliases[MQTT_MAX_ALIASES];
+    struct mqtt_inflight inflight[MQTT_INFLIGHT_LIMIT];
+    int window; // in-flight MQTT_PUB_WINDOW messages
+    struct mqtt_pub_stats stats;
+    long long stats_print_time;
+};
+
+// the scanner's own connection, behind the mqtt_*() calls
+static struct mqtt_client *ctx;
+static mqtt_cb ctx_on_message;
 
 int mqtt_is_sub_match(char *sub, char *topic)
 {
@@ -28,49 +53,148 @@ int mqtt_is_sub_match(char *sub, char *topic)
     return match_res;
 }
 
-int mqtt_subscribe_topic(topic_t topic)
+int mqtt_client_subscribe(struct mqtt_client *c, topic_t topic)
 {
-    pthread_mutex_lock(&ctx->lock);
-    int ret = mosquitto_subscribe(ctx->mosquitto, NULL, topic.name, topic.qos);
+    pthread_mutex_lock(&c->lock);
+    int ret = mosquitto_subscribe(c->mosquitto, NULL, topic.name, topic.qos);
 
     if (ret != MOSQ_ERR_SUCCESS)
         fprintf(stderr, "Failed subscription: %s, %s\n", topic.name, mosquitto_strerror(ret));
 
     // printf("subscribe topic: %s qos: %d\n", topic.name, topic.qos);
-    pthread_mutex_unlock(&ctx->lock);
+    pthread_mutex_unlock(&c->lock);
     return ret;
 }
 
-int mqtt_publish_topic(topic_t topic, payload_t payload)
+// returns alias slot for topic, -1 if aliases can't be used
+static int mqtt_get_alias(struct mqtt_client *c, const char *topic)
+{
+    for (int i = 0; i < MQTT_MAX_ALIASES && i < c->alias_max; i++) {
+        if (!strlen(c->aliases[i].name)) {
+            strncpy(c->aliases[i].name, topic, MAX_TOPIC_LEN - 1);
+            return i;
+        }
+        if (!strcmp(c->aliases[i].name, topic))
+            return i;
+    }
+    return -1;
+}
+
+static void mqtt_track_inflight(struct mqtt_client *c, int mid, int windowed)
+{
+    struct mqtt_inflight *entry = &c->inflight[mid % MQTT_INFLIGHT_LIMIT];
+
+    entry->mid = windowed ? mid : -mid;
+    entry->sent_us = time_mono_us();
+    c->stats.inflight++;
+    if (windowed)
+        c->window++;
+    metrics_set(M_MQTT_INFLIGHT, c->stats.inflight);
+}
+
+int mqtt_client_publish(struct mqtt_client *c, topic_t topic, payload_t payload)
 {
-    pthread_mutex_lock(&ctx->lock);
+    pthread_mutex_lock(&c->lock);
+    pthread_mutex_lock(&c->pub_lock);
     int message_id;
+    int alias = -1;
+    const char *name = topic.name;
+    mosquitto_property *props = NULL;
+    int ret;
 
-    // printf("publish topic: %s len: %d\n", topic.name, payload.len);
-    int ret = mosquitto_publish(ctx->mosquitto, &message_id, topic.name,
-                                payload.len, payload.data, topic.qos, false);
+    if ((topic.flags & MQTT_PUB_WINDOW) && c->window >= c->config.max_inflight) {
+        c->stats.dropped++;
+        metrics_inc(M_MQTT_DROPPED);
+        ret = MQTT_ERR_WINDOW_FULL;
+        goto out;
+    }
 
-    if (ret)
-        fprintf(stderr, "Failed publish: %s, %s\n", topic.name, mosquitto_strerror(ret));
-    else
-        ret = message_id;
+    if (c->protocol == MQTT_PROTO_V5) {
+        if ((topic.flags & MQTT_PUB_EXPIRE) && c->config.msg_expiry > 0)
+            mosquitto_property_add_int32(&props, MQTT_PROP_MESSAGE_EXPIRY_INTERVAL, c->config.msg_expiry);
+
+        // see MQTT_PUB_ALIAS, ignored for QoS >= 1
+        if ((topic.flags & MQTT_PUB_ALIAS) && topic.qos == 0 && (alias = mqtt_get_alias(c, topic.name)) >= 0) {
+            mosquitto_property_add_int16(&props, MQTT_PROP_TOPIC_ALIAS, alias + 1);
+            if (c->aliases[alias].sent)
+                name = "";
+        }
+    }
+
+    // printf("publish topic: %s len: %d\n", topic.name, payload.len);
+    ret = mosquitto_publish_v5(c->mosquitto, &message_id, name,
+                               payload.len, payload.data, topic.qos, false, props);
+    mosquitto_property_free_all(&props);
+
+    if (ret) {
+        if (!c->config.quiet)
+            fprintf(stderr, "Failed publish: %s, %s\n", topic.name, mosquitto_strerror(ret));
+        ret = MQTT_ERR_PUBLISH;
+        goto out;
+    }
 
-    pthread_mutex_unlock(&ctx->lock);
+    if (alias >= 0)
+        c->aliases[alias].sent = 1;
+    if (topic.qos > 0)
+        mqtt_track_inflight(c, message_id, topic.flags & MQTT_PUB_WINDOW);
+    c->stats.published++;
+    metrics_inc(M_MQTT_PUBLISHED);
+    ret = message_id;
+out:
+    pthread_mutex_unlock(&c->pub_lock);
+    pthread_mutex_unlock(&c->lock);
     return ret;
 }
 
-void mqtt_cleanup()
+int mqtt_client_get_pub_stats(struct mqtt_client *c, struct mqtt_pub_stats *stats)
 {
-    if (!ctx)
+    if (!c || !stats)
+        return MOSQ_ERR_INVAL;
+
+    pthread_mutex_lock(&c->pub_lock);
+    memcpy(stats, &c->stats, sizeof(struct mqtt_pub_stats));
+    stats->protocol = c->protocol;
+    stats->max_inflight = c->config.max_inflight;
+    pthread_mutex_unlock(&c->pub_lock);
+    return MOSQ_ERR_SUCCESS;
+}
+
+static void mqtt_print_pub_stats(struct mqtt_client *c)
+{
+    struct mqtt_pub_stats st;
+
+    if (time_elapsed_ms(c->stats_print_time) < MQTT_STATS_PRINT_SEC * 1000)
         return;
-    if (ctx->mosquitto)
-        mosquitto_destroy(ctx->mosquitto);
-    pthread_mutex_destroy(&ctx->lock);
-    mosquitto_lib_cleanup();
-    free(ctx);
+    c->stats_print_time = time_millis();
+
+    mqtt_client_get_pub_stats(c, &st);
+    if (!st.published)
+        return;
+
+    printf("MQTT %s: in-flight %d (window %d), published %llu, acked %llu, dropped %llu, resent %llu, "
+           "ack latency avg %.2f ms min %.2f ms max %.2f ms\n",
+           st.protocol == MQTT_PROTO_V5 ? "v5" : "v3.1.1", st.inflight, st.max_inflight,
+           (unsigned long long)st.published, (unsigned long long)st.acked,
+           (unsigned long long)st.dropped, (unsigned long long)st.resent,
+           st.acked ? st.ack_sum_us / 1000.0 / st.acked : 0.0,
+           st.ack_min_us / 1000.0, st.ack_max_us / 1000.0);
+}
+
+void mqtt_client_free(struct mqtt_client *c)
+{
+    if (!c)
+        return;
+    if (c->mosquitto) {
+        // no-op unless mqtt_client_start() ran, forced so nothing is sent on the way out
+        mosquitto_loop_stop(c->mosquitto, true);
+        mosquitto_destroy(c->mosquitto);
+    }
+    pthread_mutex_destroy(&c->lock);
+    pthread_mutex_destroy(&c->pub_lock);
+    free(c);
 }
 
-static int mqtt_read_config(char *path)
+int mqtt_read_config(const char *path, struct mosquitto_conf *conf)
 {
     FILE *fp;
     size_t len;
@@ -80,6 +204,11 @@ static int mqtt_read_config(char *path)
     // for strtol
     char *end;
     long val;
+
+    conf->protocol = MQTT_PROTO_V5;
+    conf->max_inflight = MQTT_DEFAULT_MAX_INFLIGHT;
+    conf->msg_expiry = MQTT_DEFAULT_MSG_EXPIRY;
+
     fp = fopen(path, "r");
     if (fp == NULL)
     {
@@ -101,22 +230,47 @@ static int mqtt_read_config(char *path)
 
         if (strcmp(key, "HOST") == 0)
         {
-            ctx->config.host = strdup(value);
-            ctx->config.host[count - 1] = '\0';
+            conf->host = strdup(value);
         }
         else if (strcmp(key, "PORT") == 0)
         {
-            ctx->config.port = (int)strtol(value, &end, 10);
+            conf->port = (int)strtol(value, &end, 10);
         }
         else if (strcmp(key, "USERNAME") == 0)
         {
-            ctx->config.username = strdup(value);
-            ctx->config.username[count - 1] = '\0';
+            conf->username = strdup(value);
         }
         else if (strcmp(key, "PASSWORD") == 0)
         {
-            ctx->config.password = strdup(value);
-            ctx->config.password[count - 1] = '\0';
+            conf->password = strdup(value);
+        }
+        else if (strcmp(key, "PROTOCOL") == 0)
+        {
+            // protocol level (4, 5) or version (311)
+            val = strtol(value, &end, 10);
+            if (*end == '\0' && (val == MQTT_PROTO_V311 || val == 311))
+                conf->protocol = MQTT_PROTO_V311;
+            else if (*end == '\0' && val == MQTT_PROTO_V5)
+                conf->protocol = MQTT_PROTO_V5;
+            else
+            {
+                fprintf(stderr, "Invalid PROTOCOL in MQTT config: %s (4 or 311 for 3.1.1, 5 for v5)\n", value);
+                goto err;
+            }
+        }
+        else if (strcmp(key, "MAX_INFLIGHT") == 0)
+        {
+            val = strtol(value, &end, 10);
+            if (val > 0 && val <= MQTT_INFLIGHT_LIMIT / 2)
+                conf->max_inflight = (int)val;
+            else
+                fprintf(stderr, "MAX_INFLIGHT out of range (1-%d), using %d\n",
+                        MQTT_INFLIGHT_LIMIT / 2, conf->max_inflight);
+        }
+        else if (strcmp(key, "MSG_EXPIRY") == 0)
+        {
+            val = strtol(value, &end, 10);
+            conf->msg_expiry = val > 0 ? (int)val : 0;
         }
         else
         {
@@ -128,48 +282,147 @@ static int mqtt_read_config(char *path)
 
     fclose(fp);
 
-    if (!ctx->config.host || !ctx->config.port)
+    if (!conf->host || !conf->port)
     {
         fprintf(stderr, "Broker host or port not set, check MQTT config.\n");
         return -1;
     }
 
     return 0;
+err:
+    free(line);
+    fclose(fp);
+    return -1;
 }
 
 static void mqtt_on_message(struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg)
 {
-    if (!ctx->on_message)
+    struct mqtt_client *c = obj;
+
+    if (!c->on_message)
         return;
-    ctx->on_message(msg->topic, msg->payload, msg->payloadlen);
+    c->on_message(c->userdata, msg->topic, msg->payload, msg->payloadlen);
 }
 
-static void mqtt_on_connect(struct mosquitto *mosquitto, void *obj, int reason_code)
+// new connection, the broker forgot aliases. Unacked QoS 1 messages are resent by libmosquitto,
+// they stay tracked and in the window until their PUBACK
+static void mqtt_reset_session(struct mqtt_client *c, const mosquitto_property *props)
 {
-    int ret;
+    u_int16_t alias_max = 0;
+
+    pthread_mutex_lock(&c->pub_lock);
+    if (c->protocol == MQTT_PROTO_V5)
+        mosquitto_property_read_int16(props, MQTT_PROP_TOPIC_ALIAS_MAXIMUM, &alias_max, false);
+    c->alias_max = alias_max;
+    memset(c->aliases, 0, sizeof(c->aliases));
+
+    c->stats.resent += c->stats.inflight;
+    metrics_add(M_MQTT_RESENT, c->stats.inflight);
+    pthread_mutex_unlock(&c->pub_lock);
+}
+
+static void mqtt_on_connect(struct mosquitto *mosquitto, void *obj, int reason_code, int flags,
+                            const mosquitto_property *props)
+{
+    struct mqtt_client *c = obj;
+    struct threads_shared *shared = c->shared;
+
     if (reason_code != 0)
     {
+        // 3.1.1 brokers answer v5 CONNECT with "unacceptable protocol version", retry with 3.1.1 on reconnect
+        if (c->protocol == MQTT_PROTO_V5 &&
+            (reason_code == CONNACK_REFUSED_PROTOCOL_VERSION || reason_code == MQTT_RC_UNSUPPORTED_PROTOCOL_VERSION))
+        {
+            if (!c->config.quiet)
+                printf("Broker doesn't support MQTT v5, falling back to 3.1.1\n");
+            c->protocol = MQTT_PROTO_V311;
+            mosquitto_int_option(c->mosquitto, MOSQ_OPT_PROTOCOL_VERSION, MQTT_PROTOCOL_V311);
+        }
         return;
     }
-    for (int i = 0; i < MQTT_MAX_TOPICS; i++)
+    mqtt_reset_session(c, props);
+    if (!c->config.quiet)
+        printf("Connected to broker (MQTT %s, topic alias max %d)\n",
+               c->protocol == MQTT_PROTO_V5 ? "v5" : "v3.1.1", c->alias_max);
+
+    pthread_mutex_lock(&shared->lock);
+    if (!shared->connected_us)
+        shared->connected_us = time_mono_us();
+    shared->connected = 1;
+    pthread_cond_broadcast(&shared->cond);
+    pthread_mutex_unlock(&shared->lock);
+
+    for (int i = 0; c->sub_topics && i < MQTT_MAX_TOPICS; i++)
     {
-        if (!strlen(ctx->sub_topics[i].name))
+        if (!strlen(c->sub_topics[i].name))
             break;
-        mqtt_subscribe_topic(ctx->sub_topics[i]);
+        mqtt_client_subscribe(c, c->sub_topics[i]);
     }
 }
 
-static void mqtt_on_publish(struct mosquitto *mosquitto, void *obj, int message_id)
+// only reached through the library's own loop thread, mqtt_client_run() notices the loss itself
+static void mqtt_on_disconnect(struct mosquitto *mosquitto, void *obj, int reason_code,
+                               const mosquitto_property *props)
+{
+    struct mqtt_client *c = obj;
+
+    // no aliases until the next CONNACK says how many the broker takes
+    pthread_mutex_lock(&c->pub_lock);
+    c->alias_max = 0;
+    memset(c->aliases, 0, sizeof(c->aliases));
+    pthread_mutex_unlock(&c->pub_lock);
+
+    pthread_mutex_lock(&c->shared->lock);
+    c->shared->connected = 0;
+    pthread_mutex_unlock(&c->shared->lock);
+}
+
+static void mqtt_on_publish(struct mosquitto *mosquitto, void *obj, int message_id, int reason_code,
+                            const mosquitto_property *props)
 {
-    // stub
+    struct mqtt_client *c = obj;
+    struct mqtt_inflight *entry;
+    long long latency;
+
+    pthread_mutex_lock(&c->pub_lock);
+    entry = &c->inflight[message_id % MQTT_INFLIGHT_LIMIT];
+
+    // QoS 0 messages aren't tracked
+    if (entry->mid != message_id && entry->mid != -message_id)
+        goto out;
+
+    latency = time_mono_us() - entry->sent_us;
+    if (entry->mid > 0)
+        c->window--;
+    c->stats.inflight--;
+    entry->mid = 0;
+
+    if (reason_code >= 0x80)
+        c->stats.nacked++;
+    c->stats.acked++;
+    c->stats.ack_last_us = latency;
+    c->stats.ack_sum_us += latency;
+    if (latency > c->stats.ack_max_us)
+        c->stats.ack_max_us = latency;
+    if (latency < c->stats.ack_min_us || c->stats.ack_min_us == 0)
+        c->stats.ack_min_us = latency;
+
+    metrics_inc(M_MQTT_ACKED);
+    metrics_set(M_MQTT_INFLIGHT, c->stats.inflight);
+    metrics_observe(H_MQTT_ACK_US, latency);
+    TRACE_OBSERVE(TR_ACK, latency);
+
+    wfs_debug("mid %d acked in %lld us (reason %d)\n", message_id, latency, reason_code);
+out:
+    pthread_mutex_unlock(&c->pub_lock);
 }
 
-static int mqtt_setup_login()
+static int mqtt_setup_login(struct mqtt_client *c)
 {
     int ret;
 
     // safe to not check user/pass
-    if ((ret = mosquitto_username_pw_set(ctx->mosquitto, ctx->config.username, ctx->config.password)) != MOSQ_ERR_SUCCESS)
+    if ((ret = mosquitto_username_pw_set(c->mosquitto, c->config.username, c->config.password)) != MOSQ_ERR_SUCCESS)
     {
         // syslog(LOG_ERR, "User settings error");
         fprintf(stderr,"MQTT user settings error (%d)\n", ret);
@@ -179,16 +432,10 @@ static int mqtt_setup_login()
 }
 // TODO mosquitto tls setup
 
-const char *mqtt_get_user()
-{
-    // Won't be changing, reading only so no locks here
-    return ctx->config.username;
-}
-
-int mqtt_set_will(topic_t will)
+int mqtt_client_set_will(struct mqtt_client *c, topic_t will)
 {
     int ret;
-    if ((ret = mosquitto_will_set(ctx->mosquitto, will.name, 0, NULL, will.qos, false)))
+    if ((ret = mosquitto_will_set(c->mosquitto, will.name, 0, NULL, will.qos, false)))
     {
         fprintf(stderr, "MQTT will set error: %s\n", mosquitto_strerror(ret));
         return ret;
@@ -196,41 +443,47 @@ int mqtt_set_will(topic_t will)
     return MOSQ_ERR_SUCCESS;
 }
 
-int mqtt_set_sub_topics(topic_t *topics)
+void mqtt_client_set_sub_topics(struct mqtt_client *c, topic_t *topics)
 {
-    ctx->sub_topics = topics;
+    c->sub_topics = topics;
 }
 
-int mqtt_setup(char *mqtt_conf_path, mqtt_cb on_msg_cb)
+struct mqtt_client *mqtt_client_new(const struct mosquitto_conf *conf, const char *id,
+                                    mqtt_client_cb on_msg_cb, void *userdata, struct threads_shared *shared)
 {
-    int ret;
-    if (ctx && ctx->mosquitto)
-        return MOSQ_ERR_ALREADY_EXISTS;
-    ctx = malloc(sizeof(struct mqtt_ctx));
-    memset(ctx, 0, sizeof(struct mqtt_ctx));
-    pthread_mutex_init(&ctx->lock, NULL);
+    struct mqtt_client *c;
+    pthread_mutexattr_t attr;
 
-    if ((ret = mosquitto_lib_init()) != MOSQ_ERR_SUCCESS)
-    {
-        fprintf(stderr, "Can't initialize mosquitto lib\n");
-        return ret;
-    }
+    if (!(c = calloc(1, sizeof(struct mqtt_client))))
+        return NULL;
+    pthread_mutex_init(&c->lock, NULL);
 
-    ctx->on_message = on_msg_cb;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&c->pub_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
 
-    if (( ret = mqtt_read_config(mqtt_conf_path)))
-        return MOSQ_ERR_INVAL;
+    c->config = *conf; // strings stay the caller's
+    c->on_message = on_msg_cb;
+    c->userdata = userdata;
+    c->shared = shared;
 
-    ctx->mosquitto = mosquitto_new(NULL, true, NULL);
-    if ((ret = mqtt_setup_login()) != MOSQ_ERR_SUCCESS)
-        return ret;
+    // the library hands the client back as obj in every callback
+    if (!(c->mosquitto = mosquitto_new(id, true, c)) || mqtt_setup_login(c) != MOSQ_ERR_SUCCESS)
+    {
+        mqtt_client_free(c);
+        return NULL;
+    }
 
-    mosquitto_connect_callback_set(ctx->mosquitto, mqtt_on_connect);
-    mosquitto_message_callback_set(ctx->mosquitto, mqtt_on_message);
-    mosquitto_publish_callback_set(ctx->mosquitto, mqtt_on_publish);
+    c->protocol = c->config.protocol;
+    mosquitto_int_option(c->mosquitto, MOSQ_OPT_PROTOCOL_VERSION,
+                         c->protocol == MQTT_PROTO_V5 ? MQTT_PROTOCOL_V5 : MQTT_PROTOCOL_V311);
 
-    printf("MQTT setup done\n");
-    return MOSQ_ERR_SUCCESS;
+    mosquitto_connect_v5_callback_set(c->mosquitto, mqtt_on_connect);
+    mosquitto_disconnect_v5_callback_set(c->mosquitto, mqtt_on_disconnect);
+    mosquitto_message_callback_set(c->mosquitto, mqtt_on_message);
+    mosquitto_publish_v5_callback_set(c->mosquitto, mqtt_on_publish);
+    return c;
 }
 
 static int mqtt_try_reconnect(struct mosquitto *mosquitto, int retry_count)
@@ -246,31 +499,36 @@ static int mqtt_try_reconnect(struct mosquitto *mosquitto, int retry_count)
     return MOSQ_ERR_CONN_LOST;
 }
 
-static void mqtt_loop()
+static void mqtt_loop(struct mqtt_client *c)
 {
+    struct threads_shared *shared = c->shared;
     int ret;
 
     while (1)
     {
-        pthread_mutex_lock(&shared.lock);
-        if (shared.stop)
+        pthread_mutex_lock(&shared->lock);
+        if (shared->stop)
         {
             printf("Stop MQTT thread\n");
-            pthread_mutex_unlock(&shared.lock);
+            pthread_mutex_unlock(&shared->lock);
             break;
         }
-        pthread_mutex_unlock(&shared.lock);
+        pthread_mutex_unlock(&shared->lock);
 
-        ret = mosquitto_loop(ctx->mosquitto, -1, 1);
+        ret = mosquitto_loop(c->mosquitto, -1, 1);
+        mqtt_print_pub_stats(c);
         if (ret == MOSQ_ERR_SUCCESS)
             continue;
         switch (ret)
         {
         case MOSQ_ERR_CONN_LOST:
             fprintf(stderr, "Lost connection to broker\n");
+            pthread_mutex_lock(&shared->lock);
+            shared->connected = 0;
+            pthread_mutex_unlock(&shared->lock);
             continue;
         case MOSQ_ERR_NO_CONN:
-            if (mqtt_try_reconnect(ctx->mosquitto, CONN_RETRY_CNT) != MOSQ_ERR_SUCCESS)
+            if (mqtt_try_reconnect(c->mosquitto, CONN_RETRY_CNT) != MOSQ_ERR_SUCCESS)
             {
                 fprintf(stderr, "Couldn't reconnect to broker after multiple attemps, exiting\n");
             } else continue;
@@ -283,27 +541,136 @@ static void mqtt_loop()
         // i can just write returns in each of these cases, or just put the whole switch in this
         // conditional, but eh
         if (ret != MOSQ_ERR_SUCCESS) {
-            shared.stop = 1;
+            pthread_mutex_lock(&shared->lock);
+            shared->stop = 1;
+            pthread_cond_broadcast(&shared->cond); // main thread may be waiting for reg ack
+            pthread_mutex_unlock(&shared->lock);
             return;
         }
     }
 }
 
-int mqtt_run()
+int mqtt_client_run(struct mqtt_client *c)
 {
     int ret;
-    if (!ctx || !ctx->mosquitto)
+    if (!c || !c->mosquitto)
         return MOSQ_ERR_INVAL;
 
     printf("Start MQTT\n");
-    if ((ret = mosquitto_connect(ctx->mosquitto, ctx->config.host, ctx->config.port, 10)) != MOSQ_ERR_SUCCESS)
+    if ((ret = mosquitto_connect(c->mosquitto, c->config.host, c->config.port, 10)) != MOSQ_ERR_SUCCESS)
     {
         fprintf(stderr, "Can't connect to broker\n");
+        pthread_mutex_lock(&c->shared->lock);
+        c->shared->stop = 1;
+        pthread_cond_broadcast(&c->shared->cond);
+        pthread_mutex_unlock(&c->shared->lock);
+        return ret;
+    }
+
+    mqtt_loop(c);
+
+    mosquitto_disconnect(c->mosquitto);
+    return MOSQ_ERR_SUCCESS;
+}
+
+int mqtt_client_start(struct mqtt_client *c)
+{
+    int ret;
+
+    // the library's thread keeps reconnecting on its own, up to a few seconds apart
+    mosquitto_reconnect_delay_set(c->mosquitto, 1, 5, true);
+    if ((ret = mosquitto_connect_async(c->mosquitto, c->config.host, c->config.port, 10)) != MOSQ_ERR_SUCCESS)
+        return ret;
+    return mosquitto_loop_start(c->mosquitto);
+}
+
+int mqtt_client_stop(struct mqtt_client *c, int with_will)
+{
+    int ret;
+
+    // v5 can ask the broker to send the will anyway, like it would after a crash
+    if (with_will && c->protocol == MQTT_PROTO_V5)
+        ret = mosquitto_disconnect_v5(c->mosquitto, MQTT_RC_DISCONNECT_WITH_WILL_MSG, NULL);
+    else
+        ret = mosquitto_disconnect(c->mosquitto);
+    mosquitto_loop_stop(c->mosquitto, false);
+    return ret;
+}
+
+// scanner side, one connection per process
+
+static void mqtt_ctx_on_message(void *userdata, const char *topic, void *data, u_int32_t len)
+{
+    if (ctx_on_message)
+        ctx_on_message(topic, data, len);
+}
+
+int mqtt_setup(char *mqtt_conf_path, mqtt_cb on_msg_cb, struct threads_shared *shared)
+{
+    static struct mosquitto_conf conf;
+    int ret;
+    if (ctx)
+        return MOSQ_ERR_ALREADY_EXISTS;
+
+    if ((ret = mosquitto_lib_init()) != MOSQ_ERR_SUCCESS)
+    {
+        fprintf(stderr, "Can't initialize mosquitto lib\n");
         return ret;
     }
 
-    mqtt_loop();
+    if (( ret = mqtt_read_config(mqtt_conf_path, &conf)))
+        return MOSQ_ERR_INVAL;
+
+    ctx_on_message = on_msg_cb;
+    if (!(ctx = mqtt_client_new(&conf, NULL, mqtt_ctx_on_message, NULL, shared)))
+        return MOSQ_ERR_NOMEM;
 
-    mosquitto_disconnect(ctx->mosquitto);
+    printf("MQTT setup done\n");
     return MOSQ_ERR_SUCCESS;
-}
\ No newline at end of file
+}
+
+int mqtt_subscribe_topic(topic_t topic)
+{
+    return mqtt_client_subscribe(ctx, topic);
+}
+
+int mqtt_publish_topic(topic_t topic, payload_t payload)
+{
+    return mqtt_client_publish(ctx, topic, payload);
+}
+
+int mqtt_get_pub_stats(struct mqtt_pub_stats *stats)
+{
+    return mqtt_client_get_pub_stats(ctx, stats);
+}
+
+int mqtt_set_will(topic_t will)
+{
+    return mqtt_client_set_will(ctx, will);
+}
+
+int mqtt_set_sub_topics(topic_t *topics)
+{
+    mqtt_client_set_sub_topics(ctx, topics);
+    return 0;
+}
+
+const char *mqtt_get_user()
+{
+    // Won't be changing, reading only so no locks here
+    return ctx->config.username;
+}
+
+int mqtt_run()
+{
+    return mqtt_client_run(ctx);
+}
+
+void mqtt_cleanup()
+{
+    if (!ctx)
+        return;
+    mqtt_client_free(ctx);
+    ctx = NULL;
+    mosquitto_lib_cleanup();
+}
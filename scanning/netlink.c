@@ -1,4 +1,5 @@
 #include "netlink.h"
+#include "metrics.h"
 
 int netlink_init(struct nl80211_data *nl, char *iface)
 {
@@ -37,7 +38,7 @@ free:
     return ret;
 }
 
-int netlink_deint(struct nl80211_data *nl)
+int netlink_deinit(struct nl80211_data *nl)
 {
     if (!nl || !nl->sock)
         return -EINVAL;
@@ -64,7 +65,7 @@ int netlink_switch_chan(struct nl80211_data *nl, int chan)
     }
     else if (chan >= 36 && chan <= 161)
     {
-        // TODO: handle 5ghz
+        freq = 5000 + (chan * 5);
     }
     else
     {
@@ -72,7 +73,7 @@ int netlink_switch_chan(struct nl80211_data *nl, int chan)
     }
     // nl_socket_modify_cb(nl->sock, NL_CB_VALID, NL_CB_CUSTOM, msg_valid, NULL);
     // printf("Set channel %d\n", chan);
-    float time = time_millis();
+    long long start = time_mono_us();
     struct nl_msg *msg = nlmsg_alloc();
     genlmsg_put(msg, 0, 0, nl->id, 0, 0, NL80211_CMD_SET_CHANNEL, 0);
 
@@ -80,14 +81,334 @@ int netlink_switch_chan(struct nl80211_data *nl, int chan)
     NLA_PUT_U32(msg, NL80211_ATTR_WIPHY_FREQ, freq);
 
     ret = nl_send_auto(nl->sock, msg);
-    nl_recvmsgs_default(nl->sock);
+    if (ret >= 0)
+        ret = nl_recvmsgs_default(nl->sock);
     // printf("nlmsg send and receive took: %f ms\n", time_millis() - time);
     nlmsg_free(msg);
     msleep(10); // 10 ms wait
+
+    metrics_inc(M_CHAN_SWITCHES);
+    metrics_observe(H_CHAN_SWITCH_US, time_mono_us() - start);
+    if (ret < 0) {
+        metrics_inc(M_CHAN_SWITCH_ERRORS);
+        fprintf(stderr, "Failed to switch to channel %d: %s\n", chan, nl_geterror(ret));
+        return ret;
+    }
     return 0;
 
+nla_put_failure:
+    metrics_inc(M_CHAN_SWITCH_ERRORS);
+    nlmsg_free(msg);
+    fprintf(stderr, "%s() put failure\n", __func__);
+    return -1;
+}
+static int survey_cb(struct nl_msg *msg, void *arg)
+{
+    struct netlink_survey *survey = arg;
+    struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
+    struct nlattr *tb[NL80211_ATTR_MAX + 1];
+    struct nlattr *sinfo[NL80211_SURVEY_INFO_MAX + 1];
+
+    nla_parse(tb, NL80211_ATTR_MAX, genlmsg_attrdata(gnlh, 0), genlmsg_attrlen(gnlh, 0), NULL);
+    if (!tb[NL80211_ATTR_SURVEY_INFO])
+        return NL_SKIP;
+    if (nla_parse_nested(sinfo, NL80211_SURVEY_INFO_MAX, tb[NL80211_ATTR_SURVEY_INFO], NULL))
+        return NL_SKIP;
+
+    // dump has every channel the driver knows about, only one is wanted
+    if (!sinfo[NL80211_SURVEY_INFO_FREQUENCY] ||
+        (int)nla_get_u32(sinfo[NL80211_SURVEY_INFO_FREQUENCY]) != survey->freq)
+        return NL_SKIP;
+
+    if (sinfo[NL80211_SURVEY_INFO_NOISE]) {
+        survey->noise = (int8_t)nla_get_u8(sinfo[NL80211_SURVEY_INFO_NOISE]);
+        survey->flags |= NL_SURVEY_NOISE;
+    }
+    if (sinfo[NL80211_SURVEY_INFO_TIME]) {
+        survey->active_ms = nla_get_u64(sinfo[NL80211_SURVEY_INFO_TIME]);
+        survey->flags |= NL_SURVEY_TIME;
+    }
+    if (sinfo[NL80211_SURVEY_INFO_TIME_BUSY])
+        survey->busy_ms = nla_get_u64(sinfo[NL80211_SURVEY_INFO_TIME_BUSY]);
+    if (sinfo[NL80211_SURVEY_INFO_TIME_RX])
+        survey->rx_ms = nla_get_u64(sinfo[NL80211_SURVEY_INFO_TIME_RX]);
+    if (sinfo[NL80211_SURVEY_INFO_TIME_TX])
+        survey->tx_ms = nla_get_u64(sinfo[NL80211_SURVEY_INFO_TIME_TX]);
+
+    return NL_SKIP;
+}
+
+// returns 0 if the driver had anything for freq, survey->flags tells what
+int netlink_get_survey(struct nl80211_data *nl, int freq, struct netlink_survey *survey)
+{
+    struct nl_msg *msg;
+    struct nl_cb *cb;
+    int ret;
+
+    if (!nl || !nl->sock)
+        return -EINVAL;
+
+    memset(survey, 0, sizeof(*survey));
+    survey->freq = freq;
+
+    cb = nl_cb_alloc(NL_CB_DEFAULT);
+    msg = nlmsg_alloc();
+    if (!cb || !msg) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    genlmsg_put(msg, 0, 0, nl->id, 0, NLM_F_DUMP, NL80211_CMD_GET_SURVEY, 0);
+    NLA_PUT_U32(msg, NL80211_ATTR_IFINDEX, nl->ifindex);
+    nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, survey_cb, survey);
+
+    ret = nl_send_auto(nl->sock, msg);
+    if (ret >= 0)
+        ret = nl_recvmsgs(nl->sock, cb);
+    if (ret >= 0)
+        ret = survey->flags ? 0 : -ENOENT;
+    goto out;
+
+nla_put_failure:
+    fprintf(stderr, "%s() put failure\n", __func__);
+    ret = -1;
+out:
+    nlmsg_free(msg);
+    nl_cb_put(cb);
+    return ret;
+}
+
+static int scan_event_cb(struct nl_msg *msg, void *arg)
+{
+    struct nl80211_scan *scan = arg;
+    struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
+    struct nlattr *tb[NL80211_ATTR_MAX + 1];
+
+    nla_parse(tb, NL80211_ATTR_MAX, genlmsg_attrdata(gnlh, 0), genlmsg_attrlen(gnlh, 0), NULL);
+    // the group carries every interface's scans
+    if (!tb[NL80211_ATTR_IFINDEX] || (int)nla_get_u32(tb[NL80211_ATTR_IFINDEX]) != scan->nl.ifindex)
+        return NL_SKIP;
+
+    switch (gnlh->cmd)
+    {
+    case NL80211_CMD_NEW_SCAN_RESULTS:
+        scan->status = NL_SCAN_DONE;
+        break;
+    case NL80211_CMD_SCAN_ABORTED:
+        scan->status = NL_SCAN_ABORTED;
+        break;
+    default:
+        break;
+    }
+    return NL_SKIP;
+}
+
+int netlink_scan_init(struct nl80211_scan *scan, char *iface)
+{
+    int ret, grp;
+
+    if ((ret = netlink_init(&scan->nl, iface)))
+        return ret;
+
+    scan->events = nl_socket_alloc();
+    if (!scan->events)
+    {
+        ret = -ENOMEM;
+        goto free;
+    }
+    // events aren't answers to anything we sent
+    nl_socket_disable_seq_check(scan->events);
+    nl_socket_modify_cb(scan->events, NL_CB_VALID, NL_CB_CUSTOM, scan_event_cb, scan);
+
+    if ((ret = genl_connect(scan->events)))
+        goto free_events;
+    if ((grp = genl_ctrl_resolve_grp(scan->events, "nl80211", "scan")) < 0 ||
+        (ret = nl_socket_add_membership(scan->events, grp)))
+    {
+        fprintf(stderr, "Failed to join nl80211 scan group\n");
+        ret = -ENOENT;
+        goto free_events;
+    }
+    nl_socket_set_nonblocking(scan->events);
+    return 0;
+
+free_events:
+    nl_socket_free(scan->events);
+    scan->events = NULL;
+free:
+    netlink_deinit(&scan->nl);
+    return ret;
+}
+
+void netlink_scan_deinit(struct nl80211_scan *scan)
+{
+    if (!scan || !scan->events)
+        return;
+
+    nl_socket_free(scan->events);
+    scan->events = NULL;
+    netlink_deinit(&scan->nl);
+}
+
+// returns once the driver accepted the scan, netlink_scan_poll() tells when it's done
+int netlink_scan_trigger(struct nl80211_scan *scan, int *freqs, int n)
+{
+    struct nlattr *nest;
+    struct nl_msg *msg;
+    int ret;
+
+    if (!scan || !scan->events)
+        return -EINVAL;
+
+    // whatever finished since the last search, ours or someone else's, is stale
+    while (nl_recvmsgs_default(scan->events) >= 0)
+        ;
+    scan->status = NL_SCAN_RUNNING;
+
+    msg = nlmsg_alloc();
+    if (!msg)
+        return -ENOMEM;
+    genlmsg_put(msg, 0, 0, scan->nl.id, 0, 0, NL80211_CMD_TRIGGER_SCAN, 0);
+    NLA_PUT_U32(msg, NL80211_ATTR_IFINDEX, scan->nl.ifindex);
+
+    nest = nla_nest_start(msg, NL80211_ATTR_SCAN_FREQUENCIES);
+    for (int i = 0; i < n; i++)
+        NLA_PUT_U32(msg, i + 1, freqs[i]);
+    nla_nest_end(msg, nest);
+
+    // one wildcard SSID makes it active, without SSIDs the driver only listens
+    nest = nla_nest_start(msg, NL80211_ATTR_SCAN_SSIDS);
+    NLA_PUT(msg, 1, 0, "");
+    nla_nest_end(msg, nest);
+
+    ret = nl_send_auto(scan->nl.sock, msg);
+    if (ret >= 0)
+        ret = nl_wait_for_ack(scan->nl.sock);
+    nlmsg_free(msg);
+    if (ret < 0)
+        fprintf(stderr, "Scan trigger refused: %s\n", nl_geterror(ret));
+    return ret < 0 ? ret : 0;
+
 nla_put_failure:
     nlmsg_free(msg);
     fprintf(stderr, "%s() put failure\n", __func__);
     return -1;
-}
\ No newline at end of file
+}
+
+// doesn't block, NL_SCAN_RUNNING until the driver reports results or gives up
+int netlink_scan_poll(struct nl80211_scan *scan)
+{
+    while (scan->status == NL_SCAN_RUNNING && nl_recvmsgs_default(scan->events) >= 0)
+        ;
+    return scan->status;
+}
+
+// best effort, driver may be done already
+void netlink_scan_abort(struct nl80211_scan *scan)
+{
+    struct nl_msg *msg;
+
+    if (!scan || !scan->events || !(msg = nlmsg_alloc()))
+        return;
+    genlmsg_put(msg, 0, 0, scan->nl.id, 0, 0, NL80211_CMD_ABORT_SCAN, 0);
+    NLA_PUT_U32(msg, NL80211_ATTR_IFINDEX, scan->nl.ifindex);
+    if (nl_send_auto(scan->nl.sock, msg) >= 0)
+        nl_wait_for_ack(scan->nl.sock);
+nla_put_failure:
+    nlmsg_free(msg);
+    scan->status = NL_SCAN_ABORTED;
+}
+
+struct scan_dump
+{
+    netlink_bss_cb cb;
+    void *arg;
+};
+
+static void bss_parse_ies(struct netlink_bss *bss, u_int8_t *ie, int len)
+{
+    // SSID is the first IE, but don't count on it
+    while (len >= 2 && ie[1] + 2 <= len)
+    {
+        if (ie[0] == 0)
+        {
+            bss->ssid_len = MIN(ie[1], (int)sizeof(bss->ssid) - 1);
+            memcpy(bss->ssid, ie + 2, bss->ssid_len);
+            // hidden APs may send the right length filled with zeroes
+            if (!bss->ssid[0])
+                bss->ssid_len = 0;
+            return;
+        }
+        len -= ie[1] + 2;
+        ie += ie[1] + 2;
+    }
+}
+
+static int scan_dump_cb(struct nl_msg *msg, void *arg)
+{
+    struct scan_dump *dump = arg;
+    struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
+    struct nlattr *tb[NL80211_ATTR_MAX + 1];
+    struct nlattr *binfo[NL80211_BSS_MAX + 1];
+    struct nlattr *ies;
+    struct netlink_bss bss = {0};
+
+    nla_parse(tb, NL80211_ATTR_MAX, genlmsg_attrdata(gnlh, 0), genlmsg_attrlen(gnlh, 0), NULL);
+    if (!tb[NL80211_ATTR_BSS])
+        return NL_SKIP;
+    if (nla_parse_nested(binfo, NL80211_BSS_MAX, tb[NL80211_ATTR_BSS], NULL))
+        return NL_SKIP;
+    if (!binfo[NL80211_BSS_BSSID] || !binfo[NL80211_BSS_FREQUENCY])
+        return NL_SKIP;
+
+    memcpy(bss.bssid, nla_data(binfo[NL80211_BSS_BSSID]), 6);
+    bss.freq = nla_get_u32(binfo[NL80211_BSS_FREQUENCY]);
+    if (binfo[NL80211_BSS_SIGNAL_MBM])
+        bss.signal = (int)nla_get_u32(binfo[NL80211_BSS_SIGNAL_MBM]) / 100;
+    if (binfo[NL80211_BSS_BEACON_INTERVAL])
+        bss.beacon_int = nla_get_u16(binfo[NL80211_BSS_BEACON_INTERVAL]);
+    if (binfo[NL80211_BSS_SEEN_MS_AGO])
+        bss.age_ms = nla_get_u32(binfo[NL80211_BSS_SEEN_MS_AGO]);
+
+    // probe response IEs name hidden APs when someone asked for them by name, beacon ones never do
+    ies = binfo[NL80211_BSS_INFORMATION_ELEMENTS] ? binfo[NL80211_BSS_INFORMATION_ELEMENTS]
+                                                   : binfo[NL80211_BSS_BEACON_IES];
+    if (ies)
+        bss_parse_ies(&bss, nla_data(ies), nla_len(ies));
+
+    dump->cb(&bss, dump->arg);
+    return NL_SKIP;
+}
+
+int netlink_scan_results(struct nl80211_scan *scan, netlink_bss_cb cb, void *arg)
+{
+    struct scan_dump dump = {cb, arg};
+    struct nl_msg *msg;
+    struct nl_cb *nlcb;
+    int ret;
+
+    if (!scan || !scan->events)
+        return -EINVAL;
+
+    nlcb = nl_cb_alloc(NL_CB_DEFAULT);
+    msg = nlmsg_alloc();
+    if (!nlcb || !msg) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    genlmsg_put(msg, 0, 0, scan->nl.id, 0, NLM_F_DUMP, NL80211_CMD_GET_SCAN, 0);
+    NLA_PUT_U32(msg, NL80211_ATTR_IFINDEX, scan->nl.ifindex);
+    nl_cb_set(nlcb, NL_CB_VALID, NL_CB_CUSTOM, scan_dump_cb, &dump);
+
+    ret = nl_send_auto(scan->nl.sock, msg);
+    if (ret >= 0)
+        ret = nl_recvmsgs(scan->nl.sock, nlcb);
+    goto out;
+
+nla_put_failure:
+    fprintf(stderr, "%s() put failure\n", __func__);
+    ret = -1;
+out:
+    nlmsg_free(msg);
+    nl_cb_put(nlcb);
+    return ret < 0 ? ret : 0;
+}
@@ -0,0 +1,276 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include <sys/random.h>
+#include "probe.h"
+#include "capture.h"
+#include "metrics.h"
+#include "utils.h"
+
+#define RADIOTAP_TX_FLAGS 15
+#define RADIOTAP_F_TX_NOACK 0x0008 // we can't receive the ACK to a spoofed address, don't retry for it
+#define FC_PROBE_REQ (FRAME_TYPE_MGMT << 2 | FRAME_SUBTYPE_PROBE_REQ << 4)
+#define FC_NULL_DATA (FRAME_TYPE_DATA << 2 | 4 << 4)
+#define FC_TO_DS 0x01
+#define ACK_DURATION_US 44 // SIFS + ACK at 6 Mbps, NAV the response needs
+
+// only the fields we set, in radiotap order with their alignment
+struct probe_radiotap {
+    struct radiotap_header hdr;
+    u_int8_t rate;
+    u_int8_t pad;
+    u_int16_t tx_flags;
+} __attribute__((packed));
+
+static const u_int8_t rates_24[] = {0x82, 0x84, 0x8b, 0x96, 0x0c, 0x12, 0x18, 0x24};
+static const u_int8_t ext_rates_24[] = {0x30, 0x48, 0x60, 0x6c};
+static const u_int8_t rates_5[] = {0x8c, 0x12, 0x98, 0x24, 0xb0, 0x48, 0x60, 0x6c};
+
+const char *probe_type_str(probe_type_t type)
+{
+    return type == PROBE_NULL ? "null" : "probe";
+}
+
+// first octet is replaced: locally administered, unicast, AP index in bits 2-4. The rest is the
+// interface's, so scanners on the same channel don't answer for each other
+void probe_src_mac(struct probe_ctx *p, int ap, u_int8_t *mac)
+{
+    memcpy(mac, p->base_mac, 6);
+    mac[0] = 0x02 | (ap & 0x07) << 2;
+}
+
+int probe_match(struct probe_ctx *p, const u_int8_t *addr)
+{
+    if (!p->started || (addr[0] & 0xe3) != 0x02 || memcmp(addr + 1, p->base_mac + 1, 5))
+        return -1;
+    return (addr[0] >> 2) & 0x07;
+}
+
+void probe_count_response(struct probe_ctx *p, int ap)
+{
+    atomic_fetch_add_explicit(&p->responses[ap], 1, memory_order_relaxed);
+    metrics_inc(M_PROBE_RESPONSES);
+}
+
+static u_int8_t *probe_add_ie(u_int8_t *pos, u_int8_t id, const void *data, u_int8_t len)
+{
+    *pos++ = id;
+    *pos++ = len;
+    memcpy(pos, data, len);
+    return pos + len;
+}
+
+static void probe_build(struct probe_ctx *p, struct probe_target *t, struct wifi_ap_info *ap)
+{
+    struct probe_radiotap *rt = (struct probe_radiotap *)t->frame;
+    struct wifi_data_header *hdr = (struct wifi_data_header *)(t->frame + sizeof(*rt));
+    u_int8_t *pos = (u_int8_t *)(hdr + 1);
+    u_int8_t chan = ap->channel;
+
+    memset(t->frame, 0, sizeof(t->frame));
+    rt->hdr.length = sizeof(*rt);
+    rt->hdr.present_flags = 1U << RADIOTAP_RATE | 1U << RADIOTAP_TX_FLAGS;
+    rt->rate = PROBE_TX_RATE;
+    rt->tx_flags = RADIOTAP_F_TX_NOACK;
+
+    ((u_int8_t *)&hdr->ctrl)[0] = p->type == PROBE_NULL ? FC_NULL_DATA : FC_PROBE_REQ;
+    ((u_int8_t *)&hdr->ctrl)[1] = p->type == PROBE_NULL ? FC_TO_DS : 0;
+    hdr->id = ACK_DURATION_US;
+    memcpy(hdr->addr1, ap->bssid, 6);
+    probe_src_mac(p, t->ap, hdr->addr2);
+    memcpy(hdr->addr3, ap->bssid, 6);
+
+    if (p->type == PROBE_REQ) {
+        // directed at the selected SSID, hidden ones get the wildcard and answer that too
+        pos = probe_add_ie(pos, TAG_SSID, ap->ssid, strnlen((char *)ap->ssid, sizeof(ap->ssid)));
+        if (chan > 14) {
+            pos = probe_add_ie(pos, 1, rates_5, sizeof(rates_5));
+        } else {
+            pos = probe_add_ie(pos, 1, rates_24, sizeof(rates_24));
+            pos = probe_add_ie(pos, 50, ext_rates_24, sizeof(ext_rates_24));
+        }
+        // APs hearing us on a neighbouring channel stay quiet
+        pos = probe_add_ie(pos, TAG_DS, &chan, 1);
+    }
+    t->len = pos - t->frame;
+}
+
+void probe_set_targets(struct probe_ctx *p, struct wifi_ap_info *aps, int *idx, int n)
+{
+    if (!p->started)
+        return;
+
+    pthread_mutex_lock(&p->lock);
+    for (int i = 0; i < n && i < PROBE_MAX_TARGETS; i++) {
+        p->targets[i].ap = idx[i];
+        probe_build(p, &p->targets[i], &aps[idx[i]]);
+    }
+    p->n_targets = MIN(n, PROBE_MAX_TARGETS);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void probe_reset_stats(struct probe_ctx *p)
+{
+    p->start_us = time_mono_us();
+    atomic_store(&p->missed, 0);
+    atomic_store(&p->errors, 0);
+    for (int i = 0; i < PROBE_MAX_TARGETS; i++) {
+        atomic_store(&p->sent[i], 0);
+        atomic_store(&p->responses[i], 0);
+    }
+}
+
+static void probe_send_all(struct probe_ctx *p)
+{
+    struct probe_target *t;
+    struct wifi_data_header *hdr;
+
+    pthread_mutex_lock(&p->lock);
+    for (int i = 0; i < p->n_targets; i++) {
+        t = &p->targets[i];
+        hdr = (struct wifi_data_header *)(t->frame + sizeof(struct probe_radiotap));
+        hdr->seq_ctl = (t->seq++ & 0x0fff) << 4;
+        if (pcap_inject(p->handle, t->frame, t->len) != t->len) {
+            atomic_fetch_add_explicit(&p->errors, 1, memory_order_relaxed);
+            metrics_inc(M_PROBE_ERRORS);
+            continue;
+        }
+        atomic_fetch_add_explicit(&p->sent[t->ap], 1, memory_order_relaxed);
+        metrics_inc(M_PROBES_SENT);
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+// paced by a periodic timerfd, the kernel keeps the period so wakeup jitter doesn't add up;
+// expirations slept through are counted, not made up for with a burst
+static void *probe_thread_func(void *arg)
+{
+    struct probe_ctx *p = arg;
+    struct itimerspec its = {0};
+    u_int64_t expirations;
+    long long period_ns = 1000000000LL / p->rate_hz;
+    int fd;
+
+    if ((fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) < 0) {
+        perror("Probe timer");
+        return NULL;
+    }
+    its.it_interval.tv_sec = period_ns / 1000000000LL;
+    its.it_interval.tv_nsec = period_ns % 1000000000LL;
+    its.it_value = its.it_interval;
+    timerfd_settime(fd, 0, &its, NULL);
+
+    while (!atomic_load(&p->stop)) {
+        if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+            continue;
+        if (!atomic_load(&p->active))
+            continue;
+        if (expirations > 1) {
+            atomic_fetch_add_explicit(&p->missed, expirations - 1, memory_order_relaxed);
+            metrics_add(M_PROBE_MISSED, expirations - 1);
+        }
+        probe_send_all(p);
+    }
+    close(fd);
+    return NULL;
+}
+
+int probe_init(struct probe_ctx *p, char *dev)
+{
+    char err_msg[PCAP_ERRBUF_SIZE];
+    struct bpf_program filter;
+
+    if (p->rate_hz <= 0)
+        return 0;
+    if (p->rate_hz > PROBE_MAX_HZ)
+        p->rate_hz = PROBE_MAX_HZ;
+
+    if (!(p->handle = pcap_create(dev, err_msg))) {
+        fprintf(stderr, "Failed to create injection handle: %s\n", err_msg);
+        return -1;
+    }
+    pcap_set_snaplen(p->handle, 64);
+    if (pcap_activate(p->handle)) {
+        fprintf(stderr, "Can't activate injection handle: %s\n", pcap_geterr(p->handle));
+        goto err;
+    }
+    // send only, nothing should be queued for it
+    if (pcap_compile(p->handle, &filter, "len = 0", 1, PCAP_NETMASK_UNKNOWN)) {
+        fprintf(stderr, "Can't filter injection handle: %s\n", pcap_geterr(p->handle));
+        goto err;
+    }
+    if (pcap_setfilter(p->handle, &filter)) {
+        fprintf(stderr, "Can't filter injection handle: %s\n", pcap_geterr(p->handle));
+        pcap_freecode(&filter);
+        goto err;
+    }
+    pcap_freecode(&filter);
+
+    // source addresses are derived from it and responses matched by them, scanners without a
+    // device MAC must not end up with the same one
+    set_dev_mac(dev, p->base_mac);
+    if (!is_valid_mac(p->base_mac) &&
+        getrandom(p->base_mac, sizeof(p->base_mac), 0) != sizeof(p->base_mac)) {
+        fprintf(stderr, "No device MAC and no random one for injection\n");
+        goto err;
+    }
+
+    pthread_mutex_init(&p->lock, NULL);
+    atomic_init(&p->active, 0);
+    atomic_init(&p->stop, 0);
+    probe_reset_stats(p);
+    if (pthread_create(&p->thread, NULL, probe_thread_func, p)) {
+        fprintf(stderr, "Failed to start injector thread\n");
+        goto err;
+    }
+    p->started = 1;
+    printf("Active sensing: %s frames at %d Hz per AP\n", probe_type_str(p->type), p->rate_hz);
+    return 0;
+err:
+    pcap_close(p->handle);
+    p->handle = NULL;
+    return -1;
+}
+
+void probe_deinit(struct probe_ctx *p)
+{
+    if (!p->started)
+        return;
+
+    atomic_store(&p->stop, 1);
+    pthread_join(p->thread, NULL);
+    pcap_close(p->handle);
+    p->handle = NULL;
+    p->started = 0;
+}
+
+cJSON *probe_to_json(struct probe_ctx *p)
+{
+    cJSON *json = cJSON_CreateObject();
+    long long elapsed_us = time_mono_us() - p->start_us;
+    u_int64_t sent = 0;
+
+    for (int i = 0; i < PROBE_MAX_TARGETS; i++)
+        sent += atomic_load(&p->sent[i]);
+    cJSON_AddStringToObject(json, "type", probe_type_str(p->type));
+    cJSON_AddNumberToObject(json, "rate_hz", p->rate_hz);
+    cJSON_AddNumberToObject(json, "sent", sent);
+    cJSON_AddNumberToObject(json, "sent_hz", elapsed_us > 0 ? sent * 1e6 / elapsed_us : 0);
+    cJSON_AddNumberToObject(json, "missed", atomic_load(&p->missed));
+    cJSON_AddNumberToObject(json, "errors", atomic_load(&p->errors));
+    return json;
+}
+
+// per AP part, goes into the schedule's AP entry
+void probe_ap_to_json(struct probe_ctx *p, int ap, cJSON *json)
+{
+    u_int64_t sent = atomic_load(&p->sent[ap]);
+    u_int64_t responses = atomic_load(&p->responses[ap]);
+
+    cJSON_AddNumberToObject(json, "probes", sent);
+    cJSON_AddNumberToObject(json, "responses", responses);
+    cJSON_AddNumberToObject(json, "response_ratio", sent ? (double)responses / sent : 0);
+}
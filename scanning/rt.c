@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "rt.h"
+
+// "0-2,5" style list, same as taskset
+int rt_parse_cpus(const char *str, cpu_set_t *set)
+{
+    char *copy, *tok, *save, *end;
+    long from, to;
+
+    CPU_ZERO(set);
+    if (!(copy = strdup(str)))
+        return -ENOMEM;
+
+    for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        from = strtol(tok, &end, 10);
+        to = from;
+        if (*end == '-')
+            to = strtol(end + 1, &end, 10);
+        if (*end || from < 0 || to < from || to >= CPU_SETSIZE) {
+            free(copy);
+            return -EINVAL;
+        }
+        for (long cpu = from; cpu <= to; cpu++)
+            CPU_SET(cpu, set);
+    }
+    free(copy);
+    return CPU_COUNT(set) ? 0 : -EINVAL;
+}
+
+// everything but the capture CPU, unless that leaves nothing
+void rt_default_aux_cpus(struct rt_opts *opts)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (opts->aux_set || opts->capture_cpu < 0 || n < 2)
+        return;
+
+    CPU_ZERO(&opts->aux_cpus);
+    for (long cpu = 0; cpu < n; cpu++)
+        if (cpu != opts->capture_cpu)
+            CPU_SET(cpu, &opts->aux_cpus);
+    opts->aux_set = 1;
+}
+
+int rt_pin_thread(pthread_t thread, cpu_set_t *set)
+{
+    int ret;
+
+    if ((ret = pthread_setaffinity_np(thread, sizeof(cpu_set_t), set)))
+        fprintf(stderr, "Failed to set thread affinity: %s\n", strerror(ret));
+    return ret;
+}
+
+// called from the capture thread itself, after the other threads are started so they don't inherit it
+int rt_setup_capture_thread(struct rt_opts *opts)
+{
+    struct sched_param param = {0};
+    cpu_set_t set;
+    int ret = 0, err;
+
+    // both are tried, the first failure is what's returned
+    if (opts->capture_cpu >= 0) {
+        CPU_ZERO(&set);
+        CPU_SET(opts->capture_cpu, &set);
+        if (!(ret = rt_pin_thread(pthread_self(), &set)))
+            printf("Capture thread pinned to CPU %d\n", opts->capture_cpu);
+    }
+
+    if (opts->fifo_prio > 0) {
+        param.sched_priority = opts->fifo_prio;
+        if ((err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param))) {
+            fprintf(stderr, "Failed to set SCHED_FIFO priority %d: %s\n", opts->fifo_prio, strerror(err));
+            if (!ret)
+                ret = err;
+        } else
+            printf("Capture thread running SCHED_FIFO priority %d\n", opts->fifo_prio);
+    }
+    return ret;
+}
+
+int rt_lock_memory()
+{
+    int flags = MCL_CURRENT | MCL_FUTURE;
+
+#ifdef MCL_ONFAULT
+    // don't pull every thread stack and library mapping in whole, what matters is prefaulted explicitly
+    flags |= MCL_ONFAULT;
+#endif
+    if (mlockall(flags)) {
+        fprintf(stderr, "Failed to lock memory: %s\n", strerror(errno));
+        return -errno;
+    }
+    return 0;
+}
+
+// touch every page so the capture path never takes a page fault
+void rt_prefault(void *buf, size_t len)
+{
+    volatile u_int8_t *p = buf;
+    long page = sysconf(_SC_PAGESIZE);
+
+    for (size_t i = 0; i < len; i += page)
+        p[i] = p[i];
+    if (len)
+        p[len - 1] = p[len - 1];
+}
+
+// grow the stack now, with memory locked the pages stay resident
+void __attribute__((noinline)) rt_prefault_stack()
+{
+    u_int8_t buf[RT_PREFAULT_STACK];
+
+    rt_prefault(buf, sizeof(buf));
+}
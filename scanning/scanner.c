@@ -27,9 +27,15 @@ void sig_handler(int signal)
     pthread_mutex_unlock(&shared.lock);
 }
 
+// only flags the dump, capture loop prints it
+void sig_dump_handler(int signal)
+{
+    trace_request_dump();
+}
+
 int parse_args(int argc, char *argv[])
 {
-    char *prog_opts = "d:c:";
+    char *prog_opts = "d:c:s:m:tr:R:a:P:lA:S:p:ni:";
     int opt;
 
     while ((opt = getopt(argc, argv, prog_opts)) != -1)
@@ -42,12 +48,56 @@ int parse_args(int argc, char *argv[])
         case 'c':
             ctx->mqtt_conf_path = strdup(optarg);
             break;
+        case 's':
+            ctx->stats_interval = atoi(optarg);
+            break;
+        case 'm':
+            ctx->prom_path = strdup(optarg);
+            break;
+        case 't':
+            trace_enabled = 1;
+            break;
+        case 'r':
+            ctx->replay_path = strdup(optarg);
+            break;
+        case 'R':
+            ctx->replay_rate = atoi(optarg);
+            break;
+        case 'a':
+            ctx->rt.capture_cpu = atoi(optarg);
+            break;
+        case 'P':
+            ctx->rt.fifo_prio = atoi(optarg);
+            break;
+        case 'l':
+            ctx->rt.lock_mem = 1;
+            break;
+        case 'S':
+            ctx->sta_flush_sec = atoi(optarg);
+            break;
+        case 'p':
+            ctx->probe_rate = atoi(optarg);
+            break;
+        case 'n':
+            ctx->probe_type = PROBE_NULL;
+            break;
+        case 'i':
+            ctx->scan_dev = strdup(optarg);
+            break;
+        case 'A':
+            if (rt_parse_cpus(optarg, &ctx->rt.aux_cpus))
+            {
+                fprintf(stderr, "Invalid CPU list: %s\n", optarg);
+                goto err;
+            }
+            ctx->rt.aux_set = 1;
+            break;
         default:
             break;
         }
     }
 
-    if (!ctx->dev)
+    if (!ctx->dev && !ctx->replay_path)
         goto err;
     
     if (!ctx->mqtt_conf_path)
@@ -55,41 +105,139 @@ int parse_args(int argc, char *argv[])
 
     return 0;
 err:
-    printf("Usage: %s -d IFACE -c MQTT_CONFIG\n", argv[0]);
+    printf("Usage: %s -d IFACE -c MQTT_CONFIG [-s STATS_INTERVAL_SEC] [-m PROMETHEUS_FILE] [-t]\n"
+           "       %s -r PCAP_FILE [-R PACKETS_PER_SEC] -c MQTT_CONFIG ...\n"
+           "Stations: [-S FLUSH_INTERVAL_SEC (track client stations)]\n"
+           "Active sensing: [-p PROBES_PER_SEC (per selected AP, max %d)] [-n (null data frames, not probe requests)]\n"
+           "AP search: [-i SCAN_IFACE (managed interface on the capture radio, for driver scans)]\n"
+           "Realtime: [-a CAPTURE_CPU] [-P FIFO_PRIO] [-l (lock memory)] [-A OTHER_THREADS_CPUS, e.g. 1-3]\n",
+           argv[0], argv[0], PROBE_MAX_HZ);
     return -1;
 }
 
 // send json formatted string
-void msg_send_cb(char *msg)
+void msg_send_cb(cap_payload_t type, char *msg)
 {
     pthread_mutex_lock(&shared.lock);
     payload_t payload;
     topic_t topic;
 
     topic.qos = 1;
+    // samples are only useful fresh, don't let them pile up at the broker or in our queue. No topic
+    // alias, the window needs acks, so QoS 1 and the full topic (see MQTT_PUB_ALIAS)
+    topic.flags = MQTT_PUB_EXPIRE | MQTT_PUB_WINDOW;
     payload.data = (void *)msg;
     payload.len = strlen(msg);
 
-    sprintf(topic.name, "%s/%s", SCANNER_PUB_DATA, ctx->client_id);
+    if (type == STA_LIST) {
+        // deltas, a dropped one loses counts, so don't window them
+        topic.flags &= ~MQTT_PUB_WINDOW;
+        sprintf(topic.name, "%s/%s", SCANNER_PUB_STATIONS, ctx->client_id);
+    } else if (type == AP_LIST) {
+        // sent once per search and the manager waits for it, neither dropped nor expired
+        topic.flags = 0;
+        sprintf(topic.name, "%s/%s", SCANNER_PUB_DATA, ctx->client_id);
+    } else if (type == PKT_LIST && ctx->shard >= 0) {
+        sprintf(topic.name, "%s/%d/%s", SCANNER_PUB_INGEST, ctx->shard, ctx->client_id);
+    } else {
+        sprintf(topic.name, "%s/%s", SCANNER_PUB_DATA, ctx->client_id);
+    }
+    mqtt_publish_topic(topic, payload);
+
+    pthread_mutex_unlock(&shared.lock);
+}
+
+// runs on timer thread
+void stats_timer_cb(union sigval val)
+{
+    topic_t topic = {0, 0};
+    payload_t payload;
+    cJSON *json, *schedule;
+    char *msg;
+
+    // SIGEV_THREAD timers get a fresh thread per expiry, keep it off the capture CPU
+    if (ctx->rt.aux_set)
+        rt_pin_thread(pthread_self(), &ctx->rt.aux_cpus);
+
+    topic.flags = MQTT_PUB_ALIAS; // QoS 0 and sent every interval, the one topic an alias pays off on
+    sprintf(topic.name, "%s/%s", SCANNER_PUB_STATS, ctx->client_id);
+    json = metrics_to_json();
+    if (trace_enabled)
+        cJSON_AddItemToObject(json, "trace", trace_to_json());
+    if ((schedule = cap_schedule_to_json()))
+        cJSON_AddItemToObject(json, "schedule", schedule);
+    cJSON_AddItemToObject(json, "clock", clk_to_json());
+    msg = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+    if (!msg)
+        return;
+
+    payload.data = msg;
+    payload.len = strlen(msg);
     mqtt_publish_topic(topic, payload);
+    free(msg);
+
+    if (ctx->prom_path)
+        metrics_write_prom(ctx->prom_path, ctx->client_id);
+}
+
+// runs on timer thread
+void ping_timer_cb(union sigval val)
+{
+    topic_t topic = {0, 0}; // a late ping is useless, don't retry it
+    payload_t payload;
+    char *msg;
+
+    if (ctx->rt.aux_set)
+        rt_pin_thread(pthread_self(), &ctx->rt.aux_cpus);
 
+    sprintf(topic.name, "%s/%s", SCANNER_PUB_CMD_PING, ctx->client_id);
+    // t1 is taken with the lock held, waiting for it would count as network delay
+    pthread_mutex_lock(&shared.lock);
+    if (shared.connected && ctx->registered && (msg = clk_ping_json(clk_now_us()))) {
+        payload.data = msg;
+        payload.len = strlen(msg);
+        mqtt_publish_topic(topic, payload);
+        free(msg);
+    }
     pthread_mutex_unlock(&shared.lock);
 }
 
+static int parse_ap(cJSON *obj, struct wifi_ap_info *ap)
+{
+    cJSON *ssid = cJSON_GetObjectItem(obj, "ssid");
+    cJSON *bssid = cJSON_GetObjectItem(obj, "bssid");
+    cJSON *channel = cJSON_GetObjectItem(obj, "channel");
+    cJSON *beacon_int = cJSON_GetObjectItem(obj, "beacon_int");
+
+    if (!cJSON_IsString(bssid) || !cJSON_IsNumber(channel))
+        return -1;
+
+    memset(ap, 0, sizeof(struct wifi_ap_info));
+    if (cJSON_IsString(ssid))
+        strncpy((char *)ap->ssid, ssid->valuestring, sizeof(ap->ssid) - 1);
+    bssid_str_to_val(bssid->valuestring, ap->bssid);
+    ap->channel = channel->valueint;
+    if (cJSON_IsNumber(beacon_int))
+        ap->beacon_int = beacon_int->valueint;
+    return 0;
+}
+
 void handle_cmd_all(char *cmd, void *data, unsigned int len)
 {
     cJSON *json = NULL;
     cJSON *arr = NULL;
     cJSON *obj = NULL;
-    char bssid_str[32]; // big enough buffer
-    int channel;
-    struct wifi_ap_info ap;
+    cJSON *mode = NULL;
+    cap_scan_mode_t scan_mode;
+    struct wifi_ap_info aps[CAP_MAX_APS];
+    int n_aps;
     int chans[128];
     int chan_count = 0;
 
     if (!strcmp(cmd, CMD_STOP))
     {
-        memset(&ctx->selected_ap, 0, sizeof(struct wifi_ap_info));
+        ctx->n_selected = 0;
         cap_override_state(STATE_IDLE);
     }
     else if (!strcmp(cmd, CMD_SCAN))
@@ -105,49 +253,86 @@ void handle_cmd_all(char *cmd, void *data, unsigned int len)
                 chans[chan_count++] = obj->valueint;
         }
 
+        // driver scan only when asked for, older managers don't send a mode
+        mode = cJSON_GetObjectItem(json, "mode");
+        scan_mode = cJSON_IsString(mode) && !strcmp(mode->valuestring, "active") ? SCAN_ACTIVE : SCAN_PASSIVE;
         cap_set_chans(chans, chan_count);
+        cap_set_scan_mode(scan_mode);
         cap_override_state(STATE_AP_SEARCH_START);
 
-        printf("Start AP scan on channels:\n");
+        printf("Start %s AP scan on channels:\n", scan_mode == SCAN_ACTIVE ? "active" : "passive");
         for(int i = 0; i < chan_count; i++)
             printf("%d\n", chans[i]);
     }
     else if (!strcmp(cmd, CMD_SELECT_AP))
     {
+        // either a single AP object or {"aps": [...]} for a multi channel schedule
         json = cJSON_Parse(data);
-        strncpy(bssid_str, cJSON_GetObjectItem(json, "bssid")->valuestring,
-                sizeof(bssid_str));
-        strncpy((char *)ap.ssid, cJSON_GetObjectItem(json, "ssid")->valuestring,
-                sizeof(ap.ssid));
-        bssid_str_to_val(bssid_str, ap.bssid);
-        ap.channel = cJSON_GetObjectItem(json, "channel")->valueint;
+        arr = cJSON_GetObjectItem(json, "aps");
+        n_aps = 0;
+        if (cJSON_IsArray(arr))
+        {
+            cJSON_ArrayForEach(obj, arr)
+            {
+                if (n_aps < CAP_MAX_APS && !parse_ap(obj, &aps[n_aps]))
+                    n_aps++;
+            }
+        }
+        else if (json && !parse_ap(json, &aps[0]))
+            n_aps = 1;
+
+        if (!n_aps)
+        {
+            fprintf(stderr, "Invalid AP selection\n");
+            cJSON_Delete(json);
+            return;
+        }
 
         if (ctx->registered)
-            cap_set_ap(&ap);
+            cap_set_aps(aps, n_aps);
 
-        memcpy(&ctx->selected_ap, &ap, sizeof(struct wifi_ap_info)); // hold on to it
-        printf("Set AP (SSID %s)\n", ap.ssid);
+        memcpy(ctx->selected_aps, aps, n_aps * sizeof(struct wifi_ap_info)); // hold on to it
+        ctx->n_selected = n_aps;
+        for (int i = 0; i < n_aps; i++)
+            printf("Set AP (SSID %s, channel %d)\n", aps[i].ssid, aps[i].channel);
     }
     else if(!strcmp(cmd, CMD_END))
     {
         cap_stop();
-        memset(&ctx->selected_ap, 0, sizeof(ctx->selected_ap));
+        ctx->n_selected = 0;
         ctx->registered = 0;
+        ctx->shard = -1;
     }
 
     cJSON_Delete(json);
 }
 
-void handle_cmd_id(char *cmd, void *data, unsigned int len)
+void handle_cmd_id(char *cmd, void *data, unsigned int len, long long recv_us)
 {
+    cJSON *json, *shard;
+
     if (!strcmp(cmd, SCANNER_REG_ACK))
     {
+        // manager running ingest workers names the shard, an empty ack keeps the data topic
+        json = len ? cJSON_Parse(data) : NULL;
+        shard = cJSON_GetObjectItem(json, "shard");
+        ctx->shard = cJSON_IsNumber(shard) ? shard->valueint : -1;
+        cJSON_Delete(json);
+        if (ctx->shard >= 0)
+            printf("Samples go to ingest shard %d\n", ctx->shard);
         ctx->registered = 1;
+        pthread_cond_broadcast(&shared.cond); // caller holds shared.lock
+    }
+    else if (!strcmp(cmd, SCANNER_PING_RESP))
+    {
+        clk_on_pong(data, len, recv_us);
     }
 }
 
 void msg_recv_cb(const char *topic, void *data, unsigned int len)
 {
+    // t4 of a pong, taken before the lock for the same reason as t1
+    long long recv_us = clk_now_us();
     pthread_mutex_lock(&shared.lock);
     int tlen = strlen(topic);
 
@@ -160,7 +345,7 @@ void msg_recv_cb(const char *topic, void *data, unsigned int len)
     else if (mqtt_is_sub_match(SCANNER_SUB_CMD_ID, topic))
     {
         // first check failed so we must have got a cmd for our ID
-        handle_cmd_id(basename(topic), data, len);
+        handle_cmd_id(basename(topic), data, len, recv_us);
     }
     pthread_mutex_unlock(&shared.lock);
 }
@@ -176,50 +361,101 @@ void prepare_topics(char *client_id, topic_t *topics)
     topics[1] = cmd_id;
 }
 
+static char *startup_json(int with_times)
+{
+    cJSON *json = cJSON_CreateObject();
+    cJSON *startup;
+    char *str;
+
+    cJSON_AddNumberToObject(json, "boot", ctx->boot_id);
+    if (with_times) {
+        startup = cJSON_AddObjectToObject(json, "startup");
+        cJSON_AddNumberToObject(startup, "setup_ms", cap_ctx->setup_us / 1000);
+        cJSON_AddNumberToObject(startup, "connect_ms", (shared.connected_us - ctx->start_us) / 1000);
+        cJSON_AddNumberToObject(startup, "ready_ms", metrics_get(M_STARTUP_READY_MS));
+    }
+    str = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+    return str;
+}
+
+static void timespec_add_ms(struct timespec *ts, int ms)
+{
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_nsec -= 1000000000L;
+        ts->tv_sec++;
+    }
+}
+
 int try_register()
 {
-    // empty message with topic
-    payload_t empty = {0};
+    payload_t payload = {0};
     topic_t reg_topic = {0, 2};
+    struct timespec deadline;
+    int backoff_ms = REG_BACKOFF_MIN_MS;
+    int attempts = 0;
+    char *msg;
+
     sprintf(reg_topic.name, "%s/%s", SCANNER_PUB_CMD_REGISTER, ctx->client_id);
-    int conn_cnt = 5;
-    while (1)
+    if (!(msg = startup_json(0)))
+        return -1;
+    payload.data = msg;
+    payload.len = strlen(msg);
+
+    // cond wait drops the lock, MQTT thread can deliver the ack meanwhile
+    pthread_mutex_lock(&shared.lock);
+    while (!shared.stop && !ctx->registered)
     {
-        pthread_mutex_lock(&shared.lock);
-        if (shared.stop)
+        // nothing to retry until the broker is there, connect wakes us up
+        if (shared.connected)
         {
-            printf("Stop main thread\n");
-            pthread_mutex_unlock(&shared.lock);
-            break;
+            if (attempts++ % 5 == 0)
+                printf("Trying to register...\n");
+            mqtt_publish_topic(reg_topic, payload);
         }
 
-        if (ctx->registered)
-        {
-            sprintf(reg_topic.name, "%s/%s", SCANNER_PUB_CMD_READY, ctx->client_id);
-
-            mqtt_publish_topic(reg_topic, empty);
-            printf("Client registered.\n");
-            // Edge case: crashed, received ap from active scan, but not yet initialized. Set to saved AP.
-            // Error handling is later, so no problem if this is null
-            // printf(MAC_FMT "\n", MAC_BYTES(ctx->selected_ap.bssid));
-            memcpy(&cap_ctx->selected_ap, &ctx->selected_ap, sizeof(struct wifi_ap_info));
-            pthread_mutex_unlock(&shared.lock);
-            return 0;
-        }
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        timespec_add_ms(&deadline, backoff_ms);
+        pthread_cond_timedwait(&shared.cond, &shared.lock, &deadline);
 
-        if (conn_cnt % 5 == 0)
-        {
-            printf("Trying to register...\n");
-            conn_cnt = 0;
-        }
+        if (attempts && backoff_ms < REG_BACKOFF_MAX_MS)
+            backoff_ms *= 2;
+        if (backoff_ms > REG_BACKOFF_MAX_MS)
+            backoff_ms = REG_BACKOFF_MAX_MS;
+    }
+    free(msg);
 
-        conn_cnt ++;
-        mqtt_publish_topic(reg_topic, empty);
+    if (shared.stop)
+    {
+        printf("Stop main thread\n");
         pthread_mutex_unlock(&shared.lock);
-        sleep(2);
+        printf("Failed to receive reg ack, exit\n");
+        return -1;
     }
-    printf("Failed to receive reg ack, exit\n");
-    return -1;
+
+    if (!metrics_get(M_STARTUP_READY_MS))
+        metrics_set(M_STARTUP_READY_MS, (time_mono_us() - ctx->start_us) / 1000);
+
+    sprintf(reg_topic.name, "%s/%s", SCANNER_PUB_CMD_READY, ctx->client_id);
+    if ((msg = startup_json(1)))
+    {
+        payload.data = msg;
+        payload.len = strlen(msg);
+        mqtt_publish_topic(reg_topic, payload);
+        free(msg);
+    }
+    printf("Client registered (setup %lld ms, connect %lld ms, ready %lld ms after start).\n",
+           cap_ctx->setup_us / 1000, (shared.connected_us - ctx->start_us) / 1000,
+           metrics_get(M_STARTUP_READY_MS));
+
+    // Edge case: crashed, received ap from active scan, but not yet initialized. Go through the
+    // mailbox so capture switches channel and starts capturing on its next iteration. Posted even
+    // when empty, capture may still hold a selection the manager ended
+    cap_set_aps(ctx->selected_aps, ctx->n_selected);
+    pthread_mutex_unlock(&shared.lock);
+    return 0;
 }
 
 void *mqtt_thread_func(void *arg)
@@ -232,6 +468,7 @@ int main(int argc, char *argv[])
 {
     int ret;
     pthread_t mqtt_thread;
+    pthread_condattr_t cond_attr;
     struct sigaction act;
     topic_t will = {0, 1};
     cap_ctx = NULL;
@@ -240,17 +477,32 @@ int main(int argc, char *argv[])
     sigaction(SIGINT, &act, NULL);
 
     signal(SIGTERM, sig_handler);
+    signal(SIGUSR1, sig_dump_handler);
 
     ctx = malloc(sizeof(struct scanner_client_ctx));
     memset(ctx, 0, sizeof(struct scanner_client_ctx));
+    ctx->start_us = time_mono_us();
+    ctx->boot_id = (u_int32_t)(time_millis() ^ (getpid() << 16));
+    ctx->stats_interval = METRICS_DEFAULT_INTERVAL;
+    ctx->rt.capture_cpu = -1;
+    clk_init();
 
     if (parse_args(argc, argv))
         return -1;
 
+    // before the big allocations, so they end up locked
+    if (ctx->rt.lock_mem && !rt_lock_memory())
+        printf("Memory locked\n");
+
     pcap_init(PCAP_CHAR_ENC_UTF_8, NULL);
 
     pthread_mutex_init(&shared.lock, NULL);
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC); // timed waits must not jump with wall clock
+    pthread_cond_init(&shared.cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
     ctx->registered = 0;
+    ctx->shard = -1;
     shared.stop = 0;
 
     if (ctx == NULL)
@@ -259,7 +511,7 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    if ((ret = mqtt_setup(ctx->mqtt_conf_path, &msg_recv_cb)))
+    if ((ret = mqtt_setup(ctx->mqtt_conf_path, &msg_recv_cb, &shared)))
         goto mqtt_err;
 
     ctx->client_id = mqtt_get_user();
@@ -278,12 +530,42 @@ int main(int argc, char *argv[])
         fprintf(stderr, "Failed to allocate capture context\n");
         return -1;
     }
-    memset(cap_ctx, 0, sizeof(struct capture_ctx));
+    memset(cap_ctx, 0, sizeof(struct capture_ctx)); // also prefaults sample and AP lists
+    cap_ctx->replay_path = ctx->replay_path;
+    cap_ctx->replay_rate = ctx->replay_rate;
+    cap_ctx->start_us = ctx->start_us;
+    cap_ctx->sta_flush_ms = ctx->sta_flush_sec * 1000;
+    cap_ctx->probe.rate_hz = ctx->probe_rate;
+    cap_ctx->probe.type = ctx->probe_type;
+    cap_ctx->scan_dev = ctx->scan_dev;
+
+    // broker connect runs on MQTT thread while pcap and netlink are brought up
+    pthread_create(&mqtt_thread, NULL, &mqtt_thread_func, NULL);
 
     if (cap_setup(cap_ctx, ctx->dev, &msg_send_cb))
-        goto cap_err;
+    {
+        pthread_mutex_lock(&shared.lock);
+        shared.stop = 1;
+        pthread_mutex_unlock(&shared.lock);
+        pthread_join(mqtt_thread, NULL);
+        ret = -1;
+        goto mqtt_err;
+    }
 
-    pthread_create(&mqtt_thread, NULL, &mqtt_thread_func, NULL);
+    if (ctx->stats_interval > 0)
+        ctx->stats_timer = set_timer(ctx->stats_interval, 0, stats_timer_cb, NULL, 0);
+    ctx->ping_timer = set_timer(CLK_BURST_INTERVAL_MS / 1000, MS_TO_NS(CLK_BURST_INTERVAL_MS % 1000), ping_timer_cb, NULL, 0);
+
+    // MQTT and timer threads exist by now, so they don't inherit capture CPU or FIFO policy
+    rt_default_aux_cpus(&ctx->rt);
+    if (ctx->rt.aux_set) {
+        rt_pin_thread(mqtt_thread, &ctx->rt.aux_cpus);
+        if (cap_ctx->probe.started)
+            rt_pin_thread(cap_ctx->probe.thread, &ctx->rt.aux_cpus);
+    }
+    rt_setup_capture_thread(&ctx->rt);
+    if (ctx->rt.lock_mem)
+        rt_prefault_stack();
 
     while (1)
     {
@@ -293,11 +575,14 @@ int main(int argc, char *argv[])
         cap_run();
     }
     pthread_join(mqtt_thread, NULL);
+    if (ctx->stats_timer)
+        timer_delete(ctx->stats_timer);
+    if (ctx->ping_timer)
+        timer_delete(ctx->ping_timer);
 
 mqtt_err:
     mqtt_cleanup();
     cap_close();
-cap_err:
     free(cap_ctx);
     free(ctx);
     return ret;
@@ -85,8 +85,23 @@ setup_monitor() {
     echo "Monitor interface $MONITOR_DEV is set up."
 }
 
+# managed interface on the same radio, the monitor one can't trigger driver scans
+setup_scan_iface() {
+    local scan_dev="scan${SELECTED_PHY:3}"
+
+    [ -d /sys/class/net/$scan_dev ] || iw phy $SELECTED_PHY interface add $scan_dev type managed || {
+        echo "Can't add scan interface, active AP search will fall back to passive"
+        return
+    }
+    ip link set $scan_dev up
+
+    echo "Scan interface $scan_dev is set up, pass it to the scanner with -i $scan_dev."
+}
+
 get_phy
 
 stop_proc
 
 setup_monitor
+
+setup_scan_iface
@@ -0,0 +1,699 @@
+// Scanner fleet simulator: N virtual scanners in one process, each with its own broker connection
+// through mosquitto_mqtt.c, speaking the register/ready/data protocol from topics.h to a real
+// manager. Samples are synthetic or replayed from a recorded results CSV. Scanners can crash (the
+// broker sends their will) and rejoin with a new boot id. Reports manager reg ack latency and data
+// lost on the way to the broker.
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mosquitto.h>
+#include "mosquitto_mqtt.h"
+#include "topics.h"
+#include "utils.h"
+#include "capture_types.h"
+#include "cJSON.h"
+
+#define SIM_MAX_SCANNERS 1024
+#define SIM_TICK_MS 5
+#define SIM_LAT_KEEP 4096 // newest reg ack latencies kept for percentiles
+
+// same as the scanner's
+#define SIM_REG_BACKOFF_MIN_MS 200
+#define SIM_REG_BACKOFF_MAX_MS 5000
+
+enum sim_state {
+    SIM_DOWN,
+    SIM_REGISTERING,
+    SIM_READY,
+};
+
+struct sim_scanner {
+    char id[MAX_ID_LEN];
+    struct mqtt_client *mqtt;
+    struct threads_shared shared; // lock also covers everything below
+    topic_t sub_topics[MQTT_MAX_TOPICS];
+    enum sim_state state;
+    u_int32_t boot_id;
+    int shard; // from reg_ack, -1 - data topic
+    int capturing;
+    char bssid[32];
+    char ssid[33];
+    int channel;
+
+    long long reg_first_us; // first register of this join, ack latency is counted from it
+    long long reg_next_us;
+    int backoff_ms;
+    long long rejoin_us;
+    long long next_send_us;
+    size_t replay_pos;
+    int rssi; // synthetic random walk
+    unsigned int seed;
+};
+
+struct sim_totals {
+    u_int64_t generated; // PKT_LISTs built
+    u_int64_t sent;      // accepted by mosquitto
+    u_int64_t window_full;
+    u_int64_t failed;
+    u_int64_t crashes;
+    u_int64_t rejoins;
+    u_int64_t reg_acks;
+    struct mqtt_pub_stats freed; // of connections already dropped by a crash
+};
+
+static struct sim_ctx {
+    struct mosquitto_conf conf;
+    char *prefix;
+    int n;
+    double rate;       // PKT_LISTs per second per scanner
+    int batch;         // samples per PKT_LIST
+    int duration;      // seconds, 0 - until interrupted
+    double crash_mean; // seconds between crashes of one scanner, 0 - never
+    double down_sec;   // how long a crashed scanner stays away
+    int report_sec;
+    int stagger_ms;
+    int autostart; // send samples without waiting for select_ap
+    char *replay_path;
+
+    int8_t *replay;
+    size_t replay_n;
+    char ap_ssid[33];
+    char ap_bssid[32];
+    int ap_channel;
+
+    struct sim_scanner *scanners;
+    pthread_mutex_t lock; // totals and latencies
+    struct sim_totals totals;
+    long long lat_us[SIM_LAT_KEEP];
+    u_int64_t lat_n;
+    volatile sig_atomic_t stop;
+} sim = {
+    .prefix = "sim",
+    .n = 10,
+    .rate = 10,
+    .batch = PKT_MAX,
+    .down_sec = 5,
+    .report_sec = 5,
+    .stagger_ms = 10,
+    .ap_ssid = "wfan-sim",
+    .ap_bssid = "02:00:00:00:51:01",
+    .ap_channel = 6,
+};
+
+static void sim_sig_handler(int signal)
+{
+    sim.stop = 1;
+}
+
+static int chan_freq(int channel)
+{
+    if (channel == 14)
+        return 2484;
+    return channel < 14 ? 2407 + 5 * channel : 5000 + 5 * channel;
+}
+
+static void sim_publish_json(struct sim_scanner *s, topic_t topic, cJSON *json)
+{
+    payload_t payload;
+    char *msg = cJSON_PrintUnformatted(json);
+
+    if (!msg)
+        return;
+    payload.data = msg;
+    payload.len = strlen(msg);
+    mqtt_client_publish(s->mqtt, topic, payload);
+    free(msg);
+}
+
+static void sim_send_register(struct sim_scanner *s, int unregister)
+{
+    topic_t topic = {.qos = 2};
+    payload_t empty = {0};
+    cJSON *json;
+
+    sprintf(topic.name, "%s/%s", SCANNER_PUB_CMD_REGISTER, s->id);
+    // no boot id reads as an unregister to the manager
+    if (unregister) {
+        mqtt_client_publish(s->mqtt, topic, empty);
+        return;
+    }
+    json = cJSON_CreateObject();
+    cJSON_AddNumberToObject(json, "boot", s->boot_id);
+    sim_publish_json(s, topic, json);
+    cJSON_Delete(json);
+}
+
+static void sim_send_ready(struct sim_scanner *s, long long ack_ms)
+{
+    topic_t topic = {.qos = 1};
+    cJSON *json = cJSON_CreateObject();
+    cJSON *startup;
+
+    sprintf(topic.name, "%s/%s", SCANNER_PUB_CMD_READY, s->id);
+    cJSON_AddNumberToObject(json, "boot", s->boot_id);
+    startup = cJSON_AddObjectToObject(json, "startup");
+    cJSON_AddNumberToObject(startup, "setup_ms", 0);
+    cJSON_AddNumberToObject(startup, "connect_ms", 0);
+    cJSON_AddNumberToObject(startup, "ready_ms", ack_ms);
+    sim_publish_json(s, topic, json);
+    cJSON_Delete(json);
+}
+
+// what the scanner sends after an AP search, one AP seen by everyone
+static void sim_send_ap_list(struct sim_scanner *s)
+{
+    topic_t topic = {.qos = 1};
+    cJSON *json = cJSON_CreateObject();
+    cJSON *list = cJSON_AddArrayToObject(json, "data");
+    cJSON *ap = cJSON_CreateObject();
+
+    sprintf(topic.name, "%s/%s", SCANNER_PUB_DATA, s->id);
+    cJSON_AddNumberToObject(json, "type", AP_LIST);
+    cJSON_AddNumberToObject(json, "count", 1);
+    cJSON_AddStringToObject(ap, "ssid", sim.ap_ssid);
+    cJSON_AddStringToObject(ap, "bssid", sim.ap_bssid);
+    cJSON_AddNumberToObject(ap, "channel", sim.ap_channel);
+    cJSON_AddNumberToObject(ap, "beacon_int", 100);
+    cJSON_AddItemToArray(list, ap);
+    cJSON_AddArrayToObject(json, "survey");
+    sim_publish_json(s, topic, json);
+    cJSON_Delete(json);
+}
+
+static int sim_next_rssi(struct sim_scanner *s)
+{
+    if (sim.replay_n)
+        return sim.replay[s->replay_pos++ % sim.replay_n];
+
+    s->rssi += (int)(rand_r(&s->seed) % 3) - 1;
+    if (s->rssi < -90)
+        s->rssi = -90;
+    if (s->rssi > -30)
+        s->rssi = -30;
+    return s->rssi;
+}
+
+// same fields and topic choice as the scanner's batch_to_json() and msg_send_cb()
+static void sim_send_samples(struct sim_scanner *s, long long period_ms)
+{
+    topic_t topic;
+    payload_t payload;
+    cJSON *json = cJSON_CreateObject();
+    cJSON *list;
+    long long now_ms = time_millis();
+    char *msg;
+    int ret;
+
+    topic.qos = 1;
+    topic.flags = MQTT_PUB_EXPIRE | MQTT_PUB_WINDOW;
+    if (s->shard >= 0)
+        sprintf(topic.name, "%s/%d/%s", SCANNER_PUB_INGEST, s->shard, s->id);
+    else
+        sprintf(topic.name, "%s/%s", SCANNER_PUB_DATA, s->id);
+
+    cJSON_AddNumberToObject(json, "type", PKT_LIST);
+    cJSON_AddNumberToObject(json, "count", sim.batch);
+    list = cJSON_AddArrayToObject(json, "data");
+    for (int i = 0; i < sim.batch; i++) {
+        cJSON *pkt = cJSON_CreateObject();
+        cJSON *radio = cJSON_AddObjectToObject(pkt, "radio");
+        cJSON *ap = cJSON_AddObjectToObject(pkt, "ap");
+
+        cJSON_AddNumberToObject(radio, "channel_freq", chan_freq(s->channel));
+        cJSON_AddNumberToObject(radio, "antenna_signal", sim_next_rssi(s));
+        cJSON_AddNumberToObject(radio, "noise", -95);
+        cJSON_AddNumberToObject(ap, "channel_freq", s->channel);
+        cJSON_AddStringToObject(ap, "ssid", s->ssid);
+        cJSON_AddStringToObject(ap, "bssid", s->bssid);
+        cJSON_AddNumberToObject(ap, "timestamp", now_ms - period_ms + i * period_ms / sim.batch);
+        cJSON_AddNumberToObject(pkt, "slot", 0);
+        cJSON_AddItemToArray(list, pkt);
+    }
+    msg = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+    if (!msg)
+        return;
+
+    payload.data = msg;
+    payload.len = strlen(msg);
+    ret = mqtt_client_publish(s->mqtt, topic, payload);
+    free(msg);
+
+    pthread_mutex_lock(&sim.lock);
+    sim.totals.generated++;
+    if (ret == MQTT_ERR_WINDOW_FULL)
+        sim.totals.window_full++;
+    else if (ret < 0)
+        sim.totals.failed++;
+    else
+        sim.totals.sent++;
+    pthread_mutex_unlock(&sim.lock);
+}
+
+static void sim_select_ap(struct sim_scanner *s, void *data)
+{
+    cJSON *json = cJSON_Parse(data);
+    cJSON *aps = cJSON_GetObjectItem(json, "aps");
+    cJSON *ap = cJSON_IsArray(aps) ? cJSON_GetArrayItem(aps, 0) : json;
+    cJSON *bssid = cJSON_GetObjectItem(ap, "bssid");
+    cJSON *ssid = cJSON_GetObjectItem(ap, "ssid");
+    cJSON *channel = cJSON_GetObjectItem(ap, "channel");
+
+    if (cJSON_IsString(bssid)) {
+        snprintf(s->bssid, sizeof(s->bssid), "%s", bssid->valuestring);
+        snprintf(s->ssid, sizeof(s->ssid), "%s", cJSON_IsString(ssid) ? ssid->valuestring : "");
+        s->channel = cJSON_IsNumber(channel) ? channel->valueint : sim.ap_channel;
+        s->capturing = 1;
+        s->next_send_us = time_mono_us();
+    }
+    cJSON_Delete(json);
+}
+
+static void sim_on_reg_ack(struct sim_scanner *s, void *data, u_int32_t len)
+{
+    cJSON *json, *shard;
+    long long lat;
+
+    if (s->state != SIM_REGISTERING)
+        return;
+    lat = time_mono_us() - s->reg_first_us;
+    json = len ? cJSON_Parse(data) : NULL;
+    shard = cJSON_GetObjectItem(json, "shard");
+    s->shard = cJSON_IsNumber(shard) ? shard->valueint : -1;
+    cJSON_Delete(json);
+    s->state = SIM_READY;
+    sim_send_ready(s, lat / 1000);
+
+    pthread_mutex_lock(&sim.lock);
+    sim.lat_us[sim.lat_n++ % SIM_LAT_KEEP] = lat;
+    sim.totals.reg_acks++;
+    pthread_mutex_unlock(&sim.lock);
+}
+
+static void sim_start_register(struct sim_scanner *s)
+{
+    s->state = SIM_REGISTERING;
+    s->shard = -1;
+    s->reg_first_us = 0;
+    s->reg_next_us = 0;
+    s->backoff_ms = SIM_REG_BACKOFF_MIN_MS;
+}
+
+// a scanner's own connection thread
+static void sim_on_message(void *userdata, const char *topic, void *data, u_int32_t len)
+{
+    struct sim_scanner *s = userdata;
+    const char *cmd = strrchr(topic, '/');
+
+    cmd = cmd ? cmd + 1 : topic;
+    pthread_mutex_lock(&s->shared.lock);
+    if (!s->mqtt || s->state == SIM_DOWN)
+        goto out;
+
+    if (mqtt_is_sub_match(SCANNER_SUB_CMD_ALL, (char *)topic)) {
+        if (!strcmp(cmd, CMD_SCAN) && s->state == SIM_READY)
+            sim_send_ap_list(s);
+        else if (!strcmp(cmd, CMD_SELECT_AP))
+            sim_select_ap(s, data);
+        else if (!strcmp(cmd, CMD_STOP))
+            s->capturing = 0;
+        else if (!strcmp(cmd, CMD_END)) {
+            // manager went away, register again for the next one
+            s->capturing = 0;
+            sim_start_register(s);
+        }
+    } else if (!strcmp(cmd, SCANNER_REG_ACK)) {
+        sim_on_reg_ack(s, data, len);
+    }
+out:
+    pthread_mutex_unlock(&s->shared.lock);
+}
+
+static int sim_connect(struct sim_scanner *s)
+{
+    topic_t will = {0};
+
+    s->boot_id = (u_int32_t)(time_millis() ^ ((s - sim.scanners) << 16) ^ rand_r(&s->seed));
+    s->shared.connected = 0;
+    if (!(s->mqtt = mqtt_client_new(&sim.conf, s->id, sim_on_message, s, &s->shared)))
+        return -1;
+
+    memset(s->sub_topics, 0, sizeof(s->sub_topics));
+    strcpy(s->sub_topics[0].name, SCANNER_SUB_CMD_ALL);
+    s->sub_topics[0].qos = 1;
+    snprintf(s->sub_topics[1].name, MAX_TOPIC_LEN, "%s/%s/+", TOPIC_CMD_BASE, s->id);
+    s->sub_topics[1].qos = 1;
+    mqtt_client_set_sub_topics(s->mqtt, s->sub_topics);
+
+    sprintf(will.name, "%s/%s", SCANNER_PUB_CMD_CRASH, s->id);
+    mqtt_client_set_will(s->mqtt, will);
+    sim_start_register(s);
+    s->capturing = sim.autostart;
+    if (sim.autostart) {
+        strcpy(s->bssid, sim.ap_bssid);
+        strcpy(s->ssid, sim.ap_ssid);
+        s->channel = sim.ap_channel;
+    }
+    return mqtt_client_start(s->mqtt);
+}
+
+static void sim_add_stats(struct mqtt_pub_stats *to, struct mqtt_pub_stats *st)
+{
+    to->inflight += st->inflight;
+    to->published += st->published;
+    to->acked += st->acked;
+    to->nacked += st->nacked;
+    to->dropped += st->dropped;
+    to->resent += st->resent;
+    to->lost += st->lost;
+    to->ack_sum_us += st->ack_sum_us;
+    if (st->ack_max_us > to->ack_max_us)
+        to->ack_max_us = st->ack_max_us;
+}
+
+// drops the connection without a disconnect, the broker sends the will like for a real crash
+static void sim_crash(struct sim_scanner *s, long long now_us)
+{
+    struct mqtt_client *mqtt;
+    struct mqtt_pub_stats st;
+
+    pthread_mutex_lock(&s->shared.lock);
+    mqtt = s->mqtt;
+    s->mqtt = NULL;
+    s->state = SIM_DOWN;
+    s->capturing = 0;
+    s->rejoin_us = now_us + (long long)(sim.down_sec * 1e6);
+    pthread_mutex_unlock(&s->shared.lock);
+
+    // outside the lock, the connection's thread may be waiting on it and has to finish first
+    mqtt_client_get_pub_stats(mqtt, &st);
+    st.lost += st.inflight; // won't be acked anymore
+    st.inflight = 0;
+    mqtt_client_free(mqtt);
+
+    pthread_mutex_lock(&sim.lock);
+    sim_add_stats(&sim.totals.freed, &st);
+    sim.totals.crashes++;
+    pthread_mutex_unlock(&sim.lock);
+}
+
+static void sim_tick(struct sim_scanner *s, long long now_us, double crash_p)
+{
+    long long period_us = (long long)(1e6 / sim.rate);
+    int sends = 0;
+
+    if (s->state == SIM_DOWN) {
+        if (s->rejoin_us && now_us >= s->rejoin_us) {
+            s->rejoin_us = 0;
+            pthread_mutex_lock(&s->shared.lock);
+            if (sim_connect(s))
+                fprintf(stderr, "%s: can't reconnect\n", s->id);
+            pthread_mutex_unlock(&s->shared.lock);
+            pthread_mutex_lock(&sim.lock);
+            sim.totals.rejoins++;
+            pthread_mutex_unlock(&sim.lock);
+        }
+        return;
+    }
+
+    if (crash_p > 0 && rand_r(&s->seed) < crash_p * RAND_MAX) {
+        sim_crash(s, now_us);
+        return;
+    }
+
+    pthread_mutex_lock(&s->shared.lock);
+    if (s->state == SIM_REGISTERING && s->shared.connected && now_us >= s->reg_next_us) {
+        if (!s->reg_first_us)
+            s->reg_first_us = now_us;
+        sim_send_register(s, 0);
+        s->reg_next_us = now_us + s->backoff_ms * 1000LL;
+        if (s->backoff_ms < SIM_REG_BACKOFF_MAX_MS)
+            s->backoff_ms *= 2;
+        if (s->backoff_ms > SIM_REG_BACKOFF_MAX_MS)
+            s->backoff_ms = SIM_REG_BACKOFF_MAX_MS;
+    }
+
+    // catches up a little after a stall, but doesn't flood after a long one
+    while (s->state == SIM_READY && s->capturing && now_us >= s->next_send_us && sends++ < 4) {
+        sim_send_samples(s, period_us / 1000);
+        s->next_send_us += period_us;
+    }
+    if (now_us > s->next_send_us + 4 * period_us)
+        s->next_send_us = now_us;
+    pthread_mutex_unlock(&s->shared.lock);
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void sim_report(long long elapsed_us, int final)
+{
+    struct mqtt_pub_stats st;
+    struct sim_totals t;
+    long long lat[SIM_LAT_KEEP];
+    int n_lat, ready = 0, registering = 0, down = 0, slow = 0;
+    long long now_us = time_mono_us();
+    u_int64_t loss;
+
+    for (int i = 0; i < sim.n; i++) {
+        struct sim_scanner *s = &sim.scanners[i];
+
+        pthread_mutex_lock(&s->shared.lock);
+        if (s->state == SIM_READY)
+            ready++;
+        else if (s->state == SIM_REGISTERING) {
+            registering++;
+            if (s->reg_first_us && now_us - s->reg_first_us > SIM_REG_BACKOFF_MAX_MS * 1000LL)
+                slow++;
+        } else
+            down++;
+        pthread_mutex_unlock(&s->shared.lock);
+    }
+
+    pthread_mutex_lock(&sim.lock);
+    t = sim.totals;
+    st = t.freed;
+    n_lat = sim.lat_n < SIM_LAT_KEEP ? sim.lat_n : SIM_LAT_KEEP;
+    memcpy(lat, sim.lat_us, n_lat * sizeof(long long));
+    pthread_mutex_unlock(&sim.lock);
+
+    for (int i = 0; i < sim.n; i++) {
+        struct mqtt_pub_stats cst;
+        struct sim_scanner *s = &sim.scanners[i];
+
+        pthread_mutex_lock(&s->shared.lock);
+        if (s->mqtt && !mqtt_client_get_pub_stats(s->mqtt, &cst))
+            sim_add_stats(&st, &cst);
+        pthread_mutex_unlock(&s->shared.lock);
+    }
+    qsort(lat, n_lat, sizeof(long long), cmp_ll);
+
+    // everything that was generated but never made it: window full, refused, in flight at a crash.
+    // What was in flight over a reconnect is resent, not lost
+    loss = t.window_full + t.failed + st.lost;
+    printf("%s%5.0fs: ready %d/%d, registering %d (%d waiting >%ds), down %d | reg ack %llu",
+           final ? "total " : "", elapsed_us / 1e6, ready, sim.n, registering, slow,
+           SIM_REG_BACKOFF_MAX_MS / 1000, down, (unsigned long long)t.reg_acks);
+    if (n_lat)
+        printf(" p50 %.1f p99 %.1f max %.1f ms", lat[n_lat / 2] / 1000.0,
+               lat[(n_lat * 99) / 100] / 1000.0, lat[n_lat - 1] / 1000.0);
+    printf(" | PKT_LIST %llu (%.0f/s), lost %llu (%.3f%%: window %llu, refused %llu, in flight %llu)"
+           " | broker ack avg %.2f max %.2f ms | crashes %llu\n",
+           (unsigned long long)t.generated, t.generated / (elapsed_us / 1e6),
+           (unsigned long long)loss, t.generated ? 100.0 * loss / t.generated : 0.0,
+           (unsigned long long)t.window_full, (unsigned long long)t.failed, (unsigned long long)st.lost,
+           st.acked ? st.ack_sum_us / 1000.0 / st.acked : 0.0, st.ack_max_us / 1000.0,
+           (unsigned long long)t.crashes);
+    fflush(stdout);
+}
+
+// recorded results CSV: "ssid;bssid;channel" then "timestamp;variance;signal" rows
+static int sim_load_replay(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    char *line = NULL, *field;
+    size_t len = 0, cap = 0;
+    ssize_t count;
+    int first = 1;
+
+    if (!fp) {
+        fprintf(stderr, "Can't open %s\n", path);
+        return -1;
+    }
+    while ((count = getline(&line, &len, fp)) != -1) {
+        if (count && line[count - 1] == '\n')
+            line[count - 1] = '\0';
+        if (first) {
+            first = 0;
+            if ((field = strtok(line, ";")))
+                snprintf(sim.ap_ssid, sizeof(sim.ap_ssid), "%s", field);
+            if ((field = strtok(NULL, ";")))
+                snprintf(sim.ap_bssid, sizeof(sim.ap_bssid), "%s", field);
+            if ((field = strtok(NULL, ";")))
+                sim.ap_channel = atoi(field);
+            continue;
+        }
+        if (!(field = strrchr(line, ';')))
+            continue;
+        if (sim.replay_n == cap) {
+            cap = cap ? cap * 2 : 4096;
+            sim.replay = realloc(sim.replay, cap);
+        }
+        sim.replay[sim.replay_n++] = (int8_t)atoi(field + 1);
+    }
+    free(line);
+    fclose(fp);
+    printf("Replaying %zu samples of %s (%s)\n", sim.replay_n, sim.ap_ssid, sim.ap_bssid);
+    return sim.replay_n ? 0 : -1;
+}
+
+static int sim_parse_args(int argc, char *argv[], char **conf_path)
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:n:p:r:b:f:d:C:D:i:s:a")) != -1) {
+        switch (opt) {
+        case 'c':
+            *conf_path = optarg;
+            break;
+        case 'n':
+            sim.n = atoi(optarg);
+            break;
+        case 'p':
+            sim.prefix = optarg;
+            break;
+        case 'r':
+            sim.rate = atof(optarg);
+            break;
+        case 'b':
+            sim.batch = atoi(optarg);
+            break;
+        case 'f':
+            sim.replay_path = optarg;
+            break;
+        case 'd':
+            sim.duration = atoi(optarg);
+            break;
+        case 'C':
+            sim.crash_mean = atof(optarg);
+            break;
+        case 'D':
+            sim.down_sec = atof(optarg);
+            break;
+        case 'i':
+            sim.report_sec = atoi(optarg);
+            break;
+        case 's':
+            sim.stagger_ms = atoi(optarg);
+            break;
+        case 'a':
+            sim.autostart = 1;
+            break;
+        default:
+            goto err;
+        }
+    }
+    if (!*conf_path || sim.n < 1 || sim.n > SIM_MAX_SCANNERS || sim.rate <= 0 ||
+        sim.batch < 1 || sim.batch > PKT_MAX || sim.report_sec < 1)
+        goto err;
+    return 0;
+err:
+    printf("Usage: %s -c MQTT_CONFIG [-n SCANNERS (max %d)] [-p ID_PREFIX] [-r PKT_LISTS_PER_SEC]\n"
+           "       [-b SAMPLES_PER_PKT_LIST (max %d)] [-f RESULTS_CSV (replay)] [-d DURATION_SEC]\n"
+           "       [-C MEAN_SEC_BETWEEN_CRASHES] [-D DOWN_SEC] [-i REPORT_SEC] [-s CONNECT_STAGGER_MS]\n"
+           "       [-a (send samples without waiting for an AP selection)]\n",
+           argv[0], SIM_MAX_SCANNERS, PKT_MAX);
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    char *conf_path = NULL;
+    long long start_us, next_report_us, now_us;
+    double crash_p;
+    pthread_condattr_t cond_attr;
+
+    if (sim_parse_args(argc, argv, &conf_path))
+        return EXIT_FAILURE;
+    if (sim.replay_path && sim_load_replay(sim.replay_path))
+        return EXIT_FAILURE;
+    if (mqtt_read_config(conf_path, &sim.conf))
+        return EXIT_FAILURE;
+    sim.conf.quiet = 1;
+
+    signal(SIGINT, sim_sig_handler);
+    signal(SIGTERM, sim_sig_handler);
+    mosquitto_lib_init();
+    pthread_mutex_init(&sim.lock, NULL);
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+
+    sim.scanners = calloc(sim.n, sizeof(struct sim_scanner));
+    printf("Starting %d scanners, %g PKT_LISTs/s of %d samples each\n", sim.n, sim.rate, sim.batch);
+    for (int i = 0; i < sim.n && !sim.stop; i++) {
+        struct sim_scanner *s = &sim.scanners[i];
+
+        snprintf(s->id, sizeof(s->id), "%s%03d", sim.prefix, i);
+        pthread_mutex_init(&s->shared.lock, NULL);
+        pthread_cond_init(&s->shared.cond, &cond_attr);
+        s->seed = i + 1;
+        s->rssi = -50 - i % 30;
+        s->replay_pos = sim.replay_n ? (size_t)i * 997 % sim.replay_n : 0;
+
+        pthread_mutex_lock(&s->shared.lock);
+        if (sim_connect(s))
+            fprintf(stderr, "%s: can't connect\n", s->id);
+        pthread_mutex_unlock(&s->shared.lock);
+        if (sim.stagger_ms)
+            msleep(sim.stagger_ms);
+    }
+    pthread_condattr_destroy(&cond_attr);
+
+    // per tick chance of a crash for a mean time between them of crash_mean
+    crash_p = sim.crash_mean > 0 ? SIM_TICK_MS / 1000.0 / sim.crash_mean : 0;
+    start_us = time_mono_us();
+    next_report_us = start_us + sim.report_sec * 1000000LL;
+    while (!sim.stop) {
+        now_us = time_mono_us();
+        if (sim.duration && now_us - start_us >= sim.duration * 1000000LL)
+            break;
+        for (int i = 0; i < sim.n; i++)
+            sim_tick(&sim.scanners[i], now_us, crash_p);
+        if (now_us >= next_report_us) {
+            sim_report(now_us - start_us, 0);
+            next_report_us += sim.report_sec * 1000000LL;
+        }
+        msleep(SIM_TICK_MS);
+    }
+
+    // leave like a scanner on SIGINT, unregister and disconnect cleanly
+    for (int i = 0; i < sim.n; i++) {
+        struct sim_scanner *s = &sim.scanners[i];
+
+        pthread_mutex_lock(&s->shared.lock);
+        if (s->mqtt && s->shared.connected)
+            sim_send_register(s, 1);
+        pthread_mutex_unlock(&s->shared.lock);
+    }
+    msleep(500); // in-flight acks
+    sim_report(time_mono_us() - start_us, 1);
+    for (int i = 0; i < sim.n; i++) {
+        struct sim_scanner *s = &sim.scanners[i];
+
+        if (s->mqtt) {
+            mqtt_client_stop(s->mqtt, 0);
+            mqtt_client_free(s->mqtt);
+        }
+    }
+    mosquitto_lib_cleanup();
+    free(sim.scanners);
+    free(sim.replay);
+    return 0;
+}
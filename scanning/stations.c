@@ -0,0 +1,217 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "stations.h"
+#include "utils.h"
+
+// called per frame from capture thread, everything is O(1) and nothing allocates
+
+static u_int32_t sta_hash(const u_int8_t *mac)
+{
+    u_int64_t v = 0;
+
+    memcpy(&v, mac, 6);
+    return (v * 0x9E3779B97F4A7C15ULL) >> (64 - STA_HASH_BITS);
+}
+
+static void sta_lru_unlink(struct sta_table *t, int16_t i)
+{
+    struct sta_entry *e = &t->pool[i];
+
+    if (e->prev != STA_NONE)
+        t->pool[e->prev].next = e->next;
+    else
+        t->head = e->next;
+    if (e->next != STA_NONE)
+        t->pool[e->next].prev = e->prev;
+    else
+        t->tail = e->prev;
+}
+
+static void sta_lru_push(struct sta_table *t, int16_t i)
+{
+    struct sta_entry *e = &t->pool[i];
+
+    e->prev = STA_NONE;
+    e->next = t->head;
+    if (t->head != STA_NONE)
+        t->pool[t->head].prev = i;
+    t->head = i;
+    if (t->tail == STA_NONE)
+        t->tail = i;
+}
+
+static void sta_remove(struct sta_table *t, int16_t i)
+{
+    int16_t *link = &t->buckets[sta_hash(t->pool[i].mac)];
+
+    while (*link != i)
+        link = &t->pool[*link].hnext;
+    *link = t->pool[i].hnext;
+
+    sta_lru_unlink(t, i);
+    t->pool[i].hnext = t->free;
+    t->free = i;
+    t->count--;
+}
+
+static void sta_evict(struct sta_table *t)
+{
+    struct sta_entry *e = &t->pool[t->tail];
+
+    // never reported ones, e.g. a random MAC seen once, the manager doesn't know about
+    if (e->reported) {
+        memcpy(t->evicted_macs[(t->evicted_head + t->evicted_n) % STA_MAX], e->mac, 6);
+        if (t->evicted_n < STA_MAX)
+            t->evicted_n++;
+        else
+            t->evicted_head = (t->evicted_head + 1) % STA_MAX;
+    }
+    sta_remove(t, t->tail);
+    t->evicted++;
+}
+
+static void sta_reset_interval(struct sta_entry *e)
+{
+    e->frames = 0;
+    e->rssi_n = 0;
+    e->rssi_sum = 0;
+    e->rssi_min = INT8_MAX;
+    e->rssi_max = INT8_MIN;
+}
+
+struct sta_table *sta_create()
+{
+    struct sta_table *t = malloc(sizeof(struct sta_table));
+
+    if (!t)
+        return NULL;
+    memset(t, 0, sizeof(*t)); // prefault, table is touched from capture path
+    for (int i = 0; i < STA_BUCKETS; i++)
+        t->buckets[i] = STA_NONE;
+    for (int i = 0; i < STA_MAX; i++)
+        t->pool[i].hnext = i + 1 < STA_MAX ? i + 1 : STA_NONE;
+    t->free = 0;
+    t->head = t->tail = STA_NONE;
+    t->gen = 1;
+    return t;
+}
+
+void sta_destroy(struct sta_table *t)
+{
+    free(t);
+}
+
+static int16_t sta_find(struct sta_table *t, const u_int8_t *mac)
+{
+    int16_t i = t->buckets[sta_hash(mac)];
+
+    while (i != STA_NONE && memcmp(t->pool[i].mac, mac, 6))
+        i = t->pool[i].hnext;
+    return i;
+}
+
+void sta_update(struct sta_table *t, const u_int8_t *mac, int8_t rssi, int seen, u_int64_t now_ms)
+{
+    u_int32_t h = sta_hash(mac);
+    int16_t i = sta_find(t, mac);
+    struct sta_entry *e;
+
+    if (i == STA_NONE) {
+        if (t->free == STA_NONE)
+            sta_evict(t);
+        i = t->free;
+        e = &t->pool[i];
+        t->free = e->hnext;
+        memset(e, 0, sizeof(*e));
+        memcpy(e->mac, mac, 6);
+        e->first_seen_ms = now_ms;
+        e->hnext = t->buckets[h];
+        t->buckets[h] = i;
+        t->count++;
+        sta_reset_interval(e);
+    } else {
+        e = &t->pool[i];
+        sta_lru_unlink(t, i);
+    }
+    sta_lru_push(t, i);
+
+    if (e->gen != t->gen) {
+        sta_reset_interval(e);
+        e->gen = t->gen;
+    }
+    e->seen |= seen;
+    e->last_seen_ms = now_ms;
+    e->total_frames++;
+    e->frames++;
+    // 0 - not reported
+    if (rssi) {
+        e->rssi_n++;
+        e->rssi_sum += rssi;
+        e->rssi_min = MIN(e->rssi_min, rssi);
+        e->rssi_max = MAX(e->rssi_max, rssi);
+    }
+}
+
+cJSON *sta_flush_json(struct sta_table *t, u_int64_t now_ms)
+{
+    char mac[32];
+    struct sta_entry *e;
+    cJSON *json = cJSON_CreateObject();
+    cJSON *list = cJSON_AddArrayToObject(json, "data");
+    cJSON *gone = cJSON_AddArrayToObject(json, "gone");
+    int n = 0;
+
+    // touched ones were moved to the front, stop at the first from an older interval
+    for (int16_t i = t->head; i != STA_NONE && t->pool[i].gen == t->gen; i = t->pool[i].next) {
+        e = &t->pool[i];
+        sprintf(mac, MAC_FMT, MAC_BYTES(e->mac));
+        cJSON *sta = cJSON_CreateObject();
+        cJSON_AddStringToObject(sta, "mac", mac);
+        cJSON_AddNumberToObject(sta, "frames", e->frames);
+        cJSON_AddNumberToObject(sta, "total", e->total_frames);
+        cJSON_AddNumberToObject(sta, "seen", e->seen);
+        // locally administered bit, randomized MACs of probing phones
+        cJSON_AddBoolToObject(sta, "random", e->mac[0] & 0x02);
+        cJSON_AddNumberToObject(sta, "first_seen", e->first_seen_ms);
+        cJSON_AddNumberToObject(sta, "last_seen", e->last_seen_ms);
+        if (e->rssi_n) {
+            cJSON *rssi = cJSON_AddObjectToObject(sta, "rssi");
+            cJSON_AddNumberToObject(rssi, "min", e->rssi_min);
+            cJSON_AddNumberToObject(rssi, "avg", (double)e->rssi_sum / e->rssi_n);
+            cJSON_AddNumberToObject(rssi, "max", e->rssi_max);
+        }
+        cJSON_AddItemToArray(list, sta);
+        e->reported = 1;
+    }
+
+    while (t->evicted_n && n < STA_GONE_MAX) {
+        u_int8_t *evicted = t->evicted_macs[t->evicted_head];
+
+        // came back since, it's in the table (and maybe in data above) again
+        if (sta_find(t, evicted) == STA_NONE) {
+            sprintf(mac, MAC_FMT, MAC_BYTES(evicted));
+            cJSON_AddItemToArray(gone, cJSON_CreateString(mac));
+            n++;
+        }
+        t->evicted_head = (t->evicted_head + 1) % STA_MAX;
+        t->evicted_n--;
+    }
+
+    // oldest are at the back
+    while (t->tail != STA_NONE && n < STA_GONE_MAX &&
+           now_ms > t->pool[t->tail].last_seen_ms + STA_EXPIRE_MS) {
+        sprintf(mac, MAC_FMT, MAC_BYTES(t->pool[t->tail].mac));
+        cJSON_AddItemToArray(gone, cJSON_CreateString(mac));
+        sta_remove(t, t->tail);
+        n++;
+    }
+
+    cJSON_AddNumberToObject(json, "count", cJSON_GetArraySize(list));
+    cJSON_AddNumberToObject(json, "active", t->count);
+    cJSON_AddNumberToObject(json, "evicted", t->evicted);
+
+    t->evicted = 0;
+    t->gen++;
+    return json;
+}
@@ -0,0 +1,125 @@
+#include <time.h>
+#include "trace.h"
+
+int trace_enabled;
+
+static atomic_int dump_requested;
+static struct trace_hist hists[TR_MAX];
+
+static const char *stage_names[TR_MAX] = {
+    [TR_KERNEL_TO_HANDLER] = "kernel_to_handler",
+    [TR_HANDLER_TO_FLUSH] = "handler_to_flush",
+    [TR_SERIALIZE] = "serialize",
+    [TR_PUBLISH] = "publish",
+    [TR_ACK] = "ack",
+    [TR_CAPTURE_TO_PUBLISH] = "capture_to_publish",
+    [TR_SCHED_WAKEUP] = "sched_wakeup",
+};
+
+// pcap timestamps are wall clock
+long long trace_since_kernel_us(const struct timeval *tv)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (ts.tv_sec - tv->tv_sec) * 1000000LL + (ts.tv_nsec / 1000 - tv->tv_usec);
+}
+
+static int trace_bucket(unsigned long long val)
+{
+    int msb, shift, idx;
+
+    if (val < TRACE_SUB_COUNT)
+        return (int)val;
+
+    msb = 63 - __builtin_clzll(val);
+    shift = msb - TRACE_SUB_BITS;
+    idx = (shift + 1) * TRACE_SUB_COUNT + (int)((val >> shift) - TRACE_SUB_COUNT);
+    return idx < TRACE_BUCKETS ? idx : TRACE_BUCKETS - 1;
+}
+
+// middle of the bucket value range
+static unsigned long long trace_bucket_value(int idx)
+{
+    int shift;
+    unsigned long long low;
+
+    if (idx < TRACE_SUB_COUNT * 2)
+        return idx;
+
+    shift = idx / TRACE_SUB_COUNT - 1;
+    low = (unsigned long long)(idx % TRACE_SUB_COUNT + TRACE_SUB_COUNT) << shift;
+    return low + ((1ULL << shift) >> 1);
+}
+
+void trace_observe(trace_stage_t stage, long long us)
+{
+    struct trace_hist *h = &hists[stage];
+    unsigned long long val = us > 0 ? us : 0;
+    unsigned long long max = atomic_load_explicit(&h->max, memory_order_relaxed);
+
+    atomic_fetch_add_explicit(&h->buckets[trace_bucket(val)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+    while (val > max && !atomic_compare_exchange_weak_explicit(&h->max, &max, val,
+                                                               memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+long long trace_percentile(trace_stage_t stage, double q)
+{
+    struct trace_hist *h = &hists[stage];
+    unsigned long long count = atomic_load(&h->count);
+    unsigned long long rank, seen = 0;
+
+    if (!count)
+        return 0;
+
+    rank = (unsigned long long)(q * count);
+    if (rank >= count)
+        rank = count - 1;
+
+    for (int i = 0; i < TRACE_BUCKETS; i++) {
+        seen += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+        if (seen > rank)
+            return trace_bucket_value(i);
+    }
+    return atomic_load(&h->max);
+}
+
+// async-signal-safe, actual dump happens on capture thread
+void trace_request_dump()
+{
+    atomic_store(&dump_requested, 1);
+}
+
+void trace_dump_if_requested(FILE *fp)
+{
+    if (atomic_load_explicit(&dump_requested, memory_order_relaxed) && atomic_exchange(&dump_requested, 0))
+        trace_dump(fp);
+}
+
+void trace_dump(FILE *fp)
+{
+    fprintf(fp, "Latency trace (%s), us:\n", trace_enabled ? "enabled" : "disabled");
+    fprintf(fp, "%-20s %10s %10s %10s %10s %10s\n", "stage", "count", "p50", "p99", "p999", "max");
+    for (int i = 0; i < TR_MAX; i++) {
+        fprintf(fp, "%-20s %10llu %10lld %10lld %10lld %10llu\n", stage_names[i],
+                atomic_load(&hists[i].count), trace_percentile(i, 0.5), trace_percentile(i, 0.99),
+                trace_percentile(i, 0.999), atomic_load(&hists[i].max));
+    }
+    fflush(fp);
+}
+
+cJSON *trace_to_json()
+{
+    cJSON *json = cJSON_CreateObject();
+
+    for (int i = 0; i < TR_MAX; i++) {
+        cJSON *stage = cJSON_AddObjectToObject(json, stage_names[i]);
+        cJSON_AddNumberToObject(stage, "count", atomic_load(&hists[i].count));
+        cJSON_AddNumberToObject(stage, "p50", trace_percentile(i, 0.5));
+        cJSON_AddNumberToObject(stage, "p99", trace_percentile(i, 0.99));
+        cJSON_AddNumberToObject(stage, "p999", trace_percentile(i, 0.999));
+        cJSON_AddNumberToObject(stage, "max", atomic_load(&hists[i].max));
+    }
+    return json;
+}
@@ -151,6 +151,14 @@ long long time_elapsed_ms(long long start)
     return now - start;
 }
 
+// monotonic, for measuring intervals only
+long long time_mono_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000000LL) + (ts.tv_nsec / 1000);
+}
+
 int msleep(long msec)
 {
     struct timespec req = {0};
@@ -0,0 +1,135 @@
+#!/usr/bin/env python3
+# Session archive: builds a synthetic archive of continuous captures through the same add() path the
+# manager uses, then times range queries at random points of it. For comparison, one day of one
+# scanner is written as the per session CSV the manager records and the time to filter it is
+# scaled up to the whole archive, that's what answering the same question from CSVs costs.
+import argparse
+import datetime
+import os
+import random
+import shutil
+import sys
+import tempfile
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, os.path.join(HERE, "..", "..", "management"))
+
+import consts  # noqa: E402
+from archive import Archive  # noqa: E402
+
+import numpy as np  # noqa: E402
+
+APS = [{"ssid": "wfan-bench", "bssid": "02:00:00:00:00:aa", "channel": 6},
+       {"ssid": "wfan-bench-5g", "bssid": "02:00:00:00:00:bb", "channel": 36}]
+DAY_MS = 86_400_000
+HOUR_MS = 3_600_000
+
+
+def synth(rng: np.random.Generator, start: int, end: int, rate: float):
+    """Jittered samples at about rate per second, RSSI a bounded random walk"""
+    n = int((end - start) / 1000 * rate)
+    step = 1000 / rate
+    ts = start + (np.arange(n) * step + rng.uniform(0, step * 0.5, n)).astype(np.int64)
+    sig = np.clip(-60 + np.cumsum(rng.integers(-1, 2, n)) % 20 - 10, -90, -30).astype(np.int8)
+    var = rng.gamma(2.0, 1.5, n).astype(np.float32)
+    return ts, sig, var
+
+
+def build(path: str, start: int, days: int, scanners: int, rate: float, seed: int) -> Archive:
+    rng = np.random.default_rng(seed)
+    archive = Archive(path)
+    names = [f"bench{i}" for i in range(scanners)]
+    t = time.perf_counter()
+    for day in range(days):
+        # one capture a day, the AP switches every other day
+        ap = APS[day // 2 % len(APS)]
+        session = archive.begin_session(ap)
+        for hour in range(24):
+            lo = start + day * DAY_MS + hour * HOUR_MS
+            for name in names:
+                archive.add(name, session, ap["bssid"], *synth(rng, lo, lo + HOUR_MS, rate))
+        archive.end_session(session)
+        archive.sync()  # keeps what's queued to a day
+    elapsed = time.perf_counter() - t
+    size = os.path.getsize(path)
+    print(f"archive: {days} days, {scanners} scanners, {archive.samples:,} samples in {archive.blocks:,} blocks")
+    print(f"  built in {elapsed:.1f}s ({archive.samples / elapsed / 1e6:.2f} M samples/s),"
+          f" {size / 2**20:.0f} MiB, {size / archive.samples:.1f} B/sample")
+    return archive
+
+
+def time_queries(archive: Archive, start: int, days: int, span: int, runs: int, seed: int, **kw):
+    rng = random.Random(seed)
+    lat, counts = [], []
+    for _ in range(runs):
+        lo = start + rng.randrange(0, days * DAY_MS - span)
+        t = time.perf_counter()
+        res = archive.query(lo, lo + span, **kw)
+        lat.append(time.perf_counter() - t)
+        counts.append(sum(len(v[0]) for v in res.values()))
+    lat = np.array(lat) * 1000
+    return np.percentile(lat, 50), np.percentile(lat, 99), int(np.mean(counts))
+
+
+def csv_scan_estimate(tmp: str, start: int, rate: float, days: int, scanners: int, seed: int) -> float:
+    """Seconds to filter one day of one scanner's CSV for a two minute window, times days and scanners"""
+    ts, sig, var = synth(np.random.default_rng(seed), start, start + DAY_MS, rate)
+    path = os.path.join(tmp, "bench0.csv")
+    with open(path, "w") as f:
+        ap = APS[0]
+        f.write(f"{ap['ssid']};{ap['bssid']};{ap['channel']}\n")
+        fromtimestamp = datetime.datetime.fromtimestamp
+        f.write("".join(f"{fromtimestamp(t / 1000)};{v!s};{s}\n"
+                        for t, v, s in zip(ts.tolist(), var, sig.tolist())))
+
+    lo = datetime.datetime.fromtimestamp((start + DAY_MS // 2) / 1000)
+    hi = lo + datetime.timedelta(minutes=2)
+    t = time.perf_counter()
+    found = 0
+    with open(path) as f:
+        next(f)
+        for line in f:
+            stamp = datetime.datetime.fromisoformat(line[:line.index(";")])
+            if lo <= stamp <= hi:
+                found += 1
+    return (time.perf_counter() - t) * days * scanners
+
+
+def main():
+    parser = argparse.ArgumentParser(description="session archive query benchmark")
+    parser.add_argument("--days", type=int, default=30)
+    parser.add_argument("--scanners", type=int, default=4)
+    parser.add_argument("--rate", type=float, default=2, help="samples per second per scanner")
+    parser.add_argument("--runs", type=int, default=50, help="queries per case")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--keep", help="write the archive here and leave it")
+    args = parser.parse_args()
+
+    tmp = tempfile.mkdtemp(prefix="wfan-archive-")
+    path = args.keep or os.path.join(tmp, "archive.sqlite3")
+    start = int(datetime.datetime(2026, 1, 1).timestamp() * 1000)
+    try:
+        archive = build(path, start, args.days, args.scanners, args.rate, args.seed)
+        one = ["bench0"]
+        cases = [
+            ("2 min, all scanners", 2 * 60_000, {}),
+            ("2 min, one scanner", 2 * 60_000, {"scanners": one}),
+            ("1 h, all scanners", HOUR_MS, {}),
+            ("1 h, one AP", HOUR_MS, {"bssid": APS[0]["bssid"]}),
+            ("1 day, one scanner", DAY_MS, {"scanners": one}),
+        ]
+        print(f"{'query':>22} {'p50 ms':>8} {'p99 ms':>8} {'samples':>10}")
+        for name, span, kw in cases:
+            p50, p99, n = time_queries(archive, start, args.days, span, args.runs, args.seed, **kw)
+            print(f"{name:>22} {p50:>8.2f} {p99:>8.2f} {n:>10,}")
+        archive.close()
+
+        csv = csv_scan_estimate(tmp, start, args.rate, args.days, args.scanners, args.seed)
+        print(f"2 min from per session CSVs, every file read: about {csv:.1f}s (one day measured, scaled)")
+    finally:
+        shutil.rmtree(tmp)
+
+
+if __name__ == "__main__":
+    main()
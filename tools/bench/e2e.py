@@ -0,0 +1,219 @@
+#!/usr/bin/env python3
+# End to end benchmark: pcap replay -> wfan_scanner -> local mosquitto -> manager ingest.
+# Sweeps replay rates and reports throughput, CPU per sample and capture to ingest latency.
+import argparse
+import asyncio
+import json
+import os
+import shutil
+import signal
+import subprocess
+import sys
+import tempfile
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, os.path.join(HERE, "..", "..", "management"))
+
+import consts  # noqa: E402
+from data import ManagerState  # noqa: E402
+from manager import Manager  # noqa: E402
+from mqtt_client import MqttClient  # noqa: E402
+from gen_pcap import write_pcap  # noqa: E402
+
+BENCH_BSSID = "02:00:00:00:00:aa"
+BENCH_SSID = "wfan-bench"
+BENCH_CHANNEL = 6
+OTHER_RATIO = 0.2
+
+CLK_TCK = os.sysconf("SC_CLK_TCK")
+
+
+def percentile(values: list, p: float) -> float:
+    if not values:
+        return 0.0
+    values = sorted(values)
+    idx = min(len(values) - 1, int(p / 100.0 * len(values)))
+    return values[idx]
+
+
+def proc_cpu_seconds(pid: int) -> float:
+    # utime + stime, fields 14 and 15 (comm may contain spaces, split after it)
+    with open(f"/proc/{pid}/stat") as f:
+        fields = f.read().rsplit(")", 1)[1].split()
+    return (int(fields[11]) + int(fields[12])) / CLK_TCK
+
+
+def start_broker(mosquitto: str, port: int, workdir: str) -> subprocess.Popen:
+    conf = os.path.join(workdir, "mosquitto.conf")
+    with open(conf, "w") as f:
+        f.write(f"listener {port} 127.0.0.1\nallow_anonymous true\npersistence false\n")
+    broker = subprocess.Popen([mosquitto, "-c", conf],
+                              stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    time.sleep(0.5)
+    if broker.poll() is not None:
+        raise RuntimeError("mosquitto failed to start")
+    return broker
+
+
+def write_scanner_conf(port: int, workdir: str, protocol: int) -> str:
+    conf = os.path.join(workdir, "client_mqtt.conf")
+    with open(conf, "w") as f:
+        f.write(f"HOST=127.0.0.1\nPORT={port}\nUSERNAME=bench\nPASSWORD=bench\n"
+                f"PROTOCOL={protocol}\nMAX_INFLIGHT=16\nMSG_EXPIRY=10\n")
+    return conf
+
+
+class Consumer:
+    """Headless manager, same ingest path as the UI minus the rendering"""
+
+    def __init__(self, port: int):
+        self.client = MqttClient()
+        self.manager = Manager(self.client)
+        self.latencies: list[int] = []
+        self.samples = 0
+        self.recording = False
+
+        # preset so the manager answers READY with select_ap like it would mid-capture
+        self.manager.state = ManagerState.SCANNING
+        self.manager.selected_ap_obj = {
+            "ssid": BENCH_SSID, "bssid": BENCH_BSSID, "channel": BENCH_CHANNEL}
+
+        update = self.manager._update_scanner_stats
+
+        def timed_update(id, data):
+            if self.recording:
+                now_ms = time.time() * 1000
+                for item in data:
+                    self.latencies.append(now_ms - int(item["ap"]["timestamp"]))
+                self.samples += len(data)
+            return update(id, data)
+
+        self.manager._update_scanner_stats = timed_update
+        self.client.try_connect("127.0.0.1", port, "", "")
+
+    def reset(self):
+        self.latencies.clear()
+        self.samples = 0
+
+    async def run(self):
+        while True:
+            await self.manager.receive_next()
+
+    def close(self):
+        self.client.disconnect()
+
+
+async def run_rate(args, consumer: Consumer, conf: str, pcap: str, rate: int) -> dict:
+    scanner = subprocess.Popen(
+        [args.scanner, "-r", pcap, "-R", str(rate), "-c", conf, "-s", "0"],
+        stdout=subprocess.DEVNULL if not args.verbose else None,
+        stderr=subprocess.DEVNULL if not args.verbose else None)
+    try:
+        await asyncio.sleep(args.warmup)
+        consumer.reset()
+        consumer.recording = True
+        cpu_scan_start = proc_cpu_seconds(scanner.pid)
+        cpu_cons_start = time.process_time()
+        start = time.monotonic()
+
+        await asyncio.sleep(args.duration)
+
+        elapsed = time.monotonic() - start
+        cpu_scan = proc_cpu_seconds(scanner.pid) - cpu_scan_start
+        cpu_cons = time.process_time() - cpu_cons_start
+        consumer.recording = False
+    finally:
+        scanner.send_signal(signal.SIGINT)
+        try:
+            scanner.wait(timeout=5)
+        except subprocess.TimeoutExpired:
+            scanner.kill()
+
+    samples = consumer.samples
+    expected = rate * (1 - OTHER_RATIO)
+    rate_out = samples / elapsed
+    per_sample = 1e6 / samples if samples else 0
+    return {
+        "rate": rate,
+        "samples_s": rate_out,
+        "delivered": rate_out / expected if expected else 0,
+        "scanner_cpu_us": cpu_scan * per_sample,
+        "manager_cpu_us": cpu_cons * per_sample,
+        "lat_p50_ms": percentile(consumer.latencies, 50),
+        "lat_p99_ms": percentile(consumer.latencies, 99),
+        "lat_p999_ms": percentile(consumer.latencies, 99.9),
+    }
+
+
+def print_results(results: list):
+    print(f"{'rate':>8} {'samples/s':>10} {'deliv':>6} {'scan us':>8} {'mgr us':>8}"
+          f" {'p50 ms':>8} {'p99 ms':>8} {'p99.9 ms':>9}")
+    for r in results:
+        print(f"{r['rate']:>8} {r['samples_s']:>10.1f} {r['delivered']:>6.2f}"
+              f" {r['scanner_cpu_us']:>8.1f} {r['manager_cpu_us']:>8.1f}"
+              f" {r['lat_p50_ms']:>8.1f} {r['lat_p99_ms']:>8.1f} {r['lat_p999_ms']:>9.1f}")
+
+
+def sustainable(results: list, min_delivered: float, max_p99_ms: float):
+    best = None
+    for r in sorted(results, key=lambda r: r["rate"]):
+        if r["delivered"] < min_delivered or r["lat_p99_ms"] > max_p99_ms:
+            break
+        best = r["rate"]
+    return best
+
+
+async def main():
+    parser = argparse.ArgumentParser(description="wfan end to end benchmark")
+    parser.add_argument("--scanner", default="./wfan_scanner")
+    parser.add_argument("--mosquitto", default=shutil.which("mosquitto") or "mosquitto")
+    parser.add_argument("--port", type=int, default=18830)
+    parser.add_argument("--pcap", help="replay file, generated if not given")
+    parser.add_argument("--rates", default="50,100,200,500,1000,2000,5000",
+                        help="comma separated packets/s to sweep")
+    parser.add_argument("--duration", type=float, default=10)
+    parser.add_argument("--warmup", type=float, default=3)
+    parser.add_argument("--protocol", type=int, default=5, choices=[4, 5])
+    parser.add_argument("--min-delivered", type=float, default=0.95,
+                        help="delivered/expected ratio below which a rate is not sustained")
+    parser.add_argument("--max-p99", type=float, default=1000,
+                        help="p99 latency in ms above which a rate is not sustained")
+    parser.add_argument("--json", help="also dump results to this file")
+    parser.add_argument("--verbose", action="store_true")
+    args = parser.parse_args()
+
+    workdir = tempfile.mkdtemp(prefix="wfan_bench_")
+    pcap = args.pcap
+    if not pcap:
+        pcap = os.path.join(workdir, "bench.pcap")
+        write_pcap(pcap, 50000, BENCH_BSSID, BENCH_SSID, BENCH_CHANNEL, other_ratio=OTHER_RATIO)
+
+    broker = start_broker(args.mosquitto, args.port, workdir)
+    conf = write_scanner_conf(args.port, workdir, args.protocol)
+    consumer = Consumer(args.port)
+    consume = asyncio.create_task(consumer.run())
+
+    results = []
+    try:
+        for rate in [int(r) for r in args.rates.split(",")]:
+            print(f"Running {rate} packets/s for {args.duration}s...")
+            results.append(await run_rate(args, consumer, conf, pcap, rate))
+    finally:
+        consume.cancel()
+        consumer.close()
+        broker.terminate()
+        broker.wait()
+        shutil.rmtree(workdir, ignore_errors=True)
+
+    print_results(results)
+    best = sustainable(results, args.min_delivered, args.max_p99)
+    print(f"Highest sustainable rate: {best if best else 'none'} packets/s")
+
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump({"results": results, "sustainable": best}, f, indent=2)
+
+
+if __name__ == "__main__":
+    asyncio.run(main())
@@ -0,0 +1,73 @@
+#!/usr/bin/env python3
+# Synthetic radiotap beacon capture for replaying through wfan_scanner (-r)
+import argparse
+import random
+import struct
+
+LINKTYPE_IEEE802_11_RADIOTAP = 127
+
+# radiotap present bits: channel (3), antenna signal (5), noise (6)
+RADIOTAP_PRESENT = (1 << 3) | (1 << 5) | (1 << 6)
+RADIOTAP_LEN = 14
+
+
+def mac_bytes(mac: str) -> bytes:
+    return bytes(int(part, 16) for part in mac.split(":"))
+
+
+def radiotap(freq: int, signal: int, noise: int) -> bytes:
+    # channel field is 2 byte aligned, header is 8 bytes so no padding needed
+    return struct.pack(
+        "<BBHI HH bb", 0, 0, RADIOTAP_LEN, RADIOTAP_PRESENT, freq, 0x0080, signal, noise
+    )
+
+
+def beacon(bssid: bytes, ssid: str, channel: int, seq: int, interval: int = 100) -> bytes:
+    frame_ctrl = struct.pack("<BB", 0x80, 0x00)  # mgmt, subtype beacon
+    hdr = frame_ctrl + struct.pack("<H", 0) + b"\xff" * 6 + bssid + bssid + struct.pack("<H", seq << 4)
+    fixed = struct.pack("<QHH", seq * interval * 1024, interval, 0x0411)
+    ssid_b = ssid.encode()
+    tags = struct.pack("BB", 0, len(ssid_b)) + ssid_b + struct.pack("BBB", 3, 1, channel)
+    fcs = b"\x00" * 4
+    return hdr + fixed + tags + fcs
+
+
+def write_pcap(path: str, count: int, bssid: str, ssid: str = "wfan-bench", channel: int = 6,
+               other_aps: int = 3, other_ratio: float = 0.2, seed: int = 1):
+    rng = random.Random(seed)
+    target = mac_bytes(bssid)
+    others = [bytes([0x02, 0x00, 0x00, 0x00, 0x00, i + 1]) for i in range(other_aps)]
+    freq = 2407 + channel * 5
+    rssi = -55.0
+
+    with open(path, "wb") as f:
+        f.write(struct.pack("<IHHiIII", 0xA1B2C3D4, 2, 4, 0, 0, 65535, LINKTYPE_IEEE802_11_RADIOTAP))
+        for i in range(count):
+            # slow random walk, occasional dip like someone walking through the link
+            rssi = min(-30.0, max(-90.0, rssi + rng.gauss(0, 0.7)))
+            dip = -12 if (i // 200) % 10 == 0 else 0
+            if others and rng.random() < other_ratio:
+                frame_bssid, frame_ssid = rng.choice(others), "other"
+            else:
+                frame_bssid, frame_ssid = target, ssid
+            pkt = radiotap(freq, int(rssi) + dip, -95) + beacon(frame_bssid, frame_ssid, channel, i & 0xFFF)
+            ts_us = i * 1000
+            f.write(struct.pack("<IIII", ts_us // 1000000, ts_us % 1000000, len(pkt), len(pkt)))
+            f.write(pkt)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("output")
+    parser.add_argument("--count", type=int, default=20000)
+    parser.add_argument("--bssid", default="02:00:00:00:00:aa")
+    parser.add_argument("--ssid", default="wfan-bench")
+    parser.add_argument("--channel", type=int, default=6)
+    parser.add_argument("--other-ratio", type=float, default=0.2,
+                        help="share of beacons from other APs, exercises filtering")
+    args = parser.parse_args()
+    write_pcap(args.output, args.count, args.bssid, args.ssid, args.channel, other_ratio=args.other_ratio)
+
+
+if __name__ == "__main__":
+    main()
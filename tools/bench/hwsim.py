@@ -0,0 +1,485 @@
+#!/usr/bin/env python3
+# Integration and performance test bed on mac80211_hwsim radios, no Wi-Fi hardware needed.
+# hostapd beacons on virtual APs, wfan_scanner captures on a monitor interface of another radio
+# and a headless manager drives it through register -> scan -> select -> capture over a local
+# mosquitto. Reports AP discovery time, channel switch latency and sample throughput per AP.
+# Needs root, mac80211_hwsim, iw, ip and hostapd; --traffic also wpa_supplicant and ping.
+import argparse
+import asyncio
+import json
+import os
+import shutil
+import signal
+import subprocess
+import sys
+import tempfile
+import time
+
+import paho.mqtt.client as mqtt
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, os.path.join(HERE, "..", "..", "management"))
+
+import consts  # noqa: E402
+from data import ManagerState, PayloadType  # noqa: E402
+from manager import Manager  # noqa: E402
+from mqtt_client import MqttClient  # noqa: E402
+from e2e import percentile, start_broker, write_scanner_conf  # noqa: E402
+
+HWSIM_SSID = "wfan-hwsim"
+MONITOR_DEV = "wfanmon0"
+SCAN_DEV = "wfanscan0"
+STA_NETNS = "wfan-hwsim-sta"
+AP_ADDR = "10.77.0.1"
+STA_ADDR = "10.77.0.2"
+SYS_PHY = "/sys/class/ieee80211"
+SYS_NET = "/sys/class/net"
+
+
+def run(cmd: list, check: bool = True) -> str:
+    res = subprocess.run(cmd, capture_output=True, text=True)
+    if check and res.returncode:
+        raise RuntimeError(f"{' '.join(cmd)}: {res.stderr.strip()}")
+    return res.stdout
+
+
+def list_phys() -> set:
+    return set(os.listdir(SYS_PHY)) if os.path.isdir(SYS_PHY) else set()
+
+
+def phy_ifaces(phy: str) -> list:
+    ifaces = []
+    for iface in os.listdir(SYS_NET):
+        link = os.path.join(SYS_NET, iface, "phy80211")
+        if os.path.exists(link) and os.path.basename(os.path.realpath(link)) == phy:
+            ifaces.append(iface)
+    return sorted(ifaces)
+
+
+def iface_mac(iface: str) -> str:
+    with open(os.path.join(SYS_NET, iface, "address")) as f:
+        return f.read().strip().lower()
+
+
+def hist_delta(before: dict, after: dict, name: str) -> dict:
+    """Difference of one stats histogram between two snapshots, as {count, sum, buckets}"""
+    empty = {"count": 0, "sum": 0, "buckets": []}
+    a = after["hist"].get(name, empty)
+    b = before["hist"].get(name, empty)
+    base = {bound: n for bound, n in b["buckets"]}
+    return {
+        "count": a["count"] - b["count"],
+        "sum": a["sum"] - b["sum"],
+        "buckets": [[bound, n - base.get(bound, 0)] for bound, n in a["buckets"] if n - base.get(bound, 0)],
+    }
+
+
+def hist_percentile(hist: dict, p: float) -> float:
+    """Upper bound of the power of two bucket the percentile falls in, -1 is overflow"""
+    target = p / 100.0 * hist["count"]
+    seen = 0
+    for bound, n in sorted(hist["buckets"], key=lambda b: b[0] if b[0] >= 0 else float("inf")):
+        seen += n
+        if seen >= target:
+            return bound
+    return 0
+
+
+class Hwsim:
+    """Virtual radios: APs on the first ones, the scanner's monitor on the next, a station on the last"""
+
+    def __init__(self, args, workdir: str):
+        self.args = args
+        self.workdir = workdir
+        self.phys: list[str] = []
+        self.aps: list[dict] = []
+        self.hostapd_pids: list[str] = []
+        self.monitor_phy = None
+        self.sta_iface = None
+        self.wpa_pid = None
+        self.ping = None
+        self.loaded = False
+
+    def load(self):
+        if os.path.isdir("/sys/module/mac80211_hwsim"):
+            if not self.args.reload:
+                raise RuntimeError("mac80211_hwsim is already loaded, unload it or pass --reload")
+            run(["modprobe", "-r", "mac80211_hwsim"])
+        radios = len(self.args.channels) + 1 + (1 if self.args.traffic else 0)
+        before = list_phys()
+        run(["modprobe", "mac80211_hwsim", f"radios={radios}"])
+        self.loaded = True
+
+        deadline = time.monotonic() + 5
+        while len(list_phys() - before) < radios:
+            if time.monotonic() > deadline:
+                raise RuntimeError(f"mac80211_hwsim didn't create {radios} radios")
+            time.sleep(0.1)
+        self.phys = sorted(list_phys() - before, key=lambda p: int(p[3:]))
+
+        # keep NetworkManager off the virtual radios, it scans and reconfigures them
+        if shutil.which("nmcli"):
+            for phy in self.phys:
+                for iface in phy_ifaces(phy):
+                    run(["nmcli", "dev", "set", iface, "managed", "no"], check=False)
+
+    def start_aps(self):
+        for i, channel in enumerate(self.args.channels):
+            iface = phy_ifaces(self.phys[i])[0]
+            conf = os.path.join(self.workdir, f"hostapd{i}.conf")
+            pid = os.path.join(self.workdir, f"hostapd{i}.pid")
+            ap = {"ssid": f"{HWSIM_SSID}-{i}", "bssid": iface_mac(iface), "channel": channel,
+                  "iface": iface}
+            with open(conf, "w") as f:
+                f.write(f"interface={iface}\ndriver=nl80211\nctrl_interface={self.workdir}/hostapd\n"
+                        f"ssid={ap['ssid']}\nhw_mode=g\nchannel={channel}\n"
+                        f"beacon_int={self.args.beacon_int}\n")
+            # -B returns once the AP is up, so a bad config fails here and not in the scan
+            run(["hostapd", "-B", "-P", pid, conf])
+            self.hostapd_pids.append(pid)
+            self.aps.append(ap)
+
+    def start_monitor(self) -> str:
+        self.monitor_phy = self.phys[len(self.args.channels)]
+        for iface in phy_ifaces(self.monitor_phy):
+            run(["ip", "link", "set", "dev", iface, "down"])
+        run(["iw", "phy", self.monitor_phy, "interface", "add", MONITOR_DEV, "type", "monitor"])
+        run(["ip", "link", "set", "dev", MONITOR_DEV, "up"])
+        # driver scans for active AP search, the monitor interface can't trigger them
+        run(["iw", "phy", self.monitor_phy, "interface", "add", SCAN_DEV, "type", "managed"])
+        run(["ip", "link", "set", "dev", SCAN_DEV, "up"])
+        return MONITOR_DEV
+
+    def start_traffic(self):
+        """Station in its own namespace associated to the first AP, pinging it at --traffic packets/s"""
+        ap = self.aps[0]
+        phy = self.phys[-1]
+        self.sta_iface = phy_ifaces(phy)[0]
+        conf = os.path.join(self.workdir, "wpa_supplicant.conf")
+        self.wpa_pid = os.path.join(self.workdir, "wpa_supplicant.pid")
+        with open(conf, "w") as f:
+            f.write(f"network={{\n\tssid=\"{ap['ssid']}\"\n\tkey_mgmt=NONE\n\tscan_freq={2407 + 5 * ap['channel']}\n}}\n")
+
+        run(["ip", "netns", "add", STA_NETNS])
+        run(["iw", "phy", phy, "set", "netns", "name", STA_NETNS])
+        netns = ["ip", "netns", "exec", STA_NETNS]
+        run(netns + ["ip", "link", "set", "dev", self.sta_iface, "up"])
+        run(netns + ["ip", "addr", "add", f"{STA_ADDR}/24", "dev", self.sta_iface])
+        run(["ip", "addr", "add", f"{AP_ADDR}/24", "dev", ap["iface"]])
+        run(netns + ["wpa_supplicant", "-B", "-i", self.sta_iface, "-c", conf, "-P", self.wpa_pid])
+
+        deadline = time.monotonic() + 10
+        while "Connected" not in run(netns + ["iw", "dev", self.sta_iface, "link"], check=False):
+            if time.monotonic() > deadline:
+                raise RuntimeError("traffic station didn't associate")
+            time.sleep(0.2)
+        self.ping = subprocess.Popen(
+            netns + ["ping", "-q", "-i", f"{1.0 / self.args.traffic:.4f}", "-s", "256", AP_ADDR],
+            stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+
+    @staticmethod
+    def _kill_pidfile(path: str):
+        try:
+            with open(path) as f:
+                os.kill(int(f.read().strip()), signal.SIGTERM)
+        except (OSError, ValueError):
+            pass
+
+    def teardown(self):
+        if self.ping:
+            self.ping.terminate()
+            self.ping.wait()
+        if self.wpa_pid:
+            self._kill_pidfile(self.wpa_pid)
+        for pid in self.hostapd_pids:
+            self._kill_pidfile(pid)
+        if os.path.exists(f"/run/netns/{STA_NETNS}"):
+            run(["ip", "netns", "del", STA_NETNS], check=False)
+        if self.loaded:
+            time.sleep(0.5)  # hostapd releases its interfaces before the module can go
+            run(["modprobe", "-r", "mac80211_hwsim"], check=False)
+
+
+class Driver:
+    """Headless manager plus a stats listener, timestamps every protocol step"""
+
+    def __init__(self, port: int):
+        self.client = MqttClient()
+        self.manager = Manager(self.client)
+        self.ap_list = None
+        self.ap_list_at = 0.0
+        self.scan = {}
+        self.samples: dict[str, int] = {}
+        self.recording = False
+        self.stats: list[dict] = []
+
+        handle_data = self.manager._handle_data
+
+        async def timed_data(id, json_data):
+            if json_data["type"] == PayloadType.AP_LIST.value:
+                self.ap_list_at = time.monotonic()
+                self.ap_list = json_data["data"]
+                self.scan = json_data.get("scan", {})
+            return await handle_data(id, json_data)
+
+        self.manager._handle_data = timed_data
+
+        handle_pkt_lists = self.manager._handle_pkt_lists
+
+        def counted(id, msgs):
+            if self.recording:
+                for m in msgs:
+                    for item in m["data"]:
+                        bssid = item["ap"]["bssid"].lower()
+                        self.samples[bssid] = self.samples.get(bssid, 0) + 1
+            return handle_pkt_lists(id, msgs)
+
+        self.manager._handle_pkt_lists = counted
+        self.client.try_connect("127.0.0.1", port, "", "")
+
+        # the manager doesn't take stats, they come in on their own connection
+        self.stats_client = mqtt.Client(mqtt.CallbackAPIVersion.VERSION2)
+        self.stats_client.on_connect = lambda c, *_: c.subscribe(consts.MANAGER_SUB_STATS)
+        self.stats_client.on_message = lambda c, u, msg: self.stats.append(json.loads(msg.payload))
+        self.stats_client.connect("127.0.0.1", port)
+        self.stats_client.loop_start()
+
+    async def run(self):
+        while True:
+            await self.manager.receive_next()
+
+    async def wait_for(self, cond, timeout: float, what: str):
+        deadline = time.monotonic() + timeout
+        while not cond():
+            if time.monotonic() > deadline:
+                raise RuntimeError(f"timed out waiting for {what}")
+            await asyncio.sleep(0.05)
+
+    async def next_stats(self, interval: float) -> dict:
+        n = len(self.stats)
+        await self.wait_for(lambda: len(self.stats) > n, interval * 3 + 1, "scanner stats")
+        return self.stats[-1]
+
+    def close(self):
+        self.stats_client.loop_stop()
+        self.stats_client.disconnect()
+        self.client.disconnect()
+
+
+async def run_once(args, driver: Driver, bed: Hwsim, dev: str, conf: str) -> dict:
+    manager = driver.manager
+    expected = {ap["bssid"]: ap for ap in bed.aps}
+    cmd = [args.scanner, "-d", dev, "-i", SCAN_DEV, "-c", conf, "-s", str(args.stats_interval)]
+    if args.probe_rate:
+        cmd += ["-p", str(args.probe_rate)]
+    result = {}
+
+    start = time.monotonic()
+    scanner = subprocess.Popen(cmd, stdout=subprocess.DEVNULL if not args.verbose else None,
+                               stderr=subprocess.DEVNULL if not args.verbose else None)
+    try:
+        await driver.wait_for(lambda: manager.can_scan, args.timeout, "scanner ready")
+        result["ready_ms"] = (time.monotonic() - start) * 1000
+
+        # scan: the whole band is swept and reported in one AP_LIST, discovery is scan to list
+        stats_before = await driver.next_stats(args.stats_interval)
+        driver.ap_list = None
+        manager.state = ManagerState.IDLE
+        scan_start = time.monotonic()
+        await manager.mqtt_send(consts.MANAGER_PUB_CMD_SCAN, json.dumps(
+            {"channels": sorted(set(args.channels)) if args.scan_channels else [], "mode": args.scan_mode}))
+        if not await manager.common_aps_done(args.timeout):
+            raise RuntimeError("scan didn't finish")
+        result["discovery_ms"] = (driver.ap_list_at - scan_start) * 1000
+        result["scan"] = driver.scan
+        found = [ap for ap in driver.ap_list if ap["bssid"].lower() in expected]
+        result["found"] = len(found)
+        result["expected"] = len(expected)
+        stats_scan = await driver.next_stats(args.stats_interval)
+        result["scan_switch"] = hist_delta(stats_before, stats_scan, "chan_switch_us")
+        if not found:
+            raise RuntimeError("none of the hwsim APs were found")
+
+        # select all found APs at once, the scanner rotates over their channels
+        selection = dict(found[0], aps=found)
+        manager.selected_ap_obj = selection
+        manager.do_capture_start()
+        manager.state = ManagerState.SCANNING
+        await manager.mqtt_send(consts.MANAGER_PUB_CMD_SELECT_AP, json.dumps(selection))
+
+        await asyncio.sleep(args.warmup)
+        stats_start = await driver.next_stats(args.stats_interval)
+        driver.samples.clear()
+        driver.recording = True
+        cap_start = time.monotonic()
+        await asyncio.sleep(args.duration)
+        elapsed = time.monotonic() - cap_start
+        driver.recording = False
+        stats_end = await driver.next_stats(args.stats_interval)
+
+        result["capture_switch"] = hist_delta(stats_start, stats_end, "chan_switch_us")
+        schedule = stats_end.get("schedule", {})
+        result["cycle_ms"] = schedule.get("cycle_ms", 0)
+        result["switch_overhead"] = schedule.get("switch_overhead", 0)
+        result["probe"] = schedule.get("probe")
+        sched_aps = {ap["bssid"].lower(): ap for ap in schedule.get("aps", [])}
+        result["aps"] = []
+        for ap in found:
+            bssid = ap["bssid"].lower()
+            entry = {"bssid": bssid, "channel": ap["channel"],
+                     "samples_s": driver.samples.get(bssid, 0) / elapsed,
+                     "beacons_s": 1e6 / (args.beacon_int * 1024)}
+            if bssid in sched_aps:
+                entry["scanner_rate_hz"] = sched_aps[bssid].get("rate_hz", 0)
+                entry["response_ratio"] = sched_aps[bssid].get("response_ratio")
+            result["aps"].append(entry)
+    finally:
+        manager.do_capture_stop()
+        await manager.mqtt_send(consts.MANAGER_PUB_CMD_STOP)
+        scanner.send_signal(signal.SIGINT)
+        try:
+            scanner.wait(timeout=5)
+        except subprocess.TimeoutExpired:
+            scanner.kill()
+        # next run registers from scratch
+        try:
+            await driver.wait_for(lambda: not manager.scanners, args.timeout, "scanner unregister")
+        except RuntimeError:
+            manager.scanners.clear()
+        manager.can_scan = False
+
+    return result
+
+
+def summarize(results: list) -> dict:
+    """Medians and spreads over runs, switch histograms merged"""
+    def spread(values):
+        return {"p50": percentile(values, 50), "min": min(values), "max": max(values)}
+
+    def merge(key):
+        merged = {"count": 0, "sum": 0, "buckets": []}
+        counts = {}
+        for r in results:
+            merged["count"] += r[key]["count"]
+            merged["sum"] += r[key]["sum"]
+            for bound, n in r[key]["buckets"]:
+                counts[bound] = counts.get(bound, 0) + n
+        merged["buckets"] = [[b, n] for b, n in counts.items()]
+        return {"count": merged["count"],
+                "mean_us": merged["sum"] / merged["count"] if merged["count"] else 0,
+                "p50_us": hist_percentile(merged, 50), "p99_us": hist_percentile(merged, 99)}
+
+    aps = {}
+    for r in results:
+        for ap in r["aps"]:
+            aps.setdefault(ap["bssid"], dict(ap, samples_s=[]))["samples_s"].append(ap["samples_s"])
+    return {
+        "runs": len(results),
+        "ready_ms": spread([r["ready_ms"] for r in results]),
+        "discovery_ms": spread([r["discovery_ms"] for r in results]),
+        "found": min(r["found"] for r in results),
+        "scan_mode": results[0]["scan"].get("mode", "passive"),
+        "fallbacks": sorted({r["scan"]["fallback"] for r in results if "fallback" in r["scan"]}),
+        "expected": results[0]["expected"],
+        "scan_switch": merge("scan_switch"),
+        "capture_switch": merge("capture_switch"),
+        "aps": [dict(ap, samples_s=spread(ap["samples_s"])) for ap in aps.values()],
+    }
+
+
+def print_summary(s: dict):
+    print(f"Runs: {s['runs']}, APs found {s['found']}/{s['expected']}, {s['scan_mode']} search"
+          + (f", fell back to passive: {', '.join(s['fallbacks'])}" if s["fallbacks"] else ""))
+    print(f"{'':>16} {'p50':>10} {'min':>10} {'max':>10}")
+    for key in ("ready_ms", "discovery_ms"):
+        print(f"{key:>16} {s[key]['p50']:>10.1f} {s[key]['min']:>10.1f} {s[key]['max']:>10.1f}")
+    print(f"{'switches':>16} {'count':>10} {'mean us':>10} {'p50 <us':>10} {'p99 <us':>10}")
+    for key in ("scan_switch", "capture_switch"):
+        h = s[key]
+        print(f"{key:>16} {h['count']:>10} {h['mean_us']:>10.0f} {h['p50_us']:>10.0f} {h['p99_us']:>10.0f}")
+    print(f"{'bssid':>18} {'chan':>5} {'samples/s':>10} {'min':>8} {'max':>8} {'beacons/s':>10}")
+    for ap in s["aps"]:
+        sps = ap["samples_s"]
+        print(f"{ap['bssid']:>18} {ap['channel']:>5} {sps['p50']:>10.1f} {sps['min']:>8.1f}"
+              f" {sps['max']:>8.1f} {ap['beacons_s']:>10.1f}")
+
+
+async def main():
+    parser = argparse.ArgumentParser(description="wfan test bed on mac80211_hwsim radios")
+    parser.add_argument("--scanner", default="./wfan_scanner")
+    parser.add_argument("--mosquitto", default=shutil.which("mosquitto") or "mosquitto")
+    parser.add_argument("--port", type=int, default=18831)
+    parser.add_argument("--channels", default="1,6,11",
+                        help="comma separated 2.4 GHz channels, one virtual AP on each")
+    parser.add_argument("--beacon-int", type=int, default=100, help="AP beacon interval, TU")
+    parser.add_argument("--scan-mode", default="passive", choices=["passive", "active"],
+                        help="AP search mode sent with the scan command")
+    parser.add_argument("--scan-channels", action="store_true",
+                        help="scan only the APs' channels, not the whole band")
+    parser.add_argument("--traffic", type=int, default=0,
+                        help="packets/s a station pings the first AP with, 0 - no traffic")
+    parser.add_argument("--probe-rate", type=int, default=0,
+                        help="scanner active sensing rate per AP (-p), 0 - beacons only")
+    parser.add_argument("--runs", type=int, default=3, help="scanner runs, each does a full scan and capture")
+    parser.add_argument("--duration", type=float, default=10, help="capture seconds per run")
+    parser.add_argument("--warmup", type=float, default=2)
+    parser.add_argument("--stats-interval", type=int, default=1)
+    parser.add_argument("--timeout", type=float, default=30)
+    parser.add_argument("--protocol", type=int, default=5, choices=[4, 5])
+    parser.add_argument("--reload", action="store_true", help="reload mac80211_hwsim if it's loaded")
+    parser.add_argument("--json", help="also dump results to this file")
+    parser.add_argument("--verbose", action="store_true")
+    args = parser.parse_args()
+
+    args.channels = [int(c) for c in args.channels.split(",")]
+    if any(c < 1 or c > 13 for c in args.channels):
+        parser.error("hostapd APs are 2.4 GHz only, channels 1-13")
+    if os.geteuid() != 0:
+        parser.error("must be run as root")
+    for tool in ["iw", "ip", "hostapd"] + (["wpa_supplicant", "ping"] if args.traffic else []):
+        if not shutil.which(tool):
+            parser.error(f"{tool} not found")
+
+    workdir = tempfile.mkdtemp(prefix="wfan_hwsim_")
+    bed = Hwsim(args, workdir)
+    broker = None
+    driver = None
+    consume = None
+    results = []
+    try:
+        bed.load()
+        bed.start_aps()
+        dev = bed.start_monitor()
+        if args.traffic:
+            bed.start_traffic()
+        print(f"hwsim: {len(bed.aps)} APs on channels {args.channels}, monitor {dev} on {bed.monitor_phy}")
+
+        broker = start_broker(args.mosquitto, args.port, workdir)
+        conf = write_scanner_conf(args.port, workdir, args.protocol)
+        driver = Driver(args.port)
+        consume = asyncio.create_task(driver.run())
+
+        for i in range(args.runs):
+            print(f"Run {i + 1}/{args.runs}...")
+            results.append(await run_once(args, driver, bed, dev, conf))
+    finally:
+        if consume:
+            consume.cancel()
+        if driver:
+            driver.close()
+        if broker:
+            broker.terminate()
+            broker.wait()
+        bed.teardown()
+        shutil.rmtree(workdir, ignore_errors=True)
+
+    summary = summarize(results)
+    print_summary(summary)
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump({"args": vars(args), "summary": summary,
+                       "runs": results}, f, indent=2)
+
+
+if __name__ == "__main__":
+    asyncio.run(main())
@@ -0,0 +1,109 @@
+#!/usr/bin/env python3
+# Manager ingest: one coroutine and one handler call per MQTT message vs the batched queue. A thread
+# stands in for paho and pushes PKT_LISTs from several scanners, reports CPU per message for both.
+import argparse
+import asyncio
+import json
+import os
+import sys
+import threading
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, os.path.join(HERE, "..", "..", "management"))
+
+import consts  # noqa: E402
+from data import ScannerClient  # noqa: E402
+from manager import Manager  # noqa: E402
+from mqtt_client import MqttClient  # noqa: E402
+
+BENCH_BSSID = "02:00:00:00:00:aa"
+consts.ARCHIVE_FILE = ""  # not what's measured here, and no leftover files
+
+
+class OfflineClient(MqttClient):
+    """Queue only, never connects"""
+
+    def _setup_mqtt_client(self):
+        return None
+
+
+def make_messages(count: int, scanners: int, batch: int) -> list:
+    msgs = []
+    ts = int(time.time() * 1000)
+    for k in range(count):
+        data = []
+        for j in range(batch):
+            ts += 1
+            data.append({"radio": {"antenna_signal": -60 - (j % 3)},
+                         "ap": {"bssid": BENCH_BSSID, "timestamp": ts}})
+        topic = f"{consts.SCANNER_PUB_DATA}/bench{k % scanners}"
+        msgs.append((topic, json.dumps({"type": 1, "data": data}).encode()))
+    return msgs
+
+
+def make_manager(scanners: int) -> tuple[MqttClient, Manager]:
+    client = OfflineClient()
+    manager = Manager(client)
+    manager.selected_ap_obj = {"ssid": "wfan-bench", "bssid": BENCH_BSSID, "channel": 6}
+    for i in range(scanners):
+        manager.scanners[f"bench{i}"] = ScannerClient(f"bench{i}")
+    manager.do_capture_start()
+    return client, manager
+
+
+async def run_legacy(msgs: list, scanners: int) -> float:
+    """asyncio.Queue fed with run_coroutine_threadsafe, one message per receive, as before"""
+    _, manager = make_manager(scanners)
+    queue = asyncio.Queue()
+    loop = asyncio.get_running_loop()
+
+    def producer():
+        for topic, payload in msgs:
+            asyncio.run_coroutine_threadsafe(queue.put(item=(topic, payload)), loop)
+
+    start = time.process_time()
+    thread = threading.Thread(target=producer)
+    thread.start()
+    for _ in range(len(msgs)):
+        topic, payload = await queue.get()
+        await manager._message_handler(topic, payload)
+    thread.join()
+    return time.process_time() - start
+
+
+async def run_batched(msgs: list, scanners: int) -> float:
+    client, manager = make_manager(scanners)
+
+    def producer():
+        for topic, payload in msgs:
+            client.queue.put(topic, payload)
+
+    start = time.process_time()
+    thread = threading.Thread(target=producer)
+    thread.start()
+    while manager.ingest.messages < len(msgs):
+        await manager.receive_next()
+    thread.join()
+    elapsed = time.process_time() - start
+    ingest = manager.ingest
+    print(f"  {ingest.batches} batches, {ingest.messages / ingest.batches:.1f} messages each,"
+          f" deepest queue {ingest.max_depth}")
+    return elapsed
+
+
+def main():
+    parser = argparse.ArgumentParser(description="manager ingest benchmark")
+    parser.add_argument("--messages", type=int, default=20000)
+    parser.add_argument("--scanners", type=int, default=8)
+    parser.add_argument("--batch", type=int, default=10, help="samples per PKT_LIST")
+    args = parser.parse_args()
+
+    msgs = make_messages(args.messages, args.scanners, args.batch)
+    for name, run in (("before", run_legacy), ("after", run_batched)):
+        cpu = asyncio.run(run(msgs, args.scanners))
+        print(f"{name:>7}: {len(msgs) / cpu:>9.0f} messages/s ({cpu * 1e6 / len(msgs):.1f} us CPU per message)")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,154 @@
+#!/usr/bin/env python3
+# Results recording: old per batch window rewrite vs the buffered recorder. Feeds the same PKT_LISTs
+# through the statistics, reports bytes written per byte of new samples and time the event loop
+# spends inside the recording call.
+import argparse
+import asyncio
+import copy
+import datetime
+import os
+import random
+import shutil
+import sys
+import tempfile
+import time
+from collections import deque
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, os.path.join(HERE, "..", "..", "management"))
+
+import consts  # noqa: E402
+from data import ScannerClient, ScannerStats  # noqa: E402
+from recorder import Recorder  # noqa: E402
+
+import numpy as np  # noqa: E402
+
+AP = {"ssid": "wfan-bench", "bssid": "02:00:00:00:00:aa", "channel": 6}
+
+
+def make_batches(n_batches: int, batch: int, seed: int) -> list:
+    rng = random.Random(seed)
+    ts = int(time.time() * 1000)
+    batches = []
+    for _ in range(n_batches):
+        items = []
+        for _ in range(batch):
+            ts += rng.randint(80, 120)
+            items.append((rng.randint(-62, -55), ts))
+        batches.append(items)
+    return batches
+
+
+def legacy_scanner(outfile: str) -> ScannerClient:
+    """Window kept in deques of Python objects, as it was"""
+    scanner = ScannerClient("bench", outfile=outfile)
+    scanner.stats.signal_buf = deque(maxlen=consts.PKT_STATS_BUF_SIZE)
+    scanner.stats.variance_disp_buf = deque(maxlen=consts.PKT_STATS_BUF_SIZE)
+    scanner.stats.ts_buf = deque(maxlen=consts.PKT_STATS_BUF_SIZE)
+    return scanner
+
+
+def legacy_feed(scanner: ScannerClient, batch: list) -> int:
+    """Returns the size of the batch's rows"""
+    stats = scanner.stats
+    vals, disp = stats.engine.update(stats, [s for s, _ in batch])
+    ts = [datetime.datetime.fromtimestamp(t / 1000) for _, t in batch]
+    stats.signal_buf.extend(vals)
+    stats.variance_disp_buf.extend(disp)
+    stats.ts_buf.extend(ts)
+    return sum(len(f"{t};{v:2};{s}\n") for s, v, t in zip(vals, disp, ts))
+
+
+def feed(scanner: ScannerClient, batch: list):
+    """Same as Manager._update_scanner_stats"""
+    stats = scanner.stats
+    vals, disp = stats.engine.update(stats, [s for s, _ in batch])
+    vals = np.array(vals, dtype=stats.signal_buf.buf.dtype)
+    disp = np.array(disp, dtype=stats.variance_disp_buf.buf.dtype)
+    ts = np.array([t for _, t in batch], dtype=np.int64)
+    stats.signal_buf.extend(vals)
+    stats.variance_disp_buf.extend(disp)
+    stats.ts_buf.extend(ts)
+    return vals, disp, ts
+
+
+async def legacy_write(scanner: ScannerClient):
+    """Manager._write_pkt_data before the recorder"""
+    exists = os.path.exists(scanner.outfile)
+    f = open(scanner.outfile, "a")
+    if not exists:
+        f.write(f"{AP['ssid']};{AP['bssid']};{AP['channel']}\n")
+    signals = list(scanner.stats.signal_buf)
+    variances = list(scanner.stats.variance_disp_buf)
+    timestamps = list(scanner.stats.ts_buf)
+
+    for i in range(len(signals)):
+        f.write(f"{timestamps[i]};{variances[i]:2};{signals[i]}\n")
+    f.close()
+
+
+async def run_legacy(batches: list, path: str) -> tuple[list, int]:
+    scanner = legacy_scanner(path)
+    stalls = []
+    useful = len(f"{AP['ssid']};{AP['bssid']};{AP['channel']}\n")
+    for batch in batches:
+        useful += legacy_feed(scanner, batch)
+        start = time.perf_counter()
+        await legacy_write(copy.deepcopy(scanner))
+        stalls.append(time.perf_counter() - start)
+        await asyncio.sleep(0)
+    return stalls, useful
+
+
+async def run_recorder(batches: list, path: str, interval: float) -> tuple[list, int]:
+    scanner = ScannerClient("bench", outfile=path)
+    recorder = Recorder(path, AP)
+    stalls = []
+    for batch in batches:
+        vals, disp, ts = feed(scanner, batch)
+        # same as Manager._record_pkt_data
+        start = time.perf_counter()
+        recorder.add(ts, disp, vals)
+        stalls.append(time.perf_counter() - start)
+        await asyncio.sleep(interval)
+    await recorder.close()
+    # every sample once, as the recorder formats it
+    with open(path) as f:
+        rows = f.readlines()
+    return stalls, sum(len(r) for r in rows) if len(rows) == recorder.rows + 1 else 0
+
+
+def report(name: str, stalls: list, written: int, useful: int):
+    stalls = sorted(stalls)
+    print(f"{name:>9}: {written / useful:6.2f}x written, stall per batch"
+          f" p50 {stalls[len(stalls) // 2] * 1e6:7.1f} us, max {stalls[-1] * 1e6:8.1f} us,"
+          f" total {sum(stalls) * 1e3:7.1f} ms")
+
+
+async def main():
+    parser = argparse.ArgumentParser(description="manager results recording benchmark")
+    parser.add_argument("--batches", type=int, default=2000)
+    parser.add_argument("--batch", type=int, default=10, help="samples per PKT_LIST")
+    parser.add_argument("--interval", type=float, default=0.0005,
+                        help="seconds between batches for the recorder run, lets it flush as it would live")
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    batches = make_batches(args.batches, args.batch, args.seed)
+    workdir = tempfile.mkdtemp(prefix="wfan_rec_")
+    try:
+        legacy_path = os.path.join(workdir, "legacy.csv")
+        stalls, useful = await run_legacy(batches, legacy_path)
+        report("before", stalls, os.path.getsize(legacy_path), useful)
+
+        rec_path = os.path.join(workdir, "recorder.csv")
+        stalls, useful = await run_recorder(batches, rec_path, args.interval)
+        if not useful:
+            sys.exit("recorder row count doesn't match the samples fed")
+        report("after", stalls, os.path.getsize(rec_path), useful)
+    finally:
+        shutil.rmtree(workdir, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    asyncio.run(main())
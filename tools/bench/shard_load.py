@@ -0,0 +1,238 @@
+#!/usr/bin/env python3
+# Ingest sharding load test. Simulates many scanners sending PKT_LISTs and splits them over N ingest
+# worker processes by shard_of(), the same way reg_ack assigns them.
+#
+# Without --broker every worker process takes its shard's messages from memory and runs the real
+# IngestWorker.process() on them, publishing into a counter, so it's the statistics and encoding
+# that are measured, not the network. Total throughput is messages over the slowest worker's wall
+# time; it can only grow with workers if the machine has the cores for them. The UI side is measured
+# too: manager CPU per second of load with all statistics in process vs only taking aggregates.
+#
+# With --broker host:port ingest_worker.py processes are started against a real broker, one per
+# shard, scanners publish at --rate and what comes back on agg/+ is counted.
+import argparse
+import asyncio
+import json
+import multiprocessing
+import os
+import subprocess
+import sys
+import threading
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+MANAGEMENT = os.path.join(HERE, "..", "..", "management")
+sys.path.insert(0, MANAGEMENT)
+
+import consts  # noqa: E402
+from ingest import shard_of  # noqa: E402
+
+BENCH_BSSID = "02:00:00:00:00:aa"
+consts.ARCHIVE_FILE = ""  # not what's measured here, and no leftover files
+
+
+def make_messages(scanners: int, seconds: float, rate: float, batch: int) -> dict[str, list[bytes]]:
+    """PKT_LIST payloads per scanner id, rate messages per second of batch samples each"""
+    msgs = dict()
+    base = int(time.time() * 1000)
+    for i in range(scanners):
+        id = f"load{i:03d}"
+        out = []
+        ts = base
+        for k in range(int(seconds * rate)):
+            data = []
+            for j in range(batch):
+                ts += int(1000 / rate / batch)
+                data.append({"radio": {"antenna_signal": -60 - (j + i + k) % 5},
+                             "ap": {"bssid": BENCH_BSSID, "timestamp": ts}})
+            out.append(json.dumps({"type": 1, "data": data}).encode())
+        msgs[id] = out
+    return msgs
+
+
+class CountingClient:
+    def __init__(self):
+        self.published = 0
+        self.bytes = 0
+
+    def publish(self, topic, payload, qos=0):
+        self.published += 1
+        self.bytes += len(payload)
+
+
+def shard_run(shard: int, shards: int, msgs: dict, ticks: int, go, result):
+    """One worker process: feeds its scanners' messages tick by tick as INGEST_AGG_MS rounds"""
+    from ingest_worker import IngestWorker
+    worker = IngestWorker(shard)
+    worker.client = CountingClient()
+    worker.worker.select({"bssid": BENCH_BSSID})
+    mine = {id: m for id, m in msgs.items() if shard_of(id, shards) == shard}
+    total = 0
+    go.wait()
+    cpu = time.process_time()
+    for t in range(ticks):
+        for id, m in mine.items():
+            per_tick = len(m) // ticks
+            for payload in m[t * per_tick:(t + 1) * per_tick]:
+                worker.items.append((f"{consts.TOPIC_INGEST_BASE}/{shard}/{id}", payload))
+                total += 1
+        worker.process()
+    result.put((total, time.process_time() - cpu, time.perf_counter()))
+
+
+def run_offline(msgs: dict, workers: int, ticks: int) -> tuple[int, float, float]:
+    """(messages, wall seconds until the last worker is done, CPU seconds of the busiest worker)"""
+    go = multiprocessing.Event()
+    result = multiprocessing.Queue()
+    procs = [multiprocessing.Process(target=shard_run, args=(k, workers, msgs, ticks, go, result))
+             for k in range(workers)]
+    for p in procs:
+        p.start()
+    time.sleep(0.5)  # all set up and waiting
+    start = time.perf_counter()  # CLOCK_MONOTONIC, same clock in every process
+    go.set()
+    results = [result.get() for _ in procs]
+    for p in procs:
+        p.join()
+    return sum(r[0] for r in results), max(r[2] for r in results) - start, max(r[1] for r in results)
+
+
+def ui_cost(msgs: dict, seconds: float) -> tuple[float, float]:
+    """Manager CPU per second of load: PKT_LISTs handled in process vs worker aggregates"""
+    from data import ScannerClient
+    from ingest import ShardWorker
+    from manager import Manager
+    from mqtt_client import MqttClient
+
+    class OfflineClient(MqttClient):
+        def _setup_mqtt_client(self):
+            return None
+
+    async def make_manager():
+        manager = Manager(OfflineClient())
+        manager.selected_ap_obj = {"ssid": "wfan-bench", "bssid": BENCH_BSSID, "channel": 6}
+        for id in msgs:
+            manager.scanners[id] = ScannerClient(id)
+        manager.do_capture_start()
+        return manager
+
+    async def in_process():
+        manager = await make_manager()
+        start = time.process_time()
+        for id, m in msgs.items():
+            for payload in m:
+                manager._handle_pkt_lists(id, [json.loads(payload)])
+        return time.process_time() - start
+
+    # aggregates made beforehand, as a worker would have sent them every INGEST_AGG_MS
+    worker = ShardWorker()
+    worker.select({"bssid": BENCH_BSSID})
+    aggregates = []
+    rounds = max(1, int(seconds * 1000 / consts.INGEST_AGG_MS))
+    for t in range(rounds):
+        for id, m in msgs.items():
+            per = len(m) // rounds
+            for payload in m[t * per:(t + 1) * per]:
+                worker.handle_pkt_lists(id, [json.loads(payload)])
+        aggregates += worker.take_aggregates()
+
+    async def from_workers():
+        manager = await make_manager()
+        start = time.process_time()
+        for id, payload in aggregates:
+            manager._handle_aggregate(id, payload)
+        return time.process_time() - start
+
+    return asyncio.run(in_process()) / seconds, asyncio.run(from_workers()) / seconds
+
+
+def run_broker(args, msgs: dict):
+    import paho.mqtt.client as mqtt
+    host, port = args.broker.split(":")
+    port = int(port)
+    env = dict(os.environ, PYTHONPATH=MANAGEMENT)
+    procs = [subprocess.Popen([sys.executable, os.path.join(MANAGEMENT, "ingest_worker.py"), str(k),
+                               "--shards", str(args.workers), "--host", host, "--port", str(port)], env=env, cwd=MANAGEMENT)
+             for k in range(args.workers)]
+    received = [0]
+
+    def on_message(client, userdata, msg):
+        received[0] += json.loads(msg.payload[:msg.payload.index(b"\0")])["n"]
+
+    sink = mqtt.Client(mqtt.CallbackAPIVersion.VERSION2, protocol=mqtt.MQTTv5)
+    sink.on_message = on_message
+    sink.connect(host, port)
+    sink.subscribe(consts.MANAGER_SUB_AGG, 1)
+    sink.loop_start()
+    time.sleep(1)  # workers connected and subscribed
+    ctl = mqtt.Client(mqtt.CallbackAPIVersion.VERSION2)
+    ctl.connect(host, port)
+    ctl.loop_start()
+    ctl.publish(consts.MANAGER_PUB_CMD_SELECT_AP, json.dumps({"bssid": BENCH_BSSID}), 1).wait_for_publish()
+    time.sleep(0.5)
+
+    def scanner_group(ids: list[str]):
+        client = mqtt.Client(mqtt.CallbackAPIVersion.VERSION2)
+        client.connect(host, port)
+        client.loop_start()
+        start = time.monotonic()
+        for k in range(int(args.seconds * args.rate)):
+            for id in ids:
+                topic = f"{consts.SCANNER_PUB_INGEST}/{shard_of(id, args.workers)}/{id}"
+                client.publish(topic, msgs[id][k], 1)
+            time.sleep(max(0, start + (k + 1) / args.rate - time.monotonic()))
+        client.loop_stop()
+
+    ids = list(msgs)
+    groups = [ids[i::8] for i in range(8)]
+    threads = [threading.Thread(target=scanner_group, args=(g,)) for g in groups]
+    start = time.monotonic()
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    time.sleep(1)
+    elapsed = time.monotonic() - start
+    sent = len(ids) * int(args.seconds * args.rate) * args.batch
+    print(f"broker: {len(ids)} scanners, {args.workers} workers, {sent} samples sent,"
+          f" {received[0]} aggregated back ({received[0] / elapsed:.0f} samples/s)")
+    for p in procs:
+        p.terminate()
+    sink.loop_stop()
+    ctl.loop_stop()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="ingest shard load test")
+    parser.add_argument("--scanners", type=int, default=128)
+    parser.add_argument("--seconds", type=float, default=5, help="of simulated load")
+    parser.add_argument("--rate", type=float, default=10, help="PKT_LISTs per second per scanner")
+    parser.add_argument("--batch", type=int, default=10, help="samples per PKT_LIST")
+    parser.add_argument("--workers", type=int, nargs="+", default=[1, 2, 4])
+    parser.add_argument("--broker", help="host:port, run real workers against it")
+    args = parser.parse_args()
+
+    msgs = make_messages(args.scanners, args.seconds, args.rate, args.batch)
+    offered = args.scanners * args.rate
+    print(f"{args.scanners} scanners, {offered:.0f} PKT_LISTs/s offered, {os.cpu_count()} CPUs")
+
+    if args.broker:
+        args.workers = args.workers[-1]
+        run_broker(args, msgs)
+        return
+
+    ticks = max(1, int(args.seconds * 1000 / consts.INGEST_AGG_MS))
+    # wall time only scales with workers given the cores, the busiest worker's CPU time is what
+    # the same split does with a core each
+    print(f"{'workers':>7} {'wall msg/s':>11} {'per core msg/s':>15} {'scanners at':>12} {args.rate:g}/s")
+    for workers in args.workers:
+        total, wall, cpu = run_offline(msgs, workers, ticks)
+        print(f"{workers:>7} {total / wall:>11.0f} {total / cpu:>15.0f} {total / cpu / args.rate:>16.0f}")
+
+    inproc, agg = ui_cost(msgs, args.seconds)
+    print(f"manager CPU per second of load: {inproc * 100:.0f}% with the statistics in process,"
+          f" {agg * 100:.1f}% taking worker aggregates")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,151 @@
+#!/usr/bin/env python3
+# Manager RSSI statistics: old per sample loop vs streaming engine, same input, checks outputs match
+# and reports samples/s on one core.
+import argparse
+import datetime
+import math
+import os
+import random
+import sys
+import time
+from collections import deque
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, os.path.join(HERE, "..", "..", "management"))
+
+import consts  # noqa: E402
+from data import ScannerStats  # noqa: E402
+from stats import StreamingStats  # noqa: E402
+
+import numpy as np  # noqa: E402
+
+
+def make_batches(n_batches: int, batch: int, seed: int) -> list:
+    rng = random.Random(seed)
+    ts = int(time.time() * 1000)
+    batches = []
+    for _ in range(n_batches):
+        items = []
+        for _ in range(batch):
+            signal = rng.randint(-62, -55)
+            if rng.random() < 0.01:
+                signal = -95  # spike, should hit the outlier path
+            ts += rng.randint(80, 120)
+            items.append({"radio": {"antenna_signal": signal}, "ap": {"timestamp": ts}})
+        batches.append(items)
+    return batches
+
+
+def fresh_stats() -> ScannerStats:
+    stats = ScannerStats()
+    stats.signal_buf = deque(maxlen=consts.PKT_STATS_BUF_SIZE)
+    stats.variance_disp_buf = deque(maxlen=consts.PKT_STATS_BUF_SIZE)
+    stats.ts_buf = deque(maxlen=consts.PKT_STATS_BUF_SIZE)
+    return stats
+
+
+class Legacy:
+    """Manager._update_scanner_stats before the streaming engine, verbatim apart from the record"""
+
+    def __init__(self):
+        self.stats = fresh_stats()
+        self.variance_calc_buf = deque(maxlen=consts.PKT_STATS_BUF_SIZE)
+        self.record = []
+
+    def _is_outlier(self, entry: int) -> bool:
+        var = max(self.stats.variance, 1)
+        z = (entry - self.stats.average) / math.sqrt(var)
+        return abs(z) > 5
+
+    def update(self, data):
+        stats = self.stats
+        for item in data:
+            val = item["radio"]["antenna_signal"]
+            if stats.done and self._is_outlier(val):
+                val = int(stats.average)
+            if stats.maximum < val or stats.maximum == 0:
+                stats.maximum = val
+            if stats.minimum > val:
+                stats.minimum = val
+            stats.signal_buf.append(val)
+            stats.ts_buf.append(datetime.datetime.fromtimestamp(int(item["ap"]["timestamp"]) / 1000))
+            avg = sum(stats.signal_buf) / len(stats.signal_buf)
+            stats.average = avg
+            var = (val - avg) ** 2
+            self.variance_calc_buf.append(var)
+            stats.variance = sum(self.variance_calc_buf) / len(self.variance_calc_buf)
+            var_sum = sum(list(self.variance_calc_buf)[-5:])
+            if var_sum > consts.Y_VAR_MAX:
+                var_sum = consts.Y_VAR_MAX
+            stats.variance_disp_buf.append(var_sum)
+            if len(stats.signal_buf) == consts.PKT_STATS_BUF_SIZE:
+                stats.done = True
+            self.record.append((val, stats.average, stats.variance, var_sum))
+
+
+class Streaming:
+    """Manager._update_scanner_stats as it is now"""
+
+    def __init__(self):
+        self.stats = ScannerStats()
+        self.engine = StreamingStats()
+        self.record = []
+
+    def update(self, data):
+        stats = self.stats
+        signals = [item["radio"]["antenna_signal"] for item in data]
+        timestamps = [item["ap"]["timestamp"] for item in data]
+        vals, disp = self.engine.update(stats, signals)
+        stats.signal_buf.extend(np.array(vals, dtype=stats.signal_buf.buf.dtype))
+        stats.variance_disp_buf.extend(np.array(disp, dtype=stats.variance_disp_buf.buf.dtype))
+        stats.ts_buf.extend(np.array(timestamps, dtype=np.int64))
+
+
+def run(impl, batches) -> float:
+    start = time.process_time()
+    for batch in batches:
+        impl.update(batch)
+    return time.process_time() - start
+
+
+def check(batches) -> float:
+    """Feeds one batch at a time, compares everything the manager exposes after each"""
+    legacy, streaming = Legacy(), Streaming()
+    worst = 0.0
+    for batch in batches:
+        legacy.update(batch)
+        streaming.update(batch)
+        a, b = legacy.stats, streaming.stats
+        assert list(a.signal_buf) == b.signal_buf.view().tolist(), "signal values differ"
+        assert [round(t.timestamp() * 1000) for t in a.ts_buf] == b.ts_buf.view().tolist(), "timestamps differ"
+        assert (a.minimum, a.maximum, a.done) == (b.minimum, b.maximum, b.done), "min/max/done differ"
+        assert a.average == b.average, "average differs"
+        # display variance is kept as float32 now, only as close as float32 gets
+        for x, y in zip(a.variance_disp_buf, b.variance_disp_buf.view().tolist()):
+            assert abs(x - y) <= 1e-6 * max(1, abs(x)), "display variance differs"
+        worst = max(worst, abs(a.variance - b.variance))
+    return worst
+
+
+def main():
+    parser = argparse.ArgumentParser(description="manager statistics benchmark")
+    parser.add_argument("--batches", type=int, default=2000)
+    parser.add_argument("--batch", type=int, default=10, help="samples per PKT_LIST")
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    batches = make_batches(args.batches, args.batch, args.seed)
+    worst = check(batches)
+    # sums come out of a cumulative sum instead of a left to right loop, last bits may differ
+    if worst > 1e-9:
+        sys.exit(f"variance differs by {worst}")
+    print(f"outputs match (variance within {worst:.1e})")
+
+    samples = args.batches * args.batch
+    for name, impl in (("before", Legacy()), ("after", Streaming())):
+        elapsed = run(impl, batches)
+        print(f"{name:>7}: {samples / elapsed:>12.0f} samples/s ({elapsed * 1e6 / samples:.2f} us/sample)")
+
+
+if __name__ == "__main__":
+    main()